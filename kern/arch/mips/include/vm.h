@@ -131,10 +131,9 @@ paddr_t ram_getfirstfree(void);
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	unsigned ts_asid;	/* address space ID whose entries go */
+	vaddr_t ts_vaddr;	/* the page to invalidate, unless... */
+	bool ts_writable;	/* ...all writable entries go instead */
 };
 
 #define TLBSHOOTDOWN_MAX 16
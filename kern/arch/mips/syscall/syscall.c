@@ -178,6 +178,41 @@ syscall(struct trapframe *tf)
 			tf->tf_a2,
 			&retval);
 		break;
+	    case SYS_pread:
+	    case SYS_pwrite:
+		{
+			/*
+			 * Like mmap, the 64-bit offset is aligned past a3
+			 * and onto the stack.
+			 */
+			off_t offset;
+
+			err = copyin((userptr_t)tf->tf_sp + 16,
+				     &offset, sizeof(offset));
+			if (err) {
+				break;
+			}
+			err = (callno == SYS_pread) ?
+				sys_pread(tf->tf_a0, (userptr_t)tf->tf_a1,
+					  tf->tf_a2, offset, &retval) :
+				sys_pwrite(tf->tf_a0, (userptr_t)tf->tf_a1,
+					   tf->tf_a2, offset, &retval);
+		}
+		break;
+	    case SYS_readv:
+		err = sys_readv(
+			tf->tf_a0,
+			(userptr_t)tf->tf_a1,
+			tf->tf_a2,
+			&retval);
+		break;
+	    case SYS_writev:
+		err = sys_writev(
+			tf->tf_a0,
+			(userptr_t)tf->tf_a1,
+			tf->tf_a2,
+			&retval);
+		break;
 	    case SYS_lseek:
 		{
 			/*
@@ -226,6 +261,31 @@ syscall(struct trapframe *tf)
 		err = sys_sbrk(tf->tf_a0, &retval);
 		break;
 
+	    case SYS_mmap:
+		{
+			/*
+			 * The 64-bit offset would go in a3 and the next
+			 * register, so it is aligned up to the stack
+			 * instead, and a3 is unused.
+			 */
+			off_t offset;
+
+			err = copyin((userptr_t)tf->tf_sp + 16,
+				     &offset, sizeof(offset));
+			if (err) {
+				break;
+			}
+			err = sys_mmap(tf->tf_a0, tf->tf_a1, tf->tf_a2, offset,
+				       &retval);
+		}
+		break;
+	    case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0);
+		break;
+	    case SYS_msync:
+		err = sys_msync((userptr_t)tf->tf_a0);
+		break;
+
 	    case SYS_sync:
 		err = sys_sync();
 		break;
@@ -257,6 +257,16 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	return EFAULT;
 }
 
+int
+vm_prefault(vaddr_t vaddr, size_t len, bool write)
+{
+	/* Everything is loaded up front; nothing to do. */
+	(void)vaddr;
+	(void)len;
+	(void)write;
+	return 0;
+}
+
 struct addrspace *
 as_create(void)
 {
@@ -40,9 +40,32 @@ static paddr_t lastpaddr;   /* one past end of last free physical page */
 
 
 
+/*
+ * The frame table. There is one entry for every physical frame of
+ * RAM (sized from mainbus_ramsize() in ram_bootstrap), which holds
+ * the allocation state used by alloc_kpages/free_kpages, the
+ * reference count used by the VM system for copy-on-write sharing,
+ * and the links of the free list.
+ *
+ * For page replacement, a user frame mapped by exactly one page table
+ * also records that mapping (owner and vaddr), plus a referenced bit
+ * for the clock. A frame of the page cache is marked cached instead;
+ * the page cache knows who maps it. Frames with neither are never
+ * chosen for eviction.
+ */
+
+#define FT_NONE 0xffffffff      /* "null" frame number for free lists */
+
 typedef struct ft_entry {
         unsigned allocated:1; /* the corresponding frame is allocated */
         unsigned not_last:1; /* the frame is part of a multiframe allocation */
+        unsigned referenced:1; /* used since the clock hand last passed */
+        unsigned cached:1; /* the frame belongs to the page cache */
+        unsigned ref_count:28; /* number of references to an allocated frame */
+        uint32_t next_free; /* next frame on the stripe's free list */
+        uint32_t prev_free; /* previous frame on the stripe's free list */
+        struct addrspace *owner; /* sole mapping address space, or NULL */
+        vaddr_t owner_vaddr; /* where the owner maps the frame */
 } ft_entry_t;
 
 
@@ -55,11 +78,96 @@ static uint32_t last_frame;
 #define FALSE 0
 
 
-/* frame_table protected by spinlock (interrupt disabling on
- * uniprocessor) as this implementation does not block.
- */ 
+/*
+ * The frame table is split into FT_NSTRIPES contiguous ranges of
+ * frames. Each range has its own spinlock and its own free list, so
+ * allocations, frees and reference count updates on frames in
+ * different ranges do not contend with each other.
+ *
+ * Anything that needs to look at more than one range (multiframe
+ * allocations) takes the stripe locks in ascending order.
+ */
+
+#define FT_NSTRIPES 8
+
+struct ft_stripe {
+        struct spinlock fs_lock; /* protects frames in this range */
+        uint32_t fs_freehead;    /* first free frame, or FT_NONE */
+        uint32_t fs_nfree;       /* number of frames on the free list */
+};
+
+static struct ft_stripe ft_stripes[FT_NSTRIPES];
+static uint32_t ft_stripe_frames;       /* frames per stripe */
+static volatile unsigned ft_nexthint;   /* stripe to try allocating from */
+static uint32_t ft_clockhand;           /* next frame the clock looks at */
+
+static inline struct ft_stripe *
+ft_stripe_of(uint32_t frame)
+{
+        return &ft_stripes[frame / ft_stripe_frames];
+}
 
-static struct spinlock frame_table_spinlock = SPINLOCK_INITIALIZER;
+/* Push a frame onto its stripe's free list. Stripe lock must be held. */
+static void
+ft_push_free(struct ft_stripe *fs, uint32_t i)
+{
+        frame_table[i].allocated = FALSE;
+        frame_table[i].not_last = FALSE;
+        frame_table[i].referenced = FALSE;
+        frame_table[i].cached = FALSE;
+        frame_table[i].ref_count = 0;
+        frame_table[i].owner = NULL;
+        frame_table[i].owner_vaddr = 0;
+        frame_table[i].prev_free = FT_NONE;
+        frame_table[i].next_free = fs->fs_freehead;
+        if (fs->fs_freehead != FT_NONE) {
+                frame_table[fs->fs_freehead].prev_free = i;
+        }
+        fs->fs_freehead = i;
+        fs->fs_nfree++;
+}
+
+/* Unlink a free frame from its stripe's free list. Stripe lock must be held. */
+static void
+ft_unlink_free(struct ft_stripe *fs, uint32_t i)
+{
+        KASSERT(frame_table[i].allocated == FALSE);
+
+        if (frame_table[i].prev_free != FT_NONE) {
+                frame_table[frame_table[i].prev_free].next_free =
+                        frame_table[i].next_free;
+        }
+        else {
+                KASSERT(fs->fs_freehead == i);
+                fs->fs_freehead = frame_table[i].next_free;
+        }
+        if (frame_table[i].next_free != FT_NONE) {
+                frame_table[frame_table[i].next_free].prev_free =
+                        frame_table[i].prev_free;
+        }
+        KASSERT(fs->fs_nfree > 0);
+        fs->fs_nfree--;
+}
+
+static void
+ft_lock_all(void)
+{
+        unsigned s;
+
+        for (s = 0; s < FT_NSTRIPES; s++) {
+                spinlock_acquire(&ft_stripes[s].fs_lock);
+        }
+}
+
+static void
+ft_unlock_all(void)
+{
+        unsigned s;
+
+        for (s = FT_NSTRIPES; s > 0; s--) {
+                spinlock_release(&ft_stripes[s-1].fs_lock);
+        }
+}
 
 /*
  * Called very early in system boot to figure out how much physical
@@ -69,7 +177,7 @@ void
 ram_bootstrap(void)
 {
 	size_t ramsize, frametable_size;
-        uint32_t npages, i;
+        uint32_t npages, i, s;
 
 	/* Get size of RAM. */
 	ramsize = mainbus_ramsize();
@@ -120,6 +228,16 @@ ram_bootstrap(void)
                 
         }
 
+        /* Set up the stripes; every frame belongs to exactly one. */
+
+        ft_stripe_frames = DIVROUNDUP(npages, FT_NSTRIPES);
+        for (s = 0; s < FT_NSTRIPES; s++) {
+                spinlock_init(&ft_stripes[s].fs_lock);
+                ft_stripes[s].fs_freehead = FT_NONE;
+                ft_stripes[s].fs_nfree = 0;
+        }
+        ft_nexthint = 0;
+
         /* Now initialise the frame table in two ranges. */
 
         /* The first range of frames are used by the kernel already
@@ -130,16 +248,25 @@ ram_bootstrap(void)
                 /* Mark as allocated as individual pages */
                 frame_table[i].allocated = TRUE;
                 frame_table[i].not_last = FALSE;
+                frame_table[i].referenced = FALSE;
+                frame_table[i].cached = FALSE;
+                frame_table[i].ref_count = 1;
+                frame_table[i].next_free = FT_NONE;
+                frame_table[i].prev_free = FT_NONE;
+                frame_table[i].owner = NULL;
+                frame_table[i].owner_vaddr = 0;
         }                                            
         
         /* 
-         * The second range of frames are free
+         * The second range of frames are free. Push them in
+         * reverse so each free list comes out in ascending order.
          */
         
         first_frame = firstpaddr >> PAGE_BITS;
+        ft_clockhand = first_frame;
         
-        for (i = first_frame; i < (lastpaddr >> PAGE_BITS); i++) {
-                frame_table[i].allocated = FALSE;
+        for (i = last_frame; i > first_frame; i--) {
+                ft_push_free(ft_stripe_of(i - 1), i - 1);
         }
 
         
@@ -189,39 +316,43 @@ ram_getfirstfree(void)
 }
 
 /*
- * This is a relatively inefficient first-fit allocator. Single pages
- * always fit. Multiframe allocations can suffer from external
- * fragmentation. It is intended to be easy to understand and robust,
- * not efficient.
+ * Single pages are popped off a stripe's free list in O(1); the
+ * starting stripe rotates so concurrent allocators spread out over
+ * the stripe locks. Multiframe allocations are a first-fit scan, and
+ * can suffer from external fragmentation. They are only used for
+ * large kmalloc requests.
  */
 
 
 static paddr_t alloc_one_frame(unsigned int npages)
 {
-        unsigned int i;
+        unsigned int s, start;
+        uint32_t i;
+        struct ft_stripe *fs;
 
-        /* 
-         * Just scan from the start of the frame_table array for an
-         * unallocated block
-         */
-        
         KASSERT(npages == 1);
 
-        spinlock_acquire(&frame_table_spinlock);
-        for (i =  first_frame; i < last_frame; i++) {
-                if (frame_table[i].allocated == FALSE) {
+        start = ft_nexthint++;
+        for (s = 0; s < FT_NSTRIPES; s++) {
+                fs = &ft_stripes[(start + s) % FT_NSTRIPES];
+
+                spinlock_acquire(&fs->fs_lock);
+                i = fs->fs_freehead;
+                if (i != FT_NONE) {
+                        ft_unlink_free(fs, i);
                         frame_table[i].allocated = TRUE;
                         frame_table[i].not_last = FALSE;
+                        frame_table[i].ref_count = 1;
 
-                        spinlock_release(&frame_table_spinlock);
+                        spinlock_release(&fs->fs_lock);
 
                         return (paddr_t) (i << PAGE_BITS);
                 }
+                spinlock_release(&fs->fs_lock);
         }
         
         /* Did not find an unallocated frame :-( */
 
-        spinlock_release(&frame_table_spinlock);
         return (paddr_t) 0;
 }
 
@@ -236,11 +367,11 @@ static paddr_t alloc_multiple_frames(unsigned int npages)
          */
         
 
-        spinlock_acquire(&frame_table_spinlock);
+        ft_lock_all();
 
         i = first_frame; j = 0;
 
-        while (i < (last_frame - npages) && j < npages) {
+        while (i + j < last_frame && j < npages) {
                 if (frame_table[i+j].allocated == TRUE) {
                         i = i + j + 1; /* continue scan after allocated frame */
                         j = 0;         /* restart the count */
@@ -251,21 +382,22 @@ static paddr_t alloc_multiple_frames(unsigned int npages)
         }
 
         if  (j == npages) { /* we exited as we found the number of frames required. */
-                for (j = i; j < i + npages - 1; j++) {
+                for (j = i; j < i + npages; j++) {
+                        ft_unlink_free(ft_stripe_of(j), j);
                         frame_table[j].allocated = TRUE; /* mark frame allocated */
                         frame_table[j].not_last = TRUE;  /* as a contiguous block */
+                        frame_table[j].ref_count = 1;
                 }
-                frame_table[j].allocated = TRUE;
-                frame_table[j].not_last = FALSE;
+                frame_table[j-1].not_last = FALSE;
 
-                spinlock_release(&frame_table_spinlock);
+                ft_unlock_all();
                 
                 return (paddr_t) (i << PAGE_BITS);
         }
         
         /* Did not find an unallocated contiguous range of frames :-( */
 
-        spinlock_release(&frame_table_spinlock);
+        ft_unlock_all();
         return (paddr_t) 0;
 }
 
@@ -273,26 +405,40 @@ static void free_frames(vaddr_t vaddr)
 {
         paddr_t paddr;
         uint32_t i;
+        struct ft_stripe *fs;
+        bool last;
 
         KASSERT(vaddr != (vaddr_t) NULL);
 
         paddr = KVADDR_TO_PADDR(vaddr);
 
         i = paddr >> PAGE_BITS;
+        KASSERT(i >= first_frame && i < last_frame);
 
-        spinlock_acquire(&frame_table_spinlock);
+        /* The common case: a single frame, touching only one stripe. */
+        fs = ft_stripe_of(i);
+        spinlock_acquire(&fs->fs_lock);
 
         if (frame_table[i].allocated == FALSE) { /* check for double free error */
                 panic("Double free error!!");
         }
-        
-        while (frame_table[i].allocated == TRUE) { /* otherwise mark block free */
-                frame_table[i].allocated = FALSE;
-                if (frame_table[i].not_last == TRUE) {
-                        i++;
-                }
+
+        if (frame_table[i].not_last == FALSE) {
+                ft_push_free(fs, i);
+                spinlock_release(&fs->fs_lock);
+                return;
         }
-        spinlock_release(&frame_table_spinlock);
+        spinlock_release(&fs->fs_lock);
+
+        /* A multiframe block may span stripes. */
+        ft_lock_all();
+        do {                             /* otherwise mark block free */
+                KASSERT(frame_table[i].allocated == TRUE);
+                last = !frame_table[i].not_last;
+                ft_push_free(ft_stripe_of(i), i);
+                i++;
+        } while (!last);
+        ft_unlock_all();
 }
         
 /* Allocate/free some kernel-space virtual pages */
@@ -319,3 +465,179 @@ free_kpages(vaddr_t addr)
         free_frames(addr);
 }
 
+/*
+ * Reference counts, used by the VM system to share user frames
+ * between address spaces. A frame from alloc_kpages(1) starts out
+ * with one reference; only single-frame allocations may be shared.
+ * A shared frame has no single owner, so adding a reference clears
+ * it; the VM system sets it again once the frame is private.
+ */
+
+void
+increment_ref_count(paddr_t paddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+        struct ft_stripe *fs = ft_stripe_of(i);
+
+        spinlock_acquire(&fs->fs_lock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].not_last == FALSE);
+        KASSERT(frame_table[i].ref_count > 0); // If you need new pages, use ensure_paddr
+        frame_table[i].ref_count++;
+        frame_table[i].owner = NULL;
+        spinlock_release(&fs->fs_lock);
+}
+
+void
+increment_ref_counts(const paddr_t *paddrs, unsigned n)
+{
+        uint32_t i;
+        unsigned k;
+
+        if (n == 0) {
+                return;
+        }
+
+        ft_lock_all();
+        for (k = 0; k < n; k++) {
+                i = paddrs[k] >> PAGE_BITS;
+                KASSERT(frame_table[i].allocated == TRUE);
+                KASSERT(frame_table[i].not_last == FALSE);
+                KASSERT(frame_table[i].ref_count > 0);
+                frame_table[i].ref_count++;
+                frame_table[i].owner = NULL;
+        }
+        ft_unlock_all();
+}
+
+void
+decrement_ref_count(paddr_t paddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+        struct ft_stripe *fs = ft_stripe_of(i);
+
+        spinlock_acquire(&fs->fs_lock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].ref_count > 0);
+        frame_table[i].ref_count--;
+        if (frame_table[i].ref_count == 0) {
+                ft_push_free(fs, i);
+        }
+        spinlock_release(&fs->fs_lock);
+}
+
+unsigned
+get_ref_count(paddr_t paddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+        struct ft_stripe *fs = ft_stripe_of(i);
+        unsigned ret;
+
+        spinlock_acquire(&fs->fs_lock);
+        ret = frame_table[i].ref_count;
+        spinlock_release(&fs->fs_lock);
+
+        return ret;
+}
+
+unsigned
+frame_nfree(void)
+{
+        unsigned s, n = 0;
+
+        /* Unlocked: the result is only a hint. */
+        for (s = 0; s < FT_NSTRIPES; s++) {
+                n += ft_stripes[s].fs_nfree;
+        }
+        return n;
+}
+
+/*
+ * Owners and the referenced bit, for page replacement. Owners are
+ * only changed with the VM system's vm_lock held, so a victim
+ * returned by frame_choose_victim stays valid until it is released.
+ */
+
+void
+frame_set_owner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+        struct ft_stripe *fs = ft_stripe_of(i);
+
+        spinlock_acquire(&fs->fs_lock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(as == NULL || frame_table[i].ref_count == 1);
+        frame_table[i].owner = as;
+        frame_table[i].owner_vaddr = vaddr;
+        frame_table[i].referenced = TRUE;
+        spinlock_release(&fs->fs_lock);
+}
+
+void
+frame_set_cached(paddr_t paddr, bool cached)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+        struct ft_stripe *fs = ft_stripe_of(i);
+
+        spinlock_acquire(&fs->fs_lock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].owner == NULL);
+        frame_table[i].cached = cached;
+        frame_table[i].referenced = TRUE;
+        spinlock_release(&fs->fs_lock);
+}
+
+void
+frame_mark_referenced(paddr_t paddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+        struct ft_stripe *fs = ft_stripe_of(i);
+
+        spinlock_acquire(&fs->fs_lock);
+        frame_table[i].referenced = TRUE;
+        spinlock_release(&fs->fs_lock);
+}
+
+/*
+ * Second-chance clock over the whole frame table. Only frames with
+ * an owner (and hence exactly one reference) and page cache frames
+ * are candidates; a referenced one has its bit cleared and is passed
+ * over once. A page cache frame comes back with *as set to NULL. Two
+ * full sweeps without finding a victim means there is nothing that
+ * can be evicted.
+ */
+paddr_t
+frame_choose_victim(struct addrspace **as, vaddr_t *vaddr)
+{
+        uint32_t nframes = last_frame - first_frame;
+        uint32_t n, i;
+        struct ft_stripe *fs;
+
+        for (n = 0; n < 2 * nframes; n++) {
+                i = ft_clockhand;
+                ft_clockhand = (i + 1 < last_frame) ? i + 1 : first_frame;
+
+                fs = ft_stripe_of(i);
+                spinlock_acquire(&fs->fs_lock);
+                if (frame_table[i].allocated == FALSE ||
+                    (frame_table[i].owner == NULL &&
+                     !frame_table[i].cached)) {
+                        spinlock_release(&fs->fs_lock);
+                        continue;
+                }
+                KASSERT(frame_table[i].cached ||
+                        frame_table[i].ref_count == 1);
+                if (frame_table[i].referenced) {
+                        frame_table[i].referenced = FALSE;
+                        spinlock_release(&fs->fs_lock);
+                        continue;
+                }
+                *as = frame_table[i].owner;
+                *vaddr = frame_table[i].owner_vaddr;
+                spinlock_release(&fs->fs_lock);
+
+                return (paddr_t) (i << PAGE_BITS);
+        }
+
+        return (paddr_t) 0;
+}
@@ -52,6 +52,7 @@
 #include <lamebus/emu.h>
 #include <platform/bus.h>
 #include <vfs.h>
+#include <pagecache.h>
 #include <emufs.h>
 #include "autoconf.h"
 
@@ -322,14 +323,17 @@ emu_readdir(struct emu_softc *sc, uint32_t handle, uint32_t len,
 }
 
 /*
- * Write to a hardware-level file handle.
+ * Write to a hardware-level file handle. V is the file's vnode, whose
+ * cached pages are brought up to date.
  */
 static
 int
-emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
-	  struct uio *uio)
+emu_write(struct emu_softc *sc, struct vnode *v, uint32_t handle,
+	  uint32_t len, struct uio *uio)
 {
-	int result;
+	off_t pos;
+	size_t resid;
+	int result, err;
 
 	KASSERT(uio->uio_rw == UIO_WRITE);
 
@@ -343,14 +347,31 @@ emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	emu_wreg(sc, REG_IOLEN, len);
 	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
 
+	pos = uio->uio_offset;
+	resid = uio->uio_resid;
 	result = uiomove(sc->e_iobuf, len, uio);
 	membar_store_store();
 	if (result) {
-		goto out;
+		/*
+		 * The uio has already moved past whatever was copied
+		 * in before the fault, so write that much anyway.
+		 */
+		len = resid - uio->uio_resid;
+		if (len == 0) {
+			goto out;
+		}
+		emu_wreg(sc, REG_IOLEN, len);
 	}
 
 	emu_wreg(sc, REG_OPER, EMU_OP_WRITE);
-	result = emu_waitdone(sc);
+	err = emu_waitdone(sc);
+	if (err == 0) {
+		/* e_lock keeps other writes out until this is done */
+		pagecache_write(v, pos, sc->e_iobuf, len);
+	}
+	if (result == 0) {
+		result = err;
+	}
 
  out:
 	lock_release(sc->e_lock);
@@ -474,11 +495,11 @@ emufs_reclaim(struct vnode *v)
 
 	/*
 	 * Need all of these locks, e_lock to protect the device,
-	 * vfs_biglock to protect the fs-related material, and
+	 * ef_lock to protect the fs-related material, and
 	 * vn_countlock for the reference count.
 	 */
 
-	vfs_biglock_acquire();
+	lock_acquire(ef->ef_lock);
 	lock_acquire(ef->ef_emu->e_lock);
 	spinlock_acquire(&ev->ev_v.vn_countlock);
 
@@ -488,7 +509,7 @@ emufs_reclaim(struct vnode *v)
 
 		spinlock_release(&ev->ev_v.vn_countlock);
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
+		lock_release(ef->ef_lock);
 		return EBUSY;
 	}
 	KASSERT(ev->ev_v.vn_refcount == 1);
@@ -503,7 +524,7 @@ emufs_reclaim(struct vnode *v)
 	result = emu_close(ev->ev_emu, ev->ev_handle);
 	if (result) {
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
+		lock_release(ef->ef_lock);
 		return result;
 	}
 
@@ -527,7 +548,7 @@ emufs_reclaim(struct vnode *v)
 	vnode_cleanup(&ev->ev_v);
 
 	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
+	lock_release(ef->ef_lock);
 
 	kfree(ev);
 	return 0;
@@ -611,7 +632,7 @@ emufs_write(struct vnode *v, struct uio *uio)
 
 		oldresid = uio->uio_resid;
 
-		result = emu_write(ev->ev_emu, ev->ev_handle, amt, uio);
+		result = emu_write(ev->ev_emu, v, ev->ev_handle, amt, uio);
 		if (result) {
 			return result;
 		}
@@ -725,7 +746,13 @@ int
 emufs_truncate(struct vnode *v, off_t len)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	return emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	int result;
+
+	result = emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	if (result == 0) {
+		pagecache_truncate(v, len);
+	}
+	return result;
 }
 
 /*
@@ -743,16 +770,16 @@ emufs_creat(struct vnode *dir, const char *name, bool excl, mode_t mode,
 	int result;
 	int isdir;
 
-	vfs_biglock_acquire();
+	lock_acquire(ef->ef_lock);
 	result = emu_open(ev->ev_emu, ev->ev_handle, name, true, excl, mode,
 			  &handle, &isdir);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(ef->ef_lock);
 		return result;
 	}
 
 	result = emufs_loadvnode(ef, handle, isdir, &newguy);
-	vfs_biglock_release();
+	lock_release(ef->ef_lock);
 	if (result) {
 		emu_close(ev->ev_emu, handle);
 		return result;
@@ -776,16 +803,16 @@ emufs_lookup(struct vnode *dir, char *pathname, struct vnode **ret)
 	int result;
 	int isdir;
 
-	vfs_biglock_acquire();
+	lock_acquire(ef->ef_lock);
 	result = emu_open(ev->ev_emu, ev->ev_handle, pathname, false, false, 0,
 			  &handle, &isdir);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(ef->ef_lock);
 		return result;
 	}
 
 	result = emufs_loadvnode(ef, handle, isdir, &newguy);
-	vfs_biglock_release();
+	lock_release(ef->ef_lock);
 	if (result) {
 		emu_close(ev->ev_emu, handle);
 		return result;
@@ -851,13 +878,16 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 
 /*
  * VOP_MMAP
+ *
+ * Pages are read and written through emufs_read and emufs_write,
+ * which take any offset, so any file can be mapped.
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 //////////////////////////////
@@ -1144,7 +1174,9 @@ static const struct vnode_ops emufs_dirops = {
 };
 
 /*
- * Function to load a vnode into memory.
+ * Function to load a vnode into memory. The caller must hold ef_lock,
+ * from before it opened the handle, so that a vnode with the same
+ * handle can't be reclaimed (and the handle closed) underneath it.
  */
 static
 int
@@ -1156,7 +1188,7 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	KASSERT(lock_do_i_hold(ef->ef_lock));
 	lock_acquire(ef->ef_emu->e_lock);
 
 	num = vnodearray_num(ef->ef_vnodes);
@@ -1169,7 +1201,6 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 			VOP_INCREF(&ev->ev_v);
 
 			lock_release(ef->ef_emu->e_lock);
-			vfs_biglock_release();
 			*ret = ev;
 			return 0;
 		}
@@ -1190,7 +1221,6 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 			    &ef->ef_fs, ev);
 	if (result) {
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		kfree(ev);
 		return result;
 	}
@@ -1200,13 +1230,11 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 		/* note: vnode_cleanup undoes vnode_init - it does not kfree */
 		vnode_cleanup(&ev->ev_v);
 		lock_release(ef->ef_emu->e_lock);
-		vfs_biglock_release();
 		kfree(ev);
 		return result;
 	}
 
 	lock_release(ef->ef_emu->e_lock);
-	vfs_biglock_release();
 
 	*ret = ev;
 	return 0;
@@ -1310,14 +1338,24 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 
 	ef->ef_emu = sc;
 	ef->ef_root = NULL;
+	ef->ef_lock = lock_create("emufs");
+	if (ef->ef_lock == NULL) {
+		kfree(ef);
+		return ENOMEM;
+	}
 	ef->ef_vnodes = vnodearray_create();
 	if (ef->ef_vnodes == NULL) {
+		lock_destroy(ef->ef_lock);
 		kfree(ef);
 		return ENOMEM;
 	}
 
+	lock_acquire(ef->ef_lock);
 	result = emufs_loadvnode(ef, EMU_ROOTHANDLE, 1, &ef->ef_root);
+	lock_release(ef->ef_lock);
 	if (result) {
+		vnodearray_destroy(ef->ef_vnodes);
+		lock_destroy(ef->ef_lock);
 		kfree(ef);
 		return result;
 	}
@@ -1327,6 +1365,12 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 	result = vfs_addfs(devname, &ef->ef_fs);
 	if (result) {
 		VOP_DECREF(&ef->ef_root->ev_v);
+		if (vnodearray_num(ef->ef_vnodes) > 0) {
+			/* The root couldn't be reclaimed and still uses ef */
+			return result;
+		}
+		vnodearray_destroy(ef->ef_vnodes);
+		lock_destroy(ef->ef_lock);
 		kfree(ef);
 	}
 	return result;
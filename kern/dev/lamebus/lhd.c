@@ -36,9 +36,9 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
 #include <platform/bus.h>
 #include <vfs.h>
+#include <blkq.h>
 #include <lamebus/lhd.h>
 #include "autoconf.h"
 
@@ -60,6 +60,9 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Size of the bounce buffer for I/O that can't go straight to the queue */
+#define LHD_BOUNCESIZE  4096
+
 /*
  * Shortcut for reading a register.
  */
@@ -96,15 +99,84 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start transferring the current sector of the current request.
+ */
+static
+void
+lhd_startsect(struct lhd_softc *lh)
+{
+	struct blkreq *req = lh->lh_req;
+	uint32_t statval = LHD_WORKING;
+
+	/*
+	 * Are we writing? If so, transfer the data to the
+	 * on-card buffer.
+	 */
+	if (req->br_rw == UIO_WRITE) {
+		memcpy(lh->lh_buf,
+		       (char *)req->br_data + lh->lh_sect * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, req->br_block + lh->lh_sect);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Called by the request queue, with its lock held, to begin a request.
+ */
+static
+void
+lhd_start(void *vlh, struct blkreq *req)
+{
+	struct lhd_softc *lh = vlh;
+
+	KASSERT(lh->lh_req == NULL);
+
+	lh->lh_req = req;
+	lh->lh_sect = 0;
+	lhd_startsect(lh);
+}
+
+/*
+ * Record that a sector has completed. If it was the last one of the
+ * request, or it failed, the request is done; otherwise go straight
+ * on to the next sector.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct blkreq *req = lh->lh_req;
+
+	if (req == NULL) {
+		kprintf("lhd%d: Spurious completion\n", lh->lh_unit);
+		return;
+	}
+
+	/*
+	 * Are we reading? If so, and if we succeeded,
+	 * transfer the data out of the on-card buffer.
+	 */
+	if (err == 0 && req->br_rw == UIO_READ) {
+		membar_load_load();
+		memcpy((char *)req->br_data + lh->lh_sect * LHD_SECTSIZE,
+		       lh->lh_buf, LHD_SECTSIZE);
+	}
+
+	lh->lh_sect++;
+	if (err == 0 && lh->lh_sect < req->br_nblocks) {
+		lhd_startsect(lh);
+		return;
+	}
+
+	lh->lh_req = NULL;
+	blkq_done(lh->lh_queue, req, err);
 }
 
 /*
@@ -180,21 +252,28 @@ lhd_reset(struct lhd_softc *lh)
 #endif
 
 /*
- * I/O function (for both reads and writes)
+ * I/O function (for both reads and writes).
+ *
+ * A kernel buffer in one piece is handed straight to the request
+ * queue. Anything else, such as a user process reading the raw
+ * device, goes through a bounce buffer LHD_BOUNCESIZE at a time,
+ * since the data is moved by the interrupt handler.
  */
 static
 int
 lhd_io(struct device *d, struct uio *uio)
 {
 	struct lhd_softc *lh = d->d_data;
+	struct blkreq req;
+	struct iovec *iov;
+	char *bounce;
+	size_t amt;
 
 	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
-	int result;
+	int result = 0;
 
 	/* Don't allow I/O that isn't sector-aligned. */
 	if (sectoff != 0 || lenoff != 0) {
@@ -207,61 +286,65 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	req.br_rw = uio->uio_rw;
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
-			if (result) {
-				V(lh->lh_clear);
-				return result;
-			}
+	iov = uio->uio_iov;
+	if (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1 &&
+	    iov->iov_len == uio->uio_resid) {
+		req.br_block = sector;
+		req.br_nblocks = len;
+		req.br_data = iov->iov_kbase;
+		result = blkq_io(lh->lh_queue, &req);
+		if (result) {
+			return result;
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
+		/* Do what uiomove would have */
+		iov->iov_kbase = (char *)iov->iov_kbase + uio->uio_resid;
+		iov->iov_len = 0;
+		uio->uio_offset += uio->uio_resid;
+		uio->uio_resid = 0;
+		return 0;
+	}
 
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
+	bounce = kmalloc(LHD_BOUNCESIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
 
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+	while (uio->uio_resid > 0) {
+		amt = uio->uio_resid;
+		if (amt > LHD_BOUNCESIZE) {
+			amt = LHD_BOUNCESIZE;
 		}
+		req.br_block = uio->uio_offset / LHD_SECTSIZE;
+		req.br_nblocks = amt / LHD_SECTSIZE;
+		req.br_data = bounce;
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+		if (uio->uio_rw == UIO_WRITE) {
+			result = uiomove(bounce, amt, uio);
+			if (result) {
+				break;
+			}
+		}
+		result = blkq_io(lh->lh_queue, &req);
 		if (result) {
-			return result;
+			break;
+		}
+		if (uio->uio_rw == UIO_READ) {
+			result = uiomove(bounce, amt, uio);
+			if (result) {
+				break;
+			}
 		}
 	}
 
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
@@ -284,15 +367,11 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Create the request queue. */
+	lh->lh_req = NULL;
+	lh->lh_sect = 0;
+	lh->lh_queue = blkq_create(name, lhd_start, lh);
+	if (lh->lh_queue == NULL) {
 		return ENOMEM;
 	}
 
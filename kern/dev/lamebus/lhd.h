@@ -51,9 +51,9 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct blkq *lh_queue;		/* Requests waiting for the disk */
+	struct blkreq *lh_req;		/* Request in progress */
+	unsigned lh_sect;		/* Sector of it in progress */
 
 	struct device lh_dev;		/* VFS device structure */
 };
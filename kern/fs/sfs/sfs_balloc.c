@@ -33,59 +33,438 @@
  * Block allocation.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Zero out a disk block.
+ * Allocation statistics, for all SFS volumes together.
+ */
+static struct spinlock sfs_allocstats_lock = SPINLOCK_INITIALIZER;
+static struct {
+	unsigned goal_hits;		/* data blocks allocated at the goal */
+	unsigned goal_misses;		/* ... somewhere else */
+	unsigned prealloc_hits;		/* ... from a preallocation window */
+	unsigned extent_converts;	/* files converted to block pointers */
+	unsigned unwritten;		/* data blocks handed out unzeroed */
+} sfs_allocstats;
+
+/*
+ * Zero out a disk block. This only zeros it in the buffer cache; if
+ * it is overwritten before being synced, the zeros never hit the disk.
  */
 static
 int
 sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
+	struct buf *buf;
+	int result;
 
-	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
+	result = buffer_get(&sfs->sfs_absfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(buf), SFS_BLOCKSIZE);
+	sfs_jnl_dirty(sfs, buf);
+	buffer_release(buf);
+	return 0;
 }
 
+////////////////////////////////////////////////////////////
+// The freemap
+
 /*
- * Allocate a block.
+ * Every change to the in-memory freemap goes through
+ * sfs_freemap_mark or sfs_freemap_unmark, which keep the summary in
+ * sfs_freegroups and sfs_nfree up to date and note which blocks of
+ * the freemap need writing at the next sync. The caller must hold
+ * sfs_freemaplock.
+ */
+
+static
+void
+sfs_freemap_changed(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_freegroup *fg;
+
+	fg = &sfs->sfs_freegroups[block / SFS_BITSPERBLOCK];
+	fg->fg_maxrunstale = true;
+	if (!fg->fg_dirty) {
+		fg->fg_dirty = true;
+		sfs->sfs_freemapndirty++;
+	}
+}
+
+static
+void
+sfs_freemap_mark(struct sfs_fs *sfs, daddr_t block)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	bitmap_mark(sfs->sfs_freemap, block);
+	KASSERT(sfs->sfs_freegroups[block / SFS_BITSPERBLOCK].fg_nfree > 0);
+	sfs->sfs_freegroups[block / SFS_BITSPERBLOCK].fg_nfree--;
+	sfs->sfs_nfree--;
+	sfs_freemap_changed(sfs, block);
+}
+
+static
+void
+sfs_freemap_unmark(struct sfs_fs *sfs, daddr_t block)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	bitmap_unmark(sfs->sfs_freemap, block);
+	sfs->sfs_freegroups[block / SFS_BITSPERBLOCK].fg_nfree++;
+	sfs->sfs_nfree++;
+	sfs_freemap_changed(sfs, block);
+}
+
+/*
+ * Longest run of free blocks in freemap block G, recounted only if
+ * it might have changed since it was last asked for.
+ */
+static
+unsigned
+sfs_freegroup_maxrun(struct sfs_fs *sfs, unsigned g)
+{
+	struct sfs_freegroup *fg = &sfs->sfs_freegroups[g];
+	unsigned nfree;
+
+	if (fg->fg_maxrunstale) {
+		bitmap_runstats(sfs->sfs_freemap, g * SFS_BITSPERBLOCK,
+				(g + 1) * SFS_BITSPERBLOCK,
+				&nfree, &fg->fg_maxrun);
+		KASSERT(nfree == fg->fg_nfree);
+		fg->fg_maxrunstale = false;
+	}
+	return fg->fg_maxrun;
+}
+
+/*
+ * Find LEN free blocks in a row, the first such at or after GOAL if
+ * there is one, wrapping around otherwise. Only the parts of the
+ * freemap whose summary says they could have such a run are looked
+ * at, so a mostly full volume doesn't mean scanning the whole bitmap.
+ * Runs that cross from one freemap block into the next aren't found.
+ * The caller must hold sfs_freemaplock.
+ */
+static
+int
+sfs_freemap_find(struct sfs_fs *sfs, daddr_t goal, unsigned len,
+		 daddr_t *ret)
+{
+	unsigned ngroups = SFS_FS_FREEMAPBLOCKS(sfs);
+	unsigned g, i, start, index;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (sfs->sfs_nfree < len) {
+		return ENOSPC;
+	}
+	if (goal >= SFS_FS_NBLOCKS(sfs)) {
+		goal = 0;
+	}
+
+	/* The goal's group, the rest, then the goal's group from its start */
+	for (i=0; i<=ngroups; i++) {
+		g = (goal / SFS_BITSPERBLOCK + i) % ngroups;
+		if (sfs->sfs_freegroups[g].fg_nfree < len) {
+			continue;
+		}
+		if (len > 1 && sfs_freegroup_maxrun(sfs, g) < len) {
+			continue;
+		}
+		start = (i == 0) ? goal : g * SFS_BITSPERBLOCK;
+		if (bitmap_findrun(sfs->sfs_freemap, start,
+				   (g + 1) * SFS_BITSPERBLOCK,
+				   len, &index) == 0) {
+			*ret = index;
+			return 0;
+		}
+	}
+	return ENOSPC;
+}
+
+/*
+ * Build the summary after the freemap has been loaded at mount time.
  */
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_freemap_summarize(struct sfs_fs *sfs)
+{
+	unsigned ngroups = SFS_FS_FREEMAPBLOCKS(sfs);
+	struct sfs_freegroup *fg;
+	unsigned g;
+
+	sfs->sfs_freegroups = kmalloc(ngroups * sizeof(*fg));
+	if (sfs->sfs_freegroups == NULL) {
+		return ENOMEM;
+	}
+
+	sfs->sfs_nfree = 0;
+	for (g=0; g<ngroups; g++) {
+		fg = &sfs->sfs_freegroups[g];
+		bitmap_runstats(sfs->sfs_freemap, g * SFS_BITSPERBLOCK,
+				(g + 1) * SFS_BITSPERBLOCK,
+				&fg->fg_nfree, &fg->fg_maxrun);
+		fg->fg_maxrunstale = false;
+		fg->fg_dirty = false;
+		sfs->sfs_nfree += fg->fg_nfree;
+	}
+	sfs->sfs_freemapndirty = 0;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Allocation
+
+/*
+ * Give back a vnode's preallocation window. The caller must hold
+ * sfs_freemaplock.
+ */
+static
+void
+sfs_prealloc_drop(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	for (i=0; i<sv->sv_pacount; i++) {
+		sfs_freemap_unmark(sfs, sv->sv_pastart + i);
+	}
+	KASSERT(sfs->sfs_pablocks >= sv->sv_pacount);
+	sfs->sfs_pablocks -= sv->sv_pacount;
+	sv->sv_pastart = 0;
+	sv->sv_pacount = 0;
+}
+
+/*
+ * Give back every vnode's preallocation window, because the disk is
+ * full without them, or because the freemap is about to be committed.
+ */
+void
+sfs_prealloc_reclaim(struct sfs_fs *sfs)
 {
+	struct sfs_vnode *sv;
+	unsigned i;
+
+	lock_acquire(sfs->sfs_vnlock);
+	lock_acquire(sfs->sfs_freemaplock);
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL; sv = sv->sv_hashnext) {
+			sfs_prealloc_drop(sfs, sv);
+		}
+	}
+	KASSERT(sfs->sfs_pablocks == 0);
+	lock_release(sfs->sfs_freemaplock);
+	lock_release(sfs->sfs_vnlock);
+}
+
+/*
+ * Allocate a block: the first free one at or after GOAL if there is
+ * one, so that things used together end up together on disk. A GOAL
+ * of 0 just means the first free block.
+ *
+ * If the goal itself isn't free, the block isn't going to be next to
+ * whatever came before anyway; then if RUN is more than 1, start a
+ * run of RUN free blocks if one can be found, so there's room for
+ * what comes after.
+ *
+ * The block is zeroed unless ZERO is false, in which case the caller
+ * takes care of its contents.
+ */
+static
+int
+sfs_balloc_near(struct sfs_fs *sfs, daddr_t goal, unsigned run, bool zero,
+		daddr_t *diskblock)
+{
+	daddr_t runstart;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	result = sfs_freemap_find(sfs, goal, 1, diskblock);
+	if (result == ENOSPC && sfs->sfs_pablocks > 0) {
+		/* Take back the preallocated blocks and try again */
+		lock_release(sfs->sfs_freemaplock);
+		sfs_prealloc_reclaim(sfs);
+		lock_acquire(sfs->sfs_freemaplock);
+		result = sfs_freemap_find(sfs, goal, 1, diskblock);
+	}
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	if (run > 1 && *diskblock != goal &&
+	    sfs_freemap_find(sfs, *diskblock, run, &runstart) == 0) {
+		*diskblock = runstart;
+	}
+	sfs_freemap_mark(sfs, *diskblock);
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: balloc: invalid block %u\n",
 		      sfs->sfs_sb.sb_volname, *diskblock);
 	}
 
+	if (!zero) {
+		return 0;
+	}
+
 	/* Clear block before returning it */
 	result = sfs_clearblock(sfs, *diskblock);
 	if (result) {
-		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		lock_acquire(sfs->sfs_freemaplock);
+		sfs_freemap_unmark(sfs, *diskblock);
+		lock_release(sfs->sfs_freemaplock);
 	}
 	return result;
 }
 
+int
+sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock)
+{
+	return sfs_balloc_near(sfs, goal, 1, true, diskblock);
+}
+
+/*
+ * Allocate a data block for a file, near GOAL. The caller must hold
+ * the vnode's lock.
+ *
+ * If PREALLOC is not 0 the file is being extended at the end. Then,
+ * besides the block itself, up to PREALLOC blocks after it (as many
+ * as are free) are set aside for the vnode: they are marked in use so
+ * nobody else gets them, and handed out one at a time as long as the
+ * file keeps growing sequentially. That keeps files being written at
+ * the same time from interleaving on disk.
+ *
+ * The window exists only in the in-memory freemap; it is given back
+ * whenever the inode is synced (see sfs_prealloc_release), so it never
+ * reaches the disk, and whenever the disk fills up.
+ *
+ * If ZERO is false the block comes back unwritten: whatever was on
+ * disk is still there, and not even the buffer cache has been told
+ * otherwise. The caller must then fill all of it, in memory, before
+ * anyone else can look at it. That's what file writes want, since
+ * they usually overwrite the block anyway; zeroing it first would
+ * only cost a bzero and, if the zeros got pushed out before the
+ * data arrived, a wasted disk write.
+ */
+int
+sfs_balloc_data(struct sfs_vnode *sv, daddr_t goal, unsigned prealloc,
+		bool zero, daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t block;
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sv->sv_pacount > 0 && goal == sv->sv_pastart) {
+		/*
+		 * Next block of the window. It's already marked in use,
+		 * and its freemap block dirty; a sync since then would
+		 * have given the window back.
+		 */
+		block = sv->sv_pastart++;
+		sv->sv_pacount--;
+		sfs->sfs_pablocks--;
+		lock_release(sfs->sfs_freemaplock);
+
+		if (zero) {
+			result = sfs_clearblock(sfs, block);
+			if (result) {
+				sfs_bfree(sfs, block);
+				return result;
+			}
+		}
+
+		spinlock_acquire(&sfs_allocstats_lock);
+		sfs_allocstats.prealloc_hits++;
+		if (!zero) {
+			sfs_allocstats.unwritten++;
+		}
+		spinlock_release(&sfs_allocstats_lock);
+
+		*diskblock = block;
+		return 0;
+	}
+
+	/* Not sequential; whatever was set aside is no use */
+	sfs_prealloc_drop(sfs, sv);
+	lock_release(sfs->sfs_freemaplock);
+
+	result = sfs_balloc_near(sfs, goal, prealloc + 1, zero, &block);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&sfs_allocstats_lock);
+	if (block == goal) {
+		sfs_allocstats.goal_hits++;
+	}
+	else {
+		sfs_allocstats.goal_misses++;
+	}
+	if (!zero) {
+		sfs_allocstats.unwritten++;
+	}
+	spinlock_release(&sfs_allocstats_lock);
+
+	if (prealloc > 0) {
+		lock_acquire(sfs->sfs_freemaplock);
+		for (i=1; i<=prealloc; i++) {
+			if (block + i >= sfs->sfs_sb.sb_nblocks ||
+			    bitmap_isset(sfs->sfs_freemap, block + i)) {
+				break;
+			}
+			sfs_freemap_mark(sfs, block + i);
+		}
+		sv->sv_pastart = block + 1;
+		sv->sv_pacount = i - 1;
+		sfs->sfs_pablocks += i - 1;
+		lock_release(sfs->sfs_freemaplock);
+	}
+
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Give back the vnode's preallocation window, if it has one.
+ */
+void
+sfs_prealloc_release(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sv->sv_pacount > 0) {
+		sfs_prealloc_drop(sfs, sv);
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
 /*
- * Free a block.
+ * Free a block. Whatever is cached or logged for it is thrown away,
+ * so the caller mustn't be holding its buffer.
  */
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	buffer_drop(&sfs->sfs_absfs, diskblock);
+	sfs_jnl_forget(sfs, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	sfs_freemap_unmark(sfs, diskblock);
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -94,10 +473,53 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+
+	return ret;
+}
+
+
+/*
+ * Count a file that ran out of extents; see sfs_bmap.c.
+ */
+void
+sfs_balloc_countconvert(void)
+{
+	spinlock_acquire(&sfs_allocstats_lock);
+	sfs_allocstats.extent_converts++;
+	spinlock_release(&sfs_allocstats_lock);
 }
 
+/*
+ * Print the allocation statistics.
+ */
+void
+sfs_balloc_printstats(void)
+{
+	unsigned goal_hits, goal_misses, prealloc_hits, extent_converts;
+	unsigned unwritten;
+
+	/* Don't print with the spinlock held */
+	spinlock_acquire(&sfs_allocstats_lock);
+	goal_hits = sfs_allocstats.goal_hits;
+	goal_misses = sfs_allocstats.goal_misses;
+	prealloc_hits = sfs_allocstats.prealloc_hits;
+	extent_converts = sfs_allocstats.extent_converts;
+	unwritten = sfs_allocstats.unwritten;
+	spinlock_release(&sfs_allocstats_lock);
+
+	kprintf("  data blocks: %u at goal, %u elsewhere, "
+		"%u preallocated\n", goal_hits, goal_misses, prealloc_hits);
+	kprintf("  %u data blocks not zeroed ahead of the first write\n",
+		unwritten);
+	kprintf("  %u files ran out of extents\n", extent_converts);
+}
@@ -35,197 +35,287 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+////////////////////////////////////////////////////////////
+// Block pointers
+
 /*
- * Look up the disk block number (from 0 up to the number of blocks on
- * the disk) given a file and the logical block number within that
- * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * Find which of the inode's block pointers maps file block FILEBLOCK.
+ * Returns a pointer to it in the inode, and sets *LEVELS to the number
+ * of levels of indirect blocks below it (0 for a direct block) and
+ * *OFFSET to the file block's offset within the range it maps.
+ * Returns NULL if the file block is past the largest file the inode
+ * can describe.
  */
-int
-sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-	 daddr_t *diskblock)
+static
+uint32_t *
+sfs_bmap_top(struct sfs_vnode *sv, uint32_t fileblock,
+	     unsigned *levels, uint32_t *offset)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	if (fileblock < SFS_NDIRECT) {
+		*levels = 0;
+		*offset = 0;
+		return &sv->sv_i.sfi_direct[fileblock];
+	}
+	fileblock -= SFS_NDIRECT;
+
+	if (fileblock < SFS_DBPERIDB) {
+		*levels = 1;
+		*offset = fileblock;
+		return &sv->sv_i.sfi_indirect;
+	}
+	fileblock -= SFS_DBPERIDB;
 
+	if (fileblock < SFS_DBPERIDB * SFS_DBPERIDB) {
+		*levels = 2;
+		*offset = fileblock;
+		return &sv->sv_i.sfi_dindirect;
+	}
+	fileblock -= SFS_DBPERIDB * SFS_DBPERIDB;
+
+	if (fileblock < SFS_DBPERIDB * SFS_DBPERIDB * SFS_DBPERIDB) {
+		*levels = 3;
+		*offset = fileblock;
+		return &sv->sv_i.sfi_tindirect;
+	}
+	return NULL;
+}
+
+/*
+ * Look up file block FILEBLOCK in the block pointers, handing back
+ * the disk block in *DISKBLOCK (0 for a hole).
+ *
+ * If NEWBLOCK is not 0, instead make NEWBLOCK the disk block for
+ * FILEBLOCK, which must be a hole, allocating any indirect blocks
+ * needed to reach it.
+ */
+static
+int
+sfs_blockmap(struct sfs_vnode *sv, uint32_t fileblock, daddr_t newblock,
+	     daddr_t *diskblock)
+{
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
-	daddr_t block;
-	daddr_t idblock;
-	uint32_t idnum, idoff;
+	struct buf *idbuffer;
+	uint32_t *idbuf;
+	uint32_t *top;
+	daddr_t block, nextblock;
+	uint32_t offset, span, idoff;
+	unsigned levels, i;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	top = sfs_bmap_top(sv, fileblock, &levels, &offset);
+	if (top == NULL) {
+		return EFBIG;
+	}
 
 	/*
-	 * If the block we want is one of the direct blocks...
+	 * Get the block named in the inode: the data block itself if
+	 * it's a direct block, otherwise the top indirect block.
 	 */
-	if (fileblock < SFS_NDIRECT) {
-		/*
-		 * Get the block number
-		 */
-		block = sv->sv_i.sfi_direct[fileblock];
-
+	block = *top;
+	if (block==0 && newblock==0) {
 		/*
-		 * Do we need to allocate?
+		 * Nothing allocated, and we weren't asked to put
+		 * anything here, so pretend the whole range mapped
+		 * through here is filled with zeros.
 		 */
-		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+		*diskblock = 0;
+		return 0;
+	}
+	else if (block==0) {
+		if (levels == 0) {
+			block = newblock;
+		}
+		else {
+			/* Put the indirect block near the data */
+			result = sfs_balloc(sfs, newblock, &block);
 			if (result) {
 				return result;
 			}
-
-			/* Remember what we allocated; mark inode dirty */
-			sv->sv_i.sfi_direct[fileblock] = block;
-			sv->sv_dirty = true;
 		}
 
-		/*
-		 * Hand back the block
-		 */
-		if (block != 0 && !sfs_bused(sfs, block)) {
-			panic("sfs: %s: Data block %u (block %u of file %u) "
-			      "marked free\n", sfs->sfs_sb.sb_volname,
-			      block, fileblock, sv->sv_ino);
-		}
-		*diskblock = block;
-		return 0;
+		/* Remember what we allocated; mark inode dirty */
+		*top = block;
+		sv->sv_dirty = true;
+	}
+	else if (levels == 0) {
+		KASSERT(newblock == 0);
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * Now walk down through the indirect blocks, if any. SPAN is
+	 * the number of file blocks mapped by each entry of the
+	 * indirect block we're looking at.
 	 */
-	if (idnum >= SFS_NINDIRECT) {
-		return EFBIG;
+	span = 1;
+	for (i=1; i<levels; i++) {
+		span *= SFS_DBPERIDB;
 	}
+	for (i=0; i<levels; i++) {
+		idoff = offset / span;
+		offset %= span;
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
-	}
-	else if (idblock==0) {
 		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
+		 * Load the indirect block. (A new one has been zeroed
+		 * by sfs_balloc, so this won't go to disk.)
 		 */
-		result = sfs_balloc(sfs, &idblock);
+		result = buffer_read(&sfs->sfs_absfs, block, &idbuffer);
 		if (result) {
 			return result;
 		}
+		idbuf = buffer_map(idbuffer);
 
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
-
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
+		nextblock = idbuf[idoff];
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
-	}
+		/* If there's nothing there, fill it in if asked to */
+		if (nextblock==0 && newblock!=0) {
+			if (i == levels-1) {
+				nextblock = newblock;
+			}
+			else {
+				result = sfs_balloc(sfs, newblock,
+						    &nextblock);
+				if (result) {
+					buffer_release(idbuffer);
+					return result;
+				}
+			}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+			/* Remember the block */
+			idbuf[idoff] = nextblock;
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
-		if (result) {
-			return result;
+			/* The indirect block is now dirty */
+			sfs_jnl_dirty(sfs, idbuffer);
 		}
+		else if (i == levels-1) {
+			KASSERT(newblock == 0);
+		}
+		buffer_release(idbuffer);
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
+		if (nextblock == 0) {
+			/* A hole */
+			*diskblock = 0;
+			return 0;
 		}
+		block = nextblock;
+		span /= SFS_DBPERIDB;
 	}
 
-	/* Hand back the result and return. */
-	if (block != 0 && !sfs_bused(sfs, block)) {
-		panic("sfs: %s: Data block %u (block %u of file %u) "
-		      "marked free\n", sfs->sfs_sb.sb_volname,
-		      block, fileblock, sv->sv_ino);
-	}
 	*diskblock = block;
 	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Clear the entries at or past file block BLOCKLEN in the indirect
+ * block named by *IENTRY, freeing the data blocks they point to if
+ * FREEDATA is set. LEVEL is its level of indirection (1, 2, or 3) and
+ * BASEBLOCK is the first file block it maps. If nothing is left in it
+ * afterwards, free the indirect block too, clear *IENTRY, and set
+ * *IECHANGED.
+ *
+ * Subtrees entirely before BLOCKLEN are not read at all; subtrees
+ * entirely past it are freed without writing anything back. Holes
+ * cost nothing. So truncating a large sparse file only touches the
+ * indirect blocks that actually exist past the new end.
  */
+static
 int
-sfs_itrunc(struct sfs_vnode *sv, off_t len)
+sfs_itrunc_indirect(struct sfs_fs *sfs, uint32_t *ientry, bool *iechanged,
+		    unsigned level, uint32_t baseblock, uint32_t blocklen,
+		    bool freedata)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct buf *idbuffer;
+	uint32_t *idbuf;
+	uint32_t span, j;
+	unsigned i;
+	bool hasnonzero, iddirty;
+	int result;
 
-	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	/* Number of file blocks mapped by each entry */
+	span = 1;
+	for (i=1; i<level; i++) {
+		span *= SFS_DBPERIDB;
+	}
 
-	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+	if (*ientry == 0 || blocklen >= baseblock + span * SFS_DBPERIDB) {
+		/* Nothing here, or nothing past the new EOF */
+		return 0;
+	}
 
-	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
-	int result;
-	int hasnonzero, iddirty;
+	result = buffer_read(&sfs->sfs_absfs, *ientry, &idbuffer);
+	if (result) {
+		return result;
+	}
+	idbuf = buffer_map(idbuffer);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++, baseblock += span) {
+		if (idbuf[j] == 0) {
+			continue;
+		}
+		if (level > 1) {
+			/* Recurse; this may free the whole subtree */
+			result = sfs_itrunc_indirect(sfs, &idbuf[j], &iddirty,
+						     level-1, baseblock,
+						     blocklen, freedata);
+			if (result) {
+				if (iddirty) {
+					sfs_jnl_dirty(sfs, idbuffer);
+				}
+				buffer_release(idbuffer);
+				return result;
+			}
+		}
+		else if (baseblock >= blocklen) {
+			/* Discard any data blocks past the new EOF */
+			if (freedata) {
+				sfs_bfree(sfs, idbuf[j]);
+			}
+			idbuf[j] = 0;
+			iddirty = true;
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idbuf[j] != 0) {
+			hasnonzero = true;
+		}
+	}
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		buffer_release_and_invalidate(idbuffer);
+		sfs_bfree(sfs, *ientry);
+		*ientry = 0;
+		*iechanged = true;
+	}
+	else {
+		if (iddirty) {
+			sfs_jnl_dirty(sfs, idbuffer);
+		}
+		buffer_release(idbuffer);
+	}
+	return 0;
+}
 
-	vfs_biglock_acquire();
+/*
+ * Clear the block pointers for file blocks BLOCKLEN and up, freeing
+ * the data blocks too if FREEDATA is set, and freeing any indirect
+ * blocks that end up empty.
+ */
+static
+int
+sfs_blockmap_trunc(struct sfs_vnode *sv, uint32_t blocklen, bool freedata)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t i;
+	daddr_t block;
+	uint32_t baseblock;
+	int result;
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -234,70 +324,401 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	for (i=0; i<SFS_NDIRECT; i++) {
 		block = sv->sv_i.sfi_direct[i];
 		if (i >= blocklen && block != 0) {
-			sfs_bfree(sfs, block);
+			if (freedata) {
+				sfs_bfree(sfs, block);
+			}
 			sv->sv_i.sfi_direct[i] = 0;
 			sv->sv_dirty = true;
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
+	/*
+	 * Then the indirect, double indirect, and triple indirect
+	 * trees, in that order.
+	 */
 	baseblock = SFS_NDIRECT;
+	result = sfs_itrunc_indirect(sfs, &sv->sv_i.sfi_indirect,
+				     &sv->sv_dirty, 1, baseblock, blocklen,
+				     freedata);
+	if (result) {
+		return result;
+	}
+	baseblock += SFS_DBPERIDB;
+	result = sfs_itrunc_indirect(sfs, &sv->sv_i.sfi_dindirect,
+				     &sv->sv_dirty, 2, baseblock, blocklen,
+				     freedata);
+	if (result) {
+		return result;
+	}
+	baseblock += SFS_DBPERIDB * SFS_DBPERIDB;
+	return sfs_itrunc_indirect(sfs, &sv->sv_i.sfi_tindirect,
+				   &sv->sv_dirty, 3, baseblock, blocklen,
+				   freedata);
+}
 
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
+////////////////////////////////////////////////////////////
+// Extents
 
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
+/*
+ * Look up file block FILEBLOCK in the extents. Returns the disk block,
+ * or 0 for a hole.
+ */
+static
+daddr_t
+sfs_ext_lookup(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	const struct sfs_extent *ext = sv->sv_i.sfi_extents;
+	uint32_t base;
+	unsigned i;
+
+	base = 0;
+	for (i=0; i<SFS_NEXTENTS && ext[i].se_len > 0; i++) {
+		if (fileblock < base + ext[i].se_len) {
+			if (ext[i].se_block == 0) {
+				return 0;
+			}
+			return ext[i].se_block + (fileblock - base);
+		}
+		base += ext[i].se_len;
+	}
+	return 0;
+}
 
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+/*
+ * Append a run of LEN blocks at disk block BLOCK (0 for a hole) to the
+ * extent list EXT, which has *N entries, merging it into the last one
+ * if they're contiguous. EXT must have room for one more.
+ */
+static
+void
+sfs_ext_append(struct sfs_extent *ext, unsigned *n, daddr_t block,
+	       uint32_t len)
+{
+	struct sfs_extent *last;
+
+	if (len == 0) {
+		return;
+	}
+	if (*n > 0) {
+		last = &ext[*n - 1];
+		if ((last->se_block == 0 && block == 0) ||
+		    (last->se_block != 0 && block != 0 &&
+		     last->se_block + last->se_len == block)) {
+			last->se_len += len;
+			return;
+		}
+	}
+	ext[*n].se_block = block;
+	ext[*n].se_len = len;
+	(*n)++;
+}
+
+/*
+ * Make disk block BLOCK file block FILEBLOCK, which must be a hole.
+ * Usually this just makes an extent one longer. Returns false if the
+ * extents don't have room for it.
+ */
+static
+bool
+sfs_ext_insert(struct sfs_vnode *sv, uint32_t fileblock, daddr_t block)
+{
+	struct sfs_extent *ext = sv->sv_i.sfi_extents;
+	/* Splitting a hole can add two more */
+	struct sfs_extent new[SFS_NEXTENTS + 2];
+	uint32_t base, len;
+	unsigned i, n;
+	bool done;
+
+	n = 0;
+	base = 0;
+	done = false;
+	for (i=0; i<SFS_NEXTENTS && ext[i].se_len > 0; i++) {
+		len = ext[i].se_len;
+		if (!done && fileblock < base + len) {
+			/* Split the hole around the new block */
+			KASSERT(ext[i].se_block == 0);
+			sfs_ext_append(new, &n, 0, fileblock - base);
+			sfs_ext_append(new, &n, block, 1);
+			sfs_ext_append(new, &n, 0, base + len - fileblock - 1);
+			done = true;
+		}
+		else {
+			sfs_ext_append(new, &n, ext[i].se_block, len);
+		}
+		base += len;
+	}
+	if (!done) {
+		/* Past the end; there may be a hole first */
+		sfs_ext_append(new, &n, 0, fileblock - base);
+		sfs_ext_append(new, &n, block, 1);
+	}
+
+	if (n > SFS_NEXTENTS) {
+		return false;
+	}
+	memcpy(ext, new, n * sizeof(ext[0]));
+	bzero(&ext[n], (SFS_NEXTENTS - n) * sizeof(ext[0]));
+	sv->sv_dirty = true;
+	return true;
+}
+
+/*
+ * Switch a file from extents to block pointers, when it has run out
+ * of extents. If it fails, the file is left as it was.
+ */
+static
+int
+sfs_ext_convert(struct sfs_vnode *sv)
+{
+	const struct sfs_extent *ext = sv->sv_i.sfi_extents;
+	uint32_t base, j;
+	daddr_t dummy;
+	unsigned i;
+	int result;
+
+	/*
+	 * Fill in the block pointers from the extents. Until we're
+	 * done, the file is still mapped by the extents, so nothing
+	 * looks at the pointers.
+	 */
+	base = 0;
+	for (i=0; i<SFS_NEXTENTS && ext[i].se_len > 0; i++) {
+		if (ext[i].se_block != 0) {
+			for (j=0; j<ext[i].se_len; j++) {
+				result = sfs_blockmap(sv, base + j,
+						      ext[i].se_block + j,
+						      &dummy);
+				if (result) {
+					/* Drop the pointers, not the data */
+					sfs_blockmap_trunc(sv, 0, false);
+					return result;
+				}
+			}
+		}
+		base += ext[i].se_len;
+	}
+
+	bzero(sv->sv_i.sfi_extents, sizeof(sv->sv_i.sfi_extents));
+	sv->sv_i.sfi_flags &= ~SFS_IF_EXTENTS;
+	sv->sv_dirty = true;
+	sfs_balloc_countconvert();
+	return 0;
+}
+
+/*
+ * Free the blocks at or past file block BLOCKLEN from the extents.
+ * Whole extents past it are dropped; the one it falls in is cut
+ * short.
+ */
+static
+void
+sfs_ext_trunc(struct sfs_vnode *sv, uint32_t blocklen)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_extent *ext = sv->sv_i.sfi_extents;
+	uint32_t base, len, keep, j;
+	unsigned i, n;
+
+	base = 0;
+	n = 0;
+	for (i=0; i<SFS_NEXTENTS && ext[i].se_len > 0; i++) {
+		len = ext[i].se_len;
+		if (base >= blocklen) {
+			keep = 0;
+		}
+		else if (base + len > blocklen) {
+			keep = blocklen - base;
+		}
+		else {
+			keep = len;
+		}
+		if (keep < len) {
+			if (ext[i].se_block != 0) {
+				for (j=keep; j<len; j++) {
+					sfs_bfree(sfs, ext[i].se_block + j);
+				}
+			}
+			ext[i].se_len = keep;
+			if (keep == 0) {
+				ext[i].se_block = 0;
+			}
+			sv->sv_dirty = true;
+		}
+		if (keep > 0) {
+			n = i + 1;
+		}
+		base += len;
+	}
+
+	/* A hole at the end needn't be recorded */
+	if (n > 0 && ext[n-1].se_block == 0) {
+		ext[n-1].se_len = 0;
+		sv->sv_dirty = true;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Pick a disk block to try to put file block FILEBLOCK in: the one
+ * after the file block before it, if that's allocated, so files are
+ * laid out sequentially; otherwise one near the inode.
+ */
+static
+daddr_t
+sfs_bmap_goal(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	daddr_t prev;
+
+	if (fileblock > 0) {
+		if (sv->sv_i.sfi_flags & SFS_IF_EXTENTS) {
+			prev = sfs_ext_lookup(sv, fileblock - 1);
+		}
+		else if (sfs_blockmap(sv, fileblock - 1, 0, &prev)) {
+			prev = 0;
+		}
+		if (prev != 0) {
+			return prev + 1;
+		}
+	}
+	return sv->sv_ino + 1;
+}
+
+/*
+ * Look up the disk block number (from 0 up to the number of blocks on
+ * the disk) given a file and the logical block number within that
+ * file. If DOALLOC is set, and no such block exists, one will be
+ * allocated, as near as possible to the block before it. The caller
+ * must hold the vnode's lock.
+ *
+ * A new block is zeroed, unless UNWRITTEN is not NULL: then it is left
+ * as it was on disk and *UNWRITTEN is set to say so, and the caller
+ * must fill the whole block (zeroing whatever it doesn't write) in
+ * the buffer cache before letting go of the vnode lock. Otherwise
+ * *UNWRITTEN is set to false.
+ */
+int
+sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+	 daddr_t *diskblock, bool *unwritten)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t block;
+	unsigned prealloc;
+	int result;
+
+	COMPILE_ASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (unwritten != NULL) {
+		*unwritten = false;
+	}
+
+	if (fileblock >= SFS_MAXFILEBLOCKS) {
+		return EFBIG;
+	}
+
+	if (sv->sv_i.sfi_flags & SFS_IF_EXTENTS) {
+		block = sfs_ext_lookup(sv, fileblock);
+	}
+	else {
+		result = sfs_blockmap(sv, fileblock, 0, &block);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
+	}
 
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
+	if (block == 0 && doalloc) {
+		/*
+		 * If appending, set aside room for about as much
+		 * again as the file has already.
+		 */
+		prealloc = 0;
+		if (fileblock >= DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE)) {
+			prealloc = fileblock;
+			if (prealloc < SFS_PREALLOC_MIN) {
+				prealloc = SFS_PREALLOC_MIN;
 			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
+			if (prealloc > SFS_PREALLOC_MAX) {
+				prealloc = SFS_PREALLOC_MAX;
 			}
 		}
+		result = sfs_balloc_data(sv, sfs_bmap_goal(sv, fileblock),
+					 prealloc, unwritten == NULL, &block);
+		if (result) {
+			return result;
+		}
 
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
+		if ((sv->sv_i.sfi_flags & SFS_IF_EXTENTS) &&
+		    !sfs_ext_insert(sv, fileblock, block)) {
+			result = sfs_ext_convert(sv);
+			if (result) {
+				sfs_bfree(sfs, block);
+				return result;
+			}
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
+		if (!(sv->sv_i.sfi_flags & SFS_IF_EXTENTS)) {
+			result = sfs_blockmap(sv, fileblock, block, &block);
 			if (result) {
-				vfs_biglock_release();
+				sfs_bfree(sfs, block);
 				return result;
 			}
 		}
+		if (unwritten != NULL) {
+			*unwritten = true;
+		}
 	}
 
-	/* Set the file size */
-	sv->sv_i.sfi_size = len;
+	/* Hand back the result and return. */
+	if (block != 0 && !sfs_bused(sfs, block)) {
+		panic("sfs: %s: Data block %u (block %u of file %u) "
+		      "marked free\n", sfs->sfs_sb.sb_volname,
+		      block, fileblock, sv->sv_ino);
+	}
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Called for ftruncate() and from sfs_reclaim, with the vnode locked.
+ */
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
+	/* Length in blocks (divide rounding up) */
+	uint32_t blocklen;
+
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (len < 0) {
+		return EINVAL;
+	}
+	if (len > (off_t)SFS_MAXFILEBLOCKS * SFS_BLOCKSIZE) {
+		return EFBIG;
+	}
+	blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+
+	/* Anything set aside for appending is no use now */
+	sfs_prealloc_release(sv);
+
+	if (sv->sv_i.sfi_flags & SFS_IF_EXTENTS) {
+		sfs_ext_trunc(sv, blocklen);
+		result = 0;
+	}
+	else {
+		result = sfs_blockmap_trunc(sv, blocklen, true);
+	}
+
+	if (result == 0) {
+		/* Set the file size */
+		sv->sv_i.sfi_size = len;
+	}
 
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
-	return 0;
+	return result;
 }
-
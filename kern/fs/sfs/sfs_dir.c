@@ -31,11 +31,15 @@
  * SFS filesystem
  *
  * Directory I/O
+ *
+ * All of these must be called with the directory's sv_lock held.
  */
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
 #include <vfs.h>
+#include <buf.h>
+#include <dcache.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -96,12 +100,11 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 }
 
 /*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * Search a plain directory for a name. See sfs_dir_findname.
  */
+static
 int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+sfs_flatdir_findname(struct sfs_vnode *sv, const char *name,
 		uint32_t *ino, int *slot, int *emptyslot)
 {
 	struct sfs_direntry tsd;
@@ -136,9 +139,7 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 				if (slot != NULL) {
 					*slot = i;
 				}
-				if (ino != NULL) {
-					*ino = tsd.sfd_ino;
-				}
+				*ino = tsd.sfd_ino;
 			}
 		}
 	}
@@ -146,6 +147,523 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	return found ? 0 : ENOENT;
 }
 
+////////////////////////////////////////////////////////////
+// Hashed directories (see <kern/sfs.h> for the layout)
+
+/* Slot number of entry I of the leaf in file block FILEBLOCK */
+#define SFS_LEAFSLOT(fileblock, i) \
+	((fileblock) * (SFS_BLOCKSIZE / sizeof(struct sfs_direntry)) + 1 + (i))
+
+/*
+ * The name hash: FNV-1a, stopping at the null or after MAXLEN bytes.
+ */
+static
+uint32_t
+sfs_dirhash(const char *name, size_t maxlen)
+{
+	uint32_t h = 2166136261U;
+
+	while (maxlen-- > 0 && *name != 0) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Check whether the entry SD (in a buffer, so not to be changed) has
+ * the name NAME.
+ */
+static
+bool
+sfs_hashdir_namematch(const struct sfs_direntry *sd, const char *name)
+{
+	size_t i;
+
+	for (i=0; i<sizeof(sd->sfd_name); i++) {
+		if (sd->sfd_name[i] != name[i]) {
+			return false;
+		}
+		if (name[i] == 0) {
+			return true;
+		}
+	}
+	/* Not null-terminated on disk, or NAME too long for it */
+	return false;
+}
+
+/*
+ * Get a held buffer for block FILEBLOCK of a hashed directory. There
+ * are no holes in a hashed directory; if DOALLOC is set, the block is
+ * being added at the end, and comes back zeroed.
+ */
+static
+int
+sfs_hashdir_getblock(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+		     struct buf **ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t diskblock;
+	int result;
+
+	result = sfs_bmap(sv, fileblock, doalloc, &diskblock, NULL);
+	if (result) {
+		return result;
+	}
+	if (diskblock == 0) {
+		panic("sfs: %s: hashed directory %u: block %u missing\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino, fileblock);
+	}
+	return buffer_read(&sfs->sfs_absfs, diskblock, ret);
+}
+
+/*
+ * Add a zeroed block to the end of a hashed directory.
+ */
+static
+int
+sfs_hashdir_addblock(struct sfs_vnode *sv, uint32_t *fileblock,
+		     struct buf **ret)
+{
+	int result;
+
+	*fileblock = sv->sv_i.sfi_size / SFS_BLOCKSIZE;
+	result = sfs_hashdir_getblock(sv, *fileblock, true, ret);
+	if (result) {
+		return result;
+	}
+	sv->sv_i.sfi_size += SFS_BLOCKSIZE;
+	sv->sv_dirty = true;
+	return 0;
+}
+
+/*
+ * Get a held buffer for the header block.
+ */
+static
+int
+sfs_hashdir_gethdr(struct sfs_vnode *sv, struct buf **ret,
+		   struct sfs_dirhdr **hdr)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	int result;
+
+	result = sfs_hashdir_getblock(sv, 0, false, ret);
+	if (result) {
+		return result;
+	}
+	*hdr = buffer_map(*ret);
+	if ((*hdr)->sdh_magic != SFS_DIRHDR_MAGIC ||
+	    (*hdr)->sdh_depth > SFS_DIRHASH_MAXDEPTH) {
+		panic("sfs: %s: hashed directory %u: bad header\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino);
+	}
+	return 0;
+}
+
+/*
+ * Get a held buffer for a leaf block.
+ */
+static
+int
+sfs_hashdir_getleaf(struct sfs_vnode *sv, uint32_t fileblock,
+		    struct buf **ret, struct sfs_dirleaf **leaf)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	int result;
+
+	result = sfs_hashdir_getblock(sv, fileblock, false, ret);
+	if (result) {
+		return result;
+	}
+	*leaf = buffer_map(*ret);
+	if ((*leaf)->sdl_magic != SFS_DIRLEAF_MAGIC ||
+	    (*leaf)->sdl_depth > SFS_DIRHASH_MAXDEPTH) {
+		panic("sfs: %s: hashed directory %u: bad leaf in block %u\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino, fileblock);
+	}
+	return 0;
+}
+
+/*
+ * Get the table depth.
+ */
+static
+int
+sfs_hashdir_depth(struct sfs_vnode *sv, unsigned *ret)
+{
+	struct buf *buf;
+	struct sfs_dirhdr *hdr;
+	int result;
+
+	result = sfs_hashdir_gethdr(sv, &buf, &hdr);
+	if (result) {
+		return result;
+	}
+	*ret = hdr->sdh_depth;
+	buffer_release(buf);
+	return 0;
+}
+
+/*
+ * Get a held buffer for the table block that holds pointer I, and
+ * the pointer's address in it.
+ */
+static
+int
+sfs_hashdir_getptr(struct sfs_vnode *sv, unsigned i,
+		   struct buf **ret, uint32_t **ptr)
+{
+	struct buf *buf;
+	struct sfs_dirhdr *hdr;
+	uint32_t tableblock;
+	int result;
+
+	result = sfs_hashdir_gethdr(sv, &buf, &hdr);
+	if (result) {
+		return result;
+	}
+	KASSERT(i < (1U << hdr->sdh_depth));
+	tableblock = hdr->sdh_index[i / SFS_DBPERIDB];
+	buffer_release(buf);
+
+	result = sfs_hashdir_getblock(sv, tableblock, false, ret);
+	if (result) {
+		return result;
+	}
+	*ptr = (uint32_t *)buffer_map(*ret) + i % SFS_DBPERIDB;
+	return 0;
+}
+
+/*
+ * Find the file block of the leaf for names with hash HASH.
+ */
+static
+int
+sfs_hashdir_findleaf(struct sfs_vnode *sv, uint32_t hash, uint32_t *ret)
+{
+	struct buf *buf;
+	uint32_t *ptr;
+	unsigned depth;
+	int result;
+
+	result = sfs_hashdir_depth(sv, &depth);
+	if (result) {
+		return result;
+	}
+	result = sfs_hashdir_getptr(sv, hash & ((1U << depth) - 1),
+				    &buf, &ptr);
+	if (result) {
+		return result;
+	}
+	*ret = *ptr;
+	buffer_release(buf);
+	return 0;
+}
+
+/*
+ * Search a hashed directory for a name. This only needs to look in
+ * one leaf, and an empty slot handed back is in that leaf, so that
+ * the name can go there. See sfs_dir_findname.
+ */
+static
+int
+sfs_hashdir_findname(struct sfs_vnode *sv, const char *name,
+		uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct buf *buf;
+	struct sfs_dirleaf *leaf;
+	struct sfs_direntry *sd;
+	uint32_t leafblock;
+	bool found;
+	unsigned i;
+	int result;
+
+	result = sfs_hashdir_findleaf(sv, sfs_dirhash(name, SFS_NAMELEN),
+				      &leafblock);
+	if (result) {
+		return result;
+	}
+	result = sfs_hashdir_getleaf(sv, leafblock, &buf, &leaf);
+	if (result) {
+		return result;
+	}
+
+	found = false;
+	for (i=0; i<SFS_DIRLEAF_NENTRIES; i++) {
+		sd = &leaf->sdl_entries[i];
+		if (sd->sfd_ino == SFS_NOINO) {
+			if (emptyslot != NULL) {
+				*emptyslot = SFS_LEAFSLOT(leafblock, i);
+			}
+		}
+		else if (sfs_hashdir_namematch(sd, name)) {
+			KASSERT(!found);
+			found = true;
+			if (slot != NULL) {
+				*slot = SFS_LEAFSLOT(leafblock, i);
+			}
+			*ino = sd->sfd_ino;
+		}
+	}
+	buffer_release(buf);
+
+	return found ? 0 : ENOENT;
+}
+
+/*
+ * Double the size of the table. Each new pointer is a copy of the
+ * one 2^depth below it, so that every leaf stays where it was.
+ */
+static
+int
+sfs_hashdir_grow(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *hdrbuf, *oldbuf, *newbuf;
+	struct sfs_dirhdr *hdr;
+	uint32_t *ptrs, oldblock, newblock;
+	unsigned depth, n, i;
+	int result;
+
+	result = sfs_hashdir_depth(sv, &depth);
+	if (result) {
+		return result;
+	}
+	KASSERT(depth < SFS_DIRHASH_MAXDEPTH);
+	n = 1U << depth;
+
+	if (n < SFS_DBPERIDB) {
+		/* The table fits in its first block */
+		result = sfs_hashdir_getptr(sv, 0, &oldbuf, &ptrs);
+		if (result) {
+			return result;
+		}
+		for (i=0; i<n; i++) {
+			ptrs[n + i] = ptrs[i];
+		}
+		sfs_jnl_dirty(sfs, oldbuf);
+		buffer_release(oldbuf);
+	}
+	else {
+		/* Copy each table block onto a new one */
+		for (i=0; i<n / SFS_DBPERIDB; i++) {
+			result = sfs_hashdir_addblock(sv, &newblock, &newbuf);
+			if (result) {
+				return result;
+			}
+
+			result = sfs_hashdir_gethdr(sv, &hdrbuf, &hdr);
+			if (result) {
+				buffer_release(newbuf);
+				return result;
+			}
+			oldblock = hdr->sdh_index[i];
+			hdr->sdh_index[n / SFS_DBPERIDB + i] = newblock;
+			sfs_jnl_dirty(sfs, hdrbuf);
+			buffer_release(hdrbuf);
+
+			result = sfs_hashdir_getblock(sv, oldblock, false,
+						      &oldbuf);
+			if (result) {
+				buffer_release(newbuf);
+				return result;
+			}
+			memcpy(buffer_map(newbuf), buffer_map(oldbuf),
+			       SFS_BLOCKSIZE);
+			sfs_jnl_dirty(sfs, newbuf);
+			buffer_release(newbuf);
+			buffer_release(oldbuf);
+		}
+	}
+
+	result = sfs_hashdir_gethdr(sv, &hdrbuf, &hdr);
+	if (result) {
+		return result;
+	}
+	hdr->sdh_depth = depth + 1;
+	sfs_jnl_dirty(sfs, hdrbuf);
+	buffer_release(hdrbuf);
+	return 0;
+}
+
+/*
+ * Split the leaf for names with hash HASH on its next bit of hash,
+ * moving the entries with that bit set to a new leaf.
+ */
+static
+int
+sfs_hashdir_split(struct sfs_vnode *sv, uint32_t hash)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *oldbuf, *newbuf, *ptrbuf;
+	struct sfs_dirleaf *oldleaf, *newleaf;
+	struct sfs_direntry *sd;
+	uint32_t oldblock, newblock, bit, *ptr;
+	unsigned depth, leafdepth, i, j;
+	int result;
+
+	result = sfs_hashdir_depth(sv, &depth);
+	if (result) {
+		return result;
+	}
+	result = sfs_hashdir_findleaf(sv, hash, &oldblock);
+	if (result) {
+		return result;
+	}
+	result = sfs_hashdir_getleaf(sv, oldblock, &oldbuf, &oldleaf);
+	if (result) {
+		return result;
+	}
+	leafdepth = oldleaf->sdl_depth;
+	buffer_release(oldbuf);
+
+	if (leafdepth == depth) {
+		/* Only one pointer names this leaf; need more pointers */
+		if (depth == SFS_DIRHASH_MAXDEPTH) {
+			return ENOSPC;
+		}
+		result = sfs_hashdir_grow(sv);
+		if (result) {
+			return result;
+		}
+		depth++;
+	}
+	KASSERT(leafdepth < depth);
+	bit = 1U << leafdepth;
+
+	result = sfs_hashdir_addblock(sv, &newblock, &newbuf);
+	if (result) {
+		return result;
+	}
+	result = sfs_hashdir_getleaf(sv, oldblock, &oldbuf, &oldleaf);
+	if (result) {
+		buffer_release(newbuf);
+		return result;
+	}
+	newleaf = buffer_map(newbuf);
+	newleaf->sdl_magic = SFS_DIRLEAF_MAGIC;
+	newleaf->sdl_depth = leafdepth + 1;
+	oldleaf->sdl_depth = leafdepth + 1;
+
+	j = 0;
+	for (i=0; i<SFS_DIRLEAF_NENTRIES; i++) {
+		sd = &oldleaf->sdl_entries[i];
+		if (sd->sfd_ino != SFS_NOINO &&
+		    (sfs_dirhash(sd->sfd_name, SFS_NAMELEN) & bit) != 0) {
+			newleaf->sdl_entries[j++] = *sd;
+			bzero(sd, sizeof(*sd));
+		}
+	}
+
+	sfs_jnl_dirty(sfs, newbuf);
+	sfs_jnl_dirty(sfs, oldbuf);
+	buffer_release(newbuf);
+	buffer_release(oldbuf);
+
+	/*
+	 * Of the pointers that named the old leaf, the ones with the
+	 * new bit set now name the new leaf.
+	 */
+	for (i = (hash & (bit - 1)) | bit; i < (1U << depth); i += bit << 1) {
+		result = sfs_hashdir_getptr(sv, i, &ptrbuf, &ptr);
+		if (result) {
+			return result;
+		}
+		KASSERT(*ptr == oldblock);
+		*ptr = newblock;
+		sfs_jnl_dirty(sfs, ptrbuf);
+		buffer_release(ptrbuf);
+	}
+
+	return 0;
+}
+
+/*
+ * Split leaves until the leaf for NAME has an empty slot, and hand
+ * back the slot.
+ */
+static
+int
+sfs_hashdir_makeroom(struct sfs_vnode *sv, const char *name, int *emptyslot)
+{
+	uint32_t hash, ino;
+	int result;
+
+	hash = sfs_dirhash(name, SFS_NAMELEN);
+	*emptyslot = -1;
+	while (*emptyslot < 0) {
+		result = sfs_hashdir_split(sv, hash);
+		if (result) {
+			return result;
+		}
+		result = sfs_hashdir_findname(sv, name, &ino, NULL,
+					      emptyslot);
+		if (result != ENOENT) {
+			KASSERT(result != 0);
+			return result;
+		}
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Directory operations
+
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found.
+ *
+ * If only the inode number is wanted, the name cache may have the
+ * answer; otherwise the directory is searched, and the answer put
+ * in the name cache for next time.
+ */
+int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+		uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct fs *fs = sv->sv_absvn.vn_fs;
+	uint32_t foundino;
+	ino_t cachedino;
+	int result;
+
+	if (slot == NULL && emptyslot == NULL) {
+		switch (dcache_lookup(fs, sv->sv_ino, name, &cachedino)) {
+		    case DCACHE_HIT:
+			if (ino != NULL) {
+				*ino = cachedino;
+			}
+			return 0;
+		    case DCACHE_NEGATIVE:
+			return ENOENT;
+		    case DCACHE_MISS:
+			break;
+		}
+	}
+
+	if (sv->sv_i.sfi_flags & SFS_IF_HASHDIR) {
+		result = sfs_hashdir_findname(sv, name, &foundino,
+					      slot, emptyslot);
+	}
+	else {
+		result = sfs_flatdir_findname(sv, name, &foundino,
+					      slot, emptyslot);
+	}
+
+	if (result == 0) {
+		if (ino != NULL) {
+			*ino = foundino;
+		}
+		dcache_enter(fs, sv->sv_ino, name, foundino);
+	}
+	else if (result == ENOENT) {
+		dcache_enter_negative(fs, sv->sv_ino, name);
+	}
+
+	return result;
+}
+
 /*
  * Create a link in a directory to the specified inode by number, with
  * the specified name, and optionally hand back the slot.
@@ -170,9 +688,20 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return ENAMETOOLONG;
 	}
 
-	/* If we didn't get an empty slot, add the entry at the end. */
+	/*
+	 * If we didn't get an empty slot, add the entry at the end,
+	 * or for a hashed directory, split the name's leaf.
+	 */
 	if (emptyslot < 0) {
-		emptyslot = sfs_dir_nentries(sv);
+		if (sv->sv_i.sfi_flags & SFS_IF_HASHDIR) {
+			result = sfs_hashdir_makeroom(sv, name, &emptyslot);
+			if (result) {
+				return result;
+			}
+		}
+		else {
+			emptyslot = sfs_dir_nentries(sv);
+		}
 	}
 
 	/* Set up the entry. */
@@ -185,8 +714,14 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		*slot = emptyslot;
 	}
 
-	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	/* Write the entry, and tell the name cache. */
+	result = sfs_writedir(sv, emptyslot, &sd);
+	if (result) {
+		dcache_remove(sv->sv_absvn.vn_fs, sv->sv_ino, name);
+		return result;
+	}
+	dcache_enter(sv->sv_absvn.vn_fs, sv->sv_ino, name, ino);
+	return 0;
 }
 
 /*
@@ -195,14 +730,31 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
+	struct fs *fs = sv->sv_absvn.vn_fs;
 	struct sfs_direntry sd;
+	char name[sizeof(sd.sfd_name)];
+	int result;
+
+	/* Get the name being removed, for the name cache */
+	result = sfs_readdir(sv, slot, &sd);
+	if (result) {
+		return result;
+	}
+	sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+	strcpy(name, sd.sfd_name);
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		dcache_remove(fs, sv->sv_ino, name);
+		return result;
+	}
+	dcache_enter_negative(fs, sv->sv_ino, name);
+	return 0;
 }
 
 /*
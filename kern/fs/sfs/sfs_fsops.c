@@ -38,22 +38,22 @@
 #include <lib.h>
 #include <array.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
+#include <dcache.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 
-/* Shortcuts for the size macros in kern/sfs.h */
-#define SFS_FS_NBLOCKS(sfs)        ((sfs)->sfs_sb.sb_nblocks)
-#define SFS_FS_FREEMAPBITS(sfs)    SFS_FREEMAPBITS(SFS_FS_NBLOCKS(sfs))
-#define SFS_FS_FREEMAPBLOCKS(sfs)  SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs))
-
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Reading loads the whole bitmap; writing writes only the blocks of
+ * it that have changed (see sfs_freemap_changed), so the cost of a
+ * sync goes with how much was allocated and freed rather than with
+ * the size of the volume. Consecutive blocks go in one request.
  *
  * The free block bitmap consists of SFS_FREEMAPBLOCKS 512-byte
  * sectors of bits, one bit for each sector on the filesystem. The
@@ -71,7 +71,8 @@ static
 int
 sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 {
-	uint32_t j, freemapblocks;
+	struct sfs_freegroup *groups = sfs->sfs_freegroups;
+	uint32_t j, n, i, freemapblocks;
 	char *freemapdata;
 	int result;
 
@@ -81,66 +82,101 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 	/* Pointer to our freemap data in memory. */
 	freemapdata = bitmap_getdata(sfs->sfs_freemap);
 
-	/* For each block in the free block bitmap... */
-	for (j=0; j<freemapblocks; j++) {
+	/* The freemap starts at sector 2. */
+	if (rw == UIO_READ) {
+		return sfs_readblock(sfs, SFS_FREEMAP_START, freemapdata,
+				     freemapblocks * SFS_BLOCKSIZE);
+	}
 
-		/* Get a pointer to its data */
-		void *ptr = freemapdata + j*SFS_BLOCKSIZE;
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
 
-		/* and read or write it. The freemap starts at sector 2. */
-		if (rw == UIO_READ) {
-			result = sfs_readblock(sfs, SFS_FREEMAP_START+j, ptr,
-					       SFS_BLOCKSIZE);
+	for (j=0; j<freemapblocks && sfs->sfs_freemapndirty > 0; j+=n) {
+		/* Find the next run of changed blocks */
+		n = 1;
+		if (!groups[j].fg_dirty) {
+			continue;
 		}
-		else {
-			result = sfs_writeblock(sfs, SFS_FREEMAP_START+j, ptr,
-						SFS_BLOCKSIZE);
+		while (j+n < freemapblocks && groups[j+n].fg_dirty) {
+			n++;
 		}
 
-		/* If we failed, stop. */
+		result = sfs_writeblock(sfs, SFS_FREEMAP_START+j,
+					freemapdata + j*SFS_BLOCKSIZE,
+					n * SFS_BLOCKSIZE);
 		if (result) {
 			return result;
 		}
+
+		for (i=0; i<n; i++) {
+			groups[j+i].fg_dirty = false;
+		}
+		KASSERT(sfs->sfs_freemapndirty >= n);
+		sfs->sfs_freemapndirty -= n;
 	}
 	return 0;
 }
 
 /*
- * Sync routine for the vnode table.
+ * Sync routine for the vnode table. This only copies the inodes into
+ * the buffer cache; sfs_sync then flushes the cache once, rather than
+ * once per vnode as VOP_FSYNC would.
  */
 static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
+	struct sfs_vnode **svs, *sv;
 	unsigned i, num;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/*
+	 * Each vnode's lock comes before the table lock, so take a
+	 * reference to everything in the table and work from that.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	num = sfs->sfs_nvnodes;
+	if (num == 0) {
+		lock_release(sfs->sfs_vnlock);
+		return 0;
+	}
+	svs = kmalloc(num * sizeof(svs[0]));
+	if (svs == NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	num = 0;
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL; sv = sv->sv_hashnext) {
+			VOP_INCREF(&sv->sv_absvn);
+			svs[num++] = sv;
+		}
+	}
+	KASSERT(num == sfs->sfs_nvnodes);
+	lock_release(sfs->sfs_vnlock);
+
+	/* Go over the loaded vnodes, syncing as we go. */
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		lock_acquire(svs[i]->sv_lock);
+		sfs_sync_inode(svs[i]);
+		lock_release(svs[i]->sv_lock);
+		VOP_DECREF(&svs[i]->sv_absvn);
 	}
+	kfree(svs);
 	return 0;
 }
 
 /*
  * Sync routine for the freemap.
  */
-static
 int
 sfs_sync_freemap(struct sfs_fs *sfs)
 {
 	int result;
 
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_freemapio(sfs, UIO_WRITE);
-		if (result) {
-			return result;
-		}
-		sfs->sfs_freemapdirty = false;
-	}
+	lock_acquire(sfs->sfs_freemaplock);
+	result = sfs_freemapio(sfs, UIO_WRITE);
+	lock_release(sfs->sfs_freemaplock);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -152,14 +188,17 @@ sfs_sync_superblock(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_superdirty) {
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 					sizeof(sfs->sfs_sb));
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
 
@@ -174,8 +213,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -208,28 +245,43 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* If any vnodes need to be written, write them. */
-	result = sfs_sync_vnodes(sfs);
-	if (result) {
-		vfs_biglock_release();
-		return result;
+	if (sfs->sfs_jnl != NULL) {
+		/*
+		 * The inodes are already in the buffer cache (each
+		 * operation puts them there), and committing writes
+		 * that and the freemap.
+		 */
+		result = sfs_jnl_commit(sfs);
+		if (result) {
+			return result;
+		}
 	}
+	else {
+		/* If any vnodes need to be written, write them. */
+		result = sfs_sync_vnodes(sfs);
+		if (result) {
+			return result;
+		}
 
-	/* If the free block map needs to be written, write it. */
-	result = sfs_sync_freemap(sfs);
-	if (result) {
-		vfs_biglock_release();
-		return result;
+		/* Write out everything in the buffer cache, inodes included. */
+		result = buffer_sync_fs(fs);
+		if (result) {
+			return result;
+		}
+
+		/* If the free block map needs to be written, write it. */
+		result = sfs_sync_freemap(sfs);
+		if (result) {
+			return result;
+		}
 	}
 
 	/* If the superblock needs to be written, write it. */
 	result = sfs_sync_superblock(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -243,13 +295,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
 
-	return ret;
+	/* This never changes after mount, so needs no locking. */
+	return sfs->sfs_sb.sb_volname;
 }
 
 /*
@@ -262,7 +310,16 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	kfree(sfs->sfs_freegroups);
+	if (sfs->sfs_freemaplock != NULL) {
+		lock_destroy(sfs->sfs_freemaplock);
+	}
+	if (sfs->sfs_vnlock != NULL) {
+		lock_destroy(sfs->sfs_vnlock);
+	}
+	KASSERT(sfs->sfs_nvnodes == 0);
+	kfree(sfs->sfs_vnhash);
+	sfs_jnl_destroy(sfs);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -277,18 +334,37 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
-
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open? If so, can't unmount. (If not,
+	 * none can appear: new references all start from the root,
+	 * which getdevice only takes under vfs_biglock, and the VFS
+	 * layer holds that around unmount.)
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
+
+	/*
+	 * Nothing is left to replay; say so. This waits for the last
+	 * commit's checkpoint, which fails if that does.
+	 */
+	result = sfs_jnl_unmount(sfs);
+	if (result) {
+		return result;
+	}
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
-	KASSERT(sfs->sfs_freemapdirty == false);
+	KASSERT(sfs->sfs_freemapndirty == 0);
+
+	/* so nothing in the buffer cache is dirty. */
+	buffer_drop_fs(fs);
+	dcache_purgefs(fs);
 
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
@@ -297,10 +373,26 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Block I/O for the buffer cache, which goes through the journal.
+ */
+static
+int
+sfs_fs_readblock(struct fs *fs, daddr_t block, void *data, size_t len)
+{
+	return sfs_jnl_read(fs->fs_data, block, data, len);
+}
+
+static
+int
+sfs_fs_writeblock(struct fs *fs, daddr_t block, void *data, size_t len)
+{
+	return sfs_jnl_write(fs->fs_data, block, data, len);
+}
+
 /*
  * File system operations table.
  */
@@ -309,6 +401,8 @@ static const struct fs_ops sfs_fsops = {
 	.fsop_getvolname = sfs_getvolname,
 	.fsop_getroot = sfs_getroot,
 	.fsop_unmount = sfs_unmount,
+	.fsop_readblock = sfs_fs_readblock,
+	.fsop_writeblock = sfs_fs_writeblock,
 };
 
 /*
@@ -321,6 +415,7 @@ struct sfs_fs *
 sfs_fs_create(void)
 {
 	struct sfs_fs *sfs;
+	unsigned i;
 
 	/*
 	 * Make sure our on-disk structures aren't messed up
@@ -328,6 +423,9 @@ sfs_fs_create(void)
 	COMPILE_ASSERT(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	COMPILE_ASSERT(sizeof(struct sfs_dirhdr)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(sizeof(struct sfs_dirleaf)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(SFS_BLOCKSIZE == BUFFER_SIZE);
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
@@ -351,17 +449,39 @@ sfs_fs_create(void)
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	sfs->sfs_vnhashsize = SFS_VNHASH_INITSIZE;
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_vnhash = kmalloc(SFS_VNHASH_INITSIZE *
+				  sizeof(sfs->sfs_vnhash[0]));
+	if (sfs->sfs_vnhash == NULL) {
 		goto cleanup_object;
 	}
+	for (i=0; i<SFS_VNHASH_INITSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_vnlock = lock_create("sfs vnodes");
+	if (sfs->sfs_vnlock == NULL) {
+		goto cleanup_vnodes;
+	}
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
-	sfs->sfs_freemapdirty = false;
+	sfs->sfs_freegroups = NULL;
+	sfs->sfs_freemapndirty = 0;
+	sfs->sfs_nfree = 0;
+	sfs->sfs_pablocks = 0;
+	sfs->sfs_jnl = NULL;
+	sfs->sfs_freemaplock = lock_create("sfs freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_vnlock;
+	}
 
 	return sfs;
 
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
+cleanup_vnodes:
+	kfree(sfs->sfs_vnhash);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -388,8 +508,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -402,7 +520,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
@@ -410,7 +527,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -423,7 +539,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -436,7 +551,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			SFS_MAGIC);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
@@ -448,26 +562,37 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Ensure null termination of the volume name */
 	sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
 
+	/* Finish anything committed before a crash, freemap included */
+	result = sfs_jnl_mount(sfs);
+	if (result) {
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return result;
+	}
+
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
 	if (sfs->sfs_freemap == NULL) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
+		return result;
+	}
+	result = sfs_freemap_summarize(sfs);
+	if (result) {
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
 		return result;
 	}
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -479,3 +604,23 @@ sfs_mount(const char *device)
 {
 	return vfs_mount(device, NULL, sfs_domount);
 }
+
+/*
+ * For testing journal replay (see sfs_jnl_crash): the next commit on
+ * FS is the last thing written to it before it's unmounted.
+ */
+int
+sfs_crash(struct fs *fs)
+{
+	struct sfs_fs *sfs;
+
+	if (fs->fs_ops != &sfs_fsops) {
+		return EINVAL;
+	}
+	sfs = fs->fs_data;
+	if (sfs->sfs_jnl == NULL) {
+		return EINVAL;
+	}
+	sfs_jnl_crash(sfs);
+	return 0;
+}
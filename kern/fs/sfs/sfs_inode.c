@@ -35,31 +35,214 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
+#include <buf.h>
+#include <dcache.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Vnode table statistics, for all SFS volumes together.
+ */
+static struct spinlock sfs_stats_lock = SPINLOCK_INITIALIZER;
+static struct {
+	unsigned lookups;		/* calls to sfs_loadvnode */
+	unsigned hits;			/* ... that found the vnode loaded */
+	unsigned loaded;		/* vnodes currently in memory */
+	unsigned grows;			/* times a table was enlarged */
+} sfs_stats;
+
+/*
+ * The vnode table. Loaded vnodes are hashed by inode number, which
+ * (being a block number) spreads well enough by its low bits. The
+ * chain heads are in sfs_vnhash and the chains run through
+ * sv_hashnext; all of it is protected by sfs_vnlock.
+ */
+static
+unsigned
+sfs_vnhash_bucket(struct sfs_fs *sfs, uint32_t ino)
+{
+	return ino & (sfs->sfs_vnhashsize - 1);
+}
+
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	sv = sfs->sfs_vnhash[sfs_vnhash_bucket(sfs, ino)];
+	while (sv != NULL && sv->sv_ino != ino) {
+		sv = sv->sv_hashnext;
+	}
+	return sv;
+}
+
+/*
+ * Double the number of chains. If there's no memory for a bigger
+ * table, keep the old one; that's slower but still correct.
+ */
+static
+void
+sfs_vnhash_grow(struct sfs_fs *sfs)
+{
+	struct sfs_vnode **newhash, *sv;
+	unsigned newsize, i, b;
+
+	newsize = sfs->sfs_vnhashsize * 2;
+	newhash = kmalloc(newsize * sizeof(newhash[0]));
+	if (newhash == NULL) {
+		return;
+	}
+	for (i=0; i<newsize; i++) {
+		newhash[i] = NULL;
+	}
+
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		while ((sv = sfs->sfs_vnhash[i]) != NULL) {
+			sfs->sfs_vnhash[i] = sv->sv_hashnext;
+			b = sv->sv_ino & (newsize - 1);
+			sv->sv_hashnext = newhash[b];
+			newhash[b] = sv;
+		}
+	}
+
+	kfree(sfs->sfs_vnhash);
+	sfs->sfs_vnhash = newhash;
+	sfs->sfs_vnhashsize = newsize;
+
+	spinlock_acquire(&sfs_stats_lock);
+	sfs_stats.grows++;
+	spinlock_release(&sfs_stats_lock);
+}
+
+static
+void
+sfs_vnhash_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned b;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	/* Keep the average chain at two or less */
+	if (sfs->sfs_nvnodes >= 2 * sfs->sfs_vnhashsize) {
+		sfs_vnhash_grow(sfs);
+	}
+
+	b = sfs_vnhash_bucket(sfs, sv->sv_ino);
+	sv->sv_hashnext = sfs->sfs_vnhash[b];
+	sfs->sfs_vnhash[b] = sv;
+	sfs->sfs_nvnodes++;
+
+	spinlock_acquire(&sfs_stats_lock);
+	sfs_stats.loaded++;
+	spinlock_release(&sfs_stats_lock);
+}
+
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **svp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	svp = &sfs->sfs_vnhash[sfs_vnhash_bucket(sfs, sv->sv_ino)];
+	while (*svp != NULL && *svp != sv) {
+		svp = &(*svp)->sv_hashnext;
+	}
+	if (*svp == NULL) {
+		panic("sfs: %s: reclaim vnode %u not in vnode table\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino);
+	}
+	*svp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+
+	KASSERT(sfs->sfs_nvnodes > 0);
+	sfs->sfs_nvnodes--;
+
+	spinlock_acquire(&sfs_stats_lock);
+	KASSERT(sfs_stats.loaded > 0);
+	sfs_stats.loaded--;
+	spinlock_release(&sfs_stats_lock);
+}
+
+/*
+ * Print the vnode table statistics.
+ */
+void
+sfs_printstats(void)
+{
+	unsigned lookups, hits, loaded, grows;
+
+	/* Don't print with the spinlock held */
+	spinlock_acquire(&sfs_stats_lock);
+	lookups = sfs_stats.lookups;
+	hits = sfs_stats.hits;
+	loaded = sfs_stats.loaded;
+	grows = sfs_stats.grows;
+	spinlock_release(&sfs_stats_lock);
+
+	kprintf("sfs: %u vnodes loaded, table enlarged %u times\n",
+		loaded, grows);
+	kprintf("  %u lookups, %u hits (%u%%)\n", lookups, hits,
+		lookups == 0 ? 0 : (unsigned)((uint64_t)hits * 100 / lookups));
+	sfs_balloc_printstats();
+	sfs_jnl_printstats();
+}
+
 
 /*
- * Write an on-disk inode structure back out to disk.
+ * Write an on-disk inode structure back out to disk, if it has
+ * changed. (That is, to the buffer cache, which writes it to disk
+ * later.) The caller must hold the vnode's lock, and be in a journal
+ * operation. If this fails the inode stays dirty, and goes out with
+ * whatever writes it next.
  */
 int
-sfs_sync_inode(struct sfs_vnode *sv)
+sfs_write_inode(struct sfs_vnode *sv)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
 	int result;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
-		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
-					sizeof(sv->sv_i));
+		result = buffer_get(&sfs->sfs_absfs, sv->sv_ino, &buf);
 		if (result) {
 			return result;
 		}
+		memcpy(buffer_map(buf), &sv->sv_i, sizeof(sv->sv_i));
+		sfs_jnl_dirty(sfs, buf);
+		buffer_release(buf);
 		sv->sv_dirty = false;
 	}
 	return 0;
 }
 
+/*
+ * Sync an inode: as sfs_write_inode, but also give back the vnode's
+ * preallocation window.
+ */
+int
+sfs_sync_inode(struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/*
+	 * The preallocation window is marked in the in-memory freemap
+	 * only; give it back so a sync doesn't write it to disk, where
+	 * nothing would ever free it after a crash.
+	 */
+	sfs_prealloc_release(sv);
+
+	return sfs_write_inode(sv);
+}
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
@@ -70,15 +253,24 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * Freeing the file is part of whatever dropped the last
+	 * reference (usually a remove), if that's in progress; join it.
+	 */
+	sfs_jnl_join(sfs);
+
+	/*
+	 * Holding the vnode table lock keeps sfs_loadvnode from finding
+	 * the vnode (and handing out a new reference to it) until it's
+	 * gone, and from reading the inode before it has been synced.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it.
 	 */
 	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
@@ -88,16 +280,26 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		sfs_jnl_end(sfs);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
 
+	/*
+	 * Nobody else has a reference, so nobody else can be holding
+	 * or waiting for the vnode's lock; taking it after the table
+	 * lock doesn't break the lock order.
+	 */
+	lock_acquire(sv->sv_lock);
+
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount == 0) {
 		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
+			lock_release(sfs->sfs_vnlock);
+			sfs_jnl_end(sfs);
 			return result;
 		}
 	}
@@ -105,37 +307,36 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		lock_release(sfs->sfs_vnlock);
+		sfs_jnl_end(sfs);
 		return result;
 	}
 
-	/* If there are no on-disk references, discard the inode */
+	lock_release(sv->sv_lock);
+
+	/*
+	 * If there are no on-disk references, discard the inode. If it
+	 * was a directory, the name cache mustn't think it still has
+	 * entries in case the inode number is reused.
+	 */
 	if (sv->sv_i.sfi_linkcount==0) {
+		if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+			dcache_purgedir(&sfs->sfs_absfs, sv->sv_ino);
+		}
 		sfs_bfree(sfs, sv->sv_ino);
 	}
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_vnhash_remove(sfs, sv);
 
-	vnode_cleanup(&sv->sv_absvn);
+	lock_release(sfs->sfs_vnlock);
+	sfs_jnl_end(sfs);
 
-	vfs_biglock_release();
+	vnode_cleanup(&sv->sv_absvn);
 
 	/* Release the storage for the vnode structure itself. */
+	lock_destroy(sv->sv_lock);
 	kfree(sv);
 
 	/* Done */
@@ -150,42 +351,38 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
+	struct buf *buf;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	lock_acquire(sfs->sfs_vnlock);
 
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: %s: Found inode %u in unallocated block\n",
-			      sfs->sfs_sb.sb_volname, sv->sv_ino);
-		}
+	/* Look in the vnodes table */
+	sv = sfs_vnhash_find(sfs, ino);
 
-		if (sv->sv_ino==ino) {
-			/* Found */
+	spinlock_acquire(&sfs_stats_lock);
+	sfs_stats.lookups++;
+	if (sv != NULL) {
+		sfs_stats.hits++;
+	}
+	spinlock_release(&sfs_stats_lock);
 
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+	if (sv != NULL) {
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&sv->sv_absvn);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -196,11 +393,14 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	}
 
 	/* Read the block the inode is in */
-	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
+	result = buffer_read(&sfs->sfs_absfs, ino, &buf);
 	if (result) {
+		lock_release(sfs->sfs_vnlock);
 		kfree(sv);
 		return result;
 	}
+	memcpy(&sv->sv_i, buffer_map(buf), sizeof(sv->sv_i));
+	buffer_release(buf);
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
@@ -208,11 +408,15 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out by sfs_balloc and
-	 * thus the type recorded there will be SFS_TYPE_INVAL.
+	 * thus the type recorded there will be SFS_TYPE_INVAL. New
+	 * regular files start out mapped by extents.
 	 */
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
+		if (forcetype == SFS_TYPE_FILE) {
+			sv->sv_i.sfi_flags = SFS_IF_EXTENTS;
+		}
 		sv->sv_dirty = true;
 	}
 
@@ -232,23 +436,37 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		      ino, sv->sv_i.sfi_type);
 	}
 
+	sv->sv_lock = lock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
+		lock_release(sfs->sfs_vnlock);
+		kfree(sv);
+		return ENOMEM;
+	}
+
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_ranext = 0;
+	sv->sv_rablock = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_wbnext = 0;
+	sv->sv_wbblock = 0;
+	sv->sv_pastart = 0;
+	sv->sv_pacount = 0;
+	sv->sv_hashnext = NULL;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
-		return result;
-	}
+	sfs_vnhash_add(sfs, sv);
+
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -269,7 +487,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, &ino);
 	if (result) {
 		return result;
 	}
@@ -296,25 +514,20 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
+		VOP_DECREF(&sv->sv_absvn);
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
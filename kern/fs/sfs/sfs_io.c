@@ -36,8 +36,11 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
+#include <pagecache.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -54,6 +57,11 @@
 
 /*
  * Read or write a block, retrying I/O errors.
+ *
+ * This goes straight to the device. Everything except the superblock
+ * and freemap is read and written through the buffer cache, which
+ * calls back here, and which makes sure nobody else is doing I/O on
+ * the same block at the same time.
  */
 static
 int
@@ -62,8 +70,6 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -102,7 +108,7 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 }
 
 /*
- * Read a block.
+ * Read a block, or a run of consecutive blocks starting at BLOCK.
  */
 int
 sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
@@ -110,14 +116,14 @@ sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len > 0 && len % SFS_BLOCKSIZE == 0);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
+	SFSUIO(&iov, &ku, data, block, len, UIO_READ);
 	return sfs_rwblock(sfs, &ku);
 }
 
 /*
- * Write a block.
+ * Write a block, or a run of consecutive blocks starting at BLOCK.
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
@@ -125,12 +131,136 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len > 0 && len % SFS_BLOCKSIZE == 0);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
+	SFSUIO(&iov, &ku, data, block, len, UIO_WRITE);
 	return sfs_rwblock(sfs, &ku);
 }
 
+////////////////////////////////////////////////////////////
+// Sequential access
+
+/*
+ * Queue read-ahead or write-behind of file blocks FILEBLOCK up to
+ * ENDBLOCK, as runs of consecutive disk blocks. Holes are skipped.
+ * This is only a hint, so if looking up a block fails, just stop.
+ */
+static
+void
+sfs_async(struct sfs_vnode *sv, uint32_t fileblock, uint32_t endblock,
+	  enum uio_rw rw)
+{
+	struct fs *fs = sv->sv_absvn.vn_fs;
+	daddr_t diskblock, runstart = 0;
+	unsigned runlen = 0;
+
+	for (; fileblock < endblock; fileblock++) {
+		if (sfs_bmap(sv, fileblock, false, &diskblock, NULL)) {
+			break;
+		}
+		if (runlen > 0 && diskblock == runstart + runlen) {
+			runlen++;
+			continue;
+		}
+		if (runlen > 0) {
+			if (rw == UIO_READ) {
+				buffer_readahead(fs, runstart, runlen);
+			}
+			else {
+				buffer_writebehind(fs, runstart, runlen);
+			}
+		}
+		runstart = diskblock;
+		runlen = (diskblock != 0);
+	}
+	if (runlen > 0) {
+		if (rw == UIO_READ) {
+			buffer_readahead(fs, runstart, runlen);
+		}
+		else {
+			buffer_writebehind(fs, runstart, runlen);
+		}
+	}
+}
+
+/*
+ * Called after reading from START to END. A read that starts where
+ * the last one ended is sequential: the window doubles, from
+ * SFS_RAMIN up to SFS_RAMAX blocks, and whatever part of the window
+ * past END hasn't been read ahead yet is started in the background.
+ * A read anywhere else closes the window again.
+ *
+ * This is kept per vnode rather than per open file, since that's all
+ * VOP_READ gets to see; two readers of one file at different places
+ * just don't get read-ahead.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t start, off_t end)
+{
+	uint32_t block, lastblock, eofblock;
+
+	if (start != sv->sv_ranext) {
+		sv->sv_ranext = end;
+		sv->sv_rablock = 0;
+		sv->sv_rawindow = 0;
+		return;
+	}
+	sv->sv_ranext = end;
+	if (end == start) {
+		return;
+	}
+
+	if (sv->sv_rawindow == 0) {
+		sv->sv_rawindow = SFS_RAMIN;
+	}
+	else if (sv->sv_rawindow < SFS_RAMAX) {
+		sv->sv_rawindow *= 2;
+	}
+
+	block = end / SFS_BLOCKSIZE;
+	lastblock = block + sv->sv_rawindow;
+	eofblock = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	if (lastblock > eofblock) {
+		lastblock = eofblock;
+	}
+	if (block < sv->sv_rablock) {
+		block = sv->sv_rablock;
+	}
+	if (block < lastblock) {
+		sfs_async(sv, block, lastblock, UIO_READ);
+		sv->sv_rablock = lastblock;
+	}
+}
+
+/*
+ * Called after writing from START to END. Writes go into the buffer
+ * cache and return; normally the syncer writes them out later. When
+ * a sequential writer has filled SFS_WBBLOCKS blocks since they were
+ * last pushed, they're started on their way to disk now instead, as
+ * a few large requests, so a big file isn't all left for the syncer.
+ * fsync still goes through buffer_sync_fs, which waits for any of
+ * these that are in flight and writes any that aren't.
+ */
+static
+void
+sfs_writebehind(struct sfs_vnode *sv, off_t start, off_t end)
+{
+	uint32_t endblock = end / SFS_BLOCKSIZE;
+
+	if (start != sv->sv_wbnext) {
+		sv->sv_wbnext = end;
+		sv->sv_wbblock = start / SFS_BLOCKSIZE;
+		return;
+	}
+	sv->sv_wbnext = end;
+
+	if (endblock >= sv->sv_wbblock + SFS_WBBLOCKS) {
+		sfs_async(sv, sv->sv_wbblock, endblock, UIO_WRITE);
+		sv->sv_wbblock = endblock;
+	}
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
@@ -150,18 +280,14 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuffer;
+	char *ioptr;
 	daddr_t diskblock;
 	uint32_t fileblock;
+	off_t pos;
+	size_t resid;
+	bool unwritten;
 	int result;
 
 	/* Allocate missing blocks if and only if we're writing */
@@ -169,14 +295,11 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
 	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, doalloc, &diskblock, &unwritten);
 	if (result) {
 		return result;
 	}
@@ -184,40 +307,71 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache. If it was just allocated
+	 * there's nothing on disk worth reading; the parts we aren't
+	 * writing are zeroed here in memory instead.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	if (unwritten) {
+		result = buffer_get(&sfs->sfs_absfs, diskblock, &iobuffer);
+	}
+	else {
+		result = buffer_read(&sfs->sfs_absfs, diskblock, &iobuffer);
+	}
 	if (result) {
 		return result;
 	}
+	ioptr = buffer_map(iobuffer);
+	if (unwritten) {
+		bzero(ioptr, SFS_BLOCKSIZE);
+	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 * If it was a write, the buffer is dirty even if the uiomove
+	 * failed part way.
 	 */
+	pos = uio->uio_offset;
+	resid = uio->uio_resid;
+	result = uiomove(ioptr+skipstart, len, uio);
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		buffer_mark_dirty(iobuffer);
+		pagecache_write(&sv->sv_absvn, pos, ioptr+skipstart,
+				resid - uio->uio_resid);
 	}
+	buffer_release(iobuffer);
 
-	return 0;
+	return result;
+}
+
+/*
+ * Read what's on disk past the first DONE bytes of block DISKBLOCK into
+ * BUF, for a write that didn't get the whole block in.
+ */
+static
+int
+sfs_blockio_filltail(struct sfs_fs *sfs, daddr_t diskblock, char *buf,
+		     size_t done)
+{
+	char *tmp;
+	int result;
+
+	tmp = kmalloc(SFS_BLOCKSIZE);
+	if (tmp == NULL) {
+		return ENOMEM;
+	}
+	result = sfs_readblock(sfs, diskblock, tmp, SFS_BLOCKSIZE);
+	if (result == 0) {
+		memcpy(buf + done, tmp + done, SFS_BLOCKSIZE - done);
+	}
+	kfree(tmp);
+	return result;
 }
 
 /*
@@ -228,20 +382,20 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuffer;
 	daddr_t diskblock;
 	uint32_t fileblock;
-	int result;
+	off_t pos;
+	size_t resid, done;
+	bool unwritten;
+	int result, err;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
 	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, doalloc, &diskblock, &unwritten);
 	if (result) {
 		return result;
 	}
@@ -258,45 +412,157 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
+	 * Go through the buffer cache. A write covers the whole block,
+	 * so there's no need to read it first, nor to zero it first if
+	 * it was just allocated.
 	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	if (uio->uio_rw == UIO_READ) {
+		result = buffer_read(&sfs->sfs_absfs, diskblock, &iobuffer);
+	}
+	else {
+		result = buffer_get(&sfs->sfs_absfs, diskblock, &iobuffer);
+	}
+	if (result) {
+		return result;
+	}
 
+	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
+	pos = uio->uio_offset;
+	resid = uio->uio_resid;
+	result = uiomove(buffer_map(iobuffer), SFS_BLOCKSIZE, uio);
+	done = resid - uio->uio_resid;
+	if (result && unwritten) {
+		/* Don't leave old disk contents behind what we got */
+		bzero((char *)buffer_map(iobuffer) + done,
+		      SFS_BLOCKSIZE - done);
+	}
+	else if (result && uio->uio_rw == UIO_WRITE && done > 0 &&
+		 !buffer_valid(iobuffer)) {
+		/*
+		 * The block wasn't cached, so past what we got the
+		 * buffer is zeros rather than the block: read the rest
+		 * in under it. If that fails too, the part we got is
+		 * lost; fail with that error, so that the caller
+		 * doesn't carry on past it.
+		 */
+		err = sfs_blockio_filltail(sfs, diskblock,
+					   buffer_map(iobuffer), done);
+		if (err) {
+			result = err;
+			done = 0;
+		}
+	}
 	/*
-	 * Temporarily set the residue to be one block size.
+	 * A write that failed part-way has still changed the file (and
+	 * sfs_io extends it over what we got), so it goes to disk and
+	 * the page cache like any other. One that got nothing into a
+	 * buffer from buffer_get leaves it invalid, and buffer_release
+	 * drops it.
 	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
+	if (uio->uio_rw == UIO_WRITE && (done > 0 || unwritten)) {
+		buffer_mark_dirty(iobuffer);
+		pagecache_write(&sv->sv_absvn, pos, buffer_map(iobuffer),
+				done);
+	}
+	buffer_release(iobuffer);
 
-	result = sfs_rwblock(sfs, uio);
+	return result;
+}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+/*
+ * Read up to MAXBLOCKS whole blocks that sit next to each other on
+ * disk, as one request to the device, so a sequential read isn't cut
+ * up into a request per block. Sets *DONE to the number of blocks
+ * read, which is 0 if there's no such run here; the caller then goes
+ * through sfs_blockio.
+ *
+ * This bypasses the buffer cache, so it stops at the first block
+ * that's cached, which might be dirty (and if not, is better read
+ * from the cache anyway). Nothing else can change the blocks after
+ * the check, because writing this file's data takes the vnode lock
+ * and goes through the cache; read-ahead may load them meanwhile,
+ * but only with what's on disk. Writes don't come here: they go
+ * through the cache and are clustered on the way out by write-behind.
+ */
+static
+int
+sfs_clusterio(struct sfs_vnode *sv, struct uio *uio, uint32_t maxblocks,
+	      uint32_t *done)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t startblock, diskblock;
+	uint32_t fileblock, n;
+	size_t len;
+	char *data;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_READ);
 
+	*done = 0;
+
+	if (maxblocks > SFS_CLUSTERBLOCKS) {
+		maxblocks = SFS_CLUSTERBLOCKS;
+	}
+
+	/* Find how far the run goes */
+	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	startblock = 0;
+	for (n=0; n<maxblocks; n++) {
+		result = sfs_bmap(sv, fileblock+n, false, &diskblock, NULL);
+		if (result) {
+			return result;
+		}
+		if (diskblock == 0 || (n > 0 && diskblock != startblock+n)) {
+			break;
+		}
+		if (buffer_cached(&sfs->sfs_absfs, diskblock)) {
+			break;
+		}
+		if (n == 0) {
+			startblock = diskblock;
+		}
+	}
+	if (n < 2) {
+		/* Nothing to gain */
+		return 0;
+	}
+
+	len = n * SFS_BLOCKSIZE;
+	data = kmalloc(len);
+	if (data == NULL) {
+		/* Do it the slow way */
+		return 0;
+	}
+
+	result = sfs_readblock(sfs, startblock, data, len);
+	if (result == 0) {
+		result = uiomove(data, len, uio);
+	}
+	kfree(data);
+
+	if (result == 0) {
+		*done = n;
+	}
 	return result;
 }
 
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
+ * The caller must hold the vnode's lock.
  */
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
 	uint32_t blkoff;
-	uint32_t nblocks, i;
+	uint32_t nblocks, done;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	off_t startpos;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	origresid = uio->uio_resid;
+	startpos = uio->uio_offset;
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -318,6 +584,10 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			uio->uio_resid -= extraresid;
 		}
 	}
+	else if (uio->uio_offset >= (off_t)SFS_MAXFILEBLOCKS * SFS_BLOCKSIZE) {
+		/* Don't let the file block number overflow */
+		return EFBIG;
+	}
 
 	/*
 	 * First, do any leading partial block.
@@ -352,11 +622,22 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	 */
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
 	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
-		if (result) {
-			goto out;
+	while (nblocks > 0) {
+		done = 0;
+		if (uio->uio_rw == UIO_READ) {
+			result = sfs_clusterio(sv, uio, nblocks, &done);
+			if (result) {
+				goto out;
+			}
+		}
+		if (done == 0) {
+			result = sfs_blockio(sv, uio);
+			if (result) {
+				goto out;
+			}
+			done = 1;
 		}
+		nblocks -= done;
 	}
 
 	/*
@@ -381,6 +662,16 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		sv->sv_dirty = true;
 	}
 
+	/* Start any read-ahead or write-behind */
+	if (result == 0) {
+		if (uio->uio_rw == UIO_READ) {
+			sfs_readahead(sv, startpos, uio->uio_offset);
+		}
+		else {
+			sfs_writebehind(sv, startpos, uio->uio_offset);
+		}
+	}
+
 	/* Add in any extra amount we couldn't read because of EOF */
 	uio->uio_resid += extraresid;
 
@@ -401,12 +692,16 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
  * such code in this version of SFS, it is often desirable when doing
  * more advanced things to handle metadata and user data I/O
  * differently.
+ *
+ * The caller must hold the vnode's lock.
  */
 int
 sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	   enum uio_rw rw)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuffer;
+	char *ioptr;
 	off_t endpos;
 	uint32_t vnblock;
 	uint32_t blockoffset;
@@ -414,17 +709,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
@@ -432,7 +717,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 
 	/* Get the disk block number */
 	doalloc = (rw == UIO_WRITE);
-	result = sfs_bmap(sv, vnblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, vnblock, doalloc, &diskblock, NULL);
 	if (result) {
 		return result;
 	}
@@ -446,26 +731,23 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block */
+	result = buffer_read(&sfs->sfs_absfs, diskblock, &iobuffer);
 	if (result) {
 		return result;
 	}
+	ioptr = buffer_map(iobuffer);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, ioptr + blockoffset, len);
+		buffer_release(iobuffer);
 	}
 	else {
 		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		memcpy(ioptr + blockoffset, data, len);
+		sfs_jnl_dirty(sfs, iobuffer);
+		buffer_release(iobuffer);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
@@ -0,0 +1,1337 @@
+/*
+ * SFS filesystem
+ *
+ * Metadata journal.
+ *
+ * Each operation that changes metadata runs between sfs_jnl_begin
+ * and sfs_jnl_end, and marks the metadata blocks it changes dirty
+ * with sfs_jnl_dirty rather than buffer_mark_dirty. That keeps a copy
+ * of the block in the running transaction. Until the transaction has
+ * been committed the block mustn't be written in place, so the buffer
+ * cache's writes of it are skipped (sfs_jnl_write); if the buffer is
+ * then reused, reads of the block get the copy (sfs_jnl_read).
+ *
+ * Committing waits for the operations in progress to finish and holds
+ * off new ones; writes out the file data in the buffer cache, so that
+ * nothing committed can point at blocks that were never written; then
+ * writes the copies, together with the changed blocks of the freemap,
+ * to the journal in one sequential run. That's all operations wait
+ * for. Once the commit block is on disk the copies move out of the
+ * running transaction, the journal reopens, and the committing thread
+ * checkpoints them (writes them in place, sorted) while new operations
+ * go on. However many operations there were since the last commit,
+ * and however often they changed the same blocks, each of those
+ * blocks is written once to the journal and once in place.
+ *
+ * Replay copies only the newest transaction, so the next commit
+ * doesn't write its transaction to the other slot until the
+ * checkpoint has finished; if it has to, it finishes it first. Until
+ * then reads of those blocks get the committed copies, and a block
+ * that's freed in the meantime is dropped from the checkpoint, so it
+ * can't overwrite what's written there next.
+ *
+ * sfs_sync commits, so the syncer does so every BUFFER_SYNCSECS
+ * seconds, as does fsync. sfs_jnl_begin also commits early if the
+ * transaction might otherwise outgrow a journal slot. If it does
+ * outgrow it anyway, it's written in place after the journal has been
+ * emptied, with no more protection than without a journal.
+ *
+ * See <kern/sfs.h> for the on-disk format.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Chains in the table of blocks in the running transaction */
+#define SFS_JNL_HASHSIZE 64
+
+/*
+ * A block changed by the running transaction, as it was last logged.
+ */
+struct sfs_jblock {
+	daddr_t jb_block;
+	char *jb_data;
+	struct sfs_jblock *jb_next;	/* hash chain */
+};
+
+/*
+ * j_lock protects the flags and counts, the table of blocks, and the
+ * checkpoint. It comes after every other lock. The table doesn't
+ * change while a commit is running (nobody can log anything), so the
+ * commit reads it without the lock. Nor do the committed blocks and
+ * their images change while they're checkpointed, so the checkpoint
+ * reads those without it too. The rest belongs to whoever is
+ * committing or, while j_ckpbusy is set, checkpointing.
+ */
+struct sfs_jnl {
+	struct lock *j_lock;
+	struct cv *j_cv;		/* for any of the flags and counts */
+	bool j_closed;			/* no new operations may begin */
+	bool j_committing;		/* ... or join */
+	bool j_unlogged;		/* a block couldn't be logged */
+	bool j_crash;			/* crash after the next commit */
+	bool j_frozen;			/* ... and it has; write nothing */
+	unsigned j_active;		/* operations in progress */
+	unsigned j_nblocks;		/* blocks in the table */
+	struct sfs_jblock *j_hash[SFS_JNL_HASHSIZE];
+
+	daddr_t j_start;		/* first block of slot 0 */
+	unsigned j_slotsize;		/* blocks per slot */
+	uint32_t j_seq;			/* number of the next transaction */
+	unsigned j_gen;			/* bumped when blocks leave the journal */
+
+	/* The transaction being committed, sorted by block */
+	daddr_t j_blocks[SFS_JNL_MAXBLOCKS];
+	void *j_images[SFS_JNL_MAXBLOCKS];
+
+	/*
+	 * The last transaction committed, until it's been checkpointed:
+	 * j_blocks and j_images [0, j_ckpn). Its images belong to the
+	 * blocks on j_ckplist, or, for the freemap, are in j_fmcopy.
+	 */
+	unsigned j_ckpn;
+	bool j_ckpbusy;			/* someone is checkpointing it */
+	bool j_ckpskip[SFS_JNL_MAXBLOCKS]; /* freed since; don't write */
+	daddr_t j_ckplo, j_ckphi;	/* blocks being written right now */
+	struct sfs_jblock *j_ckplist;
+	char *j_fmcopy;			/* SFS_FS_FREEMAPBLOCKS blocks */
+
+	/* Blocks being gathered into one write (see sfs_jnl_stage) */
+	char *j_io;			/* SFS_CLUSTERBLOCKS blocks */
+	daddr_t j_iostart;
+	unsigned j_iofill;
+};
+
+/* Images that fit in a transaction */
+#define SFS_JNL_CAPACITY(jnl) ((jnl)->j_slotsize - 2)
+
+/*
+ * Journal statistics, for all SFS volumes together.
+ */
+static struct spinlock sfs_jnlstats_lock = SPINLOCK_INITIALIZER;
+static struct {
+	unsigned ops;			/* operations journaled */
+	unsigned commits;		/* transactions written to the journal */
+	unsigned blocks;		/* ... and blocks in them */
+	unsigned early;			/* commits made to keep one fitting */
+	unsigned overflows;		/* transactions written in place */
+	unsigned replays;		/* transactions replayed at mount */
+} sfs_jnlstats;
+
+/*
+ * Checksum of a block, continuing from SUM. See <kern/sfs.h>.
+ */
+static
+uint32_t
+sfs_jnl_sum(uint32_t sum, const void *data)
+{
+	const unsigned char *p = data;
+	unsigned i;
+
+	for (i=0; i<SFS_BLOCKSIZE; i++) {
+		sum = ((sum << 1) | (sum >> 31)) + p[i];
+	}
+	return sum;
+}
+
+////////////////////////////////////////////////////////////
+// The running transaction
+
+static
+struct sfs_jblock *
+sfs_jnl_find(struct sfs_jnl *jnl, daddr_t block)
+{
+	struct sfs_jblock *jb;
+
+	KASSERT(lock_do_i_hold(jnl->j_lock));
+
+	jb = jnl->j_hash[block % SFS_JNL_HASHSIZE];
+	while (jb != NULL && jb->jb_block != block) {
+		jb = jb->jb_next;
+	}
+	return jb;
+}
+
+/*
+ * Find BLOCK in the transaction being checkpointed. Returns its index,
+ * or -1 if it isn't there (or nothing is being checkpointed).
+ */
+static
+int
+sfs_jnl_ckpfind(struct sfs_jnl *jnl, daddr_t block)
+{
+	unsigned lo, hi, mid;
+
+	KASSERT(lock_do_i_hold(jnl->j_lock));
+
+	lo = 0;
+	hi = jnl->j_ckpn;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (jnl->j_blocks[mid] == block) {
+			return mid;
+		}
+		if (jnl->j_blocks[mid] < block) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Take every block out of the table, returning them as a list.
+ */
+static
+struct sfs_jblock *
+sfs_jnl_detach(struct sfs_jnl *jnl)
+{
+	struct sfs_jblock *jb, *list = NULL;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(jnl->j_lock));
+
+	for (i=0; i<SFS_JNL_HASHSIZE; i++) {
+		while ((jb = jnl->j_hash[i]) != NULL) {
+			jnl->j_hash[i] = jb->jb_next;
+			jb->jb_next = list;
+			list = jb;
+		}
+	}
+	jnl->j_nblocks = 0;
+	jnl->j_unlogged = false;
+	return list;
+}
+
+static
+void
+sfs_jnl_freelist(struct sfs_jblock *list)
+{
+	struct sfs_jblock *jb;
+
+	while ((jb = list) != NULL) {
+		list = jb->jb_next;
+		kfree(jb->jb_data);
+		kfree(jb);
+	}
+}
+
+/*
+ * Throw away every block in the table.
+ */
+static
+void
+sfs_jnl_clear(struct sfs_jnl *jnl)
+{
+	sfs_jnl_freelist(sfs_jnl_detach(jnl));
+	jnl->j_gen++;
+}
+
+/*
+ * Mark a metadata buffer dirty, and log its contents in the running
+ * transaction. The caller must be in an operation and hold BUF.
+ *
+ * If there's no memory for the copy, the buffer cache is left to
+ * write the block in place, like any other; then the transaction
+ * can't be journaled either (see sfs_jnl_docommit).
+ */
+void
+sfs_jnl_dirty(struct sfs_fs *sfs, struct buf *buf)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+	struct sfs_jblock *jb;
+	daddr_t block;
+
+	buffer_mark_dirty(buf);
+	if (jnl == NULL) {
+		return;
+	}
+
+	block = buffer_block(buf);
+
+	lock_acquire(jnl->j_lock);
+	KASSERT(jnl->j_active > 0);
+	jb = sfs_jnl_find(jnl, block);
+	if (jb == NULL) {
+		jb = kmalloc(sizeof(*jb));
+		if (jb != NULL) {
+			jb->jb_data = kmalloc(SFS_BLOCKSIZE);
+			if (jb->jb_data == NULL) {
+				kfree(jb);
+				jb = NULL;
+			}
+		}
+		if (jb == NULL) {
+			jnl->j_unlogged = true;
+			lock_release(jnl->j_lock);
+			return;
+		}
+		jb->jb_block = block;
+		jb->jb_next = jnl->j_hash[block % SFS_JNL_HASHSIZE];
+		jnl->j_hash[block % SFS_JNL_HASHSIZE] = jb;
+		jnl->j_nblocks++;
+	}
+	memcpy(jb->jb_data, buffer_map(buf), SFS_BLOCKSIZE);
+	lock_release(jnl->j_lock);
+}
+
+/*
+ * A block is being freed; whatever was logged for it no longer needs
+ * to go anywhere.
+ */
+void
+sfs_jnl_forget(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+	struct sfs_jblock **jbp, *jb;
+	int i;
+
+	if (jnl == NULL) {
+		return;
+	}
+
+	lock_acquire(jnl->j_lock);
+	KASSERT(jnl->j_active > 0);
+	jbp = &jnl->j_hash[block % SFS_JNL_HASHSIZE];
+	while (*jbp != NULL && (*jbp)->jb_block != block) {
+		jbp = &(*jbp)->jb_next;
+	}
+	if (*jbp != NULL) {
+		jb = *jbp;
+		*jbp = jb->jb_next;
+		kfree(jb->jb_data);
+		kfree(jb);
+		KASSERT(jnl->j_nblocks > 0);
+		jnl->j_nblocks--;
+	}
+
+	/*
+	 * Nor must the checkpoint write the last committed copy once
+	 * the block might have been reused; if it's writing it right
+	 * now, wait for that to finish.
+	 */
+	i = sfs_jnl_ckpfind(jnl, block);
+	if (i >= 0) {
+		jnl->j_ckpskip[i] = true;
+	}
+	while (block >= jnl->j_ckplo && block < jnl->j_ckphi) {
+		cv_wait(jnl->j_cv, jnl->j_lock);
+	}
+	lock_release(jnl->j_lock);
+}
+
+/*
+ * Reads for the buffer cache: the running transaction's copy of a
+ * block is newer than what's on disk, and so is the copy being
+ * checkpointed until it has been. If copies left the journal while
+ * the disk was being read, what was read may be from before they
+ * were written in place, so read again.
+ */
+int
+sfs_jnl_read(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+	struct sfs_jblock *jb;
+	unsigned i, gen;
+	int j, result;
+
+	if (jnl == NULL) {
+		return sfs_readblock(sfs, block, data, len);
+	}
+
+	lock_acquire(jnl->j_lock);
+	do {
+		gen = jnl->j_gen;
+		lock_release(jnl->j_lock);
+		result = sfs_readblock(sfs, block, data, len);
+		if (result) {
+			return result;
+		}
+		lock_acquire(jnl->j_lock);
+	} while (jnl->j_gen != gen);
+
+	for (i=0; i < len / SFS_BLOCKSIZE; i++) {
+		if (jnl->j_nblocks == 0 && jnl->j_ckpn == 0) {
+			break;
+		}
+		jb = sfs_jnl_find(jnl, block + i);
+		if (jb != NULL) {
+			memcpy((char *)data + i * SFS_BLOCKSIZE, jb->jb_data,
+			       SFS_BLOCKSIZE);
+			continue;
+		}
+		j = sfs_jnl_ckpfind(jnl, block + i);
+		if (j >= 0 && !jnl->j_ckpskip[j]) {
+			memcpy((char *)data + i * SFS_BLOCKSIZE,
+			       jnl->j_images[j], SFS_BLOCKSIZE);
+		}
+	}
+	lock_release(jnl->j_lock);
+	return 0;
+}
+
+/*
+ * Writes for the buffer cache: write the blocks in the range that
+ * aren't in the running transaction. The others are written from the
+ * transaction's copies once it's committed; until then their old
+ * contents on disk must stay as they are. Blocks being checkpointed
+ * are written like any other, since the buffer holds the same data.
+ */
+int
+sfs_jnl_write(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+	unsigned i, start, n = len / SFS_BLOCKSIZE;
+	bool held;
+	int result;
+
+	if (jnl == NULL) {
+		return sfs_writeblock(sfs, block, data, len);
+	}
+
+	lock_acquire(jnl->j_lock);
+	held = jnl->j_frozen;
+	lock_release(jnl->j_lock);
+	if (held) {
+		return 0;
+	}
+
+	start = 0;
+	for (i=0; i<=n; i++) {
+		if (i < n) {
+			lock_acquire(jnl->j_lock);
+			held = sfs_jnl_find(jnl, block + i) != NULL;
+			lock_release(jnl->j_lock);
+			if (!held) {
+				continue;
+			}
+		}
+		if (i > start) {
+			result = sfs_writeblock(sfs, block + start,
+					(char *)data + start * SFS_BLOCKSIZE,
+					(i - start) * SFS_BLOCKSIZE);
+			if (result) {
+				return result;
+			}
+		}
+		start = i + 1;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Operations
+
+/*
+ * True if the running transaction should be committed before another
+ * operation adds to it. This is a guess (the freemap count is read
+ * without its lock), but only has to be a conservative one.
+ */
+static
+bool
+sfs_jnl_full(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+
+	KASSERT(lock_do_i_hold(jnl->j_lock));
+
+	return jnl->j_nblocks > 0 &&
+		jnl->j_nblocks + sfs->sfs_freemapndirty + SFS_JNL_RESERVE
+		> SFS_JNL_CAPACITY(jnl);
+}
+
+/*
+ * Begin an operation. The caller mustn't hold any locks, since this
+ * may wait for (or do) a commit.
+ */
+void
+sfs_jnl_begin(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+	bool full;
+
+	if (jnl == NULL) {
+		return;
+	}
+
+	lock_acquire(jnl->j_lock);
+	while (jnl->j_closed) {
+		cv_wait(jnl->j_cv, jnl->j_lock);
+	}
+	full = sfs_jnl_full(sfs);
+	lock_release(jnl->j_lock);
+
+	if (full) {
+		/* If this fails, carry on; the next commit retries */
+		(void)sfs_jnl_commit(sfs);
+		spinlock_acquire(&sfs_jnlstats_lock);
+		sfs_jnlstats.early++;
+		spinlock_release(&sfs_jnlstats_lock);
+	}
+
+	lock_acquire(jnl->j_lock);
+	while (jnl->j_closed) {
+		cv_wait(jnl->j_cv, jnl->j_lock);
+	}
+	jnl->j_active++;
+	lock_release(jnl->j_lock);
+
+	spinlock_acquire(&sfs_jnlstats_lock);
+	sfs_jnlstats.ops++;
+	spinlock_release(&sfs_jnlstats_lock);
+}
+
+/*
+ * Begin an operation that may be nested in another one, as when the
+ * last reference to a vnode is dropped and the vnode reclaimed. This
+ * goes ahead while the journal is closed to new operations, since
+ * the commit may be waiting for the outer one to end; only once the
+ * commit is actually running does it wait.
+ */
+void
+sfs_jnl_join(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+
+	if (jnl == NULL) {
+		return;
+	}
+
+	lock_acquire(jnl->j_lock);
+	while (jnl->j_committing) {
+		cv_wait(jnl->j_cv, jnl->j_lock);
+	}
+	jnl->j_active++;
+	lock_release(jnl->j_lock);
+}
+
+/*
+ * End an operation.
+ */
+void
+sfs_jnl_end(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+
+	if (jnl == NULL) {
+		return;
+	}
+
+	lock_acquire(jnl->j_lock);
+	KASSERT(jnl->j_active > 0);
+	jnl->j_active--;
+	if (jnl->j_active == 0 && jnl->j_closed) {
+		cv_broadcast(jnl->j_cv, jnl->j_lock);
+	}
+	lock_release(jnl->j_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Commit
+
+/*
+ * Blocks written with sfs_jnl_stage are gathered in j_io while they
+ * follow one another, so that each run of them goes to the disk in
+ * one request; sfs_jnl_flush writes out the last run.
+ */
+static
+int
+sfs_jnl_flush(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+	int result = 0;
+
+	if (jnl->j_iofill > 0) {
+		result = sfs_writeblock(sfs, jnl->j_iostart, jnl->j_io,
+					jnl->j_iofill * SFS_BLOCKSIZE);
+		jnl->j_iofill = 0;
+	}
+	return result;
+}
+
+static
+int
+sfs_jnl_stage(struct sfs_fs *sfs, daddr_t block, const void *data)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+	int result;
+
+	if (jnl->j_iofill == SFS_CLUSTERBLOCKS ||
+	    (jnl->j_iofill > 0 && block != jnl->j_iostart + jnl->j_iofill)) {
+		result = sfs_jnl_flush(sfs);
+		if (result) {
+			return result;
+		}
+	}
+	if (jnl->j_iofill == 0) {
+		jnl->j_iostart = block;
+	}
+	memcpy(jnl->j_io + jnl->j_iofill * SFS_BLOCKSIZE, data,
+	       SFS_BLOCKSIZE);
+	jnl->j_iofill++;
+	return 0;
+}
+
+/*
+ * Add a block to the transaction being committed, keeping it sorted,
+ * if there's room. *N counts the blocks offered either way.
+ */
+static
+void
+sfs_jnl_add(struct sfs_jnl *jnl, unsigned *n, daddr_t block, void *data)
+{
+	unsigned i;
+
+	if (*n < SFS_JNL_CAPACITY(jnl)) {
+		for (i = *n; i > 0 && jnl->j_blocks[i-1] > block; i--) {
+			jnl->j_blocks[i] = jnl->j_blocks[i-1];
+			jnl->j_images[i] = jnl->j_images[i-1];
+		}
+		jnl->j_blocks[i] = block;
+		jnl->j_images[i] = data;
+	}
+	(*n)++;
+}
+
+/*
+ * The changed blocks of the freemap have been committed (or thrown
+ * away); the next transaction needs only those changed after this.
+ */
+static
+void
+sfs_jnl_freemapclean(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	for (i=0; i<SFS_FS_FREEMAPBLOCKS(sfs); i++) {
+		if (sfs->sfs_freegroups[i].fg_dirty) {
+			sfs->sfs_freegroups[i].fg_dirty = false;
+			KASSERT(sfs->sfs_freemapndirty > 0);
+			sfs->sfs_freemapndirty--;
+		}
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Write the N blocks of the transaction being committed to its slot:
+ * the descriptor and the blocks, then, once they're on disk, the
+ * commit block.
+ */
+static
+int
+sfs_jnl_writetrans(struct sfs_fs *sfs, unsigned n)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+	struct sfs_jdesc *jd;
+	struct sfs_jcommit *jc;
+	daddr_t slot;
+	uint32_t sum;
+	unsigned i;
+	int result;
+
+	slot = jnl->j_start + (jnl->j_seq % 2) * jnl->j_slotsize;
+
+	/* The descriptor starts the run */
+	KASSERT(jnl->j_iofill == 0);
+	jd = (struct sfs_jdesc *)jnl->j_io;
+	bzero(jd, SFS_BLOCKSIZE);
+	jd->jd_magic = SFS_JNL_DESCMAGIC;
+	jd->jd_seq = jnl->j_seq;
+	jd->jd_nblocks = n;
+	for (i=0; i<n; i++) {
+		jd->jd_blocks[i] = jnl->j_blocks[i];
+	}
+	jnl->j_iostart = slot;
+	jnl->j_iofill = 1;
+
+	sum = 0;
+	for (i=0; i<n; i++) {
+		sum = sfs_jnl_sum(sum, jnl->j_images[i]);
+		result = sfs_jnl_stage(sfs, slot + 1 + i, jnl->j_images[i]);
+		if (result) {
+			jnl->j_iofill = 0;
+			return result;
+		}
+	}
+	result = sfs_jnl_flush(sfs);
+	if (result) {
+		return result;
+	}
+
+	jc = (struct sfs_jcommit *)jnl->j_io;
+	bzero(jc, SFS_BLOCKSIZE);
+	jc->jc_magic = SFS_JNL_COMMITMAGIC;
+	jc->jc_seq = jnl->j_seq;
+	jc->jc_nblocks = n;
+	jc->jc_sum = sum;
+	return sfs_writeblock(sfs, slot + 1 + n, jc, SFS_BLOCKSIZE);
+}
+
+/*
+ * Write the transaction last committed in place. Called with j_lock
+ * held, which is dropped around each write; operations carry on
+ * meanwhile. If a write fails, what hasn't been written goes back
+ * into the running transaction, so the next commit (to the other
+ * slot) includes it all again.
+ */
+static
+int
+sfs_jnl_checkpoint(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+	struct sfs_freegroup *fg;
+	struct sfs_jblock *jb;
+	daddr_t block;
+	unsigned i, k;
+	int j, result = 0;
+
+	KASSERT(lock_do_i_hold(jnl->j_lock));
+	KASSERT(jnl->j_ckpn > 0 && !jnl->j_ckpbusy);
+	jnl->j_ckpbusy = true;
+
+	for (i=0; i<jnl->j_ckpn; i+=k) {
+		for (k=0; i+k < jnl->j_ckpn && k < SFS_CLUSTERBLOCKS &&
+			     !jnl->j_ckpskip[i+k] &&
+			     jnl->j_blocks[i+k] == jnl->j_blocks[i] + k; k++) {
+			memcpy(jnl->j_io + k * SFS_BLOCKSIZE, jnl->j_images[i+k],
+			       SFS_BLOCKSIZE);
+		}
+		if (k == 0) {
+			/* Freed since it was committed */
+			k = 1;
+			continue;
+		}
+		jnl->j_ckplo = jnl->j_blocks[i];
+		jnl->j_ckphi = jnl->j_ckplo + k;
+		lock_release(jnl->j_lock);
+
+		result = sfs_writeblock(sfs, jnl->j_ckplo, jnl->j_io,
+					k * SFS_BLOCKSIZE);
+
+		lock_acquire(jnl->j_lock);
+		jnl->j_ckphi = jnl->j_ckplo;
+		cv_broadcast(jnl->j_cv, jnl->j_lock);
+		if (result) {
+			break;
+		}
+	}
+
+	if (result) {
+		/* The freemap's lock comes first */
+		lock_release(jnl->j_lock);
+		lock_acquire(sfs->sfs_freemaplock);
+		for (i=0; i<jnl->j_ckpn; i++) {
+			block = jnl->j_blocks[i];
+			if (block < SFS_FREEMAP_START ||
+			    block >= SFS_FREEMAP_START +
+				     SFS_FS_FREEMAPBLOCKS(sfs)) {
+				continue;
+			}
+			fg = &sfs->sfs_freegroups[block - SFS_FREEMAP_START];
+			if (!fg->fg_dirty) {
+				fg->fg_dirty = true;
+				sfs->sfs_freemapndirty++;
+			}
+		}
+		lock_release(sfs->sfs_freemaplock);
+		lock_acquire(jnl->j_lock);
+
+		/* Anything logged since is newer */
+		while ((jb = jnl->j_ckplist) != NULL) {
+			jnl->j_ckplist = jb->jb_next;
+			j = sfs_jnl_ckpfind(jnl, jb->jb_block);
+			KASSERT(j >= 0);
+			if (jnl->j_ckpskip[j] ||
+			    sfs_jnl_find(jnl, jb->jb_block) != NULL) {
+				kfree(jb->jb_data);
+				kfree(jb);
+				continue;
+			}
+			jb->jb_next = jnl->j_hash[jb->jb_block % SFS_JNL_HASHSIZE];
+			jnl->j_hash[jb->jb_block % SFS_JNL_HASHSIZE] = jb;
+			jnl->j_nblocks++;
+		}
+	}
+
+	sfs_jnl_freelist(jnl->j_ckplist);
+	jnl->j_ckplist = NULL;
+	jnl->j_ckpn = 0;
+	jnl->j_ckpbusy = false;
+	jnl->j_gen++;
+	cv_broadcast(jnl->j_cv, jnl->j_lock);
+	return result;
+}
+
+/*
+ * Mark both slots empty.
+ */
+static
+int
+sfs_jnl_invalidate(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+	unsigned i;
+	int result;
+
+	bzero(jnl->j_io, SFS_BLOCKSIZE);
+	for (i=0; i<2; i++) {
+		result = sfs_writeblock(sfs, jnl->j_start + i * jnl->j_slotsize,
+					jnl->j_io, SFS_BLOCKSIZE);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write a transaction that doesn't fit in the journal in place, after
+ * making sure the journal can't overwrite any of it after a crash.
+ */
+static
+int
+sfs_jnl_overflow(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+	struct sfs_jblock *jb;
+	unsigned i;
+	int result;
+
+	result = sfs_jnl_invalidate(sfs);
+	if (result) {
+		return result;
+	}
+	for (i=0; i<SFS_JNL_HASHSIZE; i++) {
+		for (jb = jnl->j_hash[i]; jb != NULL; jb = jb->jb_next) {
+			result = sfs_writeblock(sfs, jb->jb_block, jb->jb_data,
+						SFS_BLOCKSIZE);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return sfs_sync_freemap(sfs);
+}
+
+/*
+ * The body of sfs_jnl_commit. No operations are in progress.
+ */
+static
+int
+sfs_jnl_docommit(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+	struct sfs_jblock *jb;
+	char *freemapdata;
+	unsigned n, i;
+	int result;
+
+	/*
+	 * Preallocation windows are marked only in the in-memory
+	 * freemap, and mustn't get into the journal.
+	 */
+	sfs_prealloc_reclaim(sfs);
+
+	/* File data first; this skips the blocks in the transaction. */
+	result = buffer_sync_fs(&sfs->sfs_absfs);
+	if (result) {
+		return result;
+	}
+
+	if (jnl->j_frozen) {
+		/* Nothing reaches the disk any more; see sfs_jnl_crash */
+		sfs_jnl_freemapclean(sfs);
+		lock_acquire(jnl->j_lock);
+		sfs_jnl_clear(jnl);
+		lock_release(jnl->j_lock);
+		return 0;
+	}
+
+	n = 0;
+	for (i=0; i<SFS_JNL_HASHSIZE; i++) {
+		for (jb = jnl->j_hash[i]; jb != NULL; jb = jb->jb_next) {
+			sfs_jnl_add(jnl, &n, jb->jb_block, jb->jb_data);
+		}
+	}
+	/*
+	 * The freemap goes on changing while this is checkpointed, so
+	 * log copies of it.
+	 */
+	lock_acquire(sfs->sfs_freemaplock);
+	freemapdata = bitmap_getdata(sfs->sfs_freemap);
+	for (i=0; i<SFS_FS_FREEMAPBLOCKS(sfs); i++) {
+		if (sfs->sfs_freegroups[i].fg_dirty) {
+			memcpy(jnl->j_fmcopy + i * SFS_BLOCKSIZE,
+			       freemapdata + i * SFS_BLOCKSIZE, SFS_BLOCKSIZE);
+			sfs_jnl_add(jnl, &n, SFS_FREEMAP_START + i,
+				    jnl->j_fmcopy + i * SFS_BLOCKSIZE);
+		}
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	if (n == 0 && !jnl->j_unlogged) {
+		return 0;
+	}
+
+	if (n > SFS_JNL_CAPACITY(jnl) || jnl->j_unlogged) {
+		result = sfs_jnl_overflow(sfs);
+		if (result) {
+			return result;
+		}
+		spinlock_acquire(&sfs_jnlstats_lock);
+		sfs_jnlstats.overflows++;
+		spinlock_release(&sfs_jnlstats_lock);
+	}
+	else {
+		result = sfs_jnl_writetrans(sfs, n);
+		if (result) {
+			return result;
+		}
+
+		/*
+		 * From here on this transaction is what gets replayed
+		 * after a crash. Hand it to sfs_jnl_checkpoint.
+		 */
+		jnl->j_seq++;
+
+		spinlock_acquire(&sfs_jnlstats_lock);
+		sfs_jnlstats.commits++;
+		sfs_jnlstats.blocks += n;
+		spinlock_release(&sfs_jnlstats_lock);
+
+		sfs_jnl_freemapclean(sfs);
+
+		lock_acquire(jnl->j_lock);
+		if (jnl->j_crash) {
+			jnl->j_frozen = true;
+			sfs_jnl_clear(jnl);
+			lock_release(jnl->j_lock);
+			return 0;
+		}
+		KASSERT(jnl->j_ckpn == 0 && jnl->j_ckplist == NULL);
+		for (i=0; i<n; i++) {
+			jnl->j_ckpskip[i] = false;
+		}
+		jnl->j_ckpn = n;
+		jnl->j_ckplist = sfs_jnl_detach(jnl);
+		lock_release(jnl->j_lock);
+		return 0;
+	}
+
+	lock_acquire(jnl->j_lock);
+	sfs_jnl_clear(jnl);
+	lock_release(jnl->j_lock);
+	return 0;
+}
+
+/*
+ * Finish checkpointing the last transaction, or wait for whoever is
+ * doing it. Called with j_lock held.
+ */
+static
+int
+sfs_jnl_ckpwait(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+
+	KASSERT(lock_do_i_hold(jnl->j_lock));
+
+	while (jnl->j_ckpn > 0) {
+		if (!jnl->j_ckpbusy) {
+			return sfs_jnl_checkpoint(sfs);
+		}
+		cv_wait(jnl->j_cv, jnl->j_lock);
+	}
+	return 0;
+}
+
+/*
+ * Commit the running transaction and write it in place. If another
+ * commit is already going on, wait for it and then commit whatever
+ * has been done since. Operations are held off only until the
+ * transaction is in the journal; this thread then checkpoints it
+ * while they go on.
+ */
+int
+sfs_jnl_commit(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+	int result;
+
+	KASSERT(jnl != NULL);
+
+	lock_acquire(jnl->j_lock);
+	while (jnl->j_closed || jnl->j_ckpn > 0) {
+		if (jnl->j_closed) {
+			cv_wait(jnl->j_cv, jnl->j_lock);
+		}
+		else {
+			/* If this fails, its blocks are in this commit */
+			(void)sfs_jnl_ckpwait(sfs);
+		}
+	}
+	jnl->j_closed = true;
+	while (jnl->j_active > 0) {
+		cv_wait(jnl->j_cv, jnl->j_lock);
+	}
+	jnl->j_committing = true;
+	lock_release(jnl->j_lock);
+
+	result = sfs_jnl_docommit(sfs);
+
+	lock_acquire(jnl->j_lock);
+	jnl->j_closed = false;
+	jnl->j_committing = false;
+	cv_broadcast(jnl->j_cv, jnl->j_lock);
+	if (result == 0) {
+		result = sfs_jnl_ckpwait(sfs);
+	}
+	lock_release(jnl->j_lock);
+
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Mount and unmount
+
+/*
+ * Check the transaction in slot WHICH, reading its descriptor into
+ * JD. Returns 0 if it's complete, EINVAL if not.
+ */
+static
+int
+sfs_jnl_check(struct sfs_fs *sfs, struct sfs_jnl *jnl, unsigned which,
+	      struct sfs_jdesc *jd)
+{
+	struct sfs_jcommit *jc;
+	daddr_t slot, block;
+	unsigned i, j, k;
+	uint32_t sum;
+	int result;
+
+	slot = jnl->j_start + which * jnl->j_slotsize;
+	result = sfs_readblock(sfs, slot, jd, SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
+	if (jd->jd_magic != SFS_JNL_DESCMAGIC || jd->jd_seq % 2 != which ||
+	    jd->jd_nblocks == 0 || jd->jd_nblocks > SFS_JNL_CAPACITY(jnl)) {
+		return EINVAL;
+	}
+	for (i=0; i<jd->jd_nblocks; i++) {
+		block = jd->jd_blocks[i];
+		if (block == SFS_SUPER_BLOCK || block >= SFS_FS_NBLOCKS(sfs) ||
+		    (block >= jnl->j_start &&
+		     block < jnl->j_start + sfs->sfs_sb.sb_jnlblocks)) {
+			return EINVAL;
+		}
+	}
+
+	sum = 0;
+	for (i=0; i<jd->jd_nblocks; i+=k) {
+		k = jd->jd_nblocks - i;
+		if (k > SFS_CLUSTERBLOCKS) {
+			k = SFS_CLUSTERBLOCKS;
+		}
+		result = sfs_readblock(sfs, slot + 1 + i, jnl->j_io,
+				       k * SFS_BLOCKSIZE);
+		if (result) {
+			return result;
+		}
+		for (j=0; j<k; j++) {
+			sum = sfs_jnl_sum(sum, jnl->j_io + j * SFS_BLOCKSIZE);
+		}
+	}
+
+	result = sfs_readblock(sfs, slot + 1 + jd->jd_nblocks, jnl->j_io,
+			       SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
+	jc = (struct sfs_jcommit *)jnl->j_io;
+	if (jc->jc_magic != SFS_JNL_COMMITMAGIC || jc->jc_seq != jd->jd_seq ||
+	    jc->jc_nblocks != jd->jd_nblocks || jc->jc_sum != sum) {
+		return EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Find the newest complete transaction and copy it into place. This
+ * happens before the freemap is loaded, and before anything of the
+ * volume is in the buffer cache.
+ */
+static
+int
+sfs_jnl_replay(struct sfs_fs *sfs, struct sfs_jnl *jnl)
+{
+	struct sfs_jdesc *jd[2];
+	bool complete[2];
+	unsigned which, i, j, k;
+	char *images;
+	daddr_t slot;
+	int result;
+
+	jd[0] = kmalloc(2 * sizeof(struct sfs_jdesc));
+	if (jd[0] == NULL) {
+		return ENOMEM;
+	}
+	jd[1] = jd[0] + 1;
+
+	for (i=0; i<2; i++) {
+		result = sfs_jnl_check(sfs, jnl, i, jd[i]);
+		if (result && result != EINVAL) {
+			kfree(jd[0]);
+			return result;
+		}
+		complete[i] = (result == 0);
+	}
+
+	if (!complete[0] && !complete[1]) {
+		jnl->j_seq = 0;
+		kfree(jd[0]);
+		return 0;
+	}
+	if (complete[0] && complete[1]) {
+		which = (int32_t)(jd[1]->jd_seq - jd[0]->jd_seq) > 0 ? 1 : 0;
+	}
+	else {
+		which = complete[0] ? 0 : 1;
+	}
+	jnl->j_seq = jd[which]->jd_seq + 1;
+
+	images = kmalloc(SFS_CLUSTERBLOCKS * SFS_BLOCKSIZE);
+	if (images == NULL) {
+		kfree(jd[0]);
+		return ENOMEM;
+	}
+
+	slot = jnl->j_start + which * jnl->j_slotsize;
+	for (i=0; i<jd[which]->jd_nblocks; i+=k) {
+		k = jd[which]->jd_nblocks - i;
+		if (k > SFS_CLUSTERBLOCKS) {
+			k = SFS_CLUSTERBLOCKS;
+		}
+		result = sfs_readblock(sfs, slot + 1 + i, images,
+				       k * SFS_BLOCKSIZE);
+		if (result) {
+			goto done;
+		}
+		for (j=0; j<k; j++) {
+			result = sfs_jnl_stage(sfs, jd[which]->jd_blocks[i+j],
+					       images + j * SFS_BLOCKSIZE);
+			if (result) {
+				jnl->j_iofill = 0;
+				goto done;
+			}
+		}
+	}
+	result = sfs_jnl_flush(sfs);
+	if (result) {
+		goto done;
+	}
+
+	kprintf("sfs: %s: replayed journal transaction %u (%u blocks)\n",
+		sfs->sfs_sb.sb_volname, jd[which]->jd_seq,
+		jd[which]->jd_nblocks);
+
+	spinlock_acquire(&sfs_jnlstats_lock);
+	sfs_jnlstats.replays++;
+	spinlock_release(&sfs_jnlstats_lock);
+
+ done:
+	kfree(images);
+	kfree(jd[0]);
+	return result;
+}
+
+/*
+ * Set up the journal at mount time, after the superblock has been
+ * loaded, and replay it. A volume without a journal gets none.
+ */
+int
+sfs_jnl_mount(struct sfs_fs *sfs)
+{
+	struct sfs_superblock *sb = &sfs->sfs_sb;
+	struct sfs_jnl *jnl;
+	unsigned i;
+	int result;
+
+	if (sb->sb_jnlblocks == 0) {
+		return 0;
+	}
+	if (sb->sb_jnlstart < SFS_FREEMAP_START + SFS_FS_FREEMAPBLOCKS(sfs) ||
+	    sb->sb_jnlstart > sb->sb_nblocks ||
+	    sb->sb_jnlblocks > sb->sb_nblocks - sb->sb_jnlstart ||
+	    SFS_JNL_SLOTSIZE(sb->sb_jnlblocks) < 3) {
+		kprintf("sfs: %s: Invalid journal (%u blocks at %u)\n",
+			sb->sb_volname, sb->sb_jnlblocks, sb->sb_jnlstart);
+		return EINVAL;
+	}
+
+	jnl = kmalloc(sizeof(*jnl));
+	if (jnl == NULL) {
+		return ENOMEM;
+	}
+	jnl->j_io = kmalloc(SFS_CLUSTERBLOCKS * SFS_BLOCKSIZE);
+	if (jnl->j_io == NULL) {
+		kfree(jnl);
+		return ENOMEM;
+	}
+	jnl->j_lock = lock_create("sfs journal");
+	if (jnl->j_lock == NULL) {
+		kfree(jnl->j_io);
+		kfree(jnl);
+		return ENOMEM;
+	}
+	jnl->j_cv = cv_create("sfs journal");
+	if (jnl->j_cv == NULL) {
+		lock_destroy(jnl->j_lock);
+		kfree(jnl->j_io);
+		kfree(jnl);
+		return ENOMEM;
+	}
+	jnl->j_fmcopy = kmalloc(SFS_FS_FREEMAPBLOCKS(sfs) * SFS_BLOCKSIZE);
+	if (jnl->j_fmcopy == NULL) {
+		cv_destroy(jnl->j_cv);
+		lock_destroy(jnl->j_lock);
+		kfree(jnl->j_io);
+		kfree(jnl);
+		return ENOMEM;
+	}
+	jnl->j_closed = false;
+	jnl->j_committing = false;
+	jnl->j_unlogged = false;
+	jnl->j_crash = false;
+	jnl->j_frozen = false;
+	jnl->j_active = 0;
+	jnl->j_nblocks = 0;
+	for (i=0; i<SFS_JNL_HASHSIZE; i++) {
+		jnl->j_hash[i] = NULL;
+	}
+	jnl->j_start = sb->sb_jnlstart;
+	jnl->j_slotsize = SFS_JNL_SLOTSIZE(sb->sb_jnlblocks);
+	jnl->j_seq = 0;
+	jnl->j_gen = 0;
+	jnl->j_ckpn = 0;
+	jnl->j_ckpbusy = false;
+	jnl->j_ckplo = jnl->j_ckphi = 0;
+	jnl->j_ckplist = NULL;
+	jnl->j_iofill = 0;
+
+	/* sfs_jnl_stage and sfs_jnl_flush find it through sfs */
+	sfs->sfs_jnl = jnl;
+
+	result = sfs_jnl_replay(sfs, jnl);
+	if (result) {
+		sfs_jnl_destroy(sfs);
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * At unmount, after the last commit: once it's been checkpointed
+ * (whoever is doing that), empty the journal, so the next mount has
+ * nothing to replay.
+ */
+int
+sfs_jnl_unmount(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+	bool frozen;
+	int result;
+
+	if (jnl == NULL) {
+		return 0;
+	}
+
+	lock_acquire(jnl->j_lock);
+	KASSERT(jnl->j_active == 0);
+	result = sfs_jnl_ckpwait(sfs);
+	if (result == 0 && jnl->j_nblocks > 0) {
+		/* It failed in another thread, and put them back */
+		result = EIO;
+	}
+	frozen = jnl->j_frozen;
+	lock_release(jnl->j_lock);
+	if (result || frozen) {
+		return result;
+	}
+	return sfs_jnl_invalidate(sfs);
+}
+
+/*
+ * For testing replay: make the next transaction committed the last
+ * thing that reaches the disk, as though the machine crashed as soon
+ * as its commit block was written. It isn't checkpointed, and after
+ * it every write to the volume is dropped, the journal isn't emptied
+ * at unmount, and the next mount has to replay it.
+ */
+void
+sfs_jnl_crash(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+
+	KASSERT(jnl != NULL);
+
+	lock_acquire(jnl->j_lock);
+	jnl->j_crash = true;
+	lock_release(jnl->j_lock);
+}
+
+void
+sfs_jnl_destroy(struct sfs_fs *sfs)
+{
+	struct sfs_jnl *jnl = sfs->sfs_jnl;
+
+	if (jnl == NULL) {
+		return;
+	}
+
+	lock_acquire(jnl->j_lock);
+	KASSERT(!jnl->j_ckpbusy);
+	sfs_jnl_clear(jnl);
+	sfs_jnl_freelist(jnl->j_ckplist);
+	lock_release(jnl->j_lock);
+	cv_destroy(jnl->j_cv);
+	lock_destroy(jnl->j_lock);
+	kfree(jnl->j_fmcopy);
+	kfree(jnl->j_io);
+	kfree(jnl);
+	sfs->sfs_jnl = NULL;
+}
+
+/*
+ * Print the journal statistics.
+ */
+void
+sfs_jnl_printstats(void)
+{
+	unsigned ops, commits, blocks, early, overflows, replays;
+
+	/* Don't print with the spinlock held */
+	spinlock_acquire(&sfs_jnlstats_lock);
+	ops = sfs_jnlstats.ops;
+	commits = sfs_jnlstats.commits;
+	blocks = sfs_jnlstats.blocks;
+	early = sfs_jnlstats.early;
+	overflows = sfs_jnlstats.overflows;
+	replays = sfs_jnlstats.replays;
+	spinlock_release(&sfs_jnlstats_lock);
+
+	kprintf("  journal: %u operations in %u commits of %u blocks\n",
+		ops, commits, blocks);
+	kprintf("  %u commits early, %u transactions too big, "
+		"%u replayed\n", early, overflows, replays);
+}
@@ -32,24 +32,63 @@
 
 #include <uio.h> /* for uio_rw */
 
+struct buf;
+
 
 /* ops tables (in sfs_vnops.c) */
 extern const struct vnode_ops sfs_fileops;
 extern const struct vnode_ops sfs_dirops;
 
+/* Shortcuts for the size macros in kern/sfs.h */
+#define SFS_FS_NBLOCKS(sfs)        ((sfs)->sfs_sb.sb_nblocks)
+#define SFS_FS_FREEMAPBITS(sfs)    SFS_FREEMAPBITS(SFS_FS_NBLOCKS(sfs))
+#define SFS_FS_FREEMAPBLOCKS(sfs)  SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs))
+
 /* Macro for initializing a uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
+#define SFSUIO(iov, uio, ptr, block, len, rw) \
+    uio_kinit(iov, uio, ptr, len, ((off_t)(block))*SFS_BLOCKSIZE, rw)
+
+/* Number of file blocks an inode can map */
+#define SFS_MAXFILEBLOCKS \
+    (SFS_NDIRECT + SFS_DBPERIDB + SFS_DBPERIDB * SFS_DBPERIDB + \
+     SFS_DBPERIDB * SFS_DBPERIDB * SFS_DBPERIDB)
+
+/* Blocks set aside for a file being appended to (about its size) */
+#define SFS_PREALLOC_MIN 8
+#define SFS_PREALLOC_MAX 128
+
+/* Most whole blocks moved to or from the disk in one request */
+#define SFS_CLUSTERBLOCKS 8
+
+/* Read-ahead window, which grows while reads stay sequential */
+#define SFS_RAMIN 4
+#define SFS_RAMAX 64
+
+/* Full blocks a sequential writer builds up before they're pushed out */
+#define SFS_WBBLOCKS 8
+
+/* Initial number of vnode table chains; the table doubles as it fills */
+#define SFS_VNHASH_INITSIZE 32
+
+/* Most journal blocks one operation is expected to change */
+#define SFS_JNL_RESERVE 16
 
 
 /* Functions in sfs_balloc.c */
-int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_freemap_summarize(struct sfs_fs *sfs);
+int sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock);
+int sfs_balloc_data(struct sfs_vnode *sv, daddr_t goal, unsigned prealloc,
+		bool zero, daddr_t *diskblock);
+void sfs_prealloc_release(struct sfs_vnode *sv);
+void sfs_prealloc_reclaim(struct sfs_fs *sfs);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
+void sfs_balloc_countconvert(void);
+void sfs_balloc_printstats(void);
 
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-		daddr_t *diskblock);
+		daddr_t *diskblock, bool *unwritten);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
 
 /* Functions in sfs_dir.c */
@@ -62,7 +101,11 @@ int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
+/* Functions in sfs_fsops.c */
+int sfs_sync_freemap(struct sfs_fs *sfs);
+
 /* Functions in sfs_inode.c */
+int sfs_write_inode(struct sfs_vnode *sv);
 int sfs_sync_inode(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
@@ -77,5 +120,20 @@ int sfs_io(struct sfs_vnode *sv, struct uio *uio);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
 
+/* Functions in sfs_jnl.c */
+int sfs_jnl_mount(struct sfs_fs *sfs);
+int sfs_jnl_unmount(struct sfs_fs *sfs);
+void sfs_jnl_destroy(struct sfs_fs *sfs);
+void sfs_jnl_begin(struct sfs_fs *sfs);
+void sfs_jnl_join(struct sfs_fs *sfs);
+void sfs_jnl_end(struct sfs_fs *sfs);
+void sfs_jnl_dirty(struct sfs_fs *sfs, struct buf *buf);
+void sfs_jnl_forget(struct sfs_fs *sfs, daddr_t block);
+int sfs_jnl_read(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
+int sfs_jnl_write(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
+int sfs_jnl_commit(struct sfs_fs *sfs);
+void sfs_jnl_crash(struct sfs_fs *sfs);
+void sfs_jnl_printstats(void);
+
 
 #endif /* _SFSPRIVATE_H_ */
@@ -35,6 +35,7 @@
  */
 
 
+#include <array.h>
 #include <vm.h>
 #include "opt-dumbvm.h"
 
@@ -45,32 +46,108 @@ struct vnode;
 // Structs
 // -------
 
-// Frame table - one entry for each physical frame. Keeps track of how many processes reference the address.
-// Does not need to keep paddr, as the paddr is used to index into the frame table.
-struct frame {
-        int                 ref_count;
+// Two - stage page table.
+// The root is an array of NUM_ROOT_ENTRIES pointers to secondary tables,
+// both allocated on first use. Each secondary entry is one 32-bit PTE:
+//
+//   31..12  physical page number   (TLBLO_PPAGE)
+//   11..9   TLBLO_NOCACHE, TLBLO_DIRTY, TLBLO_VALID, exactly as loaded
+//           into the TLB. VALID means physical memory is present.
+//    8      PTE_ACCESSED - set by the TLB refill handler each time it
+//                          loads the entry; cleared by the clock
+//                          (evict_page). May be lost to a racing store.
+//    7      PTE_COW      - frame is shared copy-on-write (DIRTY is clear)
+//    6      PTE_SHARED   - frame belongs to the page cache: text, a page
+//                          of a private mapping not yet written (with
+//                          PTE_COW), or a page of a shared file mapping
+//                          (DIRTY is clear until the first write).
+//                          Eviction of the page zeroes every such entry
+//                          for it, in whatever address space.
+//    5      PTE_SWAPPED  - page is in swap; VALID is clear and bits 31..12
+//                          hold the swap slot instead of a frame
+//    4      PTE_FILE     - private frame that still matches the file, so
+//                          eviction can drop it instead of swapping. With
+//                          PF_W it stands in for a shared mapping's page
+//                          that was busy in the cache, and is dropped on
+//                          the first write.
+//    3      PTE_BUSY     - with PTE_SWAPPED: the page is still being
+//                          written out to its slot, from a frame that is
+//                          not freed yet. Faults on it, and anything that
+//                          would drop it, wait (pt_wait_idle).
+//    2..0   PF_R, PF_W, PF_X permissions of the page
+//
+// An all-zero PTE is a page that has not been touched yet; whether the
+// address is valid at all is decided by the region map.
+//
+// Page tables of every address space, and the frame owners used for
+// eviction, are protected by vm_lock. It is not held across I/O: not
+// across file I/O, since the filesystem may fault while holding its own
+// locks, and not across swap I/O, so that one page-out doesn't hold up
+// every fault in the system. A page being paged out is PTE_BUSY
+// meanwhile; one being paged in is not valid yet, and only its own
+// process changes such an entry.
+//
+// One lock for all of this is enough because little runs under it.
+// Kernel allocations take only the frame table's stripe locks. TLB
+// misses on present pages are refilled in the exception vector without
+// it. What's left (first touches, COW faults, fork, exit, eviction)
+// holds it for at most a page copy, and page zeroing is done ahead of
+// time by the zero pool. vmstat counts how often taking it had to wait,
+// which is the number to watch before splitting it per address space.
+typedef uint32_t pte_t;
+
+#define PTE_ACCESSED   0x00000100
+#define PTE_COW        0x00000080
+#define PTE_PERMS      (PF_R | PF_W | PF_X)
+
+#define PTE_SHARED     0x00000040
+#define PTE_SWAPPED    0x00000020
+#define PTE_FILE       0x00000010
+#define PTE_BUSY       0x00000008
+
+// Swap slot of a PTE_SWAPPED entry, and the entry for a slot
+#define PTE_SWAPSLOT(pte)         ((pte) >> 12)
+#define PTE_MKSWAP(slot, perms)   (((slot) << 12) | PTE_SWAPPED | (perms))
+
+// The bits of a PTE that are passed to the TLB as entrylo
+#define PTE_TLBLO_MASK (TLBLO_PPAGE | TLBLO_NOCACHE | TLBLO_DIRTY | TLBLO_VALID)
+
+// Region map - one interval per run of pages with the same permissions
+// and backing. Kept sorted by vbase and non-overlapping; adjacent alike
+// intervals are merged. Which pages are actually present comes from the
+// page table, not from here.
+//
+// A file-backed region (r_vnode != NULL) is filled on demand: the bytes
+// at [r_filevaddr, r_filevaddr + r_filesize) come from the file starting
+// at offset r_fileoff, everything else is zero. These describe the whole
+// ELF segment or mapping, so they are the same in every piece of a split
+// region. Writes to a file-backed region are private unless r_shared is
+// set, in which case they go back to the file.
+//
+// A region made by mmap (r_mmap) is never split or merged: munmap and
+// msync name it by its base address.
+struct region {
+        vaddr_t         r_vbase;        // Page aligned base
+        size_t          r_npages;       // Length in pages
+        int             r_perms;        // PF_R | PF_W | PF_X
+        int             r_saved_perms;  // r_perms before as_prepare_load
+        struct vnode    *r_vnode;       // Backing file (referenced), or NULL
+        off_t           r_fileoff;      // File offset of r_filevaddr
+        vaddr_t         r_filevaddr;    // Address of first file byte
+        size_t          r_filesize;     // Number of bytes from the file
+        bool            r_mmap;         // Made by mmap
+        bool            r_shared;       // Writes go back to the file
 };
 
-// Two - stage page table
-struct secondary_page_entry {
-	vaddr_t	               vaddr;    //This is the page num (first 20 bytes of vaddr)
-	uint32_t	       paddr;    //The "low" that can be passed to tlb. If not set yet, it is USERSPACETOP
-        int            copy_on_write;    //Defaults to 0. Is only 1 if it references physical memory of another process.
-	int                    flags;    //The flags for permissions on the page. If not set, will be -1
-};
+#ifndef ADDRSPACEINLINE
+#define ADDRSPACEINLINE INLINE
+#endif
 
-struct root_page_entry {
-    uint32_t 	           vaddr_prefix;   //First 10 bytes of the page num
-    struct secondary_page_entry *target;   //Malloc'd secondary page, or NULL if not allocated
-};
+DECLARRAY(region, ADDRSPACEINLINE);
+DEFARRAY(region, ADDRSPACEINLINE);
 
-// Linked list to keep track of exactly which pages have been allocated
-// (so we don't need to search entire PT each time)
-struct region {
-        vaddr_t       vbase;
-        int       old_flags;
-        struct region *next;
-};
+// End address (exclusive) of a region
+#define REGION_END(r) ((r)->r_vbase + (r)->r_npages * PAGE_SIZE)
 
 
 // ---------
@@ -101,10 +178,15 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 #else
-        struct region *as_region;
-        struct root_page_entry page_table[NUM_ROOT_ENTRIES];
+        struct regionarray as_regions;  /* sorted region map */
+        pte_t **as_pt;          /* root page table, NULL until first use */
+        struct addrspace *as_ptnext;    /* list of address spaces with */
+        struct addrspace *as_ptprev;    /* page tables (vm.c) */
         vaddr_t as_heap_start;	
 	vaddr_t as_heap_end;	
+        unsigned as_asid;       /* TLB address space ID */
+        unsigned as_asidgen;    /* generation as_asid belongs to */
+        uint32_t as_cpus;       /* CPUs (by number) that ran as_asid */
 #endif
 };
 
@@ -113,27 +195,64 @@ struct addrspace {
 // ----------
 // (defined in vm.c)
 
-// Ensures that vaddr is present in as's page table, and sets the flags as given.
-// Will allocate a secondary page table if required.
-void add_single_vaddr_page(struct addrspace *as, vaddr_t vaddr, int flags);
+extern struct lock *vm_lock;
+
+// Takes vm_lock, counting contention for vmstat.
+void vm_lock_acquire(void);
+
+// Gets the page table entry for vaddr in as's page table.
+// Will allocate the root and a secondary page table if required.
+// Returns NULL if they cannot be allocated.
+pte_t * get_page_create(struct addrspace *as, vaddr_t vaddr);
 
 // Gets a page from as's page table. Returns the page table entry if found,
 // returns NULL if secondary page table does not exist.
-struct secondary_page_entry * get_page(struct addrspace *as, vaddr_t vaddr);
+pte_t * get_page(struct addrspace *as, vaddr_t vaddr);
 
-// Ensures that the page given has some physical memory.
+// Ensures that the page given has some physical memory, with permissions perms.
 // Does nothing if there is already physical memory,
-//  allocates a single page if there is no physical memory.
-void ensure_paddr(struct secondary_page_entry * page);
+//  allocates a single zeroed page if there is no physical memory.
+// Returns ENOMEM if no page is available. Caller holds vm_lock, which
+// is dropped for a while if another page has to be paged out first.
+int ensure_paddr(pte_t *pte, int perms);
 
-// Decrements the specific paddr in the frame table
-// If ref_count drops to 0, will free the paddr
-void decrement_ref_count(paddr_t paddr);
+// Waits until *pte is not PTE_BUSY. Caller holds vm_lock.
+void pt_wait_idle(pte_t *pte);
 
-// Increments the ref count of paddr in frame table
-// Use when copying, not allocating new memory
-// If you need new physical memory, call ensure_paddr
-void increment_ref_count(paddr_t paddr);
+// Drops the reference an entry held to the private frame in OLD, the
+// entry's value before the caller cleared or replaced it; VADDR is the
+// page it mapped. A copy-on-write frame left with one sharer is handed
+// to that one. Caller holds vm_lock.
+void pt_release_frame(pte_t old, vaddr_t vaddr);
+
+// Calls fn on every non-empty page table entry for addresses in [start, end).
+// Missing secondary tables are skipped whole.
+void pt_foreach(struct addrspace *as, vaddr_t start, vaddr_t end,
+                void (*fn)(struct addrspace *as, vaddr_t vaddr, pte_t *pte, void *data),
+                void *data);
+
+// Copies old's page table into new (which has none) for fork, sharing
+// every page copy-on-write. On failure, new holds whatever was copied
+// and must be destroyed. Caller holds vm_lock.
+int pt_copy(struct addrspace *old, struct addrspace *new);
+
+// Releases all frames and swap slots referenced by as's page table,
+// and the table itself.
+void free_page_table(struct addrspace *as);
+
+// Points this CPU's TLB refill handler at as's page table.
+void pt_activate(struct addrspace *as);
+
+// Makes sure no CPU's TLB refill handler refers to as any more.
+void pt_forget(struct addrspace *as);
+
+// Removes as's TLB entry for vaddr, if there is one, on every CPU.
+// Caller holds vm_lock, and has already changed the PTE.
+void vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr);
+
+// Removes all of as's writable TLB entries on every CPU, in one pass
+// each. Caller holds vm_lock.
+void vm_tlb_flush_writable(struct addrspace *as);
 
 /*
  * Functions in addrspace.c:
@@ -193,11 +312,39 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
 
 
+// Defines a demand-paged region backed by FILESIZE bytes of file V at
+// OFFSET, for a segment at VADDR of size MEMSIZE. Takes a reference to V.
+// The region must not overlap any existing region.
+int as_define_file_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+                          struct vnode *v, off_t offset, size_t filesize,
+                          int readable, int writeable, int executable);
+
 // Identical to as_define_region, but doesn't modify heap.
 int as_define_region_noheap(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 					 int readable, int writeable, int executable);
 // Removes a region (as may happen when sbrk is called with a negative)
-void as_remove_region(struct addrspace *as, vaddr_t vaddr, size_t memsize);
+int as_remove_region(struct addrspace *as, vaddr_t vaddr, size_t memsize);
+// Finds the region containing vaddr, or NULL if vaddr is not mapped. O(log n).
+struct region *as_find_region(struct addrspace *as, vaddr_t vaddr);
+// Whether no region overlaps [vaddr, vaddr + size).
+bool as_range_free(struct addrspace *as, vaddr_t vaddr, size_t size);
+// Sets *asid to as's ASID, and returns the other CPUs (as a mask of CPU
+// numbers) whose TLBs may still hold entries under it. For the address
+// space running on this CPU that is always none: it is given a new ASID
+// the next time it is activated instead.
+uint32_t as_tlb_cpus(struct addrspace *as, unsigned *asid);
+
+// Maps SIZE bytes of file V from OFFSET (page aligned) for mmap, at the
+// highest free address between the heap and the stack, which is
+// returned in *ret. The first FILESIZE bytes come from the file; PERMS
+// are PF_R | PF_W; SHARED sends writes back to the file. Takes a
+// reference to V.
+int as_define_mmap(struct addrspace *as, size_t size, struct vnode *v,
+                   off_t offset, size_t filesize, int perms, bool shared,
+                   vaddr_t *ret);
+// Writes the dirty pages of region r (a shared file mapping) back to
+// its file. Must not be called with vm_lock held.
+int as_sync_region(struct addrspace *as, struct region *r);
 
 
 /*
@@ -38,6 +38,12 @@
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
  *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *     bitmap_alloc_near - same, but take the first one at or after a
+ *                      given index if possible.
+ *     bitmap_findrun - find the first run of a given number of cleared
+ *                      bits within a range, without setting them.
+ *     bitmap_runstats - count the cleared bits within a range, and
+ *                      measure the longest run of them.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
  *     bitmap_isset   - return whether a particular bit is set or not.
@@ -50,6 +56,14 @@ struct bitmap;  /* Opaque. */
 struct bitmap *bitmap_create(unsigned nbits);
 void          *bitmap_getdata(struct bitmap *);
 int            bitmap_alloc(struct bitmap *, unsigned *index);
+int            bitmap_alloc_near(struct bitmap *, unsigned goal,
+                                 unsigned *index);
+int            bitmap_findrun(struct bitmap *, unsigned start,
+                              unsigned end, unsigned len,
+                              unsigned *index);
+void           bitmap_runstats(struct bitmap *, unsigned start,
+                               unsigned end, unsigned *nclear,
+                               unsigned *maxrun);
 void           bitmap_mark(struct bitmap *, unsigned index);
 void           bitmap_unmark(struct bitmap *, unsigned index);
 int            bitmap_isset(struct bitmap *, unsigned index);
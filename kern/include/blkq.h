@@ -0,0 +1,65 @@
+#ifndef _BLKQ_H_
+#define _BLKQ_H_
+
+/*
+ * Block request queue, between filesystems and disk drivers.
+ *
+ * A request names a run of device blocks and a kernel buffer. The
+ * submitter queues it on the device's queue and sleeps; the driver
+ * takes requests off the queue one at a time, in the order chosen by
+ * the queue's policy, and reports each one done from its interrupt
+ * handler, which wakes the submitter. Reordering thus comes from
+ * several threads doing I/O on the same disk at once.
+ *
+ * Policies:
+ *    fifo      - arrival order.
+ *    cscan     - the lowest block at or past where the last request
+ *                ended, wrapping around to the lowest block overall.
+ *                A request that picks up where the last one left off
+ *                thus goes next, with no seek.
+ *    deadline  - cscan, except that a request that has waited longer
+ *                than BLKQ_READ_EXPIRE or BLKQ_WRITE_EXPIRE (ms) goes
+ *                first. This is the default.
+ *
+ *    blkq_create       - make a queue for a driver. START is called,
+ *                        with the queue's spinlock held, to begin a
+ *                        request; the driver calls blkq_done when it
+ *                        has finished.
+ *    blkq_io           - queue a request and wait for it.
+ *    blkq_done         - for drivers: report the current request done.
+ *    blkq_setpolicy    - pick the policy for the queue named NAME.
+ *    blkq_printstats   - print queue depth and latency for every queue.
+ */
+
+#include <kern/time.h>
+#include <uio.h>
+
+#define BLKQ_READ_EXPIRE   500
+#define BLKQ_WRITE_EXPIRE  5000
+
+struct blkq;		/* Opaque. */
+
+struct blkreq {
+	/* Filled in by the submitter */
+	daddr_t br_block;		/* first device block */
+	unsigned br_nblocks;		/* number of blocks */
+	enum uio_rw br_rw;
+	void *br_data;			/* kernel buffer */
+
+	/* Private to blkq */
+	struct timespec br_submitted;
+	bool br_finished;
+	int br_result;
+	struct blkreq *br_next;
+};
+
+struct blkq *blkq_create(const char *name,
+			 void (*start)(void *drvdata, struct blkreq *),
+			 void *drvdata);
+int blkq_io(struct blkq *bq, struct blkreq *req);
+void blkq_done(struct blkq *bq, struct blkreq *req, int result);
+
+int blkq_setpolicy(const char *name, const char *policy);
+void blkq_printstats(void);
+
+#endif /* _BLKQ_H_ */
@@ -0,0 +1,89 @@
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache for block-structured filesystems.
+ *
+ * Each buffer holds one BUFFER_SIZE block of a filesystem, keyed by
+ * the struct fs and the block number, and found through a hash table.
+ * Buffers that nobody holds sit on an LRU list; when the cache is
+ * full the least recently used one is reused, and written back first
+ * if it's dirty. The cache does its I/O through FSOP_READBLOCK and
+ * FSOP_WRITEBLOCK, so a filesystem using it must provide those.
+ *
+ * Every BUFFER_SYNCSECS seconds a background syncer thread syncs each
+ * mounted filesystem, so that filesystems get to write out their own
+ * metadata (or commit their journals) regularly, and then writes any
+ * dirty buffers left over. buffer_sync_fs writes them immediately.
+ *
+ * A second thread does read-ahead and write-behind on request, up to
+ * BUFFER_ASYNCRUN consecutive blocks per device request. Requests are
+ * only hints: when too many are waiting, new ones are dropped.
+ *
+ * A buffer is held by one thread at a time, from buffer_read or
+ * buffer_get until buffer_release; anyone else asking for the same
+ * block waits. Don't hold a buffer across anything that might want
+ * the same block, and don't hold more than a couple at once.
+ *
+ *    buffer_bootstrap    - set up the cache and start the syncer.
+ *    buffer_read         - get a held buffer with the block's contents.
+ *    buffer_get          - get a held buffer without reading the block
+ *                          from disk; use this when it is about to be
+ *                          completely overwritten. If the block isn't
+ *                          cached the buffer is zero-filled.
+ *    buffer_map          - get a pointer to a buffer's data.
+ *    buffer_block        - get the number of the block a buffer holds.
+ *    buffer_valid        - check whether a buffer holds its block's
+ *                          contents; false for one from buffer_get
+ *                          whose block wasn't cached, until it is
+ *                          marked dirty.
+ *    buffer_mark_dirty   - note that the data has been changed (and is
+ *                          now valid, for buffers from buffer_get).
+ *    buffer_release      - let go of a buffer.
+ *    buffer_release_and_invalidate
+ *                        - let go of a buffer and discard its contents,
+ *                          dirty or not.
+ *    buffer_drop         - discard a block if it's cached, e.g. when
+ *                          the filesystem frees it.
+ *    buffer_cached       - check whether a block is cached, e.g. before
+ *                          reading it from the disk directly. Only
+ *                          meaningful if the caller stops anyone else
+ *                          from changing the block meanwhile.
+ *    buffer_readahead    - start reading blocks into the cache in the
+ *                          background, if they aren't there already.
+ *    buffer_writebehind  - start writing out blocks that are cached and
+ *                          dirty in the background.
+ *    buffer_sync_fs      - write out all dirty buffers of a filesystem.
+ *    buffer_drop_fs      - discard all buffers of a filesystem, which
+ *                          must have no dirty ones; for unmount.
+ *    buffer_printstats   - print the cache size and hit counts.
+ */
+
+#define BUFFER_SIZE      512	/* size of each buffer */
+#define BUFFER_SYNCSECS  5	/* syncer interval */
+#define BUFFER_ASYNCRUN  8	/* most blocks per read-ahead/write-behind */
+
+struct fs;
+struct buf;	/* Opaque. */
+
+void buffer_bootstrap(void);
+
+int buffer_read(struct fs *fs, daddr_t block, struct buf **ret);
+int buffer_get(struct fs *fs, daddr_t block, struct buf **ret);
+void *buffer_map(struct buf *buf);
+daddr_t buffer_block(struct buf *buf);
+bool buffer_valid(struct buf *buf);
+void buffer_mark_dirty(struct buf *buf);
+void buffer_release(struct buf *buf);
+void buffer_release_and_invalidate(struct buf *buf);
+
+void buffer_drop(struct fs *fs, daddr_t block);
+bool buffer_cached(struct fs *fs, daddr_t block);
+void buffer_readahead(struct fs *fs, daddr_t block, unsigned nblocks);
+void buffer_writebehind(struct fs *fs, daddr_t block, unsigned nblocks);
+int buffer_sync_fs(struct fs *fs);
+void buffer_drop_fs(struct fs *fs);
+
+void buffer_printstats(void);
+
+#endif /* _BUF_H_ */
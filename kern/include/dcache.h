@@ -0,0 +1,55 @@
+#ifndef _DCACHE_H_
+#define _DCACHE_H_
+
+/*
+ * Directory name lookup cache.
+ *
+ * Remembers the result of looking up a name in a directory, keyed by
+ * the struct fs, the directory's inode number, and the name. A
+ * positive entry gives the inode number the name refers to; a
+ * negative entry records that the name isn't there. The cache has a
+ * fixed number of entries and reuses the least recently used one.
+ * Names longer than DCACHE_NAMELEN-1 aren't cached.
+ *
+ * The cache doesn't know when a directory changes; the filesystem
+ * must tell it, under whatever lock keeps the directory from
+ * changing while it is searched, so that entries are never stale.
+ *
+ *    dcache_bootstrap    - set up the cache.
+ *    dcache_lookup       - look up a name: DCACHE_HIT (and the inode
+ *                          number), DCACHE_NEGATIVE, or DCACHE_MISS.
+ *    dcache_enter        - record that a name refers to an inode.
+ *    dcache_enter_negative
+ *                        - record that a name does not exist.
+ *    dcache_remove       - forget a name.
+ *    dcache_purgedir     - forget everything in a directory, e.g. when
+ *                          it is removed.
+ *    dcache_purgefs      - forget everything on a filesystem; for
+ *                          unmount.
+ *    dcache_printstats   - print the hit counts.
+ */
+
+#define DCACHE_SIZE     512	/* number of entries */
+#define DCACHE_NAMELEN  32	/* longest name kept, plus one */
+
+enum dcache_result {
+	DCACHE_MISS,		/* don't know */
+	DCACHE_HIT,		/* name exists */
+	DCACHE_NEGATIVE,	/* name does not exist */
+};
+
+struct fs;
+
+void dcache_bootstrap(void);
+
+enum dcache_result dcache_lookup(struct fs *fs, ino_t dir, const char *name,
+				 ino_t *ret);
+void dcache_enter(struct fs *fs, ino_t dir, const char *name, ino_t ino);
+void dcache_enter_negative(struct fs *fs, ino_t dir, const char *name);
+void dcache_remove(struct fs *fs, ino_t dir, const char *name);
+void dcache_purgedir(struct fs *fs, ino_t dir);
+void dcache_purgefs(struct fs *fs);
+
+void dcache_printstats(void);
+
+#endif /* _DCACHE_H_ */
@@ -51,6 +51,7 @@ struct emufs_fs {
 	struct fs ef_fs;		/* abstract filesystem structure */
 	struct emu_softc *ef_emu;	/* device */
 	struct emufs_vnode *ef_root;	/* root vnode */
+	struct lock *ef_lock;		/* lock for vnode table and opens */
 	struct vnodearray *ef_vnodes;	/* table of loaded vnodes */
 };
 
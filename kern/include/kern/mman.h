@@ -0,0 +1,21 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Flags for mmap(), shared with libc's <unistd.h>.
+ *
+ * mmap() takes the simplified UNSW argument list, which has no flags
+ * argument, so the kind of mapping is or'ed into the protection.
+ * Shared is the default: writes through the mapping go back to the
+ * file (at msync or munmap). A private mapping's writes are copied
+ * into pages of the process's own and the file never sees them.
+ */
+
+#define PROT_READ     1      /* Pages may be read */
+#define PROT_WRITE    2      /* Pages may be written */
+
+#define MAP_SHARED    0      /* Writes go back to the file (the default) */
+#define MAP_PRIVATE   0x100  /* Writes are copy-on-write, for this process */
+
+
+#endif /* _KERN_MMAN_H_ */
@@ -41,9 +41,10 @@
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_NINDIRECT     1             /* # of indirect blocks in inode */
-#define SFS_NDINDIRECT    0             /* # of 2x indirect blocks in inode */
-#define SFS_NTINDIRECT    0             /* # of 3x indirect blocks in inode */
+#define SFS_NDINDIRECT    1             /* # of 2x indirect blocks in inode */
+#define SFS_NTINDIRECT    1             /* # of 3x indirect blocks in inode */
 #define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
+#define SFS_NEXTENTS      32            /* # of extents in inode */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SUPER_BLOCK   0             /* block the superblock lives in */
 #define SFS_FREEMAP_START 2             /* 1st block of the freemap */
@@ -67,6 +68,28 @@
 #define SFS_TYPE_FILE     1
 #define SFS_TYPE_DIR      2
 
+/* Flags for sfi_flags */
+#define SFS_IF_HASHDIR    0x1     /* Directory is hashed (see below) */
+#define SFS_IF_EXTENTS    0x2     /* File is mapped by sfi_extents */
+
+/* Hashed directory parameters */
+#define SFS_DIRHDR_MAGIC     0x5f5d1dea  /* header block magic number */
+#define SFS_DIRLEAF_MAGIC    0x5f5d1eaf  /* leaf block magic number */
+#define SFS_DIRHASH_MAXDEPTH 13          /* max hash bits used */
+#define SFS_DIRHASH_NINDEX   ((1 << SFS_DIRHASH_MAXDEPTH) / SFS_DBPERIDB)
+#define SFS_DIRLEAF_NENTRIES 7           /* entries per leaf block */
+
+/* Journal (see below) */
+#define SFS_JNL_DESCMAGIC    0x5f5d10de  /* descriptor block magic number */
+#define SFS_JNL_COMMITMAGIC  0x5f5d10c0  /* commit block magic number */
+#define SFS_JNL_MAXBLOCKS    125         /* most images per transaction */
+#define SFS_JNL_MINBLOCKS    64          /* smallest journal mksfs makes */
+#define SFS_JNL_DEFBLOCKS    256         /* ... and largest */
+
+/* Size of each of the journal's two slots (in blocks) */
+#define SFS_JNL_SLOTSIZE(jblocks) \
+    ((jblocks)/2 < SFS_JNL_MAXBLOCKS+2 ? (jblocks)/2 : SFS_JNL_MAXBLOCKS+2)
+
 /*
  * On-disk superblock
  */
@@ -74,11 +97,32 @@ struct sfs_superblock {
 	uint32_t sb_magic;		/* Magic number; should be SFS_MAGIC */
 	uint32_t sb_nblocks;			/* Number of blocks in fs */
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];			/* unused, set to 0 */
+	uint32_t sb_jnlstart;			/* First block of journal */
+	uint32_t sb_jnlblocks;			/* Size of journal, or 0 */
+	uint32_t reserved[116];			/* unused, set to 0 */
+};
+
+/*
+ * Extent: a run of SE_LEN consecutive file blocks stored in the
+ * consecutive disk blocks starting at SE_BLOCK, or a hole if SE_BLOCK
+ * is 0.
+ */
+struct sfs_extent {
+	uint32_t se_block;			/* First disk block, or 0 */
+	uint32_t se_len;			/* Number of blocks */
 };
 
 /*
  * On-disk inode
+ *
+ * An inode maps its file's blocks one of two ways. Normally it uses
+ * the direct and indirect block pointers, and sfi_extents is all
+ * zero. If SFS_IF_EXTENTS is set, the block pointers are all zero
+ * instead, and the extents in sfi_extents describe the file from
+ * block 0 on, each one starting where the one before it left off.
+ * The extents in use come first; the rest have se_len 0. File blocks
+ * past the end of the last extent are holes. A file that needs more
+ * than SFS_NEXTENTS extents is converted to use block pointers.
  */
 struct sfs_dinode {
 	uint32_t sfi_size;			/* Size of this file (bytes) */
@@ -86,7 +130,12 @@ struct sfs_dinode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_flags;			/* SFS_IF_* flags */
+	struct sfs_extent sfi_extents[SFS_NEXTENTS]; /* Extents */
+	uint32_t sfi_waste[128-6-SFS_NDIRECT-2*SFS_NEXTENTS];
+						/* unused space, set to 0 */
 };
 
 /*
@@ -97,5 +146,83 @@ struct sfs_direntry {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * Hashed directories
+ *
+ * A plain directory is an array of struct sfs_direntry. A directory
+ * with SFS_IF_HASHDIR set is instead an extendible hash table, so a
+ * name can be found (or added, or removed) by reading a few blocks
+ * however big the directory gets.
+ *
+ * Names are hashed with 32-bit FNV-1a over their bytes (without the
+ * terminating null). File block 0 of the directory is a struct
+ * sfs_dirhdr. Its sdh_index[] gives the file blocks holding the
+ * table: 2^sdh_depth pointers in all, SFS_DBPERIDB per block, each
+ * the file block number of a leaf. A name whose hash has low-order
+ * bits i (taking sdh_depth bits) is found in the leaf named by
+ * pointer i.
+ *
+ * Each leaf is a struct sfs_dirleaf: all its entries have the same
+ * low sdl_depth bits of hash, and it is named by every pointer
+ * ending in those bits. When a leaf fills up, it is split in two on
+ * the next bit of hash, first doubling the table if the leaf already
+ * uses as many bits as the table does. Leaves and table blocks are
+ * added at the end of the directory and never removed.
+ *
+ * A directory entry's slot number is still its byte offset in the
+ * directory divided by sizeof(struct sfs_direntry); in a hashed
+ * directory the slot of each leaf header is never used.
+ */
+struct sfs_dirhdr {
+	uint32_t sdh_magic;			/* SFS_DIRHDR_MAGIC */
+	uint32_t sdh_depth;			/* hash bits used by table */
+	uint32_t sdh_index[SFS_DIRHASH_NINDEX];	/* table blocks */
+	uint32_t sdh_reserved[128-2-SFS_DIRHASH_NINDEX]; /* set to 0 */
+};
+
+struct sfs_dirleaf {
+	uint32_t sdl_magic;			/* SFS_DIRLEAF_MAGIC */
+	uint32_t sdl_depth;			/* hash bits shared */
+	uint32_t sdl_reserved[14];		/* set to 0 */
+	struct sfs_direntry sdl_entries[SFS_DIRLEAF_NENTRIES];
+};
+
+/*
+ * Journal
+ *
+ * Changes to inodes, indirect blocks, directories, and the freemap
+ * are grouped into transactions, each written to the journal before
+ * any of it is written in place. A volume made without a journal has
+ * sb_jnlblocks 0, and is updated in place as before.
+ *
+ * The journal is divided into two slots of SFS_JNL_SLOTSIZE blocks,
+ * and transactions alternate between them: transaction number N goes
+ * in slot N % 2. A transaction is a struct sfs_jdesc listing where
+ * each of the blocks that follow it belongs, then those blocks, then
+ * a struct sfs_jcommit. The commit block is written only once all the
+ * rest is on disk, and the next transaction is written only once all
+ * of this one has been written in place; so after a crash, the newest
+ * transaction whose commit block is intact (magic number, sequence
+ * number, count, and checksum all matching) is copied into place,
+ * which is all there can be left to do. Doing so twice is harmless.
+ *
+ * The checksum is over the bytes of the blocks in order: for each
+ * byte, rotate the sum left by one bit and add the byte.
+ */
+struct sfs_jdesc {
+	uint32_t jd_magic;			/* SFS_JNL_DESCMAGIC */
+	uint32_t jd_seq;			/* transaction number */
+	uint32_t jd_nblocks;			/* blocks that follow */
+	uint32_t jd_blocks[SFS_JNL_MAXBLOCKS];	/* where each one goes */
+};
+
+struct sfs_jcommit {
+	uint32_t jc_magic;			/* SFS_JNL_COMMITMAGIC */
+	uint32_t jc_seq;			/* same as jd_seq */
+	uint32_t jc_nblocks;			/* same as jd_nblocks */
+	uint32_t jc_sum;			/* checksum of the blocks */
+	uint32_t jc_reserved[124];		/* set to 0 */
+};
+
 
 #endif /* _KERN_SFS_H_ */
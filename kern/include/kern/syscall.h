@@ -65,6 +65,8 @@
 //#define SYS_munlock    14
 //#define SYS_munlockall 15
 //#define SYS_minherit   16
+//                              (numbered past the end; none free here)
+#define SYS_msync        121
 //                              (security/credentials)
 #define SYS_umask        17
 #define SYS_issetugid    18
@@ -109,12 +111,12 @@
 #define SYS_close        49
 #define SYS_read         50
 #define SYS_pread        51
-//#define SYS_readv      52
+#define SYS_readv        52
 //#define SYS_preadv     53
 #define SYS_getdirentry  54
 #define SYS_write        55
 #define SYS_pwrite       56
-//#define SYS_writev     57
+#define SYS_writev       57
 //#define SYS_pwritev    58
 #define SYS_lseek        59
 #define SYS_flock        60
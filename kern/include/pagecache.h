@@ -0,0 +1,116 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Shared cache of file pages.
+ *
+ * vm_fault fills pages of file-backed regions through here, so every
+ * process running the same binary, or mapping the same file, maps the
+ * same frame. A page is identified by its vnode, the file offset of
+ * the start of the page, and the byte range [lo, hi) of the page that
+ * comes from the file; the rest of the page is zero. Each mapping holds
+ * one reference to the frame, and the cache holds one more, along with
+ * a reference to the vnode.
+ *
+ * A page nobody maps any more stays cached (so the next exec of the
+ * same binary finds its text) on an idle list, which vm_getpage takes
+ * frames from, oldest first, before evicting anything. Mapped pages are
+ * eviction candidates as well: the cache remembers every page table
+ * entry that maps a page, and eviction drops them all. Dirty pages are
+ * written back first, by the page cache's own thread.
+ *
+ * Page table entries for cached frames are marked PTE_SHARED, and must
+ * be copied and dropped with pagecache_dup and pagecache_unmap rather
+ * than the frame table reference counts. Eviction may zero such an
+ * entry at any time vm_lock is not held.
+ *
+ * Most cached pages are never written: text, and pages of private
+ * mappings until their first write copies them. Shared file mappings
+ * write to the cached frame itself. A mapping's first write marks the
+ * entry dirty, and msync, munmap or exit write it back to the file.
+ * Since other mappings may be writing too, the dirty mark is only
+ * cleared by a writer that holds the one mapping left, or by the page
+ * cache thread, which makes all the mappings clean at once.
+ *
+ * Filesystems that support mmap call pagecache_write with each piece
+ * of file data they write, with the file locked against other writes,
+ * so that cached pages always hold what the file does. Otherwise a
+ * later writeback would put back what write() replaced, and a new
+ * mapping (e.g. exec after cp) would still find the old contents.
+ * Likewise they call pagecache_truncate when a file is truncated; the
+ * pages that reached past the new end are no longer found. Since idle
+ * pages keep their vnode, a filesystem calls pagecache_purge when a
+ * file loses its last link, and unmounting calls pagecache_purge_fs.
+ *
+ *    pagecache_bootstrap - initialise; called from vm_bootstrap.
+ *    pagecache_map       - find or read the page, adding a mapping
+ *                          reference for the entry of AS at VADDR,
+ *                          which the caller then sets (under vm_lock).
+ *                          *shared is false if the page had to be read
+ *                          privately instead (somebody else was filling
+ *                          it), in which case it is an ordinary frame.
+ *    pagecache_dup       - add a mapping reference (fork). Fails only
+ *                          for lack of memory.
+ *    pagecache_unmap     - drop a mapping reference.
+ *    pagecache_reclaim   - take the frame of the oldest idle page out
+ *                          of the cache and return it (unzeroed), or 0
+ *                          if there is none. Caller holds vm_lock.
+ *    pagecache_evict     - evict the cached page in frame PADDR, picked
+ *                          by the clock: unmap it everywhere and drop
+ *                          it. Fails with EAGAIN if it is dirty (it is
+ *                          then queued for writeback), and EBUSY if it
+ *                          is in use (SECONDCHANCE and a mapping has
+ *                          PTE_ACCESSED) or in transition. Caller holds
+ *                          vm_lock.
+ *    pagecache_waitflush - if pages are queued for writeback, wait until
+ *                          the page cache thread has done one. Must not
+ *                          be called with vm_lock held.
+ *    pagecache_purge     - drop V's idle pages. Caller holds V.
+ *    pagecache_purge_fs  - drop the idle pages of all of FS's files.
+ *    pagecache_readpage  - read file bytes into [lo, hi) of the page at
+ *                          kernel address KVADDR and zero the rest.
+ *    pagecache_write     - copy LEN bytes of DATA, just written to the
+ *                          file at OFF, into any cached pages they fall
+ *                          in (except for a page's own writeback). May
+ *                          be called with filesystem locks held.
+ *    pagecache_truncate  - the file is now LEN bytes long: zero what
+ *                          cached pages hold past that, and drop those
+ *                          pages from lookups.
+ *    pagecache_markdirty - note a write through a shared file mapping.
+ *    pagecache_hold_dirty - if the page is dirty, add a reference for
+ *                          pagecache_writeback and return true. If the
+ *                          caller's mapping is the only one, the dirty
+ *                          mark is cleared and *sole is set: the caller
+ *                          must then make its own entry clean, so that
+ *                          its next write is noticed again.
+ *    pagecache_writeback - write a held page's bytes back to the file
+ *                          (never extending it) and drop the hold. On
+ *                          failure the page is left dirty. Must not be
+ *                          called with vm_lock held.
+ */
+
+struct vnode;
+struct fs;
+struct addrspace;
+
+void pagecache_bootstrap(void);
+int pagecache_map(struct vnode *v, off_t off, unsigned lo, unsigned hi,
+		  struct addrspace *as, vaddr_t vaddr,
+		  paddr_t *ret, bool *shared);
+int pagecache_dup(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void pagecache_unmap(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+vaddr_t pagecache_reclaim(void);
+int pagecache_evict(paddr_t paddr, bool secondchance);
+void pagecache_waitflush(void);
+void pagecache_purge(struct vnode *v);
+void pagecache_purge_fs(struct fs *fs);
+int pagecache_readpage(struct vnode *v, off_t off, unsigned lo, unsigned hi,
+		       vaddr_t kvaddr);
+void pagecache_write(struct vnode *v, off_t off, const void *data,
+		     size_t len);
+void pagecache_truncate(struct vnode *v, off_t len);
+void pagecache_markdirty(paddr_t paddr);
+bool pagecache_hold_dirty(paddr_t paddr, bool *sole);
+int pagecache_writeback(paddr_t paddr);
+
+#endif /* _PAGECACHE_H_ */
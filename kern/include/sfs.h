@@ -48,27 +48,66 @@
  */
 #include <kern/sfs.h>
 
+struct sfs_jnl;		/* Opaque; see sfs_jnl.c */
+
 /*
  * In-memory inode
+ *
+ * sv_lock protects sv_i, sv_dirty, the sequential access state (see
+ * sfs_readahead and sfs_writebehind), and the contents of the file. The
+ * inode number and type never change, so can be read without it. The
+ * preallocation window (see sfs_balloc_data) belongs to the freemap
+ * and is protected by sfs_freemaplock.
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
+	struct lock *sv_lock;           /* lock for the inode and data */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	off_t sv_ranext;                /* where a sequential read starts */
+	uint32_t sv_rablock;            /* file block read ahead up to */
+	unsigned sv_rawindow;           /* blocks to read ahead, or 0 */
+	off_t sv_wbnext;                /* where a sequential write starts */
+	uint32_t sv_wbblock;            /* first full block not pushed */
+	daddr_t sv_pastart;             /* preallocation window start */
+	unsigned sv_pacount;            /* blocks left in window */
+	struct sfs_vnode *sv_hashnext;  /* vnode table chain (sfs_vnlock) */
+};
+
+/*
+ * In-memory summary of one block of the freemap, that is, of
+ * SFS_BITSPERBLOCK disk blocks. Protected by sfs_freemaplock.
+ */
+struct sfs_freegroup {
+	unsigned fg_nfree;              /* free blocks */
+	unsigned fg_maxrun;             /* longest run of free blocks */
+	bool fg_maxrunstale;            /* fg_maxrun needs recounting */
+	bool fg_dirty;                  /* freemap block needs writing */
 };
 
 /*
  * In-memory info for a whole fs volume
+ *
+ * Lock order: a directory's sv_lock, then the sv_lock of a file in
+ * it, then sfs_vnlock, then sfs_freemaplock.
  */
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* lock for the vnode table */
+	struct sfs_vnode **sfs_vnhash;  /* loaded vnodes, hashed by inode */
+	unsigned sfs_vnhashsize;        /* number of chains (power of 2) */
+	unsigned sfs_nvnodes;           /* number of vnodes loaded */
+	struct lock *sfs_freemaplock;   /* lock for the freemap and super */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
-	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct sfs_freegroup *sfs_freegroups; /* one per freemap block */
+	unsigned sfs_freemapndirty;     /* freemap blocks to write */
+	unsigned sfs_nfree;             /* free blocks */
+	unsigned sfs_pablocks;          /* blocks in preallocation windows */
+	struct sfs_jnl *sfs_jnl;        /* metadata journal, or NULL */
 };
 
 /*
@@ -76,5 +115,16 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * Make the next commit on a journaled volume the last write to it
+ * (for the journal replay test)
+ */
+int sfs_crash(struct fs *fs);
+
+/*
+ * Print vnode table statistics (for the menu)
+ */
+void sfs_printstats(void);
+
 
 #endif /* _SFS_H_ */
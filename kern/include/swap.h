@@ -0,0 +1,32 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space: page-sized slots on a raw disk device (SWAP_DEVICE).
+ *
+ * Slots are handed out from a bitmap. Each slot also has a reference
+ * count, so that fork can share a swapped-out page between parent
+ * and child the same way it shares frames; whoever swaps it back in
+ * gets a private copy and drops one reference.
+ *
+ * If the device can't be opened at boot, swapping is disabled and
+ * swap_alloc always fails.
+ *
+ *    swap_bootstrap - open the device; called from vm_bootstrap.
+ *    swap_alloc     - get a free slot with one reference.
+ *    swap_dup       - add a reference to a slot.
+ *    swap_free      - drop a reference; the slot is free at zero.
+ *    swap_write     - write the frame PADDR to SLOT.
+ *    swap_read      - read SLOT into the frame PADDR.
+ */
+
+#define SWAP_DEVICE "lhd0raw:"
+
+void swap_bootstrap(void);
+int swap_alloc(unsigned *slot);
+void swap_dup(unsigned slot);
+void swap_free(unsigned slot);
+int swap_write(unsigned slot, paddr_t paddr);
+int swap_read(unsigned slot, paddr_t paddr);
+
+#endif /* _SWAP_H_ */
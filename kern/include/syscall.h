@@ -78,6 +78,10 @@ int sys_dup2(int oldfd, int newfd, int *retval);
 int sys_close(int fd);
 int sys_read(int fd, userptr_t buf, size_t size, int *retval);
 int sys_write(int fd, userptr_t buf, size_t size, int *retval);
+int sys_pread(int fd, userptr_t buf, size_t size, off_t offset, int *retval);
+int sys_pwrite(int fd, userptr_t buf, size_t size, off_t offset, int *retval);
+int sys_readv(int fd, const_userptr_t iov, int iovcnt, int *retval);
+int sys_writev(int fd, const_userptr_t iov, int iovcnt, int *retval);
 int sys_lseek(int fd, off_t offset, int code, off_t *retval);
 
 int sys_chdir(const_userptr_t path);
@@ -94,4 +98,8 @@ int sys_fstat(int fd, userptr_t statptr);
 int sys_fsync(int fd);
 int sys_ftruncate(int fd, off_t len);
 
+int sys_mmap(size_t length, int prot, int fd, off_t offset, int *retval);
+int sys_munmap(userptr_t addr);
+int sys_msync(userptr_t addr);
+
 #endif /* _SYSCALL_H_ */
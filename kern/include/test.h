@@ -89,6 +89,7 @@ int writestress(int, char **);
 int writestress2(int, char **);
 int longstress(int, char **);
 int createstress(int, char **);
+int journaltest(int, char **);
 int printfile(int, char **);
 
 /* other tests */
@@ -106,6 +106,16 @@ struct thread {
 	 * Public fields
 	 */
 
+	/*
+	 * t_fsio is set while a read or write call is inside the
+	 * filesystem copying to or from a user buffer. A fault on a
+	 * file-backed page then fails (setting t_fsiofault) instead of
+	 * reading the file, which might need locks the filesystem is
+	 * holding; see sys_readwritev.
+	 */
+	bool t_fsio;			/* In VOP_READ/VOP_WRITE on user memory */
+	bool t_fsiofault;		/* A file page fault failed in there */
+
 	/* add more here as needed */
 };
 
@@ -51,10 +51,74 @@ void vm_bootstrap(void);
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
+/*
+ * Fault in the pages of the user buffer [vaddr, vaddr + len) that come
+ * from files (for writing, if WRITE), so that a read or write call
+ * doesn't fault them in from inside a filesystem that is holding its
+ * own locks; such a fault fails there (see t_fsio in thread.h). Returns
+ * an error if a page can't be faulted in; addresses outside any region
+ * are left for the copy itself to find.
+ */
+int vm_prefault(vaddr_t vaddr, size_t len, bool write);
+
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * Frame reference counts (kept in the frame table alongside the
+ * allocator state). A page from alloc_kpages(1) starts with one
+ * reference.
+ *
+ *    increment_ref_count - add a reference to an allocated frame. Use
+ *                          when sharing, not allocating new memory.
+ *    increment_ref_counts - the same for N frames at once, taking the
+ *                          frame table locks only once.
+ *    decrement_ref_count - drop a reference; frees the frame at zero.
+ *    get_ref_count       - current number of references.
+ */
+void increment_ref_count(paddr_t paddr);
+void increment_ref_counts(const paddr_t *paddrs, unsigned n);
+void decrement_ref_count(paddr_t paddr);
+unsigned get_ref_count(paddr_t paddr);
+
+/*
+ * Page replacement support, also in the frame table. A user frame
+ * that exactly one page table maps can be given an owner; owned frames
+ * and page cache frames are the eviction candidates. Adding a
+ * reference drops the owner.
+ *
+ *    frame_nfree           - (approximate) number of free frames.
+ *    frame_set_owner       - record (or, with NULL, forget) the mapping
+ *                            of a private frame.
+ *    frame_set_cached      - mark (or unmark) a page cache frame.
+ *    frame_mark_referenced - note a use of the frame for the clock.
+ *    frame_choose_victim   - run the clock; returns an owned frame and
+ *                            its mapping, a page cache frame with *as
+ *                            NULL, or 0 if there is none.
+ */
+struct addrspace;
+
+unsigned frame_nfree(void);
+void frame_set_owner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void frame_set_cached(paddr_t paddr, bool cached);
+void frame_mark_referenced(paddr_t paddr);
+paddr_t frame_choose_victim(struct addrspace **as, vaddr_t *vaddr);
+
+/*
+ * Allocate one (unzeroed) page for user memory, evicting a page to
+ * swap first if memory is short. Returns 0 if nothing could be freed.
+ * Implemented in vm.c; must not be called with vm_lock held.
+ */
+vaddr_t alloc_upage(void);
+
+/*
+ * Print the VM system's per-CPU event counters (TLB misses seen by
+ * vm_fault, page-ins, copy-on-write faults, TLB invalidations, ...).
+ * The counters are updated without locking and are approximate.
+ */
+void vm_printstats(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
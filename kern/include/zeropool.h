@@ -0,0 +1,33 @@
+#ifndef _ZEROPOOL_H_
+#define _ZEROPOOL_H_
+
+/*
+ * Pool of pre-zeroed pages for zero-fill faults.
+ *
+ * A kernel thread refills the pool to its target size, one page at a
+ * time and only while its CPU has nothing else to run, so the cost of
+ * clearing pages comes out of idle time rather than the fault path.
+ * It is woken when the pool drops below half the target, and stops
+ * when free memory gets low: the pool is never worth evicting user
+ * pages for.
+ *
+ *    zeropool_bootstrap  - start the zeroing thread; from vm_bootstrap.
+ *    zeropool_get        - take a zeroed page (a kernel address), or 0
+ *                          if the pool is empty.
+ *    zeropool_reclaim    - take any pooled page back for general use,
+ *                          when memory is short; 0 if none.
+ *    zeropool_settarget  - set the pool size (0 turns the pool off;
+ *                          pages already in it are still used).
+ *    zeropool_printstats - print the target and counters.
+ */
+
+#define ZEROPOOL_MAXPAGES   256	/* largest allowed target */
+#define ZEROPOOL_DEFTARGET  32	/* default target */
+
+void zeropool_bootstrap(void);
+vaddr_t zeropool_get(void);
+vaddr_t zeropool_reclaim(void);
+int zeropool_settarget(unsigned target);
+void zeropool_printstats(void);
+
+#endif /* _ZEROPOOL_H_ */
@@ -120,6 +120,121 @@ bitmap_alloc(struct bitmap *b, unsigned *index)
         return ENOSPC;
 }
 
+/*
+ * Like bitmap_alloc, but take the first cleared bit at or after GOAL,
+ * wrapping around to the beginning if there isn't one.
+ */
+int
+bitmap_alloc_near(struct bitmap *b, unsigned goal, unsigned *index)
+{
+        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        unsigned ix, i;
+        unsigned offset;
+
+        if (goal >= b->nbits) {
+                goal = 0;
+        }
+
+        /*
+         * Start with the goal's own word, from the goal on; then go
+         * a word at a time, ending back at the start of that word.
+         */
+        offset = goal % BITS_PER_WORD;
+        for (i=0; i<=maxix; i++) {
+                ix = (goal/BITS_PER_WORD + i) % maxix;
+                if (b->v[ix]!=WORD_ALLBITS) {
+                        for (; offset < BITS_PER_WORD; offset++) {
+                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
+
+                                if ((b->v[ix] & mask)==0) {
+                                        b->v[ix] |= mask;
+                                        *index = (ix*BITS_PER_WORD)+offset;
+                                        KASSERT(*index < b->nbits);
+                                        return 0;
+                                }
+                        }
+                }
+                offset = 0;
+        }
+        return ENOSPC;
+}
+
+/*
+ * Find the first run of LEN cleared bits lying within [START, END).
+ */
+int
+bitmap_findrun(struct bitmap *b, unsigned start, unsigned end,
+               unsigned len, unsigned *index)
+{
+        unsigned bit, run;
+
+        KASSERT(len > 0);
+        if (end > b->nbits) {
+                end = b->nbits;
+        }
+
+        run = 0;
+        bit = start;
+        while (bit < end) {
+                WORD_TYPE w = b->v[bit / BITS_PER_WORD];
+
+                /* Whole words at a time where possible */
+                if (bit % BITS_PER_WORD == 0 && w == WORD_ALLBITS) {
+                        run = 0;
+                        bit += BITS_PER_WORD;
+                        continue;
+                }
+                if (w & ((WORD_TYPE)1 << (bit % BITS_PER_WORD))) {
+                        run = 0;
+                }
+                else if (++run == len) {
+                        *index = bit + 1 - len;
+                        return 0;
+                }
+                bit++;
+        }
+        return ENOSPC;
+}
+
+/*
+ * Count the cleared bits in [START, END), and find the longest run of
+ * them.
+ */
+void
+bitmap_runstats(struct bitmap *b, unsigned start, unsigned end,
+                unsigned *nclear, unsigned *maxrun)
+{
+        unsigned bit, run;
+
+        if (end > b->nbits) {
+                end = b->nbits;
+        }
+
+        *nclear = 0;
+        *maxrun = 0;
+        run = 0;
+        bit = start;
+        while (bit < end) {
+                WORD_TYPE w = b->v[bit / BITS_PER_WORD];
+
+                if (bit % BITS_PER_WORD == 0 && w == WORD_ALLBITS) {
+                        run = 0;
+                        bit += BITS_PER_WORD;
+                        continue;
+                }
+                if (w & ((WORD_TYPE)1 << (bit % BITS_PER_WORD))) {
+                        run = 0;
+                }
+                else {
+                        (*nclear)++;
+                        if (++run > *maxrun) {
+                                *maxrun = run;
+                        }
+                }
+                bit++;
+        }
+}
+
 static
 inline
 void
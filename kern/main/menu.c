@@ -41,12 +41,18 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <blkq.h>
+#include <buf.h>
+#include <dcache.h>
+#include <vm.h>
+#include <zeropool.h>
 #include <sfs.h>
 #include <pid.h>
 #include <syscall.h>
 #include <test.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -483,6 +489,116 @@ cmd_kheapgeneration(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	buffer_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_blkqstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	blkq_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for choosing a disk's request ordering.
+ */
+static
+int
+cmd_blkqsched(int nargs, char **args)
+{
+	int result;
+
+	if (nargs != 3) {
+		kprintf("Usage: blksched device fifo|cscan|deadline\n");
+		return EINVAL;
+	}
+
+	result = blkq_setpolicy(args[1], args[2]);
+	if (result) {
+		kprintf("blksched: %s\n", strerror(result));
+		return result;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_dcachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	dcache_printstats();
+
+	return 0;
+}
+
+#if OPT_SFS
+static
+int
+cmd_sfsstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sfs_printstats();
+
+	return 0;
+}
+#endif
+
+#if !OPT_DUMBVM
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for showing the zeroed page pool, or setting its size.
+ */
+static
+int
+cmd_zeropool(int nargs, char **args)
+{
+	if (nargs == 2) {
+		if (zeropool_settarget(atoi(args[1]))) {
+			kprintf("zpool: at most %u pages\n", ZEROPOOL_MAXPAGES);
+			return EINVAL;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: zpool [target]\n");
+		return EINVAL;
+	}
+
+	zeropool_printstats();
+
+	return 0;
+}
+#endif
+
 static
 int
 cmd_kheapdump(int nargs, char **args)
@@ -584,6 +700,7 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+	"[fs7] Journal replay test           ",
 	NULL
 };
 
@@ -657,6 +774,17 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "bufstat",    cmd_bufstats },
+	{ "blkstat",    cmd_blkqstats },
+	{ "blksched",   cmd_blkqsched },
+	{ "dcstat",     cmd_dcachestats },
+#if OPT_SFS
+	{ "sfsstat",    cmd_sfsstats },
+#endif
+#if !OPT_DUMBVM
+	{ "vmstat",     cmd_vmstats },
+	{ "zpool",      cmd_zeropool },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -715,6 +843,7 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
+	{ "fs7",	journaltest },
 
 	{ NULL, NULL }
 };
@@ -38,17 +38,26 @@
 #include <kern/seek.h>
 #include <kern/stat.h>
 #include <lib.h>
+#include <limits.h>
 #include <uio.h>
 #include <proc.h>
 #include <current.h>
+#include <thread.h>
 #include <synch.h>
 #include <copyinout.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <vm.h>
 #include <openfile.h>
 #include <filetable.h>
 #include <syscall.h>
 
+/*
+ * How many times in a row a read or write may lose a prefaulted page
+ * without getting any further before giving up.
+ */
+#define PREFAULT_RETRIES 4
+
 /*
  * open() - get the path with copyinstr, then use openfile_open and
  * filetable_place to do the real work.
@@ -105,20 +114,26 @@ sys_open(const_userptr_t upath, int flags, mode_t mode, int *retval)
 }
 
 /*
- * Common logic for read and write.
+ * Common logic for all the reads and writes.
  *
- * Look up the fd, then use VOP_READ or VOP_WRITE.
+ * Look up the fd, then use VOP_READ or VOP_WRITE on the IOVCNT user
+ * buffers in IOV, which hold SIZE bytes in all. If OFFSETP is NULL the
+ * file's seek position is used and updated; otherwise the transfer
+ * starts at *OFFSETP and neither the seek position nor its lock is
+ * touched, so pread and pwrite on a shared file don't wait on it.
  */
 static
 int
-sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
-	      int badaccmode, ssize_t *retval)
+sys_readwritev(int fd, struct iovec *iov, unsigned iovcnt, size_t size,
+	       const off_t *offsetp, enum uio_rw rw, int badaccmode,
+	       ssize_t *retval)
 {
 	struct openfile *file;
 	bool locked;
 	off_t pos;
-	struct iovec iov;
 	struct uio useruio;
+	size_t resid;
+	unsigned i, retries;
 	int result;
 
 	/* better be a valid file descriptor */
@@ -127,9 +142,22 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 		return result;
 	}
 
+	if (file->of_accmode == badaccmode) {
+		filetable_put(curproc->p_filetable, fd, file);
+		return EBADF;
+	}
+
 	/* Only lock the seek position if we're really using it. */
-	locked = VOP_ISSEEKABLE(file->of_vnode);
-	if (locked) {
+	locked = false;
+	if (offsetp != NULL) {
+		if (!VOP_ISSEEKABLE(file->of_vnode)) {
+			filetable_put(curproc->p_filetable, fd, file);
+			return ESPIPE;
+		}
+		pos = *offsetp;
+	}
+	else if (VOP_ISSEEKABLE(file->of_vnode)) {
+		locked = true;
 		lock_acquire(file->of_offsetlock);
 		pos = file->of_offset;
 	}
@@ -137,18 +165,53 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 		pos = 0;
 	}
 
-	if (file->of_accmode == badaccmode) {
-		result = EBADF;
-		goto fail;
-	}
+	/* set up a uio with the buffers, their size, and the offset */
+	useruio.uio_iov = iov;
+	useruio.uio_iovcnt = iovcnt;
+	useruio.uio_offset = pos;
+	useruio.uio_resid = size;
+	useruio.uio_segflg = UIO_USERSPACE;
+	useruio.uio_rw = rw;
+	useruio.uio_space = proc_getas();
 
-	/* set up a uio with the buffer, its size, and the current offset */
-	uio_uinit(&iov, &useruio, buf, size, pos, rw);
+	/*
+	 * Do the read or write. Pages of the buffers that map files
+	 * are faulted in first, as a fault inside the fs can't read a
+	 * file (see t_fsio). If one was evicted again before the copy
+	 * got to it, the copy fails with t_fsiofault set; fault the
+	 * rest in again and carry on where it stopped, as long as that
+	 * keeps making progress.
+	 */
+	retries = 0;
+	while (1) {
+		for (i=0; i<useruio.uio_iovcnt; i++) {
+			result = vm_prefault(
+				(vaddr_t)useruio.uio_iov[i].iov_ubase,
+				useruio.uio_iov[i].iov_len, rw == UIO_READ);
+			if (result) {
+				goto fail;
+			}
+		}
 
-	/* do the read or write */
-	result = (rw == UIO_READ) ?
-		VOP_READ(file->of_vnode, &useruio) :
-		VOP_WRITE(file->of_vnode, &useruio);
+		resid = useruio.uio_resid;
+		curthread->t_fsio = true;
+		curthread->t_fsiofault = false;
+		result = (rw == UIO_READ) ?
+			VOP_READ(file->of_vnode, &useruio) :
+			VOP_WRITE(file->of_vnode, &useruio);
+		curthread->t_fsio = false;
+		if (result != EFAULT || !curthread->t_fsiofault) {
+			break;
+		}
+		if (useruio.uio_resid < resid) {
+			retries = 0;
+		}
+		else if (++retries == PREFAULT_RETRIES) {
+			/* memory is too tight to keep the buffer in */
+			result = ENOMEM;
+			break;
+		}
+	}
 	if (result) {
 		goto fail;
 	}
@@ -177,13 +240,76 @@ fail:
 	return result;
 }
 
+/*
+ * Common logic for the single-buffer calls.
+ */
+static
+int
+sys_readwrite(int fd, userptr_t buf, size_t size, const off_t *offsetp,
+	      enum uio_rw rw, int badaccmode, ssize_t *retval)
+{
+	struct iovec iov;
+
+	iov.iov_ubase = buf;
+	iov.iov_len = size;
+	return sys_readwritev(fd, &iov, 1, size, offsetp, rw, badaccmode,
+			      retval);
+}
+
+/*
+ * Common logic for readv and writev: copy in the iovec array, then
+ * do the whole transfer with one uio.
+ */
+static
+int
+sys_readwrite_iovec(int fd, const_userptr_t uiov, int iovcnt,
+		    enum uio_rw rw, int badaccmode, ssize_t *retval)
+{
+	/* the total has to fit in the (signed) return value */
+	const size_t maxsize = (size_t)-1 >> 1;
+
+	struct iovec *iov;
+	size_t size;
+	int i, result;
+
+	if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+		return EINVAL;
+	}
+
+	iov = kmalloc(iovcnt * sizeof(*iov));
+	if (iov == NULL) {
+		return ENOMEM;
+	}
+
+	/* userland's iov_base is the same pointer as our iov_ubase */
+	result = copyin(uiov, iov, iovcnt * sizeof(*iov));
+	if (result) {
+		kfree(iov);
+		return result;
+	}
+
+	size = 0;
+	for (i=0; i<iovcnt; i++) {
+		if (iov[i].iov_len > maxsize - size) {
+			kfree(iov);
+			return EINVAL;
+		}
+		size += iov[i].iov_len;
+	}
+
+	result = sys_readwritev(fd, iov, iovcnt, size, NULL, rw, badaccmode,
+				retval);
+	kfree(iov);
+	return result;
+}
+
 /*
  * read() - use sys_readwrite
  */
 int
 sys_read(int fd, userptr_t buf, size_t size, int *retval)
 {
-	return sys_readwrite(fd, buf, size, UIO_READ, O_WRONLY, retval);
+	return sys_readwrite(fd, buf, size, NULL, UIO_READ, O_WRONLY, retval);
 }
 
 /*
@@ -192,7 +318,53 @@ sys_read(int fd, userptr_t buf, size_t size, int *retval)
 int
 sys_write(int fd, userptr_t buf, size_t size, int *retval)
 {
-	return sys_readwrite(fd, buf, size, UIO_WRITE, O_RDONLY, retval);
+	return sys_readwrite(fd, buf, size, NULL, UIO_WRITE, O_RDONLY, retval);
+}
+
+/*
+ * pread() - use sys_readwrite at a given offset
+ */
+int
+sys_pread(int fd, userptr_t buf, size_t size, off_t offset, int *retval)
+{
+	if (offset < 0) {
+		return EINVAL;
+	}
+	return sys_readwrite(fd, buf, size, &offset, UIO_READ, O_WRONLY,
+			     retval);
+}
+
+/*
+ * pwrite() - use sys_readwrite at a given offset
+ */
+int
+sys_pwrite(int fd, userptr_t buf, size_t size, off_t offset, int *retval)
+{
+	if (offset < 0) {
+		return EINVAL;
+	}
+	return sys_readwrite(fd, buf, size, &offset, UIO_WRITE, O_RDONLY,
+			     retval);
+}
+
+/*
+ * readv() - use sys_readwrite_iovec
+ */
+int
+sys_readv(int fd, const_userptr_t iov, int iovcnt, int *retval)
+{
+	return sys_readwrite_iovec(fd, iov, iovcnt, UIO_READ, O_WRONLY,
+				   retval);
+}
+
+/*
+ * writev() - use sys_readwrite_iovec
+ */
+int
+sys_writev(int fd, const_userptr_t iov, int iovcnt, int *retval)
+{
+	return sys_readwrite_iovec(fd, iov, iovcnt, UIO_WRITE, O_RDONLY,
+				   retval);
 }
 
 /*
@@ -42,8 +42,12 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * With the full VM system, executables are normally not loaded at all:
+ * each segment is mapped with as_define_file_region and its pages are
+ * read in by vm_fault on first touch. Read-only segments (text) are
+ * then shared between processes through the page cache. The eager
+ * path above is kept for executables whose segments share a page,
+ * which a file-backed region cannot describe.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -59,6 +63,14 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include <kern/stat.h>
+#include "opt-dumbvm.h"
+
+/*
+ * Most loadable segments we will map lazily. Executables with more
+ * than this are loaded eagerly.
+ */
+#define ELF_MAXLAZY 8
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -145,6 +157,116 @@ load_segment(struct addrspace *as, struct vnode *v,
 	return result;
 }
 
+#if !OPT_DUMBVM
+/*
+ * Try to map the PT_LOAD segments of V without reading them. Returns
+ * 0 on success, EAGAIN if the executable can't be mapped this way and
+ * has to be loaded eagerly (nothing has been done to AS in that case),
+ * or another error.
+ */
+static
+int
+map_segments(struct addrspace *as, struct vnode *v, const Elf_Ehdr *eh)
+{
+	Elf_Phdr phs[ELF_MAXLAZY];
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	unsigned nload = 0, i, j;
+	int result, n;
+
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+
+	for (n=0; n<eh->e_phnum; n++) {
+		Elf_Phdr *ph;
+		off_t offset = eh->e_phoff + n*eh->e_phentsize;
+
+		if (nload == ELF_MAXLAZY) {
+			return EAGAIN;
+		}
+		ph = &phs[nload];
+
+		uio_kinit(&iov, &ku, ph, sizeof(*ph), offset, UIO_READ);
+		result = VOP_READ(v, &ku);
+		if (result) {
+			return result;
+		}
+		if (ku.uio_resid != 0) {
+			kprintf("ELF: short read on phdr - file truncated?\n");
+			return ENOEXEC;
+		}
+
+		switch (ph->p_type) {
+		    case PT_NULL: /* skip */ continue;
+		    case PT_PHDR: /* skip */ continue;
+		    case PT_MIPS_REGINFO: /* skip */ continue;
+		    case PT_LOAD: break;
+		    default:
+			kprintf("loadelf: unknown segment type %d\n",
+				ph->p_type);
+			return ENOEXEC;
+		}
+
+		if (ph->p_filesz > ph->p_memsz) {
+			kprintf("ELF: warning: segment filesize > segment memsize\n");
+			ph->p_filesz = ph->p_memsz;
+		}
+
+		/*
+		 * Nothing is copied in through uiomove any more, so the
+		 * checks it used to make for us have to be done here.
+		 */
+		if (ph->p_vaddr >= USERSPACETOP ||
+		    ph->p_memsz > USERSPACETOP - ph->p_vaddr) {
+			return ENOEXEC;
+		}
+		if (ph->p_offset > st.st_size ||
+		    ph->p_filesz > st.st_size - ph->p_offset) {
+			kprintf("ELF: segment past end of file - file truncated?\n");
+			return ENOEXEC;
+		}
+		nload++;
+	}
+
+	/* Two segments on the same page can't both own it. */
+	for (i=0; i<nload; i++) {
+		vaddr_t istart = phs[i].p_vaddr & PAGE_FRAME;
+		vaddr_t iend = phs[i].p_vaddr + phs[i].p_memsz;
+
+		for (j=i+1; j<nload; j++) {
+			vaddr_t jstart = phs[j].p_vaddr & PAGE_FRAME;
+			vaddr_t jend = phs[j].p_vaddr + phs[j].p_memsz;
+
+			if (istart < jend && jstart < iend) {
+				return EAGAIN;
+			}
+		}
+	}
+
+	for (i=0; i<nload; i++) {
+		DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+		      (unsigned long) phs[i].p_filesz,
+		      (unsigned long) phs[i].p_vaddr);
+
+		result = as_define_file_region(as,
+					       phs[i].p_vaddr, phs[i].p_memsz,
+					       v, phs[i].p_offset,
+					       phs[i].p_filesz,
+					       phs[i].p_flags & PF_R,
+					       phs[i].p_flags & PF_W,
+					       phs[i].p_flags & PF_X);
+		if (result) {
+			return result;
+		}
+	}
+
+	return 0;
+}
+#endif
+
 /*
  * Load an ELF executable user program into the current address space.
  *
@@ -202,6 +324,17 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return ENOEXEC;
 	}
 
+#if !OPT_DUMBVM
+	result = map_segments(as, v, &eh);
+	if (result == 0) {
+		*entrypoint = eh.e_entry;
+		return 0;
+	}
+	if (result != EAGAIN) {
+		return result;
+	}
+#endif
+
 	/*
 	 * Go through the list of segments and set up the address space.
 	 *
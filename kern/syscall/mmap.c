@@ -0,0 +1,156 @@
+/*
+ * File mapping system calls: mmap, munmap, msync.
+ *
+ * A mapping is a file-backed region of the address space (see
+ * <addrspace.h>); vm_fault reads its pages through the page cache.
+ * Private mappings share the cached pages until written, then copy
+ * them. Shared mappings write to the cached pages themselves, which go
+ * back to the file through VOP_WRITE at msync, munmap, or exit. Both
+ * keep the vnode referenced, so closing the file doesn't matter.
+ *
+ * Only the part of the file that existed when it was mapped is mapped;
+ * the rest of the last page, and any pages after it, are zero, and
+ * writes to them are not kept.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <stat.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <elf.h>
+#include <vnode.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <syscall.h>
+
+/*
+ * Find the mapping that starts at ADDR.
+ */
+static
+int
+mmap_find(struct addrspace *as, userptr_t addr, struct region **ret)
+{
+	struct region *r;
+
+	r = as_find_region(as, (vaddr_t)addr);
+	if (r == NULL || !r->r_mmap || r->r_vbase != (vaddr_t)addr) {
+		return EINVAL;
+	}
+	*ret = r;
+	return 0;
+}
+
+/*
+ * mmap() - check the file and access, then let the address space pick
+ * a place for it.
+ */
+int
+sys_mmap(size_t length, int prot, int fd, off_t offset, int *retval)
+{
+	const int allprot = PROT_READ | PROT_WRITE | MAP_PRIVATE;
+
+	struct openfile *file;
+	struct stat info;
+	size_t filesize;
+	bool shared;
+	int perms;
+	vaddr_t addr;
+	int result;
+
+	if ((prot & allprot) != prot || length == 0 ||
+	    offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	shared = (prot & MAP_PRIVATE) == 0;
+	perms = ((prot & PROT_READ) ? PF_R : 0) |
+		((prot & PROT_WRITE) ? PF_W : 0);
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+
+	/* Pages are always read in; only shared writes need O_RDWR */
+	if (file->of_accmode == O_WRONLY ||
+	    (shared && (prot & PROT_WRITE) && file->of_accmode != O_RDWR)) {
+		result = EACCES;
+		goto out;
+	}
+
+	result = VOP_MMAP(file->of_vnode);
+	if (result) {
+		goto out;
+	}
+
+	result = VOP_STAT(file->of_vnode, &info);
+	if (result) {
+		goto out;
+	}
+	filesize = 0;
+	if (info.st_size > offset) {
+		filesize = info.st_size - offset < (off_t)length ?
+			info.st_size - offset : length;
+	}
+
+	result = as_define_mmap(proc_getas(), length, file->of_vnode, offset,
+				filesize, perms, shared, &addr);
+	if (result) {
+		goto out;
+	}
+	*retval = (int)addr;
+
+out:
+	filetable_put(curproc->p_filetable, fd, file);
+	return result;
+}
+
+/*
+ * munmap() - write back anything shared, then drop the whole mapping.
+ * As on exit, write errors are lost; msync first to see them.
+ */
+int
+sys_munmap(userptr_t addr)
+{
+	struct addrspace *as = proc_getas();
+	struct region *r;
+	vaddr_t base;
+	size_t size;
+	int result;
+
+	result = mmap_find(as, addr, &r);
+	if (result) {
+		return result;
+	}
+	if (r->r_shared) {
+		(void)as_sync_region(as, r);
+	}
+
+	base = r->r_vbase;
+	size = r->r_npages * PAGE_SIZE;
+	return as_remove_region(as, base, size);
+}
+
+/*
+ * msync() - write back a shared mapping's dirty pages.
+ */
+int
+sys_msync(userptr_t addr)
+{
+	struct addrspace *as = proc_getas();
+	struct region *r;
+	int result;
+
+	result = mmap_find(as, addr, &r);
+	if (result) {
+		return result;
+	}
+	if (!r->r_shared) {
+		return 0;
+	}
+	return as_sync_region(as, r);
+}
@@ -44,13 +44,23 @@ int sys_sbrk(int amount, int * retval) {
 		if ((((*retval) - 1) & PAGE_FRAME) != ((heapEnd - 1) & PAGE_FRAME)) {
 			// We start allocation at the next page frame
 			uint32_t newBase = (((*retval) - 1) & PAGE_FRAME) + PAGE_SIZE;
-			as_define_region_noheap(as, newBase, heapEnd - newBase, PF_R, PF_W, PF_X);
+			// Don't grow into a mapping (or the stack)
+			if (!as_range_free(as, newBase, heapEnd - newBase)) {
+				return ENOMEM;
+			}
+			int result = as_define_region_noheap(as, newBase, heapEnd - newBase, PF_R, PF_W, PF_X);
+			if (result) {
+				return result;
+			}
 		}
 	} else if (amount < 0) {
 		// Only delete pages larger than the current end
 		uint32_t base = ((heapEnd - 1) & PAGE_FRAME) + PAGE_SIZE;
 		// Here, memsize may be negative, but as_remove_region can deal with that (it will do nothing)
-		as_remove_region(as, base, (*retval) - base);
+		int result = as_remove_region(as, base, (*retval) - base);
+		if (result) {
+			return result;
+		}
 	}
 
    as->as_heap_end = heapEnd;
@@ -72,6 +72,48 @@ bitmaptest(int nargs, char **args)
 		}
 	}
 
+	/* Check the run functions against counting by hand */
+	for (i=0; i<TESTSIZE; i+=TESTSIZE/7) {
+		unsigned nclear, maxrun, mynclear, mymaxrun, run, len;
+		int j;
+
+		mynclear = mymaxrun = run = 0;
+		for (j=i; j<TESTSIZE; j++) {
+			if (data[j]) {
+				run = 0;
+			}
+			else {
+				mynclear++;
+				if (++run > mymaxrun) {
+					mymaxrun = run;
+				}
+			}
+		}
+		bitmap_runstats(b, i, TESTSIZE, &nclear, &maxrun);
+		KASSERT(nclear == mynclear);
+		KASSERT(maxrun == mymaxrun);
+
+		for (len=1; len<=mymaxrun+1; len++) {
+			run = 0;
+			for (j=i; j<TESTSIZE; j++) {
+				run = data[j] ? 0 : run+1;
+				if (run == len) {
+					break;
+				}
+			}
+			if (j < TESTSIZE) {
+				KASSERT(bitmap_findrun(b, i, TESTSIZE, len,
+						       &x) == 0);
+				KASSERT(x == (uint32_t)j + 1 - len);
+			}
+			else {
+				KASSERT(len > mymaxrun);
+				KASSERT(bitmap_findrun(b, i, TESTSIZE, len,
+						       &x) != 0);
+			}
+		}
+	}
+
 	for (i=0; i<TESTSIZE; i++) {
 		if (data[i]) {
 			bitmap_unmark(b, i);
@@ -48,6 +48,7 @@
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
+#include <sfs.h>
 #include <test.h>
 
 #define SLOGAN   "HODIE MIHI - CRAS TIBI\n"
@@ -674,6 +675,89 @@ docreatestress(const char *filesys)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Journal replay test: write a file and sync, then rename it and let
+ * the commit with the rename be the last thing written to the volume
+ * (see sfs_crash), so it's never checkpointed. After remounting, the
+ * file must be there under its new name, which only replay can do.
+ * The volume must be a journaled SFS volume nothing else is using.
+ */
+static
+void
+dojournaltest(const char *filesys)
+{
+	struct vnode *root;
+	char name[32], newname[32];
+	int err;
+
+	kprintf("*** Starting journal replay test on %s:\n", filesys);
+
+	if (fstest_write(filesys, "", 1, 0)) {
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	err = vfs_sync();
+	if (err) {
+		kprintf("sync: %s\n", strerror(err));
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	err = vfs_getroot(filesys, &root);
+	if (err == 0) {
+		err = sfs_crash(root->vn_fs);
+		VOP_DECREF(root);
+	}
+	if (err) {
+		kprintf("%s: not a journaled SFS volume\n", filesys);
+		fstest_remove(filesys, "");
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	/* vfs_rename destroys the strings it's passed */
+	fstest_makename(name, sizeof(name), filesys, "");
+	fstest_makename(newname, sizeof(newname), filesys, ".moved");
+	err = vfs_rename(name, newname);
+	if (err == 0) {
+		err = vfs_sync();
+	}
+	if (err) {
+		kprintf("rename: %s\n", strerror(err));
+		kprintf("*** Test failed; unmount and remount %s\n", filesys);
+		return;
+	}
+
+	/* The "crash"; nothing more reaches the disk */
+	err = vfs_unmount(filesys);
+	if (err) {
+		kprintf("unmount: %s\n", strerror(err));
+		kprintf("*** Test failed; unmount and remount %s\n", filesys);
+		return;
+	}
+	err = sfs_mount(filesys);
+	if (err) {
+		kprintf("mount: %s\n", strerror(err));
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	if (fstest_read(filesys, ".moved")) {
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	if (fstest_remove(filesys, ".moved")) {
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	kprintf("*** Journal replay test done\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 checkfilesystem(int nargs, char **args)
@@ -681,7 +765,7 @@ checkfilesystem(int nargs, char **args)
 	char *device;
 
 	if (nargs != 2) {
-		kprintf("Usage: fs[123456] filesystem:\n");
+		kprintf("Usage: fs[1234567] filesystem:\n");
 		return EINVAL;
 	}
 
@@ -714,6 +798,7 @@ DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(longstress);
 DEFTEST(createstress);
+DEFTEST(journaltest);
 
 ////////////////////////////////////////////////////////////
 
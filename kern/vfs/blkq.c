@@ -0,0 +1,350 @@
+/*
+ * Block request queue.
+ * See <blkq.h> for the interface.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <blkq.h>
+
+/*
+ * A policy chooses the next request from a nonempty queue, returning
+ * the link that points to it so it can be unlinked.
+ */
+struct blkq_policy {
+	const char *bp_name;
+	struct blkreq **(*bp_pick)(struct blkq *bq);
+};
+
+/*
+ * Everything is protected by bq_lock, which the driver's interrupt
+ * handler also takes (through blkq_done).
+ */
+struct blkq {
+	char *bq_name;
+	struct spinlock bq_lock;
+	struct wchan *bq_wchan;		/* waiters for their requests */
+	void (*bq_start)(void *drvdata, struct blkreq *req);
+	void *bq_drvdata;
+	const struct blkq_policy *bq_policy;
+	struct blkreq *bq_head;		/* waiting, in arrival order */
+	struct blkreq *bq_active;	/* with the driver */
+	daddr_t bq_headpos;		/* block after the last request */
+	unsigned bq_depth;		/* waiting or active */
+	struct blkq *bq_next;		/* list of every queue */
+
+	struct {
+		unsigned submitted;
+		unsigned errors;
+		unsigned sequential;	/* began where the last one ended */
+		unsigned expired;	/* taken early by the deadline */
+		unsigned maxdepth;
+		uint64_t depthsum;	/* depth found by each submit */
+		uint64_t latsum;	/* submit to done, in us */
+		uint32_t latmax;
+	} bq_stats;
+};
+
+/* Queues are made at boot and never go away. */
+static struct spinlock blkq_alllock = SPINLOCK_INITIALIZER;
+static struct blkq *blkq_all;
+
+/*
+ * Microseconds from T1 to T2.
+ */
+static
+uint32_t
+blkq_usecs(const struct timespec *t1, const struct timespec *t2)
+{
+	struct timespec diff;
+
+	timespec_sub(t2, t1, &diff);
+	return diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+}
+
+////////////////////////////////////////////////////////////
+// Policies
+
+static
+struct blkreq **
+blkq_pick_fifo(struct blkq *bq)
+{
+	return &bq->bq_head;
+}
+
+static
+struct blkreq **
+blkq_pick_cscan(struct blkq *bq)
+{
+	struct blkreq **rp, **ahead = NULL, **lowest = NULL;
+	daddr_t block;
+
+	for (rp = &bq->bq_head; *rp != NULL; rp = &(*rp)->br_next) {
+		block = (*rp)->br_block;
+		if (block >= bq->bq_headpos &&
+		    (ahead == NULL || block < (*ahead)->br_block)) {
+			ahead = rp;
+		}
+		if (lowest == NULL || block < (*lowest)->br_block) {
+			lowest = rp;
+		}
+	}
+	return ahead != NULL ? ahead : lowest;
+}
+
+static
+struct blkreq **
+blkq_pick_deadline(struct blkq *bq)
+{
+	struct blkreq **rp;
+	struct timespec now;
+	uint32_t expire;
+
+	/* The first expired one in arrival order has waited longest */
+	gettime(&now);
+	for (rp = &bq->bq_head; *rp != NULL; rp = &(*rp)->br_next) {
+		expire = (*rp)->br_rw == UIO_READ ?
+			BLKQ_READ_EXPIRE : BLKQ_WRITE_EXPIRE;
+		if (blkq_usecs(&(*rp)->br_submitted, &now) > expire * 1000) {
+			bq->bq_stats.expired++;
+			return rp;
+		}
+	}
+	return blkq_pick_cscan(bq);
+}
+
+static const struct blkq_policy blkq_policies[] = {
+	{ "fifo",     blkq_pick_fifo },
+	{ "cscan",    blkq_pick_cscan },
+	{ "deadline", blkq_pick_deadline },
+	{ NULL, NULL },
+};
+
+#define BLKQ_DEFAULTPOLICY (&blkq_policies[2])
+
+////////////////////////////////////////////////////////////
+// Dispatch
+
+/*
+ * If the driver is idle, hand it the next request.
+ */
+static
+void
+blkq_startnext(struct blkq *bq)
+{
+	struct blkreq **rp, *req;
+
+	KASSERT(spinlock_do_i_hold(&bq->bq_lock));
+
+	if (bq->bq_active != NULL || bq->bq_head == NULL) {
+		return;
+	}
+
+	rp = bq->bq_policy->bp_pick(bq);
+	req = *rp;
+	*rp = req->br_next;
+	req->br_next = NULL;
+
+	if (req->br_block == bq->bq_headpos) {
+		bq->bq_stats.sequential++;
+	}
+	bq->bq_headpos = req->br_block + req->br_nblocks;
+	bq->bq_active = req;
+	bq->bq_start(bq->bq_drvdata, req);
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+struct blkq *
+blkq_create(const char *name, void (*start)(void *, struct blkreq *),
+	    void *drvdata)
+{
+	struct blkq *bq;
+
+	bq = kmalloc(sizeof(*bq));
+	if (bq == NULL) {
+		return NULL;
+	}
+	bq->bq_name = kstrdup(name);
+	if (bq->bq_name == NULL) {
+		kfree(bq);
+		return NULL;
+	}
+	bq->bq_wchan = wchan_create(bq->bq_name);
+	if (bq->bq_wchan == NULL) {
+		kfree(bq->bq_name);
+		kfree(bq);
+		return NULL;
+	}
+	spinlock_init(&bq->bq_lock);
+	bq->bq_start = start;
+	bq->bq_drvdata = drvdata;
+	bq->bq_policy = BLKQ_DEFAULTPOLICY;
+	bq->bq_head = NULL;
+	bq->bq_active = NULL;
+	bq->bq_headpos = 0;
+	bq->bq_depth = 0;
+	bzero(&bq->bq_stats, sizeof(bq->bq_stats));
+
+	spinlock_acquire(&blkq_alllock);
+	bq->bq_next = blkq_all;
+	blkq_all = bq;
+	spinlock_release(&blkq_alllock);
+
+	return bq;
+}
+
+int
+blkq_io(struct blkq *bq, struct blkreq *req)
+{
+	struct blkreq **rp;
+	int result;
+
+	KASSERT(req->br_nblocks > 0);
+
+	gettime(&req->br_submitted);
+	req->br_finished = false;
+	req->br_result = 0;
+	req->br_next = NULL;
+
+	spinlock_acquire(&bq->bq_lock);
+
+	for (rp = &bq->bq_head; *rp != NULL; rp = &(*rp)->br_next) {
+		/* nothing */
+	}
+	*rp = req;
+
+	bq->bq_depth++;
+	bq->bq_stats.submitted++;
+	bq->bq_stats.depthsum += bq->bq_depth;
+	if (bq->bq_depth > bq->bq_stats.maxdepth) {
+		bq->bq_stats.maxdepth = bq->bq_depth;
+	}
+
+	blkq_startnext(bq);
+
+	while (!req->br_finished) {
+		wchan_sleep(bq->bq_wchan, &bq->bq_lock);
+	}
+	result = req->br_result;
+	spinlock_release(&bq->bq_lock);
+
+	return result;
+}
+
+void
+blkq_done(struct blkq *bq, struct blkreq *req, int result)
+{
+	struct timespec now;
+	uint32_t lat;
+
+	gettime(&now);
+	lat = blkq_usecs(&req->br_submitted, &now);
+
+	spinlock_acquire(&bq->bq_lock);
+	KASSERT(bq->bq_active == req);
+	bq->bq_active = NULL;
+	bq->bq_depth--;
+
+	if (result) {
+		bq->bq_stats.errors++;
+	}
+	bq->bq_stats.latsum += lat;
+	if (lat > bq->bq_stats.latmax) {
+		bq->bq_stats.latmax = lat;
+	}
+
+	/*
+	 * Once it's marked finished and the lock is dropped, its waiter
+	 * may reclaim it, so don't touch it afterwards.
+	 */
+	req->br_result = result;
+	req->br_finished = true;
+	wchan_wakeall(bq->bq_wchan, &bq->bq_lock);
+
+	blkq_startnext(bq);
+	spinlock_release(&bq->bq_lock);
+}
+
+int
+blkq_setpolicy(const char *name, const char *policy)
+{
+	struct blkq *bq;
+	unsigned i;
+
+	for (i=0; blkq_policies[i].bp_name != NULL; i++) {
+		if (!strcmp(blkq_policies[i].bp_name, policy)) {
+			break;
+		}
+	}
+	if (blkq_policies[i].bp_name == NULL) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&blkq_alllock);
+	for (bq = blkq_all; bq != NULL; bq = bq->bq_next) {
+		if (!strcmp(bq->bq_name, name)) {
+			break;
+		}
+	}
+	spinlock_release(&blkq_alllock);
+	if (bq == NULL) {
+		return ENODEV;
+	}
+
+	spinlock_acquire(&bq->bq_lock);
+	bq->bq_policy = &blkq_policies[i];
+	spinlock_release(&bq->bq_lock);
+
+	return 0;
+}
+
+void
+blkq_printstats(void)
+{
+	struct blkq *bq;
+	const char *policy;
+	unsigned depth, submitted, errors, sequential, expired, maxdepth;
+	uint64_t depthsum, latsum;
+	uint32_t latmax, completed;
+
+	spinlock_acquire(&blkq_alllock);
+	bq = blkq_all;
+	spinlock_release(&blkq_alllock);
+
+	for (; bq != NULL; bq = bq->bq_next) {
+		/* Snapshot, since we can't print with the lock held */
+		spinlock_acquire(&bq->bq_lock);
+		policy = bq->bq_policy->bp_name;
+		depth = bq->bq_depth;
+		submitted = bq->bq_stats.submitted;
+		errors = bq->bq_stats.errors;
+		sequential = bq->bq_stats.sequential;
+		expired = bq->bq_stats.expired;
+		maxdepth = bq->bq_stats.maxdepth;
+		depthsum = bq->bq_stats.depthsum;
+		latsum = bq->bq_stats.latsum;
+		latmax = bq->bq_stats.latmax;
+		spinlock_release(&bq->bq_lock);
+
+		completed = submitted - depth;
+		kprintf("%s: %s, %u requests, %u errors, %u queued\n",
+			bq->bq_name, policy, submitted, errors, depth);
+		kprintf("  depth: %u.%u average, %u max\n",
+			submitted ? (unsigned)(depthsum / submitted) : 0,
+			submitted ? (unsigned)(depthsum * 10 / submitted % 10)
+			: 0,
+			maxdepth);
+		kprintf("  %u sequential, %u taken by deadline\n",
+			sequential, expired);
+		kprintf("  latency: %u us average, %u us max\n",
+			completed ? (unsigned)(latsum / completed) : 0,
+			latmax);
+	}
+}
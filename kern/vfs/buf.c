@@ -0,0 +1,868 @@
+/*
+ * Buffer cache.
+ * See <buf.h> for the interface.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <clock.h>
+#include <mainbus.h>
+#include <fs.h>
+#include <vfs.h>
+#include <buf.h>
+
+struct buf {
+	struct fs *b_fs;		/* NULL if not caching anything */
+	daddr_t b_block;
+	void *b_data;
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* ... and it needs writing */
+	bool b_busy;			/* held, or being written out */
+	struct buf *b_hashnext;		/* hash chain */
+	struct buf *b_lruprev;		/* LRU list, when not busy */
+	struct buf *b_lrunext;
+	struct buf *b_allnext;		/* list of every buffer */
+};
+
+/*
+ * Everything is protected by buffer_lock, except the contents of a
+ * busy buffer, which belong to whoever made it busy. buffer_lock is
+ * dropped for I/O; the buffer being read or written stays busy.
+ * buffer_cv is signalled whenever a buffer stops being busy.
+ *
+ * Buffers are never freed. buffer_max is a target: if every buffer
+ * is busy, more are made rather than waiting, so that holding two
+ * buffers at once can't deadlock.
+ */
+#define BUFFER_HASHSIZE 256
+#define BUFFER_MINBUFS  16
+#define BUFFER_MAXBUFS  1024
+
+static struct lock *buffer_lock;
+static struct cv *buffer_cv;
+static struct buf *buffer_hash[BUFFER_HASHSIZE];
+static struct buf *buffer_lruhead;	/* least recently used */
+static struct buf *buffer_lrutail;	/* most recently used */
+static struct buf *buffer_all;
+static unsigned buffer_count;
+static unsigned buffer_max;
+
+/*
+ * Read-ahead and write-behind requests, waiting for the async thread,
+ * which sleeps on buffer_asynccv. buffer_asyncfs is the filesystem
+ * of the one it's doing, so unmount can wait for it. buffer_asyncdata
+ * holds a run of blocks on the way to or from the disk.
+ */
+#define BUFFER_ASYNCMAX 32
+
+struct bufasync {
+	struct fs *ba_fs;
+	daddr_t ba_block;
+	unsigned ba_nblocks;
+	bool ba_write;
+};
+
+static struct bufasync buffer_async[BUFFER_ASYNCMAX];
+static unsigned buffer_asynchead, buffer_asynccount;
+static struct cv *buffer_asynccv;
+static struct fs *buffer_asyncfs;
+static char *buffer_asyncdata;
+
+static struct {
+	unsigned hits;			/* lookups that found the block */
+	unsigned misses;		/* ... that didn't */
+	unsigned reads;			/* blocks read from disk */
+	unsigned writes;		/* blocks written to disk */
+	unsigned readaheads;		/* of those, read ahead */
+	unsigned writebehinds;		/* ... written behind */
+	unsigned asyncdrops;		/* requests dropped, queue full */
+} buffer_stats;
+
+////////////////////////////////////////////////////////////
+// Hash table and LRU list
+
+static
+unsigned
+buffer_hashindex(struct fs *fs, daddr_t block)
+{
+	return (block ^ ((uintptr_t)fs >> 4)) % BUFFER_HASHSIZE;
+}
+
+static
+struct buf *
+buffer_find(struct fs *fs, daddr_t block)
+{
+	struct buf *b;
+
+	b = buffer_hash[buffer_hashindex(fs, block)];
+	while (b != NULL && (b->b_fs != fs || b->b_block != block)) {
+		b = b->b_hashnext;
+	}
+	return b;
+}
+
+static
+void
+buffer_hashin(struct buf *b)
+{
+	unsigned ix = buffer_hashindex(b->b_fs, b->b_block);
+
+	b->b_hashnext = buffer_hash[ix];
+	buffer_hash[ix] = b;
+}
+
+/*
+ * Take a buffer out of the hash table, so it caches nothing.
+ */
+static
+void
+buffer_hashout(struct buf *b)
+{
+	struct buf **bp;
+
+	KASSERT(b->b_fs != NULL);
+
+	bp = &buffer_hash[buffer_hashindex(b->b_fs, b->b_block)];
+	while (*bp != b) {
+		KASSERT(*bp != NULL);
+		bp = &(*bp)->b_hashnext;
+	}
+	*bp = b->b_hashnext;
+
+	b->b_hashnext = NULL;
+	b->b_fs = NULL;
+	b->b_valid = false;
+	b->b_dirty = false;
+}
+
+static
+void
+buffer_lruremove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buffer_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buffer_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+/*
+ * Mark a buffer busy; it comes off the LRU list while it is.
+ */
+static
+void
+buffer_setbusy(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(!b->b_busy);
+
+	b->b_busy = true;
+	buffer_lruremove(b);
+}
+
+/*
+ * Put a busy buffer back on the LRU list: at the most recently used
+ * end normally, or at the other end if it no longer caches anything
+ * so that it gets reused first.
+ */
+static
+void
+buffer_unbusy(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_busy);
+
+	b->b_busy = false;
+	if (b->b_fs == NULL) {
+		b->b_lruprev = NULL;
+		b->b_lrunext = buffer_lruhead;
+		if (buffer_lruhead != NULL) {
+			buffer_lruhead->b_lruprev = b;
+		}
+		else {
+			buffer_lrutail = b;
+		}
+		buffer_lruhead = b;
+	}
+	else {
+		b->b_lrunext = NULL;
+		b->b_lruprev = buffer_lrutail;
+		if (buffer_lrutail != NULL) {
+			buffer_lrutail->b_lrunext = b;
+		}
+		else {
+			buffer_lruhead = b;
+		}
+		buffer_lrutail = b;
+	}
+	cv_broadcast(buffer_cv, buffer_lock);
+}
+
+////////////////////////////////////////////////////////////
+// I/O and replacement
+
+/*
+ * Write out a busy, dirty buffer. Drops buffer_lock for the I/O.
+ */
+static
+int
+buffer_writeout(struct buf *b)
+{
+	struct fs *fs = b->b_fs;
+	int result;
+
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dirty);
+
+	lock_release(buffer_lock);
+	result = FSOP_WRITEBLOCK(fs, b->b_block, b->b_data, BUFFER_SIZE);
+	lock_acquire(buffer_lock);
+
+	if (result == 0) {
+		b->b_dirty = false;
+		buffer_stats.writes++;
+	}
+	return result;
+}
+
+static
+struct buf *
+buffer_create(void)
+{
+	struct buf *b;
+
+	b = kmalloc(sizeof(*b));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->b_data = kmalloc(BUFFER_SIZE);
+	if (b->b_data == NULL) {
+		kfree(b);
+		return NULL;
+	}
+	b->b_fs = NULL;
+	b->b_block = 0;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_busy = true;
+	b->b_hashnext = NULL;
+	b->b_lruprev = b->b_lrunext = NULL;
+
+	b->b_allnext = buffer_all;
+	buffer_all = b;
+	buffer_count++;
+	return b;
+}
+
+/*
+ * Get a busy buffer that caches nothing: a new one if we're under
+ * buffer_max, otherwise the least recently used one, written back if
+ * necessary. May drop buffer_lock.
+ */
+static
+int
+buffer_getfree(struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	while (1) {
+		if (buffer_count < buffer_max || buffer_lruhead == NULL) {
+			b = buffer_create();
+			if (b != NULL) {
+				*ret = b;
+				return 0;
+			}
+			if (buffer_lruhead == NULL) {
+				/* Out of memory and nothing to reuse */
+				cv_wait(buffer_cv, buffer_lock);
+				continue;
+			}
+		}
+
+		b = buffer_lruhead;
+		buffer_setbusy(b);
+		if (b->b_dirty) {
+			result = buffer_writeout(b);
+			if (result) {
+				buffer_unbusy(b);
+				return result;
+			}
+		}
+		if (b->b_fs != NULL) {
+			buffer_hashout(b);
+		}
+		*ret = b;
+		return 0;
+	}
+}
+
+/*
+ * Common code for buffer_read and buffer_get.
+ */
+static
+int
+buffer_obtain(struct fs *fs, daddr_t block, bool doread, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	lock_acquire(buffer_lock);
+
+	while (1) {
+		b = buffer_find(fs, block);
+		if (b != NULL && b->b_busy) {
+			/* It may be gone when we wake up; look again */
+			cv_wait(buffer_cv, buffer_lock);
+			continue;
+		}
+		if (b != NULL) {
+			buffer_setbusy(b);
+			buffer_stats.hits++;
+			break;
+		}
+
+		result = buffer_getfree(&b);
+		if (result) {
+			lock_release(buffer_lock);
+			return result;
+		}
+		if (buffer_find(fs, block) != NULL) {
+			/* Someone else loaded it while we slept */
+			buffer_unbusy(b);
+			continue;
+		}
+		b->b_fs = fs;
+		b->b_block = block;
+		buffer_hashin(b);
+		buffer_stats.misses++;
+		break;
+	}
+
+	if (!doread && !b->b_valid) {
+		/* Don't hand out whatever the buffer held before */
+		bzero(b->b_data, BUFFER_SIZE);
+	}
+	else if (doread && !b->b_valid) {
+		lock_release(buffer_lock);
+		result = FSOP_READBLOCK(fs, block, b->b_data, BUFFER_SIZE);
+		lock_acquire(buffer_lock);
+		if (result) {
+			buffer_hashout(b);
+			buffer_unbusy(b);
+			lock_release(buffer_lock);
+			return result;
+		}
+		b->b_valid = true;
+		buffer_stats.reads++;
+	}
+
+	lock_release(buffer_lock);
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Write out dirty buffers belonging to FS, or to every filesystem if
+ * FS is NULL. Returns the first error, but carries on past it.
+ */
+static
+int
+buffer_flush(struct fs *fs)
+{
+	struct buf *b;
+	int result, ret = 0;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	b = buffer_all;
+	while (b != NULL) {
+		if (b->b_fs == NULL || (fs != NULL && b->b_fs != fs) ||
+		    !b->b_dirty) {
+			b = b->b_allnext;
+			continue;
+		}
+		if (b->b_busy) {
+			/* Look at this one again when it's free */
+			cv_wait(buffer_cv, buffer_lock);
+			continue;
+		}
+		buffer_setbusy(b);
+		result = buffer_writeout(b);
+		buffer_unbusy(b);
+		if (result && ret == 0) {
+			ret = result;
+		}
+		b = b->b_allnext;
+	}
+	return ret;
+}
+
+/*
+ * The syncer. Write errors are left for the next sync to retry (the
+ * filesystem has already complained about them). FSOP_SYNC normally
+ * flushes the filesystem's buffers itself, so the flush after it is
+ * mostly a backstop.
+ */
+static
+void
+buffer_syncer(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		clocksleep(BUFFER_SYNCSECS);
+		vfs_sync();
+		lock_acquire(buffer_lock);
+		(void)buffer_flush(NULL);
+		lock_release(buffer_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Read-ahead and write-behind
+
+/*
+ * Read blocks that aren't cached, BUFFER_ASYNCRUN at a time. Each run
+ * is made up of new buffers, held until the read is done, so anyone
+ * who wants one of them meanwhile waits instead of reading it too.
+ */
+static
+void
+buffer_fillrun(struct fs *fs, daddr_t block, unsigned nblocks)
+{
+	struct buf *bufs[BUFFER_ASYNCRUN];
+	struct buf *b;
+	unsigned i, n;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	while (nblocks > 0) {
+		for (n=0; n<nblocks && n<BUFFER_ASYNCRUN; n++) {
+			if (buffer_find(fs, block+n) != NULL) {
+				break;
+			}
+			result = buffer_getfree(&b);
+			if (result) {
+				/* Can't get a buffer; forget the rest */
+				nblocks = n;
+				break;
+			}
+			if (buffer_find(fs, block+n) != NULL) {
+				/* Someone else loaded it while we slept */
+				buffer_unbusy(b);
+				break;
+			}
+			b->b_fs = fs;
+			b->b_block = block+n;
+			buffer_hashin(b);
+			bufs[n] = b;
+		}
+		if (n == 0) {
+			if (nblocks == 0) {
+				break;
+			}
+			/* Already cached */
+			block++;
+			nblocks--;
+			continue;
+		}
+
+		lock_release(buffer_lock);
+		result = FSOP_READBLOCK(fs, block, buffer_asyncdata,
+					n * BUFFER_SIZE);
+		lock_acquire(buffer_lock);
+
+		for (i=0; i<n; i++) {
+			if (result == 0) {
+				memcpy(bufs[i]->b_data,
+				       buffer_asyncdata + i * BUFFER_SIZE,
+				       BUFFER_SIZE);
+				bufs[i]->b_valid = true;
+			}
+			else {
+				buffer_hashout(bufs[i]);
+			}
+			buffer_unbusy(bufs[i]);
+		}
+		if (result == 0) {
+			buffer_stats.reads += n;
+			buffer_stats.readaheads += n;
+		}
+
+		block += n;
+		nblocks -= n;
+	}
+}
+
+/*
+ * Write out blocks that are cached, dirty, and not held by anyone,
+ * BUFFER_ASYNCRUN at a time. They're held until the write is done so
+ * nobody changes them underneath it; otherwise a change could be
+ * marked clean without having been written.
+ */
+static
+void
+buffer_pushrun(struct fs *fs, daddr_t block, unsigned nblocks)
+{
+	struct buf *bufs[BUFFER_ASYNCRUN];
+	struct buf *b;
+	unsigned i, n;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	while (nblocks > 0) {
+		for (n=0; n<nblocks && n<BUFFER_ASYNCRUN; n++) {
+			b = buffer_find(fs, block+n);
+			if (b == NULL || b->b_busy || !b->b_dirty) {
+				break;
+			}
+			buffer_setbusy(b);
+			bufs[n] = b;
+		}
+		if (n == 0) {
+			block++;
+			nblocks--;
+			continue;
+		}
+
+		lock_release(buffer_lock);
+		for (i=0; i<n; i++) {
+			memcpy(buffer_asyncdata + i * BUFFER_SIZE,
+			       bufs[i]->b_data, BUFFER_SIZE);
+		}
+		result = FSOP_WRITEBLOCK(fs, block, buffer_asyncdata,
+					 n * BUFFER_SIZE);
+		lock_acquire(buffer_lock);
+
+		/* On failure they stay dirty, for the syncer to retry */
+		for (i=0; i<n; i++) {
+			if (result == 0) {
+				bufs[i]->b_dirty = false;
+			}
+			buffer_unbusy(bufs[i]);
+		}
+		if (result == 0) {
+			buffer_stats.writes += n;
+			buffer_stats.writebehinds += n;
+		}
+
+		block += n;
+		nblocks -= n;
+	}
+}
+
+/*
+ * The read-ahead and write-behind thread.
+ */
+static
+void
+buffer_asyncer(void *unused1, unsigned long unused2)
+{
+	struct bufasync ba;
+
+	(void)unused1;
+	(void)unused2;
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		while (buffer_asynccount == 0) {
+			cv_wait(buffer_asynccv, buffer_lock);
+		}
+		ba = buffer_async[buffer_asynchead];
+		buffer_asynchead = (buffer_asynchead + 1) % BUFFER_ASYNCMAX;
+		buffer_asynccount--;
+
+		buffer_asyncfs = ba.ba_fs;
+		if (ba.ba_write) {
+			buffer_pushrun(ba.ba_fs, ba.ba_block, ba.ba_nblocks);
+		}
+		else {
+			buffer_fillrun(ba.ba_fs, ba.ba_block, ba.ba_nblocks);
+		}
+		buffer_asyncfs = NULL;
+		cv_broadcast(buffer_cv, buffer_lock);
+	}
+}
+
+/*
+ * Queue a request for the async thread, or tack it onto the last one
+ * if it carries straight on from it.
+ */
+static
+void
+buffer_queueasync(struct fs *fs, daddr_t block, unsigned nblocks, bool write)
+{
+	struct bufasync *ba;
+
+	if (nblocks == 0) {
+		return;
+	}
+
+	lock_acquire(buffer_lock);
+	if (buffer_asynccount > 0) {
+		ba = &buffer_async[(buffer_asynchead + buffer_asynccount - 1)
+				   % BUFFER_ASYNCMAX];
+		if (ba->ba_fs == fs && ba->ba_write == write &&
+		    ba->ba_block + ba->ba_nblocks == block) {
+			ba->ba_nblocks += nblocks;
+			lock_release(buffer_lock);
+			return;
+		}
+	}
+	if (buffer_asynccount == BUFFER_ASYNCMAX) {
+		buffer_stats.asyncdrops++;
+		lock_release(buffer_lock);
+		return;
+	}
+	ba = &buffer_async[(buffer_asynchead + buffer_asynccount)
+			   % BUFFER_ASYNCMAX];
+	ba->ba_fs = fs;
+	ba->ba_block = block;
+	ba->ba_nblocks = nblocks;
+	ba->ba_write = write;
+	buffer_asynccount++;
+	cv_signal(buffer_asynccv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+/*
+ * Throw away queued requests for FS, and wait for the async thread to
+ * finish with it.
+ */
+static
+void
+buffer_cancelasync(struct fs *fs)
+{
+	unsigned i, n, count;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	count = buffer_asynccount;
+	n = 0;
+	for (i=0; i<count; i++) {
+		struct bufasync *ba;
+
+		ba = &buffer_async[(buffer_asynchead + i) % BUFFER_ASYNCMAX];
+		if (ba->ba_fs != fs) {
+			buffer_async[(buffer_asynchead + n) % BUFFER_ASYNCMAX]
+				= *ba;
+			n++;
+		}
+	}
+	buffer_asynccount = n;
+
+	while (buffer_asyncfs == fs) {
+		cv_wait(buffer_cv, buffer_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+void
+buffer_bootstrap(void)
+{
+	int result;
+
+	buffer_lock = lock_create("buffer cache");
+	buffer_cv = cv_create("buffer cache");
+	buffer_asynccv = cv_create("buffer async");
+	buffer_asyncdata = kmalloc(BUFFER_ASYNCRUN * BUFFER_SIZE);
+	if (buffer_lock == NULL || buffer_cv == NULL ||
+	    buffer_asynccv == NULL || buffer_asyncdata == NULL) {
+		panic("buffer_bootstrap: out of memory\n");
+	}
+
+	/* About 1/32 of RAM */
+	buffer_max = mainbus_ramsize() / 32 / BUFFER_SIZE;
+	if (buffer_max < BUFFER_MINBUFS) {
+		buffer_max = BUFFER_MINBUFS;
+	}
+	if (buffer_max > BUFFER_MAXBUFS) {
+		buffer_max = BUFFER_MAXBUFS;
+	}
+
+	result = thread_fork("syncer", NULL, buffer_syncer, NULL, 0);
+	if (result) {
+		panic("buffer_bootstrap: thread_fork: %s\n",
+		      strerror(result));
+	}
+	result = thread_fork("bufasync", NULL, buffer_asyncer, NULL, 0);
+	if (result) {
+		panic("buffer_bootstrap: thread_fork: %s\n",
+		      strerror(result));
+	}
+}
+
+int
+buffer_read(struct fs *fs, daddr_t block, struct buf **ret)
+{
+	return buffer_obtain(fs, block, true, ret);
+}
+
+int
+buffer_get(struct fs *fs, daddr_t block, struct buf **ret)
+{
+	return buffer_obtain(fs, block, false, ret);
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+daddr_t
+buffer_block(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_block;
+}
+
+bool
+buffer_valid(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_valid;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+	b->b_dirty = true;
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	if (!b->b_valid) {
+		/* From buffer_get, and never filled in */
+		buffer_hashout(b);
+	}
+	buffer_unbusy(b);
+	lock_release(buffer_lock);
+}
+
+void
+buffer_release_and_invalidate(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	buffer_hashout(b);
+	buffer_unbusy(b);
+	lock_release(buffer_lock);
+}
+
+void
+buffer_drop(struct fs *fs, daddr_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	while ((b = buffer_find(fs, block)) != NULL && b->b_busy) {
+		cv_wait(buffer_cv, buffer_lock);
+	}
+	if (b != NULL) {
+		buffer_setbusy(b);
+		buffer_hashout(b);
+		buffer_unbusy(b);
+	}
+	lock_release(buffer_lock);
+}
+
+bool
+buffer_cached(struct fs *fs, daddr_t block)
+{
+	bool ret;
+
+	lock_acquire(buffer_lock);
+	ret = buffer_find(fs, block) != NULL;
+	lock_release(buffer_lock);
+
+	return ret;
+}
+
+void
+buffer_readahead(struct fs *fs, daddr_t block, unsigned nblocks)
+{
+	buffer_queueasync(fs, block, nblocks, false);
+}
+
+void
+buffer_writebehind(struct fs *fs, daddr_t block, unsigned nblocks)
+{
+	buffer_queueasync(fs, block, nblocks, true);
+}
+
+int
+buffer_sync_fs(struct fs *fs)
+{
+	int result;
+
+	KASSERT(fs != NULL);
+
+	lock_acquire(buffer_lock);
+	result = buffer_flush(fs);
+	lock_release(buffer_lock);
+
+	return result;
+}
+
+void
+buffer_drop_fs(struct fs *fs)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	buffer_cancelasync(fs);
+	b = buffer_all;
+	while (b != NULL) {
+		if (b->b_fs != fs) {
+			b = b->b_allnext;
+			continue;
+		}
+		if (b->b_busy) {
+			cv_wait(buffer_cv, buffer_lock);
+			continue;
+		}
+		KASSERT(!b->b_dirty);
+		buffer_setbusy(b);
+		buffer_hashout(b);
+		buffer_unbusy(b);
+		b = b->b_allnext;
+	}
+	lock_release(buffer_lock);
+}
+
+void
+buffer_printstats(void)
+{
+	lock_acquire(buffer_lock);
+	kprintf("buffer cache: %u buffers (target %u)\n",
+		buffer_count, buffer_max);
+	kprintf("  %u hits, %u misses, %u reads, %u writes\n",
+		buffer_stats.hits, buffer_stats.misses,
+		buffer_stats.reads, buffer_stats.writes);
+	kprintf("  %u read ahead, %u written behind, %u requests dropped\n",
+		buffer_stats.readaheads, buffer_stats.writebehinds,
+		buffer_stats.asyncdrops);
+	lock_release(buffer_lock);
+}
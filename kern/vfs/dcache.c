@@ -0,0 +1,326 @@
+/*
+ * Directory name lookup cache.
+ * See <dcache.h> for the interface.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <dcache.h>
+
+struct dcentry {
+	struct fs *de_fs;		/* NULL if not in use */
+	ino_t de_dir;
+	ino_t de_ino;
+	bool de_negative;		/* de_ino is meaningless */
+	char de_name[DCACHE_NAMELEN];
+	struct dcentry *de_hashnext;	/* hash chain */
+	struct dcentry *de_lruprev;	/* LRU list */
+	struct dcentry *de_lrunext;
+};
+
+/*
+ * The entries are allocated statically and every one of them is on
+ * the LRU list all the time, unused ones at the front; so nothing
+ * here ever allocates memory, and a spinlock is enough to protect it
+ * all.
+ */
+#define DCACHE_HASHSIZE 256
+
+static struct dcentry dcache_entries[DCACHE_SIZE];
+static struct dcentry *dcache_hash[DCACHE_HASHSIZE];
+static struct dcentry *dcache_lruhead;	/* least recently used */
+static struct dcentry *dcache_lrutail;	/* most recently used */
+static struct spinlock dcache_spinlock = SPINLOCK_INITIALIZER;
+
+static struct {
+	unsigned hits;			/* lookups that found a name */
+	unsigned neghits;		/* ... that found it wasn't there */
+	unsigned misses;		/* ... that found nothing */
+	unsigned evictions;		/* entries reused while in use */
+} dcache_stats;
+
+////////////////////////////////////////////////////////////
+// Hash table and LRU list
+
+static
+unsigned
+dcache_hashindex(struct fs *fs, ino_t dir, const char *name)
+{
+	unsigned h;
+
+	h = dir ^ ((uintptr_t)fs >> 4);
+	while (*name) {
+		h = h * 31 + (unsigned char)*name++;
+	}
+	return h % DCACHE_HASHSIZE;
+}
+
+static
+struct dcentry *
+dcache_find(struct fs *fs, ino_t dir, const char *name)
+{
+	struct dcentry *de;
+
+	de = dcache_hash[dcache_hashindex(fs, dir, name)];
+	while (de != NULL && (de->de_fs != fs || de->de_dir != dir ||
+			      strcmp(de->de_name, name) != 0)) {
+		de = de->de_hashnext;
+	}
+	return de;
+}
+
+static
+void
+dcache_lruremove(struct dcentry *de)
+{
+	if (de->de_lruprev != NULL) {
+		de->de_lruprev->de_lrunext = de->de_lrunext;
+	}
+	else {
+		dcache_lruhead = de->de_lrunext;
+	}
+	if (de->de_lrunext != NULL) {
+		de->de_lrunext->de_lruprev = de->de_lruprev;
+	}
+	else {
+		dcache_lrutail = de->de_lruprev;
+	}
+	de->de_lruprev = de->de_lrunext = NULL;
+}
+
+static
+void
+dcache_lruaddhead(struct dcentry *de)
+{
+	de->de_lruprev = NULL;
+	de->de_lrunext = dcache_lruhead;
+	if (dcache_lruhead != NULL) {
+		dcache_lruhead->de_lruprev = de;
+	}
+	else {
+		dcache_lrutail = de;
+	}
+	dcache_lruhead = de;
+}
+
+static
+void
+dcache_lruaddtail(struct dcentry *de)
+{
+	de->de_lrunext = NULL;
+	de->de_lruprev = dcache_lrutail;
+	if (dcache_lrutail != NULL) {
+		dcache_lrutail->de_lrunext = de;
+	}
+	else {
+		dcache_lruhead = de;
+	}
+	dcache_lrutail = de;
+}
+
+/*
+ * Make an entry unused: take it out of the hash table and put it at
+ * the front of the LRU list to be reused first.
+ */
+static
+void
+dcache_discard(struct dcentry *de)
+{
+	struct dcentry **dep;
+
+	KASSERT(de->de_fs != NULL);
+
+	dep = &dcache_hash[dcache_hashindex(de->de_fs, de->de_dir,
+					    de->de_name)];
+	while (*dep != de) {
+		KASSERT(*dep != NULL);
+		dep = &(*dep)->de_hashnext;
+	}
+	*dep = de->de_hashnext;
+	de->de_hashnext = NULL;
+	de->de_fs = NULL;
+
+	dcache_lruremove(de);
+	dcache_lruaddhead(de);
+}
+
+/*
+ * Common code for dcache_enter and dcache_enter_negative.
+ */
+static
+void
+dcache_doenter(struct fs *fs, ino_t dir, const char *name,
+	       bool negative, ino_t ino)
+{
+	struct dcentry *de;
+	unsigned ix;
+
+	KASSERT(fs != NULL);
+
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return;
+	}
+
+	spinlock_acquire(&dcache_spinlock);
+
+	de = dcache_find(fs, dir, name);
+	if (de == NULL) {
+		/* Reuse the least recently used entry */
+		de = dcache_lruhead;
+		KASSERT(de != NULL);
+		if (de->de_fs != NULL) {
+			dcache_discard(de);
+			dcache_stats.evictions++;
+		}
+		de->de_fs = fs;
+		de->de_dir = dir;
+		strcpy(de->de_name, name);
+		ix = dcache_hashindex(fs, dir, name);
+		de->de_hashnext = dcache_hash[ix];
+		dcache_hash[ix] = de;
+	}
+	de->de_negative = negative;
+	de->de_ino = ino;
+
+	dcache_lruremove(de);
+	dcache_lruaddtail(de);
+
+	spinlock_release(&dcache_spinlock);
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+void
+dcache_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<DCACHE_SIZE; i++) {
+		dcache_entries[i].de_fs = NULL;
+		dcache_entries[i].de_hashnext = NULL;
+		dcache_lruaddtail(&dcache_entries[i]);
+	}
+}
+
+enum dcache_result
+dcache_lookup(struct fs *fs, ino_t dir, const char *name, ino_t *ret)
+{
+	struct dcentry *de;
+	enum dcache_result result;
+
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return DCACHE_MISS;
+	}
+
+	spinlock_acquire(&dcache_spinlock);
+	de = dcache_find(fs, dir, name);
+	if (de == NULL) {
+		dcache_stats.misses++;
+		result = DCACHE_MISS;
+	}
+	else {
+		if (de->de_negative) {
+			dcache_stats.neghits++;
+			result = DCACHE_NEGATIVE;
+		}
+		else {
+			dcache_stats.hits++;
+			*ret = de->de_ino;
+			result = DCACHE_HIT;
+		}
+		dcache_lruremove(de);
+		dcache_lruaddtail(de);
+	}
+	spinlock_release(&dcache_spinlock);
+
+	return result;
+}
+
+void
+dcache_enter(struct fs *fs, ino_t dir, const char *name, ino_t ino)
+{
+	dcache_doenter(fs, dir, name, false, ino);
+}
+
+void
+dcache_enter_negative(struct fs *fs, ino_t dir, const char *name)
+{
+	dcache_doenter(fs, dir, name, true, 0);
+}
+
+void
+dcache_remove(struct fs *fs, ino_t dir, const char *name)
+{
+	struct dcentry *de;
+
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return;
+	}
+
+	spinlock_acquire(&dcache_spinlock);
+	de = dcache_find(fs, dir, name);
+	if (de != NULL) {
+		dcache_discard(de);
+	}
+	spinlock_release(&dcache_spinlock);
+}
+
+/*
+ * These two look at every entry, but they're rare and the cache is
+ * small.
+ */
+void
+dcache_purgedir(struct fs *fs, ino_t dir)
+{
+	unsigned i;
+
+	spinlock_acquire(&dcache_spinlock);
+	for (i=0; i<DCACHE_SIZE; i++) {
+		if (dcache_entries[i].de_fs == fs &&
+		    dcache_entries[i].de_dir == dir) {
+			dcache_discard(&dcache_entries[i]);
+		}
+	}
+	spinlock_release(&dcache_spinlock);
+}
+
+void
+dcache_purgefs(struct fs *fs)
+{
+	unsigned i;
+
+	spinlock_acquire(&dcache_spinlock);
+	for (i=0; i<DCACHE_SIZE; i++) {
+		if (dcache_entries[i].de_fs == fs) {
+			dcache_discard(&dcache_entries[i]);
+		}
+	}
+	spinlock_release(&dcache_spinlock);
+}
+
+void
+dcache_printstats(void)
+{
+	unsigned i, used;
+	unsigned hits, neghits, misses, evictions;
+
+	/* Don't print with the spinlock held */
+	spinlock_acquire(&dcache_spinlock);
+	used = 0;
+	for (i=0; i<DCACHE_SIZE; i++) {
+		if (dcache_entries[i].de_fs != NULL) {
+			used++;
+		}
+	}
+	hits = dcache_stats.hits;
+	neghits = dcache_stats.neghits;
+	misses = dcache_stats.misses;
+	evictions = dcache_stats.evictions;
+	spinlock_release(&dcache_spinlock);
+
+	kprintf("dcache: %u of %u entries in use\n", used, DCACHE_SIZE);
+	kprintf("  %u hits, %u negative hits, %u misses, %u evictions\n",
+		hits, neghits, misses, evictions);
+}
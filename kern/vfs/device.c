@@ -42,6 +42,7 @@
 #include <synch.h>
 #include <vnode.h>
 #include <device.h>
+#include <vm.h>
 
 /*
  * Called for each open().
@@ -237,15 +238,23 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. Block devices can be mapped, as long as a page is a whole
+ * number of blocks; the VM system reads and writes them through
+ * dev_read and dev_write. Character devices don't make sense to map.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v)
 {
-	(void)v;
-	return ENOSYS;
+	struct device *d = v->vn_data;
+
+	if (d->d_blocks == 0) {
+		return ENODEV;
+	}
+	if (PAGE_SIZE % d->d_blocksize != 0) {
+		return EINVAL;
+	}
+	return 0;
 }
 
 /*
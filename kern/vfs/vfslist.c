@@ -43,6 +43,9 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <buf.h>
+#include <dcache.h>
+#include <pagecache.h>
 
 /*
  * Structure for a single named device.
@@ -114,6 +117,8 @@ vfs_bootstrap(void)
 
 	devnull_create();
 	semfs_bootstrap();
+	buffer_bootstrap();
+	dcache_bootstrap();
 }
 
 /*
@@ -654,6 +659,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* cached pages nobody maps still hold on to their files */
+	pagecache_purge_fs(kd->kd_fs);
+
 	/* sync the fs */
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
@@ -745,6 +753,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		pagecache_purge_fs(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
@@ -27,17 +27,25 @@
  * SUCH DAMAGE.
  */
 
+#define ADDRSPACEINLINE
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
 #include <elf.h>
+#include <vnode.h>
+#include <stat.h>
+#include <synch.h>
+#include <pagecache.h>
+#include <swap.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -49,6 +57,248 @@
  *
  */
 
+/*
+ * Region map helpers. as->as_regions is sorted by base address and
+ * its intervals never overlap, so lookups are binary searches.
+ */
+
+// Index of the first region that ends above vaddr, ie the region
+// containing vaddr if there is one, otherwise the next region up.
+static unsigned region_search(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned lo = 0, hi = regionarray_num(&as->as_regions);
+
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (REGION_END(regionarray_get(&as->as_regions, mid)) <= vaddr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+struct region *as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned i = region_search(as, vaddr);
+	struct region *r;
+
+	if (i < regionarray_num(&as->as_regions)) {
+		r = regionarray_get(&as->as_regions, i);
+		if (r->r_vbase <= vaddr) {
+			return r;
+		}
+	}
+	return NULL;
+}
+
+bool as_range_free(struct addrspace *as, vaddr_t vaddr, size_t size)
+{
+	unsigned i = region_search(as, vaddr);
+
+	return i == regionarray_num(&as->as_regions) ||
+		regionarray_get(&as->as_regions, i)->r_vbase >= vaddr + size;
+}
+
+// Inserts a copy of proto at position index, sliding the later entries up.
+// The copy takes its own reference to the backing file.
+static int region_insert(struct addrspace *as, unsigned index, const struct region *proto)
+{
+	unsigned num = regionarray_num(&as->as_regions);
+	unsigned i;
+	int result;
+
+	struct region *r = kmalloc(sizeof(struct region));
+	if (r == NULL) {
+		return ENOMEM;
+	}
+	*r = *proto;
+
+	result = regionarray_setsize(&as->as_regions, num + 1);
+	if (result) {
+		kfree(r);
+		return result;
+	}
+	for (i = num; i > index; i--) {
+		regionarray_set(&as->as_regions, i, regionarray_get(&as->as_regions, i - 1));
+	}
+	regionarray_set(&as->as_regions, index, r);
+	if (r->r_vnode != NULL) {
+		VOP_INCREF(r->r_vnode);
+	}
+	return 0;
+}
+
+static void region_free(struct region *r)
+{
+	struct stat st;
+
+	if (r->r_vnode != NULL) {
+		// The idle pages of a file unlinked while it was mapped would
+		// keep it from being freed once the mappings are gone
+		if (VOP_STAT(r->r_vnode, &st) == 0 && st.st_nlink == 0) {
+			pagecache_purge(r->r_vnode);
+		}
+		VOP_DECREF(r->r_vnode);
+	}
+	kfree(r);
+}
+
+// Makes sure no region straddles vaddr, splitting one in two if needed.
+static int region_split(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned i = region_search(as, vaddr);
+	struct region *r, upper;
+	size_t lower_pages;
+	int result;
+
+	if (i == regionarray_num(&as->as_regions)) {
+		return 0;
+	}
+	r = regionarray_get(&as->as_regions, i);
+	if (r->r_vbase >= vaddr) {
+		return 0;
+	}
+
+	lower_pages = (vaddr - r->r_vbase) / PAGE_SIZE;
+	upper = *r;
+	upper.r_vbase = vaddr;
+	upper.r_npages = r->r_npages - lower_pages;
+
+	result = region_insert(as, i + 1, &upper);
+	if (result) {
+		return result;
+	}
+	r->r_npages = lower_pages;
+	return 0;
+}
+
+// Merges region i into region i-1 if they are adjacent and alike.
+// Mappings made by mmap are left alone.
+static void region_merge(struct addrspace *as, unsigned i)
+{
+	struct region *lower, *upper;
+
+	if (i == 0 || i >= regionarray_num(&as->as_regions)) {
+		return;
+	}
+	lower = regionarray_get(&as->as_regions, i - 1);
+	upper = regionarray_get(&as->as_regions, i);
+	if (REGION_END(lower) == upper->r_vbase &&
+	    lower->r_perms == upper->r_perms &&
+	    lower->r_saved_perms == upper->r_saved_perms &&
+	    lower->r_vnode == upper->r_vnode &&
+	    lower->r_fileoff == upper->r_fileoff &&
+	    lower->r_filevaddr == upper->r_filevaddr &&
+	    lower->r_filesize == upper->r_filesize &&
+	    !lower->r_mmap && !upper->r_mmap) {
+		lower->r_npages += upper->r_npages;
+		region_free(upper);
+		regionarray_remove(&as->as_regions, i);
+	}
+}
+
+// Adds the range described by proto to the region map. Parts that are
+// already mapped (two segments sharing a page) get the union of the
+// permissions; file-backed ranges may not overlap anything.
+static int region_add(struct addrspace *as, const struct region *proto)
+{
+	vaddr_t vbase = proto->r_vbase;
+	vaddr_t end = REGION_END(proto);
+	vaddr_t cur = vbase;
+	int perms = proto->r_perms;
+	unsigned first, i;
+	struct region *r, gap;
+	int result;
+
+	if (proto->r_npages == 0) {
+		return 0;
+	}
+
+	if (proto->r_vnode != NULL) {
+		i = region_search(as, vbase);
+		if (i < regionarray_num(&as->as_regions) &&
+		    regionarray_get(&as->as_regions, i)->r_vbase < end) {
+			return EINVAL;
+		}
+	}
+
+	result = region_split(as, vbase);
+	if (result) {
+		return result;
+	}
+	result = region_split(as, end);
+	if (result) {
+		return result;
+	}
+
+	first = i = region_search(as, vbase);
+	while (cur < end) {
+		if (i < regionarray_num(&as->as_regions) &&
+		    (r = regionarray_get(&as->as_regions, i))->r_vbase == cur) {
+			r->r_perms |= perms;
+			r->r_saved_perms |= perms;
+			cur = REGION_END(r);
+		} else {
+			gap = *proto;
+			gap.r_vbase = cur;
+			if (i < regionarray_num(&as->as_regions)) {
+				r = regionarray_get(&as->as_regions, i);
+				gap.r_npages = ((r->r_vbase < end ? r->r_vbase : end) - cur) / PAGE_SIZE;
+			} else {
+				gap.r_npages = (end - cur) / PAGE_SIZE;
+			}
+			result = region_insert(as, i, &gap);
+			if (result) {
+				return result;
+			}
+			cur = REGION_END(&gap);
+		}
+		i++;
+	}
+
+	// Merge from the top down so lower indices stay put
+	for (; i > first; i--) {
+		region_merge(as, i);
+	}
+	region_merge(as, first);
+	return 0;
+}
+
+static void region_destroy_all(struct addrspace *as)
+{
+	unsigned i;
+
+	for (i = 0; i < regionarray_num(&as->as_regions); i++) {
+		region_free(regionarray_get(&as->as_regions, i));
+	}
+	regionarray_setsize(&as->as_regions, 0);
+}
+
+// Page table visitor: drop the page, freeing its frame if nobody else uses it.
+static void as_release_page(struct addrspace *as, vaddr_t vaddr, pte_t *pte, void *data)
+{
+	pte_t old;
+
+	(void)data;
+
+	// Its swap slot can't go until it has been written
+	pt_wait_idle(pte);
+	if (*pte & PTE_SHARED) {
+		pagecache_unmap(*pte & TLBLO_PPAGE, as, vaddr);
+		vm_tlb_invalidate(as, vaddr);
+	} else if (*pte & PTE_SWAPPED) {
+		swap_free(PTE_SWAPSLOT(*pte));
+	} else if (*pte & TLBLO_VALID) {
+		old = *pte;
+		*pte = 0;
+		vm_tlb_invalidate(as, vaddr);
+		pt_release_frame(old, vaddr);
+	}
+	*pte = 0;
+}
+
 struct addrspace *
 as_create(void)
 {
@@ -60,16 +310,15 @@ as_create(void)
 		return NULL;
 	}
 
-	as->as_region = NULL;
+	regionarray_init(&as->as_regions);
+	as->as_pt = NULL;
+	as->as_ptnext = NULL;
+	as->as_ptprev = NULL;
 	as->as_heap_start = 0;
 	as->as_heap_end = 0;
-
-	// Initialise base page table
-	int i;
-	for (i=0; i < NUM_ROOT_ENTRIES; i++){
-		as->page_table[i].vaddr_prefix = i;
-		as->page_table[i].target = NULL;
-	}
+	as->as_asid = 0;
+	as->as_asidgen = 0;	// never current: gets an ASID on activation
+	as->as_cpus = 0;
 
 	return as;
 }
@@ -77,6 +326,8 @@ as_create(void)
 int as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *newas;
+	unsigned i;
+	int result;
 
 	newas = as_create();
 	if (newas == NULL)
@@ -87,37 +338,22 @@ int as_copy(struct addrspace *old, struct addrspace **ret)
 	newas->as_heap_start = old->as_heap_start;
 	newas->as_heap_end = old->as_heap_end;
 
-	// Copy data to new address space
-	struct region *cur = old->as_region;
-	while (cur != NULL)
-	{
-		//Copy vaddr's by simply calling add_single_vaddr_page on new as
-		struct secondary_page_entry *old_page = get_page(old, cur->vbase);
-		add_single_vaddr_page(newas, cur->vbase, old_page->flags);
-
-		// If physical memory exists, do not move it but instead set copy_on_write for all
-		struct secondary_page_entry *new_page = get_page(newas, cur->vbase);
-		if (old_page->paddr != USERSPACETOP){
-			new_page->paddr = old_page->paddr;
-
-			// Note that we don't just do this for pages with write permission
-			// This is because as_prepare_load can change permissions.
-
-			new_page->copy_on_write = 1;
-			new_page->paddr = new_page->paddr & (~TLBLO_DIRTY); // Remove dirty from paddr, ie make readonly
-			old_page->copy_on_write = 1;
-			old_page->paddr = old_page->paddr & (~TLBLO_DIRTY); // Remove dirty from paddr, ie make readonly
-			increment_ref_count(new_page->paddr);
-
-			// We need to remove the old TLB entry if it exists
-			int index = tlb_probe(new_page->vaddr<<12, 0);
-			if (index >= 0){
-				int spl = splhigh();
-				tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
-				splx(spl);
-			}
+	// Copy the region map; it is already sorted
+	for (i = 0; i < regionarray_num(&old->as_regions); i++) {
+		result = region_insert(newas, i, regionarray_get(&old->as_regions, i));
+		if (result) {
+			as_destroy(newas);
+			return result;
 		}
-		cur = cur->next;
+	}
+
+	// Share every present page copy-on-write
+	vm_lock_acquire();
+	result = pt_copy(old, newas);
+	lock_release(vm_lock);
+	if (result) {
+		as_destroy(newas);
+		return result;
 	}
 
 	*ret = newas;
@@ -126,31 +362,64 @@ int as_copy(struct addrspace *old, struct addrspace **ret)
 
 void as_destroy(struct addrspace *as)
 {
-	// Ensure the TLB is clean
-	as_deactivate();
-
-	struct region *region_node = as->as_region;
-	struct region *temp_node;
-	while (region_node != NULL)
-	{
-		// Delete any USEG memory
-		struct secondary_page_entry *page = get_page(as, region_node->vbase);
-		if (page->paddr != USERSPACETOP) {
-			decrement_ref_count(page->paddr & TLBLO_PPAGE);
+	unsigned i;
+	struct region *r;
+
+	// Any TLB entries left are tagged with our ASID, which is not handed
+	// out again before the TLB is flushed at the next ASID rollover.
+	// The refill handler must not walk the page table being freed, though.
+	pt_forget(as);
+
+	// Shared file mappings are written back as if unmapped. There is
+	// nobody left to tell about errors.
+	for (i = 0; i < regionarray_num(&as->as_regions); i++) {
+		r = regionarray_get(&as->as_regions, i);
+		if (r->r_shared) {
+			(void)as_sync_region(as, r);
 		}
-
-		// Delete from region linked list
-		temp_node = region_node->next;
-		kfree(region_node);
-		region_node = temp_node;
 	}
 
-	// Free secondary tables (if they're allocated)
+	// Delete any USEG memory, and the page table itself. This goes
+	// first so the regions' vnode references outlive the page cache's
+	// (the last VOP_DECREF may do I/O, which can't be under vm_lock).
+	vm_lock_acquire();
+	free_page_table(as);
+	lock_release(vm_lock);
+
+	region_destroy_all(as);
+	regionarray_cleanup(&as->as_regions);
+
+	kfree(as);
+}
+
+/*
+ * Address space IDs. Each address space's TLB entries are tagged with
+ * its ASID, so switching address spaces doesn't need a TLB flush; an
+ * address space's entries are just ignored while another one runs.
+ *
+ * ASIDs are handed out in order, one per address space per generation.
+ * When they run out a new generation starts: every address space gets
+ * a fresh ASID the next time it is activated, and each CPU flushes its
+ * TLB once when it first sees the new generation. Until then an ASID
+ * is never reused, so stale entries of dead address spaces are harmless.
+ * ASID 0 is left for no address space.
+ *
+ * An address space's entries can outlive a switch on every CPU it has
+ * run on, so as_cpus records those CPUs for TLB shootdown (vm.c). A
+ * process only runs on one CPU at a time, so when its own PTEs change
+ * it can do better than interrupting the others: it retires its ASID,
+ * and the entries it left behind are never looked at again.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static unsigned asid_generation = 1;
+static unsigned asid_next = 1;
+
+static void tlb_flush_all(void)
+{
 	int i;
-	for (i=0; i < NUM_ROOT_ENTRIES; i++){
-		if (as->page_table[i].target != NULL) {
-			kfree(as->page_table[i].target);
-		}
+	for (i = 0; i < NUM_TLB; i++)
+	{
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
 	}
 }
 
@@ -171,37 +440,57 @@ void as_activate(void)
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	int spl = splhigh();
 
-	int i;
-	for (i = 0; i < NUM_TLB; i++)
-	{
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	spinlock_acquire(&asid_lock);
+	if (as->as_asidgen != asid_generation) {
+		if (asid_next == NUM_ASID) {
+			asid_generation++;
+			asid_next = 1;
+		}
+		as->as_asid = asid_next++;
+		as->as_asidgen = asid_generation;
+		as->as_cpus = 0;
+	}
+	as->as_cpus |= (uint32_t)1 << curcpu->c_number;
+	if (curcpu->c_asidgen != asid_generation) {
+		tlb_flush_all();
+		curcpu->c_asidgen = asid_generation;
 	}
+	tlb_setasid(as->as_asid);
+	pt_activate(as);
+	spinlock_release(&asid_lock);
 
 	splx(spl);
 }
 
-void as_deactivate(void)
+uint32_t as_tlb_cpus(struct addrspace *as, unsigned *asid)
 {
-	struct addrspace *as = proc_getas();
-	if (as == NULL)
-	{
+	uint32_t self = (uint32_t)1 << curcpu->c_number;
+	uint32_t others;
+
+	spinlock_acquire(&asid_lock);
+	*asid = as->as_asid;
+	others = as->as_cpus & ~self;
+	if (others != 0 && as == proc_getas()) {
 		/*
-		 * Kernel thread without an address space; leave the
-		 * prior address space in place.
+		 * This CPU keeps using the old ASID (and its entries,
+		 * which the caller fixes up) until the next switch.
 		 */
-		return;
+		as->as_asidgen = 0;
+		as->as_cpus = self;
+		others = 0;
 	}
+	spinlock_release(&asid_lock);
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	int spl = splhigh();
-
-	int i;
-	for (i = 0; i < NUM_TLB; i++)
-	{
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
+	return others;
+}
 
-	splx(spl);
+void as_deactivate(void)
+{
+	/*
+	 * Nothing to do: the outgoing address space's TLB entries stay
+	 * tagged with its ASID, ready for when it runs again, and
+	 * as_destroy takes care of the refill handler's pointer.
+	 */
 }
 
 /*
@@ -210,9 +499,8 @@ void as_deactivate(void)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment.
+ * Nothing is allocated here; pages are filled in by vm_fault.
  */
 int as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 					 int readable, int writeable, int executable)
@@ -224,34 +512,14 @@ int as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 	// Align the region's size.
 	memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
 
-	int flags = readable | writeable | executable;
-
 	// Update the heap on the writeable region
 	// (ie data/bss segment, which I will assume is the only writable region as per loadelf.c)
 	if (writeable) {
 		as->as_heap_start = (vaddr & PAGE_FRAME) + memsize;
 		as->as_heap_end = as->as_heap_start;
 	}
-	
-
-	// Split the region up into pages, and allocate seperately for each
-	vaddr_t i;
-	for (i = 0; i < memsize; i += PAGE_SIZE) {
-		// Add to PT
-		add_single_vaddr_page(as, vaddr + i, flags);
 
-		// Add to linked list, stack-style
-		struct region* tmp = kmalloc(sizeof(struct region));
-		if (tmp == NULL){
-			return EFAULT;
-		}
-		tmp->vbase = vaddr+i;
-		tmp->old_flags = flags;
-		tmp->next = as->as_region;
-		as->as_region = tmp;
-	}
-
-	return 0; 
+	return as_define_region_noheap(as, vaddr, memsize, readable, writeable, executable);
 }
 
 // Identical to as_define_region, but doesn't modify heap.
@@ -265,113 +533,260 @@ int as_define_region_noheap(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 	// Align the region's size.
 	memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
 
-	int flags = readable | writeable | executable;
+	struct region proto;
+	proto.r_vbase = vaddr;
+	proto.r_npages = memsize / PAGE_SIZE;
+	proto.r_perms = readable | writeable | executable;
+	proto.r_saved_perms = proto.r_perms;
+	proto.r_vnode = NULL;
+	proto.r_fileoff = 0;
+	proto.r_filevaddr = 0;
+	proto.r_filesize = 0;
+	proto.r_mmap = false;
+	proto.r_shared = false;
+
+	return region_add(as, &proto);
+}
+
+int as_define_file_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+                          struct vnode *v, off_t offset, size_t filesize,
+                          int readable, int writeable, int executable)
+{
+	struct region proto;
 
+	KASSERT(v != NULL);
+	KASSERT(filesize <= memsize);
+
+	proto.r_vnode = v;
+	proto.r_fileoff = offset;
+	proto.r_filevaddr = vaddr;
+	proto.r_filesize = filesize;
+
+	// Align the region's base
+	memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	// Align the region's size.
+	memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	// Same heap rule as as_define_region
+	if (writeable) {
+		as->as_heap_start = vaddr + memsize;
+		as->as_heap_end = as->as_heap_start;
+	}
 
-	// Split the region up into pages, and allocate seperately for each
-	vaddr_t i;
-	for (i = 0; i < memsize; i += PAGE_SIZE) {
-		// Add to PT
-		add_single_vaddr_page(as, vaddr + i, flags);
+	proto.r_vbase = vaddr;
+	proto.r_npages = memsize / PAGE_SIZE;
+	proto.r_perms = readable | writeable | executable;
+	proto.r_saved_perms = proto.r_perms;
+	proto.r_mmap = false;
+	proto.r_shared = false;
 
-		// Add to linked list, stack-style
-		struct region* tmp = kmalloc(sizeof(struct region));
-		if (tmp == NULL){
-			return EFAULT;
+	return region_add(as, &proto);
+}
+
+int as_define_mmap(struct addrspace *as, size_t size, struct vnode *v,
+                   off_t offset, size_t filesize, int perms, bool shared,
+                   vaddr_t *ret)
+{
+	vaddr_t floor, top;
+	struct region *r, proto;
+	unsigned i;
+	int result;
+
+	KASSERT(v != NULL);
+	KASSERT(offset % PAGE_SIZE == 0);
+	KASSERT(filesize <= size);
+
+	size = (size + PAGE_SIZE - 1) & PAGE_FRAME;
+	if (size == 0) {
+		// Wrapped around
+		return ENOMEM;
+	}
+
+	// Look for the highest gap that fits, from the stack down, leaving
+	// the heap alone; sbrk stops growing it at the first mapping.
+	floor = (as->as_heap_end + PAGE_SIZE - 1) & PAGE_FRAME;
+	top = USERSPACETOP;
+	i = regionarray_num(&as->as_regions);
+	while (i > 0) {
+		r = regionarray_get(&as->as_regions, i - 1);
+		if (REGION_END(r) <= floor || top - REGION_END(r) >= size) {
+			break;
 		}
-		tmp->vbase = vaddr+i;
-		tmp->old_flags = flags;
-		tmp->next = as->as_region;
-		as->as_region = tmp;
+		top = r->r_vbase;
+		i--;
+	}
+	if (i > 0) {
+		r = regionarray_get(&as->as_regions, i - 1);
+		if (REGION_END(r) > floor) {
+			floor = REGION_END(r);
+		}
+	}
+	if (top < floor || top - floor < size) {
+		return ENOMEM;
 	}
 
-	return 0; 
+	proto.r_vbase = top - size;
+	proto.r_npages = size / PAGE_SIZE;
+	proto.r_perms = perms;
+	proto.r_saved_perms = perms;
+	proto.r_vnode = v;
+	proto.r_fileoff = offset;
+	proto.r_filevaddr = proto.r_vbase;
+	proto.r_filesize = filesize;
+	proto.r_mmap = true;
+	proto.r_shared = shared;
+
+	result = region_add(as, &proto);
+	if (result) {
+		return result;
+	}
+	*ret = proto.r_vbase;
+	return 0;
 }
 
-// Removes a region (as may happen when sbrk is called with a negative)
-void as_remove_region(struct addrspace *as, vaddr_t vaddr, size_t memsize)
+int as_sync_region(struct addrspace *as, struct region *r)
 {
-	struct region* prev = NULL;
-	struct region* cur = as->as_region;
-
-	while (cur != NULL){
-		if (cur->vbase >= vaddr && cur->vbase < vaddr + memsize) {
-			// Update pointers
-			if (prev == NULL) {
-				as->as_region = cur->next;
-			} else {
-				prev->next = cur->next;
+	vaddr_t vaddr;
+	paddr_t paddr = 0;
+	pte_t *pte;
+	bool held, sole;
+	int result, error = 0;
+
+	KASSERT(r->r_shared);
+
+	// A page at a time, since the write can't be under vm_lock
+	for (vaddr = r->r_vbase; vaddr < REGION_END(r); vaddr += PAGE_SIZE) {
+		held = false;
+		vm_lock_acquire();
+		pte = get_page(as, vaddr);
+		// Stand-ins for busy pages (PTE_FILE) are never written
+		if (pte != NULL && (*pte & PTE_SHARED)) {
+			paddr = *pte & TLBLO_PPAGE;
+			held = pagecache_hold_dirty(paddr, &sole);
+			if (held && sole && (*pte & TLBLO_DIRTY)) {
+				*pte &= ~TLBLO_DIRTY;
+				vm_tlb_invalidate(as, vaddr);
 			}
+		}
+		lock_release(vm_lock);
 
-			// Actually delete (freeing any physical memory)
-			struct region* tmp = cur->next;
-
-			struct secondary_page_entry *page = get_page(as, cur->vbase);
-			if (page->paddr != USERSPACETOP) {
-				decrement_ref_count(page->paddr & TLBLO_PPAGE);
+		if (held) {
+			result = pagecache_writeback(paddr);
+			if (result && error == 0) {
+				error = result;
 			}
+		}
+	}
+	return error;
+}
 
-			kfree(cur);
+// Removes a region (as may happen when sbrk is called with a negative)
+int as_remove_region(struct addrspace *as, vaddr_t vaddr, size_t memsize)
+{
+	vaddr_t end;
+	unsigned i;
+	int result;
 
-			cur = tmp;
-		} else {
-			prev = cur;
-			cur = cur->next;
-		}
+	// Align the range outwards to whole pages
+	end = vaddr + memsize;
+	vaddr &= PAGE_FRAME;
+	if (end <= vaddr || end > USERSPACETOP) {
+		// Empty (or "negative") range, nothing to do
+		return 0;
+	}
+	end = (end + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	result = region_split(as, vaddr);
+	if (result) {
+		return result;
+	}
+	result = region_split(as, end);
+	if (result) {
+		return result;
+	}
+
+	// Actually delete (freeing any physical memory); before the regions
+	// go, for the same reason as in as_destroy
+	vm_lock_acquire();
+	pt_foreach(as, vaddr, end, as_release_page, NULL);
+	lock_release(vm_lock);
+
+	// After splitting, the range is covered by whole regions
+	i = region_search(as, vaddr);
+	while (i < regionarray_num(&as->as_regions) &&
+	       regionarray_get(&as->as_regions, i)->r_vbase < end) {
+		region_free(regionarray_get(&as->as_regions, i));
+		regionarray_remove(&as->as_regions, i);
+	}
+	return 0;
+}
+
+// Page table visitor: make a present page writable for loading.
+static void as_prepare_page(struct addrspace *as, vaddr_t vaddr, pte_t *pte, void *data)
+{
+	(void)data;
+
+	*pte = *pte | PF_W; // Ensure able to be written
+
+	// Update paddr DIRTY flag if required
+	if ((*pte & TLBLO_VALID) && (*pte & PTE_COW) == 0 && (*pte & TLBLO_DIRTY) == 0) {
+		// We need to remove the old TLB entry if it exists
+		vm_tlb_invalidate(as, vaddr);
+
+		*pte = *pte | TLBLO_DIRTY;
+	}
+}
+
+// Page table visitor: put back the permissions passed in data.
+static void as_complete_page(struct addrspace *as, vaddr_t vaddr, pte_t *pte, void *data)
+{
+	int perms = *(int *)data;
+
+	*pte = (*pte & ~PTE_PERMS) | perms; // Restore previous permissions
+
+	// Update paddr DIRTY flag if required
+	if ((*pte & TLBLO_VALID) && (*pte & PF_W) == 0 && (*pte & TLBLO_DIRTY)) {
+		// We need to remove the old TLB entry if it exists
+		vm_tlb_invalidate(as, vaddr);
+
+		*pte = *pte & ~TLBLO_DIRTY;
 	}
 }
 
 int as_prepare_load(struct addrspace *as)
 {
-	struct region *regions = as->as_region;
-
-	while (regions) {
-		struct secondary_page_entry *page = get_page(as, regions->vbase);
-
-		regions->old_flags = page->flags; // Save old flags
-		page->flags = page->flags | PF_W; // Ensure able to be written
-
-		// Update paddr DIRTY flag if required
-    	if ((page->paddr != USERSPACETOP) && ((page->paddr & TLBLO_DIRTY) == 0)) {
-			// We need to remove the old TLB entry if it exists
-			int index = tlb_probe(page->vaddr<<12, 0);
-			if (index >= 0){
-				int spl = splhigh();
-				tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
-				splx(spl);
-			}
+	unsigned i;
 
-			page->paddr = page->paddr | TLBLO_DIRTY;
-		}
+	for (i = 0; i < regionarray_num(&as->as_regions); i++) {
+		struct region *r = regionarray_get(&as->as_regions, i);
 
-		regions = regions->next;
+		r->r_saved_perms = r->r_perms; // Save old flags
+		r->r_perms |= PF_W;
+		vm_lock_acquire();
+		pt_foreach(as, r->r_vbase, REGION_END(r), as_prepare_page, NULL);
+		lock_release(vm_lock);
 	}
 	return 0;
 }
 
 int as_complete_load(struct addrspace *as)
 {
-	struct region *regions = as->as_region;
-
-	while (regions) {
-		struct secondary_page_entry *page = get_page(as, regions->vbase);
-		
-		page->flags = regions->old_flags; // Restore previous permissions
-
-		// Update paddr DIRTY flag if required
-    	if ((page->paddr != USERSPACETOP) && ((page->flags & PF_W) == 0) && ((page->paddr & TLBLO_DIRTY) == 1)) {
-			// We need to remove the old TLB entry if it exists
-			int index = tlb_probe(page->vaddr<<12, 0);
-			if (index >= 0){
-				int spl = splhigh();
-				tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
-				splx(spl);
-			}
+	unsigned i;
 
-			page->paddr = page->paddr & (!TLBLO_DIRTY);
-		}
+	for (i = 0; i < regionarray_num(&as->as_regions); i++) {
+		struct region *r = regionarray_get(&as->as_regions, i);
+
+		r->r_perms = r->r_saved_perms;
+		vm_lock_acquire();
+		pt_foreach(as, r->r_vbase, REGION_END(r), as_complete_page, &r->r_perms);
+		lock_release(vm_lock);
+	}
 
-		regions = regions->next;
+	// Regions that only differed while loading can be merged again
+	for (i = regionarray_num(&as->as_regions); i > 1; i--) {
+		region_merge(as, i - 1);
 	}
 	return 0;
 }
@@ -0,0 +1,951 @@
+/*
+ * Shared page cache for file-backed regions.
+ * See <pagecache.h> for the interface.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <stat.h>
+#include <synch.h>
+#include <current.h>
+#include <thread.h>
+#include <vnode.h>
+#include <vm.h>
+#include <machine/tlb.h>
+#include <addrspace.h>
+#include <pagecache.h>
+
+/*
+ * Each entry is on two hash chains: one by (vnode, offset), used on
+ * fault, and one by physical page, used on unmap. It also lists the
+ * page table entries that map it, so that eviction can take the page
+ * away from all of them. An entry nobody maps is on the idle list,
+ * oldest first, until it is mapped again or reclaimed.
+ *
+ * All reference count changes on cached frames happen with pc_lock
+ * held, so the "only the cache is left" check in pc_release cannot
+ * race with a new mapping. pc_lock is not held across I/O; an entry
+ * being filled is marked busy instead. It is taken under vm_lock.
+ *
+ * Eviction runs under vm_lock, where neither a writeback nor letting go
+ * of a vnode (which may reclaim it) can be done. The page cache thread
+ * does those: it writes back dirty pages eviction asked for, and drops
+ * the vnode references of entries eviction got rid of.
+ */
+
+#define PC_HASHSIZE 127
+
+struct pc_map {
+	struct addrspace *pm_as;	/* address space mapping the page */
+	vaddr_t pm_vaddr;		/* where */
+	struct pc_map *pm_next;
+};
+
+struct pc_entry {
+	struct vnode *pe_vnode;		/* file (referenced) */
+	off_t pe_off;			/* file offset of start of page */
+	unsigned pe_lo, pe_hi;		/* part of page read from the file */
+	paddr_t pe_paddr;		/* the frame */
+	bool pe_busy;			/* still being read in */
+	bool pe_stale;			/* file written while being read in */
+	bool pe_gone;			/* off pc_bykey: file truncated */
+	bool pe_dirty;			/* written through a shared mapping */
+	bool pe_flush;			/* eviction wants it written back */
+	bool pe_idle;			/* on the idle list */
+	struct thread *pe_writer;	/* thread writing it back, if any */
+	struct pc_map *pe_maps;		/* page table entries mapping it */
+	struct pc_entry *pe_keynext;	/* next on pc_bykey chain */
+	struct pc_entry *pe_pagenext;	/* next on pc_bypage chain */
+	struct pc_entry *pe_idlenext;	/* next on idle list */
+	struct pc_entry *pe_idleprev;	/* previous on idle list */
+};
+
+static struct pc_entry *pc_bykey[PC_HASHSIZE];
+static struct pc_entry *pc_bypage[PC_HASHSIZE];
+static struct pc_entry *pc_idlehead, *pc_idletail;
+static struct pc_entry *pc_reap;	/* removed, vnode not yet let go */
+static bool pc_flushwanted;		/* some entry has pe_flush set */
+static struct lock *pc_lock;
+static struct cv *pc_cv;		/* a writeback (or flush) finished */
+static struct cv *pc_workcv;		/* work for the page cache thread */
+
+static
+unsigned
+pc_keyhash(struct vnode *v, off_t off)
+{
+	return ((uintptr_t)v / sizeof(struct vnode) +
+		(uint32_t)(off / PAGE_SIZE)) % PC_HASHSIZE;
+}
+
+static
+unsigned
+pc_pagehash(paddr_t paddr)
+{
+	return (paddr / PAGE_SIZE) % PC_HASHSIZE;
+}
+
+static
+struct pc_entry *
+pc_lookup(struct vnode *v, off_t off, unsigned lo, unsigned hi)
+{
+	struct pc_entry *pe;
+
+	for (pe = pc_bykey[pc_keyhash(v, off)]; pe; pe = pe->pe_keynext) {
+		if (pe->pe_vnode == v && pe->pe_off == off &&
+		    pe->pe_lo == lo && pe->pe_hi == hi) {
+			return pe;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+pc_insert(struct pc_entry *pe)
+{
+	unsigned kh = pc_keyhash(pe->pe_vnode, pe->pe_off);
+	unsigned ph = pc_pagehash(pe->pe_paddr);
+
+	pe->pe_keynext = pc_bykey[kh];
+	pc_bykey[kh] = pe;
+	pe->pe_pagenext = pc_bypage[ph];
+	pc_bypage[ph] = pe;
+}
+
+static
+void
+pc_remove(struct pc_entry *pe)
+{
+	struct pc_entry **pp;
+
+	if (!pe->pe_gone) {
+		for (pp = &pc_bykey[pc_keyhash(pe->pe_vnode, pe->pe_off)];
+		     *pp != pe; pp = &(*pp)->pe_keynext) {
+			KASSERT(*pp != NULL);
+		}
+		*pp = pe->pe_keynext;
+	}
+
+	for (pp = &pc_bypage[pc_pagehash(pe->pe_paddr)];
+	     *pp != pe; pp = &(*pp)->pe_pagenext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = pe->pe_pagenext;
+}
+
+static
+struct pc_entry *
+pc_lookup_page(paddr_t paddr)
+{
+	struct pc_entry *pe;
+
+	for (pe = pc_bypage[pc_pagehash(paddr)]; pe; pe = pe->pe_pagenext) {
+		if (pe->pe_paddr == paddr) {
+			return pe;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+pc_idle_add(struct pc_entry *pe)
+{
+	KASSERT(!pe->pe_idle && pe->pe_maps == NULL);
+
+	pe->pe_idlenext = NULL;
+	pe->pe_idleprev = pc_idletail;
+	if (pc_idletail != NULL) {
+		pc_idletail->pe_idlenext = pe;
+	}
+	else {
+		pc_idlehead = pe;
+	}
+	pc_idletail = pe;
+	pe->pe_idle = true;
+}
+
+static
+void
+pc_idle_remove(struct pc_entry *pe)
+{
+	KASSERT(pe->pe_idle);
+
+	if (pe->pe_idleprev != NULL) {
+		pe->pe_idleprev->pe_idlenext = pe->pe_idlenext;
+	}
+	else {
+		pc_idlehead = pe->pe_idlenext;
+	}
+	if (pe->pe_idlenext != NULL) {
+		pe->pe_idlenext->pe_idleprev = pe->pe_idleprev;
+	}
+	else {
+		pc_idletail = pe->pe_idleprev;
+	}
+	pe->pe_idle = false;
+}
+
+/*
+ * Add a mapping reference to a filled entry, using PM to record that
+ * AS maps it at VADDR.
+ */
+static
+void
+pc_addmap(struct pc_entry *pe, struct pc_map *pm, struct addrspace *as,
+	  vaddr_t vaddr)
+{
+	KASSERT(!pe->pe_busy);
+
+	if (pe->pe_idle) {
+		pc_idle_remove(pe);
+	}
+	increment_ref_count(pe->pe_paddr);
+	frame_mark_referenced(pe->pe_paddr);
+	pm->pm_as = as;
+	pm->pm_vaddr = vaddr;
+	pm->pm_next = pe->pe_maps;
+	pe->pe_maps = pm;
+}
+
+/* Take AS's mapping at VADDR off the list; returns it for freeing. */
+static
+struct pc_map *
+pc_delmap(struct pc_entry *pe, struct addrspace *as, vaddr_t vaddr)
+{
+	struct pc_map **pp, *pm;
+
+	for (pp = &pe->pe_maps; *pp != NULL; pp = &(*pp)->pm_next) {
+		pm = *pp;
+		if (pm->pm_as == as && pm->pm_vaddr == vaddr) {
+			*pp = pm->pm_next;
+			return pm;
+		}
+	}
+	panic("pagecache: page not mapped at 0x%x\n", vaddr);
+}
+
+/*
+ * Drop a reference other than the cache's own. If that leaves just the
+ * cache's, the entry goes idle; unless it can't be found any more, or
+ * is still dirty, which means the last writeback failed and there is
+ * nobody left to retry it. Then it goes away, and is returned for
+ * pc_free once pc_lock has been let go.
+ */
+static
+struct pc_entry *
+pc_release(struct pc_entry *pe)
+{
+	decrement_ref_count(pe->pe_paddr);
+	if (get_ref_count(pe->pe_paddr) > 1) {
+		return NULL;
+	}
+	KASSERT(pe->pe_maps == NULL);
+
+	if (!pe->pe_gone && !pe->pe_dirty) {
+		pc_idle_add(pe);
+		return NULL;
+	}
+	pc_remove(pe);
+	decrement_ref_count(pe->pe_paddr);
+	return pe;
+}
+
+/* Free a removed entry. Not with pc_lock held: this may reclaim the vnode. */
+static
+void
+pc_free(struct pc_entry *pe)
+{
+	VOP_DECREF(pe->pe_vnode);
+	kfree(pe);
+}
+
+/*
+ * Hand a removed entry to the page cache thread to free, for callers
+ * that hold vm_lock. Call with pc_lock held.
+ */
+static
+void
+pc_defer_free(struct pc_entry *pe)
+{
+	pe->pe_keynext = pc_reap;
+	pc_reap = pe;
+	cv_signal(pc_workcv, pc_lock);
+}
+
+/*
+ * Make every mapping of the page clean and write it back, so that
+ * eviction can have it. Its next write through any mapping marks it
+ * dirty again.
+ */
+static
+void
+pc_clean(paddr_t paddr)
+{
+	struct pc_entry *pe;
+	struct pc_map *pm;
+	pte_t *pte;
+	bool held = false;
+
+	vm_lock_acquire();
+	lock_acquire(pc_lock);
+	pe = pc_lookup_page(paddr);
+	if (pe != NULL && !pe->pe_busy && pe->pe_dirty) {
+		for (pm = pe->pe_maps; pm != NULL; pm = pm->pm_next) {
+			pte = get_page(pm->pm_as, pm->pm_vaddr);
+			if (pte != NULL && (*pte & TLBLO_DIRTY) &&
+			    (*pte & (TLBLO_PPAGE | PTE_SHARED)) ==
+			    (paddr | PTE_SHARED)) {
+				*pte &= ~TLBLO_DIRTY;
+				vm_tlb_invalidate(pm->pm_as, pm->pm_vaddr);
+			}
+		}
+		pe->pe_dirty = false;
+		increment_ref_count(paddr);
+		held = true;
+	}
+	lock_release(pc_lock);
+	lock_release(vm_lock);
+
+	if (held) {
+		(void)pagecache_writeback(paddr);
+	}
+}
+
+/*
+ * The page cache thread: frees what eviction removed, and writes back
+ * pages eviction found dirty.
+ */
+static
+void
+pagecache_thread(void *unused1, unsigned long unused2)
+{
+	struct pc_entry *pe;
+	paddr_t paddr;
+	unsigned i;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		lock_acquire(pc_lock);
+		while (pc_reap == NULL && !pc_flushwanted) {
+			cv_wait(pc_workcv, pc_lock);
+		}
+
+		pe = pc_reap;
+		if (pe != NULL) {
+			pc_reap = pe->pe_keynext;
+			lock_release(pc_lock);
+			pc_free(pe);
+			continue;
+		}
+
+		paddr = 0;
+		for (i = 0; i < PC_HASHSIZE && paddr == 0; i++) {
+			for (pe = pc_bypage[i]; pe; pe = pe->pe_pagenext) {
+				if (pe->pe_flush) {
+					pe->pe_flush = false;
+					paddr = pe->pe_paddr;
+					break;
+				}
+			}
+		}
+		if (paddr == 0) {
+			pc_flushwanted = false;
+		}
+		lock_release(pc_lock);
+
+		if (paddr != 0) {
+			pc_clean(paddr);
+		}
+
+		/* Whether or not that freed anything up, say so */
+		lock_acquire(pc_lock);
+		cv_broadcast(pc_cv, pc_lock);
+		lock_release(pc_lock);
+	}
+}
+
+void
+pagecache_bootstrap(void)
+{
+	int result;
+
+	pc_lock = lock_create("pagecache");
+	pc_cv = cv_create("pagecache");
+	pc_workcv = cv_create("pagecache work");
+	if (pc_lock == NULL || pc_cv == NULL || pc_workcv == NULL) {
+		panic("pagecache_bootstrap: out of memory\n");
+	}
+
+	result = thread_fork("pagecache", NULL, pagecache_thread, NULL, 0);
+	if (result) {
+		panic("pagecache_bootstrap: thread_fork: %s\n",
+		      strerror(result));
+	}
+}
+
+int
+pagecache_readpage(struct vnode *v, off_t off, unsigned lo, unsigned hi,
+		   vaddr_t kvaddr)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(lo <= hi && hi <= PAGE_SIZE);
+
+	bzero((void *)kvaddr, PAGE_SIZE);
+	if (lo == hi) {
+		return 0;
+	}
+
+	uio_kinit(&iov, &ku, (void *)(kvaddr + lo), hi - lo, off + lo,
+		  UIO_READ);
+	result = VOP_READ(v, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		/* short read; file truncated under us? */
+		return EIO;
+	}
+	return 0;
+}
+
+int
+pagecache_map(struct vnode *v, off_t off, unsigned lo, unsigned hi,
+	      struct addrspace *as, vaddr_t vaddr, paddr_t *ret, bool *shared)
+{
+	struct pc_entry *pe;
+	struct pc_map *pm;
+	vaddr_t kvaddr;
+	int result;
+
+	pm = kmalloc(sizeof(*pm));
+	if (pm == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(pc_lock);
+	pe = pc_lookup(v, off, lo, hi);
+	if (pe != NULL && !pe->pe_busy) {
+		pc_addmap(pe, pm, as, vaddr);
+		*ret = pe->pe_paddr;
+		*shared = true;
+		lock_release(pc_lock);
+		return 0;
+	}
+	lock_release(pc_lock);
+
+	/*
+	 * Getting a page may have to evict one, which takes vm_lock;
+	 * unmapping takes pc_lock under vm_lock, so don't hold it here.
+	 */
+	kvaddr = alloc_upage();
+	if (kvaddr == 0) {
+		kfree(pm);
+		return ENOMEM;
+	}
+
+	lock_acquire(pc_lock);
+	pe = pc_lookup(v, off, lo, hi);
+	if (pe != NULL && !pe->pe_busy) {
+		/* Filled in while we were allocating. */
+		pc_addmap(pe, pm, as, vaddr);
+		*ret = pe->pe_paddr;
+		*shared = true;
+		lock_release(pc_lock);
+		free_kpages(kvaddr);
+		return 0;
+	}
+
+	if (pe != NULL) {
+		/*
+		 * Someone else is reading this page. Don't wait for
+		 * them: they may need a lock (e.g. the filesystem's)
+		 * that we hold if we faulted inside a read or write.
+		 * Read a private copy instead.
+		 */
+		lock_release(pc_lock);
+		kfree(pm);
+		result = pagecache_readpage(v, off, lo, hi, kvaddr);
+		if (result) {
+			free_kpages(kvaddr);
+			return result;
+		}
+		*ret = KVADDR_TO_PADDR(kvaddr);
+		*shared = false;
+		return 0;
+	}
+
+	pe = kmalloc(sizeof(*pe));
+	if (pe == NULL) {
+		free_kpages(kvaddr);
+		lock_release(pc_lock);
+		kfree(pm);
+		return ENOMEM;
+	}
+	VOP_INCREF(v);
+	pe->pe_vnode = v;
+	pe->pe_off = off;
+	pe->pe_lo = lo;
+	pe->pe_hi = hi;
+	pe->pe_paddr = KVADDR_TO_PADDR(kvaddr);	/* the cache's reference */
+	pe->pe_busy = true;
+	pe->pe_stale = false;
+	pe->pe_gone = false;
+	pe->pe_dirty = false;
+	pe->pe_flush = false;
+	pe->pe_idle = false;
+	pe->pe_writer = NULL;
+	pe->pe_maps = NULL;
+	pc_insert(pe);
+	lock_release(pc_lock);
+
+	result = pagecache_readpage(v, off, lo, hi, kvaddr);
+
+	lock_acquire(pc_lock);
+	if (result || pe->pe_stale) {
+		/*
+		 * If the file was written meanwhile, what we read may
+		 * be from before; it is as good as a private copy read
+		 * then, but mustn't be shared with later mappings.
+		 */
+		pc_remove(pe);
+		lock_release(pc_lock);
+		kfree(pm);
+		pc_free(pe);
+		if (result) {
+			free_kpages(kvaddr);
+			return result;
+		}
+		*ret = KVADDR_TO_PADDR(kvaddr);
+		*shared = false;
+		return 0;
+	}
+	pe->pe_busy = false;
+	frame_set_cached(pe->pe_paddr, true);
+	pc_addmap(pe, pm, as, vaddr);
+	*ret = pe->pe_paddr;
+	*shared = true;
+	lock_release(pc_lock);
+	return 0;
+}
+
+int
+pagecache_dup(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct pc_entry *pe;
+	struct pc_map *pm;
+
+	pm = kmalloc(sizeof(*pm));
+	if (pm == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(pc_lock);
+	pe = pc_lookup_page(paddr);
+	KASSERT(pe != NULL);
+	pc_addmap(pe, pm, as, vaddr);
+	lock_release(pc_lock);
+	return 0;
+}
+
+void
+pagecache_unmap(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct pc_entry *pe, *dead;
+	struct pc_map *pm;
+
+	lock_acquire(pc_lock);
+	pe = pc_lookup_page(paddr);
+	KASSERT(pe != NULL && !pe->pe_busy);
+	pm = pc_delmap(pe, as, vaddr);
+	dead = pc_release(pe);
+	lock_release(pc_lock);
+
+	kfree(pm);
+	if (dead != NULL) {
+		pc_free(dead);
+	}
+}
+
+vaddr_t
+pagecache_reclaim(void)
+{
+	struct pc_entry *pe;
+	paddr_t paddr;
+
+	lock_acquire(pc_lock);
+	pe = pc_idlehead;
+	if (pe == NULL) {
+		lock_release(pc_lock);
+		return 0;
+	}
+	pc_idle_remove(pe);
+	pc_remove(pe);
+
+	/* The cache's reference becomes the caller's */
+	paddr = pe->pe_paddr;
+	frame_set_cached(paddr, false);
+	pc_defer_free(pe);
+	lock_release(pc_lock);
+
+	return PADDR_TO_KVADDR(paddr);
+}
+
+int
+pagecache_evict(paddr_t paddr, bool secondchance)
+{
+	struct pc_entry *pe;
+	struct pc_map *pm;
+	pte_t *pte;
+	unsigned nmaps;
+	bool used;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	lock_acquire(pc_lock);
+	pe = pc_lookup_page(paddr);
+	if (pe == NULL || pe->pe_busy || pe->pe_gone) {
+		/* Gone meanwhile, being filled, or no longer in the file */
+		lock_release(pc_lock);
+		return EBUSY;
+	}
+	if (pe->pe_dirty) {
+		if (!pe->pe_flush) {
+			pe->pe_flush = true;
+			pc_flushwanted = true;
+			cv_signal(pc_workcv, pc_lock);
+		}
+		lock_release(pc_lock);
+		return EAGAIN;
+	}
+
+	/*
+	 * Every reference but the cache's must be a mapping already in
+	 * its page table, rather than one still being set up by
+	 * pagecache_map or a writeback's hold.
+	 */
+	nmaps = 0;
+	used = false;
+	for (pm = pe->pe_maps; pm != NULL; pm = pm->pm_next) {
+		pte = get_page(pm->pm_as, pm->pm_vaddr);
+		if (pte == NULL ||
+		    (*pte & (TLBLO_PPAGE | PTE_SHARED | TLBLO_VALID)) !=
+		    (paddr | PTE_SHARED | TLBLO_VALID)) {
+			lock_release(pc_lock);
+			return EBUSY;
+		}
+		if (*pte & PTE_ACCESSED) {
+			used = true;
+		}
+		nmaps++;
+	}
+	if (get_ref_count(paddr) != nmaps + 1) {
+		lock_release(pc_lock);
+		return EBUSY;
+	}
+
+	if (used && secondchance) {
+		/* As in evict_page: the next use sets PTE_ACCESSED again */
+		for (pm = pe->pe_maps; pm != NULL; pm = pm->pm_next) {
+			pte = get_page(pm->pm_as, pm->pm_vaddr);
+			*pte &= ~PTE_ACCESSED;
+			vm_tlb_invalidate(pm->pm_as, pm->pm_vaddr);
+		}
+		lock_release(pc_lock);
+		return EBUSY;
+	}
+
+	/* The page is clean, so the mappings can just be dropped */
+	while ((pm = pe->pe_maps) != NULL) {
+		pe->pe_maps = pm->pm_next;
+		pte = get_page(pm->pm_as, pm->pm_vaddr);
+		*pte = 0;
+		vm_tlb_invalidate(pm->pm_as, pm->pm_vaddr);
+		decrement_ref_count(paddr);
+		kfree(pm);
+	}
+	if (pe->pe_idle) {
+		pc_idle_remove(pe);
+	}
+	pc_remove(pe);
+	decrement_ref_count(paddr);
+	pc_defer_free(pe);
+	lock_release(pc_lock);
+	return 0;
+}
+
+void
+pagecache_waitflush(void)
+{
+	lock_acquire(pc_lock);
+	if (pc_flushwanted) {
+		cv_wait(pc_cv, pc_lock);
+	}
+	lock_release(pc_lock);
+}
+
+/*
+ * Get rid of the idle entries of vnode V, or of every vnode of FS.
+ */
+static
+void
+pc_purge(struct vnode *v, struct fs *fs)
+{
+	struct pc_entry *pe, *next, *dead = NULL;
+
+	lock_acquire(pc_lock);
+	for (pe = pc_idlehead; pe != NULL; pe = next) {
+		next = pe->pe_idlenext;
+		if (v != NULL ? pe->pe_vnode != v : pe->pe_vnode->vn_fs != fs) {
+			continue;
+		}
+		pc_idle_remove(pe);
+		pc_remove(pe);
+		decrement_ref_count(pe->pe_paddr);
+		pe->pe_keynext = dead;
+		dead = pe;
+	}
+	if (fs != NULL) {
+		/* Don't leave any to the thread either */
+		while ((pe = pc_reap) != NULL) {
+			pc_reap = pe->pe_keynext;
+			pe->pe_keynext = dead;
+			dead = pe;
+		}
+	}
+	lock_release(pc_lock);
+
+	while ((pe = dead) != NULL) {
+		dead = pe->pe_keynext;
+		pc_free(pe);
+	}
+}
+
+void
+pagecache_purge(struct vnode *v)
+{
+	pc_purge(v, NULL);
+}
+
+void
+pagecache_purge_fs(struct fs *fs)
+{
+	pc_purge(NULL, fs);
+}
+
+void
+pagecache_write(struct vnode *v, off_t off, const void *data, size_t len)
+{
+	struct pc_entry *pe;
+	off_t idx, start, end;
+
+	KASSERT(off >= 0);
+	if (len == 0) {
+		return;
+	}
+
+	/*
+	 * Pages start wherever their segment puts them in the file, so
+	 * look on the chain of every page number one could be filed
+	 * under and still overlap.
+	 */
+	lock_acquire(pc_lock);
+	for (idx = (off - PAGE_SIZE + 1) / PAGE_SIZE;
+	     idx <= (off + (off_t)len - 1) / PAGE_SIZE; idx++) {
+		for (pe = pc_bykey[pc_keyhash(v, idx * PAGE_SIZE)]; pe;
+		     pe = pe->pe_keynext) {
+			if (pe->pe_vnode != v) {
+				continue;
+			}
+			/* Only [lo, hi) of the page comes from the file */
+			start = pe->pe_off + pe->pe_lo;
+			end = pe->pe_off + pe->pe_hi;
+			if (start < off) {
+				start = off;
+			}
+			if (end > off + (off_t)len) {
+				end = off + (off_t)len;
+			}
+			if (start >= end) {
+				continue;
+			}
+			if (pe->pe_busy) {
+				pe->pe_stale = true;
+				continue;
+			}
+			if (pe->pe_writer == curthread) {
+				/*
+				 * This is its writeback: the data came
+				 * from the page, which may have been
+				 * stored to again since.
+				 */
+				continue;
+			}
+			memcpy((char *)PADDR_TO_KVADDR(pe->pe_paddr) +
+			       (start - pe->pe_off),
+			       (const char *)data + (start - off),
+			       end - start);
+		}
+	}
+	lock_release(pc_lock);
+}
+
+void
+pagecache_truncate(struct vnode *v, off_t len)
+{
+	struct pc_entry *pe, **pp, *dead = NULL;
+	off_t start, end;
+	unsigned i;
+
+	lock_acquire(pc_lock);
+	for (i = 0; i < PC_HASHSIZE; i++) {
+		pp = &pc_bykey[i];
+		while ((pe = *pp) != NULL) {
+			end = pe->pe_off + pe->pe_hi;
+			if (pe->pe_vnode != v || end <= len) {
+				pp = &pe->pe_keynext;
+				continue;
+			}
+			if (pe->pe_busy) {
+				pe->pe_stale = true;
+				pp = &pe->pe_keynext;
+				continue;
+			}
+
+			/*
+			 * What's left of it no longer matches the file.
+			 * Existing mappings keep it, with the part that
+			 * was cut off zeroed; later ones read the file
+			 * afresh. If there are none, it just goes.
+			 */
+			*pp = pe->pe_keynext;
+			pe->pe_gone = true;
+			if (pe->pe_idle) {
+				pc_idle_remove(pe);
+				pc_remove(pe);
+				decrement_ref_count(pe->pe_paddr);
+				pe->pe_keynext = dead;
+				dead = pe;
+				continue;
+			}
+			start = pe->pe_off + pe->pe_lo;
+			if (start < len) {
+				start = len;
+			}
+			bzero((char *)PADDR_TO_KVADDR(pe->pe_paddr) +
+			      (start - pe->pe_off), end - start);
+		}
+	}
+	lock_release(pc_lock);
+
+	/* The caller has V, so these aren't the last references */
+	while ((pe = dead) != NULL) {
+		dead = pe->pe_keynext;
+		pc_free(pe);
+	}
+}
+
+void
+pagecache_markdirty(paddr_t paddr)
+{
+	struct pc_entry *pe;
+
+	lock_acquire(pc_lock);
+	pe = pc_lookup_page(paddr);
+	KASSERT(pe != NULL && !pe->pe_busy);
+	pe->pe_dirty = true;
+	lock_release(pc_lock);
+}
+
+bool
+pagecache_hold_dirty(paddr_t paddr, bool *sole)
+{
+	struct pc_entry *pe;
+
+	*sole = false;
+
+	lock_acquire(pc_lock);
+	pe = pc_lookup_page(paddr);
+	KASSERT(pe != NULL && !pe->pe_busy);
+	if (!pe->pe_dirty) {
+		lock_release(pc_lock);
+		return false;
+	}
+
+	/*
+	 * With nobody else mapping the page, nobody else can write it
+	 * without faulting first, once the caller's entry is clean.
+	 */
+	if (get_ref_count(paddr) == 2) {
+		pe->pe_dirty = false;
+		*sole = true;
+	}
+	increment_ref_count(paddr);
+	lock_release(pc_lock);
+	return true;
+}
+
+int
+pagecache_writeback(paddr_t paddr)
+{
+	struct pc_entry *pe, *dead;
+	struct vnode *v;
+	struct stat st;
+	struct iovec iov;
+	struct uio ku;
+	off_t off;
+	unsigned lo, hi;
+	int result;
+
+	/*
+	 * The hold keeps the entry from going away. One writeback of
+	 * a page at a time, so pagecache_write can tell which it is.
+	 */
+	lock_acquire(pc_lock);
+	pe = pc_lookup_page(paddr);
+	KASSERT(pe != NULL && !pe->pe_busy);
+	while (pe->pe_writer != NULL) {
+		cv_wait(pc_cv, pc_lock);
+	}
+	pe->pe_writer = curthread;
+	v = pe->pe_vnode;
+	off = pe->pe_off;
+	lo = pe->pe_lo;
+	hi = pe->pe_hi;
+	lock_release(pc_lock);
+
+	/* Whatever lies past the end of the file now stays there */
+	result = VOP_STAT(v, &st);
+	if (result == 0) {
+		if (off + hi > st.st_size) {
+			hi = st.st_size > off + lo ? st.st_size - off : lo;
+		}
+		if (lo < hi) {
+			uio_kinit(&iov, &ku,
+				  (void *)(PADDR_TO_KVADDR(paddr) + lo),
+				  hi - lo, off + lo, UIO_WRITE);
+			result = VOP_WRITE(v, &ku);
+		}
+	}
+
+	lock_acquire(pc_lock);
+	pe->pe_writer = NULL;
+	if (result) {
+		pe->pe_dirty = true;
+	}
+	cv_broadcast(pc_cv, pc_lock);
+	dead = pc_release(pe);
+	lock_release(pc_lock);
+
+	if (dead != NULL) {
+		pc_free(dead);
+	}
+	return result;
+}
@@ -0,0 +1,144 @@
+/*
+ * Swap space on a raw disk device.
+ * See <swap.h> for the interface.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+
+/*
+ * The bitmap and reference counts are protected by swap_spinlock.
+ * I/O is not: a slot is only read or written by whoever holds a
+ * reference to it, and the VM system serializes those.
+ */
+
+static struct vnode *swap_vnode;	/* NULL if swapping is disabled */
+static unsigned swap_nslots;
+static struct bitmap *swap_map;		/* slots in use */
+static uint16_t *swap_refs;		/* references to each slot */
+static struct spinlock swap_spinlock = SPINLOCK_INITIALIZER;
+
+void
+swap_bootstrap(void)
+{
+	char path[] = SWAP_DEVICE;
+	struct stat st;
+	int result;
+
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s; swapping disabled\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap: stat %s: %s\n", SWAP_DEVICE, strerror(result));
+	}
+	swap_nslots = st.st_size / PAGE_SIZE;
+
+	swap_map = bitmap_create(swap_nslots);
+	swap_refs = kmalloc(swap_nslots * sizeof(swap_refs[0]));
+	if (swap_map == NULL || swap_refs == NULL) {
+		panic("swap_bootstrap: out of memory\n");
+	}
+	bzero(swap_refs, swap_nslots * sizeof(swap_refs[0]));
+
+	kprintf("swap: %uk on %s\n", swap_nslots * PAGE_SIZE / 1024,
+		SWAP_DEVICE);
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	if (swap_vnode == NULL) {
+		return ENOSPC;
+	}
+
+	spinlock_acquire(&swap_spinlock);
+	result = bitmap_alloc(swap_map, slot);
+	if (result == 0) {
+		KASSERT(swap_refs[*slot] == 0);
+		swap_refs[*slot] = 1;
+	}
+	spinlock_release(&swap_spinlock);
+
+	return result;
+}
+
+void
+swap_dup(unsigned slot)
+{
+	spinlock_acquire(&swap_spinlock);
+	KASSERT(slot < swap_nslots);
+	KASSERT(swap_refs[slot] > 0 && swap_refs[slot] < 0xffff);
+	swap_refs[slot]++;
+	spinlock_release(&swap_spinlock);
+}
+
+void
+swap_free(unsigned slot)
+{
+	spinlock_acquire(&swap_spinlock);
+	KASSERT(slot < swap_nslots);
+	KASSERT(swap_refs[slot] > 0);
+	swap_refs[slot]--;
+	if (swap_refs[slot] == 0) {
+		bitmap_unmark(swap_map, slot);
+	}
+	spinlock_release(&swap_spinlock);
+}
+
+static
+int
+swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(slot < swap_nslots);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_write(unsigned slot, paddr_t paddr)
+{
+	return swap_io(slot, paddr, UIO_WRITE);
+}
+
+int
+swap_read(unsigned slot, paddr_t paddr)
+{
+	return swap_io(slot, paddr, UIO_READ);
+}
@@ -7,145 +7,843 @@
 #include <machine/tlb.h>
 #include <spl.h>
 #include <elf.h>
+#include <cpu.h>
 #include <current.h>
 #include <proc.h>
-#include <addrspace.h>
+#include <synch.h>
+#include <platform/maxcpus.h>
+#include <pagecache.h>
+#include <swap.h>
+#include <zeropool.h>
 
-// Frame table
-struct frame frame_table[NUM_ROOT_ENTRIES * NUM_SECONDARY_ENTRIES];
+struct lock *vm_lock;
 
-// Frame table functions
+// Signalled whenever a PTE stops being PTE_BUSY
+static struct cv *vm_busy_cv;
 
-void decrement_ref_count(paddr_t paddr) {
-    // Disable interrupts when changing frame table
-    int spl = splhigh();
-    paddr = paddr >> 12;
+// Replies to TLB shootdowns sent to other CPUs (see tlb_shootdown)
+static struct semaphore *tlb_shootdown_done;
+
+// The page table of the address space running on each CPU, for the TLB
+// refill handler in exception-mips1.S (indexed by CPU number, like
+// cpustacks[]). A slot points at the as_pt field rather than the table,
+// so a root table allocated later is picked up; CPUs with no address
+// space point at no_page_table. The handler can't cope with NULL here.
+static pte_t **no_page_table = NULL;
+pte_t **const *cpupagetables[MAXCPUS] = {
+    [0 ... MAXCPUS - 1] = &no_page_table
+};
+
+// Event counters, one set per CPU (see vm_printstats). Only the local
+// CPU's set is updated, without locking, so a thread migrating in the
+// middle of an update can make the totals very slightly off.
+struct vmstats {
+    unsigned vs_faults;         // TLB misses that reached vm_fault
+    unsigned vs_reloads;        // ... for pages that were already present
+    unsigned vs_zerofills;      // new zero-filled pages
+    unsigned vs_filefills;      // pages read in from a file
+    unsigned vs_swapins;        // pages read back from swap
+    unsigned vs_evictions;      // pages paged out (to swap, or dropped)
+    unsigned vs_cowfaults;      // writes to copy-on-write pages
+    unsigned vs_cowcopies;      // ... that had to copy the page
+    unsigned vs_cowreowns;      // copy-on-write frames down to one sharer
+    unsigned vs_invalidations;  // TLB entries removed by vm_tlb_invalidate
+    unsigned vs_shootdowns;     // ... and requests sent for other CPUs
+    unsigned vs_reserved;       // entries loaded into the reserved slots
+    unsigned vs_locks;          // times vm_lock was taken
+    unsigned vs_lockwaits;      // ... while another thread held it
+};
+static struct vmstats vm_cpustats[MAXCPUS];
+
+#define VMSTAT(field) (vm_cpustats[curcpu->c_number].field++)
+
+// TLB slots below this are never picked by tlbwr (the Random register
+// only covers 8..63), so tlb_load fills them itself, round robin, with
+// stack and text pages: nearly every instruction touches those, and a
+// random refill shouldn't throw them out.
+#define TLB_NRESERVED 8
+static unsigned tlb_nextreserved[MAXCPUS];
+
+// Free frames kept back for the kernel's own allocations. kmalloc never
+// evicts anything, so user pages start being swapped out at this point.
+#define VM_RESERVE_FRAMES 16
+
+/* Place your page table functions here */
 
-    (frame_table[paddr].ref_count)--;
-    if (frame_table[paddr].ref_count == 0) {
-        free_kpages(PADDR_TO_KVADDR(paddr << 12));
+// Takes vm_lock, counting how often that meant waiting for another
+// thread. The holder is looked at without the lock's spinlock, which is
+// good enough for counting.
+void vm_lock_acquire(void) {
+    VMSTAT(vs_locks);
+    if (vm_lock->lk_holder != NULL) {
+        VMSTAT(vs_lockwaits);
     }
-    splx(spl);
+    lock_acquire(vm_lock);
 }
 
-void increment_ref_count(paddr_t paddr) {
-    // Disable interrupts when changing frame table
-    int spl = splhigh();
-    paddr = paddr >> 12;
+// Every address space that has a page table, for pt_release_frame.
+// Protected by vm_lock.
+static struct addrspace *pt_all = NULL;
 
-    KASSERT(frame_table[paddr].ref_count > 0); // If you need new pages, use ensure_paddr
+static void pt_link(struct addrspace *as) {
+    as->as_ptprev = NULL;
+    as->as_ptnext = pt_all;
+    if (pt_all != NULL) {
+        pt_all->as_ptprev = as;
+    }
+    pt_all = as;
+}
 
-    (frame_table[paddr].ref_count)++;
-    splx(spl);
+static void pt_unlink(struct addrspace *as) {
+    if (as->as_ptprev != NULL) {
+        as->as_ptprev->as_ptnext = as->as_ptnext;
+    } else {
+        pt_all = as->as_ptnext;
+    }
+    if (as->as_ptnext != NULL) {
+        as->as_ptnext->as_ptprev = as->as_ptprev;
+    }
 }
 
-/* Place your page table functions here */
+// Split a user address into its root and secondary page table indices,
+// and put it back together.
+#define PT_ROOT_INDEX(vaddr)      ((vaddr) >> 22)
+#define PT_SECONDARY_INDEX(vaddr) (((vaddr) >> 12) & (NUM_SECONDARY_ENTRIES - 1))
+#define PT_VADDR(root, index)     (((vaddr_t)(root) << 22) | ((vaddr_t)(index) << 12))
 
-// Allocates a secondary page table at specified index of the root page table.
-void create_secondary_table(struct addrspace *as, int index);
+pte_t * get_page_create(struct addrspace *as, vaddr_t address) {
+    uint32_t prefix = PT_ROOT_INDEX(address);
+    uint32_t secondary_index = PT_SECONDARY_INDEX(address);
 
+    KASSERT(address < USERSPACETOP);
+
+    if (as->as_pt == NULL) {
+        as->as_pt = kmalloc(NUM_ROOT_ENTRIES * sizeof(pte_t *));
+        if (as->as_pt == NULL) {
+            return NULL;
+        }
+        bzero(as->as_pt, NUM_ROOT_ENTRIES * sizeof(pte_t *));
+        pt_link(as);
+    }
 
-void add_single_vaddr_page(struct addrspace *as, vaddr_t address, int flags) {
-    // Number of the page we are looking for
-    uint32_t page_num = ((uint32_t) address) / PAGE_SIZE;
+    if (as->as_pt[prefix] == NULL) {
+        // An all-zero PTE is a page that has not been touched yet
+        as->as_pt[prefix] = kmalloc(NUM_SECONDARY_ENTRIES * sizeof(pte_t));
+        if (as->as_pt[prefix] == NULL) {
+            return NULL;
+        }
+        bzero(as->as_pt[prefix], NUM_SECONDARY_ENTRIES * sizeof(pte_t));
+    }
 
-    // Get indices
-    uint32_t prefix = page_num >> 10;
-    uint32_t secondary_index = page_num ^ (prefix << 10);
+    return &as->as_pt[prefix][secondary_index];
+}
 
-    // Only fails if page table corrupt or hasn't been initialised
-    KASSERT(as->page_table[prefix].vaddr_prefix == prefix);
+pte_t * get_page(struct addrspace *as, vaddr_t address) {
+    uint32_t prefix = PT_ROOT_INDEX(address);
 
-    if (as->page_table[prefix].target == NULL){
-        create_secondary_table(as, prefix);
+    // If prefix is for an address which is too big
+    if (address >= USERSPACETOP) {
+        return NULL;
     }
 
-    struct secondary_page_entry *secondary_page = &(as->page_table[prefix].target[secondary_index]);
-    KASSERT(secondary_page->vaddr == page_num);
+    if (as->as_pt == NULL || as->as_pt[prefix] == NULL) {
+        return NULL;
+    }
 
-    secondary_page->flags = flags;
+    return &as->as_pt[prefix][PT_SECONDARY_INDEX(address)];
 }
 
-struct secondary_page_entry * get_page(struct addrspace *as, vaddr_t address) {
-    // Number of the page we are looking for
-    uint32_t page_num = ((uint32_t) address) / PAGE_SIZE;
+// -------------
+// Paging to swap
+// -------------
 
-    // Get indices
-    uint32_t prefix = page_num >> 10;
-    uint32_t secondary_index = page_num ^ (prefix << 10);
+// How many victims the clock may offer whose PTE_ACCESSED is set before
+// evict_page takes one anyway. Each pass over one costs a shootdown.
+#define EVICT_MAX_SKIPS 16
 
-    // If prefix is for an address which is too big
-    if (prefix >= NUM_ROOT_ENTRIES) {
-        return NULL;
+// How many page cache victims that can't go yet (dirty, or being filled
+// or written back) evict_page passes over before giving up.
+#define EVICT_MAX_BUSY 64
+
+// Evicts one user page chosen by the frame table's clock. Unmodified
+// file pages are just dropped (they are read again on the next fault);
+// anything else is written to swap. Caller holds vm_lock, which is
+// dropped during the write. A page cache frame is handed to the page
+// cache, which drops it from every page table mapping it; dirty ones
+// are written back by the page cache thread first. Returns EAGAIN if
+// only such pages were found.
+//
+// The clock only sees the faults that reach vm_fault; a page in use is
+// mostly refilled by the TLB refill handler, which sets PTE_ACCESSED
+// instead. A victim with that set is given another chance: the bit is
+// cleared and the page dropped from every TLB, so that the next use
+// sets it again.
+static int evict_page(void) {
+    struct addrspace *as;
+    vaddr_t vaddr;
+    paddr_t paddr;
+    pte_t *pte, old;
+    unsigned slot = 0;
+    unsigned skips, busy = 0;
+    bool flushing = false;
+    int result;
+
+    for (skips = 0; ; skips++) {
+        paddr = frame_choose_victim(&as, &vaddr);
+        if (paddr == 0) {
+            return flushing ? EAGAIN : ENOMEM;
+        }
+
+        if (as == NULL) {
+            result = pagecache_evict(paddr, skips < EVICT_MAX_SKIPS);
+            if (result == 0) {
+                VMSTAT(vs_evictions);
+                return 0;
+            }
+            if (result == EAGAIN) {
+                flushing = true;
+            }
+            if (++busy == EVICT_MAX_BUSY) {
+                return flushing ? EAGAIN : ENOMEM;
+            }
+            continue;
+        }
+
+        pte = get_page(as, vaddr);
+        KASSERT(pte != NULL && (*pte & TLBLO_VALID));
+        KASSERT((*pte & TLBLO_PPAGE) == paddr);
+        KASSERT((*pte & (PTE_COW | PTE_SHARED)) == 0);
+        if ((*pte & PTE_ACCESSED) == 0 || skips == EVICT_MAX_SKIPS) {
+            break;
+        }
+        *pte &= ~PTE_ACCESSED;
+        vm_tlb_invalidate(as, vaddr);
     }
+    old = *pte;
 
-    // Only fails if page table corrupt or hasn't been initialised
-    KASSERT(as->page_table[prefix].vaddr_prefix == prefix);
+    VMSTAT(vs_evictions);
+    if (old & PTE_FILE) {
+        *pte = 0;
+    } else {
+        result = swap_alloc(&slot);
+        if (result) {
+            return result;
+        }
+        *pte = PTE_MKSWAP(slot, old & PTE_PERMS) | PTE_BUSY;
+    }
 
-    //This function should not be called without calling add_single_vaddr_page first
-    if (as->page_table[prefix].target == NULL) {
-        return NULL;
+    // The owner may be running on another CPU. Nothing may write the
+    // frame once it is being copied out, let alone once it is freed.
+    vm_tlb_invalidate(as, vaddr);
+    frame_set_owner(paddr, NULL, 0);
+
+    if (*pte & PTE_SWAPPED) {
+        // The frame has no owner now, so nobody else picks it, and
+        // the busy entry keeps its table (and as) alive
+        lock_release(vm_lock);
+        result = swap_write(slot, paddr);
+        vm_lock_acquire();
+        if (result) {
+            swap_free(slot);
+            // as_prepare_load may have changed the permissions meanwhile
+            *pte = (old & ~PTE_PERMS) | (*pte & PTE_PERMS);
+            frame_set_owner(paddr, as, vaddr);
+        } else {
+            *pte &= ~PTE_BUSY;
+        }
+        cv_broadcast(vm_busy_cv, vm_lock);
+        if (result) {
+            return result;
+        }
     }
 
-    return &(as->page_table[prefix].target[secondary_index]);
+    decrement_ref_count(paddr);
+    return 0;
 }
 
-void ensure_paddr(struct secondary_page_entry * page){
-    // We only need to add a paddr if it does not exist.
-    if (page->paddr == USERSPACETOP){
-        // Get a single page
-        paddr_t new_page = KVADDR_TO_PADDR(alloc_kpages(1));
+void pt_wait_idle(pte_t *pte) {
+    KASSERT(lock_do_i_hold(vm_lock));
+    while (*pte & PTE_BUSY) {
+        cv_wait(vm_busy_cv, vm_lock);
+    }
+}
 
-        if (PADDR_TO_KVADDR(new_page) == (int) NULL){
-            panic("vm_fault: Unable to allocate new frame\n");
+// Waits until no entry of a secondary table is PTE_BUSY. Since entries
+// only become busy under vm_lock, none do until the caller lets go of it.
+static void table_wait_idle(pte_t *table) {
+    int i;
+
+    for (i = 0; i < NUM_SECONDARY_ENTRIES; i++) {
+        if (table[i] & PTE_BUSY) {
+            pt_wait_idle(&table[i]);
+            // Others may have become busy while we slept
+            i = -1;
         }
+    }
+}
 
-        // Update frame table (without interrupts)
-        int spl = splhigh();
-        frame_table[new_page >> 12].ref_count = 1;
-        splx(spl);
+// How many times vm_getpage waits for the page cache thread to write
+// back a page before it gives up.
+#define VM_MAX_FLUSHWAITS 8
 
-        // Zero-fill
-        bzero((void *)PADDR_TO_KVADDR(new_page), PAGE_SIZE);
+// Gets a page for user memory, evicting once free memory is down to
+// the kernel's reserve. Caller holds vm_lock, which evicting drops for
+// a while.
+static vaddr_t vm_getpage(void) {
+    vaddr_t kvaddr;
+    unsigned waits = 0;
+    int result;
 
-        // Set paddr up in the same form that gets passed to the tlb.
-        uint32_t low = (TLBLO_PPAGE & new_page);
+    KASSERT(lock_do_i_hold(vm_lock));
+
+    if (frame_nfree() <= VM_RESERVE_FRAMES) {
+        // Pre-zeroed pages are the cheapest thing to give up, then
+        // cached pages nobody maps
+        kvaddr = zeropool_reclaim();
+        if (kvaddr == 0) {
+            kvaddr = pagecache_reclaim();
+        }
+        if (kvaddr != 0) {
+            return kvaddr;
+        }
+        // Not fatal yet; the reserve itself can still be used
+        (void)evict_page();
+    }
+
+    kvaddr = alloc_kpages(1);
+    while (kvaddr == 0) {
+        kvaddr = pagecache_reclaim();
+        if (kvaddr != 0) {
+            break;
+        }
+        result = evict_page();
+        if (result == EAGAIN && !curthread->t_fsio &&
+            waits++ < VM_MAX_FLUSHWAITS) {
+            // Only dirty cached pages are left. Wait for one to be
+            // written back; not from inside a read or write, though,
+            // as the writeback may need the filesystem's locks.
+            lock_release(vm_lock);
+            pagecache_waitflush();
+            vm_lock_acquire();
+        } else if (result) {
+            return 0;
+        }
+        kvaddr = alloc_kpages(1);
+    }
+    return kvaddr;
+}
+
+vaddr_t alloc_upage(void) {
+    vaddr_t kvaddr;
+
+    vm_lock_acquire();
+    kvaddr = vm_getpage();
+    lock_release(vm_lock);
+
+    return kvaddr;
+}
+
+// Reads a swapped-out page back into a new frame. Caller holds vm_lock;
+// it is dropped during the read.
+static int swap_in_page(pte_t *pte) {
+    unsigned slot = PTE_SWAPSLOT(*pte);
+    int perms = *pte & PTE_PERMS;
+    vaddr_t kvaddr;
+    int result;
+
+    kvaddr = vm_getpage();
+    if (kvaddr == 0) {
+        return ENOMEM;
+    }
+
+    // The entry is not valid, so only this thread changes it, and the
+    // new frame has no owner yet, so it can't be evicted
+    lock_release(vm_lock);
+    result = swap_read(slot, KVADDR_TO_PADDR(kvaddr));
+    vm_lock_acquire();
+    if (result) {
+        free_kpages(kvaddr);
+        return result;
+    }
+
+    // A slot shared by fork stays with the other address spaces;
+    // this one now has its own copy.
+    swap_free(slot);
+    VMSTAT(vs_swapins);
+
+    *pte = KVADDR_TO_PADDR(kvaddr) | TLBLO_VALID | perms;
+    if (perms & PF_W) {
+        *pte |= TLBLO_DIRTY;
+    }
+    return 0;
+}
 
-        int flags = page->flags;
+int ensure_paddr(pte_t *pte, int perms){
+    // We only need to add a paddr if it does not exist.
+    if ((*pte & TLBLO_VALID) == 0){
+        // Get a single zeroed page, from the pool if it has one
+        vaddr_t kvaddr = zeropool_get();
+        if (kvaddr == 0) {
+            kvaddr = vm_getpage();
+            if (kvaddr == 0){
+                return ENOMEM;
+            }
+            bzero((void *)kvaddr, PAGE_SIZE);
+        }
 
-        int writeable = flags & PF_W;
+        // Set paddr up in the same form that gets passed to the tlb.
+        uint32_t low = KVADDR_TO_PADDR(kvaddr) & TLBLO_PPAGE;
 
-        if (writeable) {
+        if (perms & PF_W) {
             low = low | TLBLO_DIRTY;
         }
 
         low = low | TLBLO_VALID;
 
-        page->paddr = low;
-        KASSERT(page->paddr != USERSPACETOP);
+        *pte = low | (perms & PTE_PERMS);
+    }
+
+    KASSERT(*pte & TLBLO_VALID);
+    return 0;
+}
+
+// Releases the frames mapped by secondary table ROOT of as, and the
+// table itself
+static void free_secondary_table(struct addrspace *as, int root) {
+    pte_t *table = as->as_pt[root];
+    pte_t old;
+    int i;
+
+    table_wait_idle(table);
+    for (i = 0; i < NUM_SECONDARY_ENTRIES; i++) {
+        if (table[i] & PTE_SHARED) {
+            pagecache_unmap(table[i] & TLBLO_PPAGE, as,
+                            PT_VADDR(root, i));
+        } else if (table[i] & PTE_SWAPPED) {
+            swap_free(PTE_SWAPSLOT(table[i]));
+        } else if (table[i] & TLBLO_VALID) {
+            old = table[i];
+            table[i] = 0;
+            pt_release_frame(old, PT_VADDR(root, i));
+        }
+    }
+    kfree(table);
+}
+
+// With one sharer left, a copy-on-write frame is that one's to write
+// without copying, and it becomes the frame's owner so that the page
+// can be evicted again. Sharers all map the frame at the same address
+// (fork copies page tables as they are), so the last one is found by
+// looking there in each address space.
+void pt_release_frame(pte_t old, vaddr_t vaddr) {
+    paddr_t paddr = old & TLBLO_PPAGE;
+    struct addrspace *as;
+    pte_t *pte;
+
+    KASSERT(lock_do_i_hold(vm_lock));
+    KASSERT((old & (TLBLO_VALID | PTE_SHARED)) == TLBLO_VALID);
+
+    decrement_ref_count(paddr);
+    if ((old & PTE_COW) == 0 || get_ref_count(paddr) != 1) {
+        return;
+    }
+
+    for (as = pt_all; as != NULL; as = as->as_ptnext) {
+        pte = get_page(as, vaddr);
+        if (pte != NULL &&
+            (*pte & (TLBLO_PPAGE | TLBLO_VALID | PTE_COW | PTE_SHARED)) ==
+            (paddr | TLBLO_VALID | PTE_COW)) {
+            // Its TLB entry may still be read-only; a write just
+            // reloads it
+            *pte &= ~PTE_COW;
+            if (*pte & PF_W) {
+                *pte |= TLBLO_DIRTY;
+            }
+            frame_set_owner(paddr, as, vaddr);
+            VMSTAT(vs_cowreowns);
+            return;
+        }
+    }
+}
+
+void pt_foreach(struct addrspace *as, vaddr_t start, vaddr_t end,
+                void (*fn)(struct addrspace *as, vaddr_t vaddr, pte_t *pte, void *data),
+                void *data) {
+    vaddr_t vaddr;
+    pte_t *table;
+
+    if (as->as_pt == NULL) {
+        return;
+    }
+
+    KASSERT(end <= USERSPACETOP);
+    vaddr = start & PAGE_FRAME;
+    while (vaddr < end) {
+        table = as->as_pt[PT_ROOT_INDEX(vaddr)];
+        if (table == NULL) {
+            // Skip to the start of the next secondary table
+            vaddr = (vaddr | ((NUM_SECONDARY_ENTRIES * PAGE_SIZE) - 1)) + 1;
+            if (vaddr == 0) {
+                break;
+            }
+            continue;
+        }
+        if (table[PT_SECONDARY_INDEX(vaddr)] != 0) {
+            fn(as, vaddr, &table[PT_SECONDARY_INDEX(vaddr)], data);
+        }
+        vaddr += PAGE_SIZE;
+    }
+}
+
+// Copies old's page table into new, which has none yet, for fork. Every
+// present private page becomes copy-on-write in both. This goes a whole
+// secondary table at a time: the frame references for a table are taken
+// in one batch, and the TLB is cleaned once at the end rather than page
+// by page. Caller holds vm_lock.
+int pt_copy(struct addrspace *old, struct addrspace *new) {
+    paddr_t *batch;
+    pte_t *from, *to;
+    unsigned nbatch;
+    int i, j;
+    int result = 0;
+
+    KASSERT(new->as_pt == NULL);
+
+    if (old->as_pt == NULL) {
+        return 0;
+    }
+
+    new->as_pt = kmalloc(NUM_ROOT_ENTRIES * sizeof(pte_t *));
+    if (new->as_pt == NULL) {
+        return ENOMEM;
+    }
+    bzero(new->as_pt, NUM_ROOT_ENTRIES * sizeof(pte_t *));
+    pt_link(new);
+
+    batch = kmalloc(NUM_SECONDARY_ENTRIES * sizeof(paddr_t));
+    if (batch == NULL) {
+        return ENOMEM;
+    }
+
+    for (i = 0; i < NUM_ROOT_ENTRIES; i++) {
+        from = old->as_pt[i];
+        if (from == NULL) {
+            continue;
+        }
+
+        // Allocate before touching the old table, so a failure leaves
+        // every page it has marked accounted for
+        to = kmalloc(NUM_SECONDARY_ENTRIES * sizeof(pte_t));
+        if (to == NULL) {
+            result = ENOMEM;
+            break;
+        }
+
+        // A page still on its way to swap can't be shared yet. Pages
+        // only start on the way out under vm_lock, which is held from
+        // here to the end of the table.
+        table_wait_idle(from);
+
+        nbatch = 0;
+        for (j = 0; j < NUM_SECONDARY_ENTRIES; j++) {
+            to[j] = from[j];
+            if (from[j] & PTE_SHARED) {
+                // Page cache frames are simply shared. The child's first
+                // write through a shared file mapping must still be
+                // seen, so its entry starts out clean. If the cache
+                // can't note the new mapping, the child just faults
+                // the page in again.
+                if (pagecache_dup(from[j] & TLBLO_PPAGE, new,
+                                  PT_VADDR(i, j))) {
+                    to[j] = 0;
+                } else {
+                    to[j] &= ~TLBLO_DIRTY;
+                }
+            } else if ((from[j] & (PTE_FILE | PF_W)) == (PTE_FILE | PF_W)) {
+                // A stand-in for a busy shared page; the child gets the
+                // real one when it faults
+                to[j] = 0;
+            } else if (from[j] & PTE_SWAPPED) {
+                // Each side will read in its own copy
+                swap_dup(PTE_SWAPSLOT(from[j]));
+            } else if (from[j] & TLBLO_VALID) {
+                // Note that we don't just do this for pages with write permission
+                // This is because as_prepare_load can change permissions.
+                from[j] = (from[j] | PTE_COW) & ~TLBLO_DIRTY;
+                batch[nbatch++] = from[j] & TLBLO_PPAGE;
+                to[j] = from[j];
+            }
+        }
+        increment_ref_counts(batch, nbatch);
+        new->as_pt[i] = to;
+    }
+    kfree(batch);
+
+    // Writable entries of the old address space are now stale
+    vm_tlb_flush_writable(old);
+
+    return result;
+}
+
+void free_page_table(struct addrspace *as) {
+    int i;
+
+    if (as->as_pt == NULL) {
+        return;
     }
 
-    KASSERT(page->paddr != USERSPACETOP);
+    // Free secondary tables (if they're allocated)
+    for (i = 0; i < NUM_ROOT_ENTRIES; i++) {
+        if (as->as_pt[i] != NULL) {
+            free_secondary_table(as, i);
+        }
+    }
+    kfree(as->as_pt);
+    as->as_pt = NULL;
+    pt_unlink(as);
 }
 
-// Creates and initialises a secondary page table, at the index specified
-void create_secondary_table(struct addrspace *as, int prefix){
+void pt_activate(struct addrspace *as) {
+    cpupagetables[curcpu->c_number] = &as->as_pt;
+}
 
-    // This function shouldn't be called on an existing secondary table
-    KASSERT(as->page_table[prefix].target == NULL);
+void pt_forget(struct addrspace *as) {
+    unsigned i;
 
-    as->page_table[prefix].target = kmalloc(NUM_SECONDARY_ENTRIES * sizeof(struct secondary_page_entry));
-    if (as->page_table[prefix].target == NULL) {
-        panic("vm_fault: could not allocate a secondary page table!\n");
+    // A dying address space is not running anywhere, so this can't race
+    // with pt_activate for it.
+    for (i = 0; i < MAXCPUS; i++) {
+        if (cpupagetables[i] == &as->as_pt) {
+            cpupagetables[i] = &no_page_table;
+        }
     }
+}
 
+// Carries out a shootdown on this CPU's TLB.
+static void tlb_shootdown_local(const struct tlbshootdown *ts) {
+    uint32_t pid = ts->ts_asid << TLBHI_PIDSHIFT;
+    uint32_t hi, lo;
     int i;
-    for (i=0; i < NUM_SECONDARY_ENTRIES; i++){
-        as->page_table[prefix].target[i].vaddr = (prefix << 10) | i;
-        as->page_table[prefix].target[i].paddr = USERSPACETOP;
-        as->page_table[prefix].target[i].copy_on_write = 0;
-        as->page_table[prefix].target[i].flags = -1;
+
+    // Disable interrupts on this CPU while frobbing the TLB.
+    int spl = splhigh();
+    if (ts->ts_writable) {
+        for (i = 0; i < NUM_TLB; i++) {
+            tlb_read(&hi, &lo, i);
+            if ((lo & TLBLO_VALID) && (lo & TLBLO_DIRTY) &&
+                (hi & TLBHI_PID) == pid) {
+                tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+                VMSTAT(vs_invalidations);
+            }
+        }
+    } else {
+        i = tlb_probe((ts->ts_vaddr & TLBHI_VPAGE) | pid, 0);
+        if (i >= 0) {
+            tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+            VMSTAT(vs_invalidations);
+        }
+    }
+    splx(spl);
+}
+
+// Carries out a shootdown on every CPU whose TLB may hold as's entries,
+// and waits until they have all done it. Everyone who sends shootdowns
+// holds vm_lock, so one semaphore is enough to count the replies.
+static void tlb_shootdown(struct addrspace *as, struct tlbshootdown *ts) {
+    uint32_t cpus;
+    unsigned n = 0;
+    int spl;
+
+    KASSERT(lock_do_i_hold(vm_lock));
+
+    // This thread mustn't move to another CPU between deciding which
+    // ones to interrupt and doing its own
+    spl = splhigh();
+    cpus = as_tlb_cpus(as, &ts->ts_asid);
+    tlb_shootdown_local(ts);
+    if (cpus != 0) {
+        n = ipi_tlbshootdown_cpus(cpus, ts);
+        vm_cpustats[curcpu->c_number].vs_shootdowns += n;
+    }
+    splx(spl);
+
+    while (n-- > 0) {
+        P(tlb_shootdown_done);
+    }
+}
+
+void vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr) {
+    struct tlbshootdown ts;
+
+    ts.ts_vaddr = vaddr & PAGE_FRAME;
+    ts.ts_writable = false;
+    tlb_shootdown(as, &ts);
+}
+
+void vm_tlb_flush_writable(struct addrspace *as) {
+    struct tlbshootdown ts;
+
+    ts.ts_vaddr = 0;
+    ts.ts_writable = true;
+    tlb_shootdown(as, &ts);
+}
+
+// Loads the translation for vaddr into the TLB. An existing entry for
+// the page is replaced in place; stack and text pages go to the reserved
+// slots, anything else to a random one.
+static void tlb_load(struct addrspace *as, vaddr_t vaddr, pte_t pte) {
+    uint32_t hi = (vaddr & TLBHI_VPAGE) | (as->as_asid << TLBHI_PIDSHIFT);
+    uint32_t lo = pte & PTE_TLBLO_MASK;
+    bool hot = (pte & PF_X) ||
+        (vaddr >= USERSTACK - USERSTACK_SIZE && vaddr < USERSTACK);
+    unsigned *next;
+    int index;
+
+    // Disable interrupts on this CPU while frobbing the TLB.
+    int spl = splhigh();
+
+    index = tlb_probe(hi, 0);
+    if (index >= 0) {
+        tlb_write(hi, lo, index);
+    } else if (hot) {
+        next = &tlb_nextreserved[curcpu->c_number];
+        tlb_write(hi, lo, *next);
+        *next = (*next + 1) % TLB_NRESERVED;
+        VMSTAT(vs_reserved);
+    } else {
+        tlb_random(hi, lo);
+    }
+
+    splx(spl);
+}
+
+// Whether any bytes of a file-backed region's file land on the page at vaddr
+static bool page_has_file_bytes(struct region *region, vaddr_t vaddr) {
+    vaddr_t file_start = region->r_filevaddr;
+    vaddr_t file_end = region->r_filevaddr + region->r_filesize;
+
+    return file_start < vaddr + PAGE_SIZE && file_end > vaddr;
+}
+
+// Reads the page at vaddr of a file-backed region from its file, and
+// returns the PTE for it. Pages come from the shared page cache, except
+// that a write to a private region reads a private copy straight away.
+// A private region's cached pages are copy-on-write; a shared region's
+// are written in place, and stay clean until vm_fault sees the first
+// write. Called without vm_lock.
+static int fill_file_page(struct addrspace *as, struct region *region,
+                          vaddr_t vaddr, int faulttype, pte_t *ret) {
+    vaddr_t file_start = region->r_filevaddr;
+    vaddr_t file_end = region->r_filevaddr + region->r_filesize;
+    unsigned lo, hi;
+    off_t off;
+    paddr_t paddr;
+    bool shared;
+    int result;
+
+    KASSERT(page_has_file_bytes(region, vaddr));
+
+    lo = file_start > vaddr ? file_start - vaddr : 0;
+    hi = file_end < vaddr + PAGE_SIZE ? file_end - vaddr : PAGE_SIZE;
+    // File offset that lines up with the start of this page
+    off = region->r_fileoff - (off_t)region->r_filevaddr + (off_t)vaddr;
+
+    if ((region->r_perms & PF_W) == 0 || region->r_shared) {
+        result = pagecache_map(region->r_vnode, off, lo, hi, as, vaddr,
+                               &paddr, &shared);
+        if (result) {
+            return result;
+        }
+        // A private copy of a read-only page can never change, so it can
+        // be dropped on eviction. One of a shared page is dropped on the
+        // first write instead, so the write goes to the cached page.
+        *ret = paddr | TLBLO_VALID | (region->r_perms & PTE_PERMS) |
+            (shared ? PTE_SHARED : PTE_FILE);
+        return 0;
+    }
+
+    if (faulttype == VM_FAULT_READ) {
+        result = pagecache_map(region->r_vnode, off, lo, hi, as, vaddr,
+                               &paddr, &shared);
+        if (result) {
+            return result;
+        }
+        // A private copy is already this process's own to write
+        *ret = paddr | TLBLO_VALID | (region->r_perms & PTE_PERMS) |
+            (shared ? (PTE_SHARED | PTE_COW) : TLBLO_DIRTY);
+        return 0;
+    }
+
+    vaddr_t kvaddr = alloc_upage();
+    if (kvaddr == 0) {
+        return ENOMEM;
+    }
+    result = pagecache_readpage(region->r_vnode, off, lo, hi, kvaddr);
+    if (result) {
+        free_kpages(kvaddr);
+        return result;
+    }
+    *ret = KVADDR_TO_PADDR(kvaddr) | TLBLO_VALID | TLBLO_DIRTY |
+        (region->r_perms & PTE_PERMS);
+    return 0;
+}
+
+// Makes the page at vaddr present: on first touch, or after it was paged
+// out. Caller holds vm_lock; it is dropped while reading from a file.
+static int page_in(struct addrspace *as, vaddr_t vaddr, int faulttype,
+                   pte_t **ptep) {
+    struct region *region;
+    pte_t *pte = *ptep;
+    pte_t newpte;
+    int result;
+
+    region = as_find_region(as, vaddr);
+    if (region == NULL) {
+        // Indicates the address is invalid
+        // (in that it was not allocated in the current process' address space.)
+        return EFAULT;
+    }
+
+    if (pte == NULL) {
+        pte = get_page_create(as, vaddr);
+        if (pte == NULL) {
+            return ENOMEM;
+        }
+        *ptep = pte;
+    }
+
+    if (*pte & PTE_SWAPPED) {
+        result = swap_in_page(pte);
+    } else if (region->r_vnode != NULL && page_has_file_bytes(region, vaddr)) {
+        // Inside a read or write the filesystem may hold locks the read
+        // would need (even this file's own); fail the copy instead, and
+        // the caller faults the page in and tries again.
+        if (curthread->t_fsio) {
+            curthread->t_fsiofault = true;
+            return EFAULT;
+        }
+        // Only this thread changes this page table entry while it is
+        // not valid, so it is safe to let go of the lock.
+        lock_release(vm_lock);
+        result = fill_file_page(as, region, vaddr, faulttype, &newpte);
+        vm_lock_acquire();
+        if (result == 0) {
+            *pte = newpte;
+            VMSTAT(vs_filefills);
+        }
+    } else {
+        // Make sure there is physical memory here to write to
+        result = ensure_paddr(pte, region->r_perms);
+        VMSTAT(vs_zerofills);
+    }
+    if (result) {
+        return result;
+    }
+
+    if ((*pte & PTE_SHARED) == 0) {
+        frame_set_owner(*pte & TLBLO_PPAGE, as, vaddr);
     }
+    return 0;
 }
 
 // ------------
@@ -155,19 +853,25 @@ void create_secondary_table(struct addrspace *as, int prefix){
 
 void vm_bootstrap(void)
 {
-    /* Initialise VM sub-system.  You probably want to initialise your 
-       frame table here as well.
+    /* Initialise VM sub-system.  The frame table is set up by
+       ram_bootstrap(), as it is sized from the amount of RAM.
     */
-
-   int i;
-   for (i = 0; i < NUM_ROOT_ENTRIES * NUM_SECONDARY_ENTRIES; i++) {
-       frame_table[i].ref_count = 0;
-   }
+    vm_lock = lock_create("vm");
+    vm_busy_cv = cv_create("vm busy");
+    tlb_shootdown_done = sem_create("tlb shootdown", 0);
+    if (vm_lock == NULL || vm_busy_cv == NULL || tlb_shootdown_done == NULL) {
+        panic("vm_bootstrap: out of memory\n");
+    }
+    pagecache_bootstrap();
+    swap_bootstrap();
+    zeropool_bootstrap();
 }
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
+    int result;
+
     if (curproc == NULL) {
 		/*
 		 * No process. This is probably a kernel fault early
@@ -186,80 +890,201 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
-    struct secondary_page_entry *page = get_page(as, faultaddress);
+    faultaddress &= PAGE_FRAME;
+
+    vm_lock_acquire();
+    pte_t *pte = get_page(as, faultaddress);
+    if (pte != NULL) {
+        // A page on its way out has to get there before it can come back
+        pt_wait_idle(pte);
+    }
 
     switch (faulttype) {
 	    case VM_FAULT_READONLY:
-        if (page->copy_on_write) break;
+        // Only legal for a writable page kept clean on purpose: one
+        // shared copy-on-write, or one of a shared file mapping
+        if (pte != NULL && (*pte & TLBLO_VALID) && (*pte & PF_W)) break;
+        lock_release(vm_lock);
 		return EFAULT;
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
+        VMSTAT(vs_faults);
 		break;
 	    default:
+        lock_release(vm_lock);
 		return EINVAL;
 	}
 
-    if (page == NULL || page->flags == -1) {
-        // Indicates the address is invalid
-        // (in that it was not allocated in the current process' address space.)
-        return EFAULT;
-    }
-
-    if (page->copy_on_write && (faulttype == VM_FAULT_READONLY || faulttype == VM_FAULT_WRITE)) {
-        // Disable interrupts when changing page table
-        int spl = splhigh();
-
-        paddr_t paddr = page->paddr;
-        KASSERT(paddr != USERSPACETOP);
+    if (pte == NULL || (*pte & TLBLO_VALID) == 0) {
+        result = page_in(as, faultaddress, faulttype, &pte);
+        if (result) {
+            lock_release(vm_lock);
+            return result;
+        }
+    } else if ((*pte & (PTE_FILE | PF_W)) == (PTE_FILE | PF_W) &&
+               faulttype != VM_FAULT_READ) {
+        // A private stand-in for a shared mapping's page (see
+        // fill_file_page): drop it and try the page cache again. If the
+        // page is still busy there, the write just faults once more.
+        decrement_ref_count(*pte & TLBLO_PPAGE);
+        *pte = 0;
+        vm_tlb_invalidate(as, faultaddress);
+        result = page_in(as, faultaddress, faulttype, &pte);
+        if (result) {
+            lock_release(vm_lock);
+            return result;
+        }
+    } else if ((*pte & PTE_COW) && (faulttype == VM_FAULT_READONLY || faulttype == VM_FAULT_WRITE)) {
+        paddr_t paddr = *pte & TLBLO_PPAGE;
+        bool cached = (*pte & PTE_SHARED) != 0;
+        pte_t old;
 
-        if (frame_table[paddr >> 12].ref_count == 1) {
+        VMSTAT(vs_cowfaults);
+        if (!cached && get_ref_count(paddr) == 1) {
             // No other processes reference this paddr any more, no need to allocate
-            page->copy_on_write = 0;
-            // Make dirty again
-            if (page->flags & PF_W) {
-                page->paddr = page->paddr | TLBLO_DIRTY;
-            }
+            *pte &= ~PTE_COW;
         } else {
-            page->paddr = USERSPACETOP;
-            ensure_paddr(page);
-            memmove((void*)PADDR_TO_KVADDR(page->paddr & TLBLO_PPAGE),
-                    (const void*)PADDR_TO_KVADDR(paddr & TLBLO_PPAGE),
+            vaddr_t kvaddr = vm_getpage();
+            if (kvaddr == 0) {
+                lock_release(vm_lock);
+                return ENOMEM;
+            }
+            VMSTAT(vs_cowcopies);
+            memmove((void *)kvaddr,
+                    (const void *)PADDR_TO_KVADDR(paddr),
                     PAGE_SIZE);
-            decrement_ref_count(paddr);
-
-            page->copy_on_write = 0;
+            old = *pte;
+            *pte = (KVADDR_TO_PADDR(kvaddr) & TLBLO_PPAGE) | TLBLO_VALID |
+                (*pte & PTE_PERMS);
+            if (cached) {
+                pagecache_unmap(paddr, as, faultaddress);
+            } else {
+                pt_release_frame(old, faultaddress);
+            }
         }
+        frame_set_owner(*pte & TLBLO_PPAGE, as, faultaddress);
 
-        // We need to remove the old TLB entry if it exists
-        int index = tlb_probe(page->vaddr<<12, 0);
-        if (index >= 0){
-            tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+        // Make dirty again
+        if (*pte & PF_W) {
+            *pte |= TLBLO_DIRTY;
         }
 
-        splx(spl);
+        // We need to remove the old TLB entry if it exists
+        vm_tlb_invalidate(as, faultaddress);
     } else {
-        // Make sure there is physical memory here to write to
-        ensure_paddr(page);
+        // Plain TLB miss on a present page: count it as a use for the clock
+        frame_mark_referenced(*pte & TLBLO_PPAGE);
+        VMSTAT(vs_reloads);
     }
-    
-    
-    uint32_t high = faultaddress & TLBHI_VPAGE;
-    int spl = splhigh();
-    tlb_random(high, page->paddr);
-    splx(spl);
 
+    // The first write to a shared file mapping's page since it was last
+    // clean is let through once the page cache knows to write it back
+    if (faulttype != VM_FAULT_READ &&
+        (*pte & (PTE_SHARED | PTE_COW | PF_W | TLBLO_DIRTY)) ==
+        (PTE_SHARED | PF_W)) {
+        pagecache_markdirty(*pte & TLBLO_PPAGE);
+        *pte |= TLBLO_DIRTY;
+    }
+
+    tlb_load(as, faultaddress, *pte);
+
+    lock_release(vm_lock);
     return 0;
 }
 
+int vm_prefault(vaddr_t vaddr, size_t len, bool write) {
+    struct addrspace *as = proc_getas();
+    struct region *region;
+    vaddr_t end = vaddr + len;
+    int result;
+
+    if (as == NULL || end < vaddr || end > USERSPACETOP) {
+        return 0;
+    }
+
+    // Only this process changes its region map, so it can be read here
+    vaddr &= PAGE_FRAME;
+    while (vaddr < end) {
+        region = as_find_region(as, vaddr);
+        if (region == NULL) {
+            break;
+        }
+        if (region->r_vnode == NULL ||
+            (write && (region->r_perms & PF_W) == 0)) {
+            vaddr = REGION_END(region);
+            continue;
+        }
+        result = vm_fault(write ? VM_FAULT_WRITE : VM_FAULT_READ, vaddr);
+        if (result) {
+            return result;
+        }
+        vaddr += PAGE_SIZE;
+    }
+    return 0;
+}
+
+static void vmstats_print(const char *name, const struct vmstats *vs) {
+    kprintf("%-6s %8u %8u %8u %8u %8u %8u %8u %8u %8u %8u %8u %8u\n", name,
+            vs->vs_faults, vs->vs_reloads, vs->vs_zerofills,
+            vs->vs_filefills, vs->vs_swapins, vs->vs_evictions,
+            vs->vs_cowfaults, vs->vs_cowcopies, vs->vs_cowreowns,
+            vs->vs_invalidations, vs->vs_shootdowns, vs->vs_reserved);
+}
+
+void vm_printstats(void) {
+    struct vmstats total;
+    char name[16];
+    unsigned i;
+
+    bzero(&total, sizeof(total));
+
+    kprintf("%-6s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n", "",
+            "misses", "reloads", "zerofill", "filefill", "swapin",
+            "evicted", "cow", "cowcopy", "cowreown", "inval", "shootdn",
+            "reserved");
+    for (i = 0; i < MAXCPUS; i++) {
+        const struct vmstats *vs = &vm_cpustats[i];
+
+        if (vs->vs_faults == 0 && vs->vs_invalidations == 0 &&
+            vs->vs_locks == 0) {
+            // Never ran user code
+            continue;
+        }
+        snprintf(name, sizeof(name), "cpu%u", i);
+        vmstats_print(name, vs);
+
+        total.vs_faults += vs->vs_faults;
+        total.vs_reloads += vs->vs_reloads;
+        total.vs_zerofills += vs->vs_zerofills;
+        total.vs_filefills += vs->vs_filefills;
+        total.vs_swapins += vs->vs_swapins;
+        total.vs_evictions += vs->vs_evictions;
+        total.vs_cowfaults += vs->vs_cowfaults;
+        total.vs_cowcopies += vs->vs_cowcopies;
+        total.vs_cowreowns += vs->vs_cowreowns;
+        total.vs_invalidations += vs->vs_invalidations;
+        total.vs_shootdowns += vs->vs_shootdowns;
+        total.vs_reserved += vs->vs_reserved;
+        total.vs_locks += vs->vs_locks;
+        total.vs_lockwaits += vs->vs_lockwaits;
+    }
+    vmstats_print("total", &total);
+    kprintf("(misses handled by the refill handler in the exception "
+            "vector are not counted)\n");
+    kprintf("vm_lock: taken %u times, %u of them after waiting\n",
+            total.vs_locks, total.vs_lockwaits);
+}
+
 /*
- *
- * SMP-specific functions.  Unused in our configuration.
+ * SMP-specific functions.
  */
 
+// A shootdown sent by tlb_shootdown on another CPU. Called from the
+// IPI handler.
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("vm tried to do tlb shootdown?!\n");
+    tlb_shootdown_local(ts);
+    V(tlb_shootdown_done);
 }
 
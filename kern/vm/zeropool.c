@@ -0,0 +1,209 @@
+/*
+ * Pool of pre-zeroed pages.
+ * See <zeropool.h> for the interface.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <threadlist.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <zeropool.h>
+
+/*
+ * Don't refill with fewer free frames than this. It's well above the
+ * point where the VM system starts evicting (VM_RESERVE_FRAMES), so
+ * pooled pages never push user pages out to swap.
+ */
+#define ZP_MINFREE 64
+
+/*
+ * Pages are kept as physical addresses in an array rather than on a
+ * list threaded through the pages, so the pages themselves stay zero.
+ * Everything here is protected by zp_spinlock.
+ */
+static paddr_t zp_pages[ZEROPOOL_MAXPAGES];
+static unsigned zp_count;
+static unsigned zp_target = ZEROPOOL_DEFTARGET;
+static bool zp_refilling;		/* zeroing thread is awake */
+static struct wchan *zp_wchan;
+static struct spinlock zp_spinlock = SPINLOCK_INITIALIZER;
+
+static struct {
+	unsigned hits;			/* zeropool_get found a page */
+	unsigned misses;		/* ... didn't */
+	unsigned zeroed;		/* pages zeroed by the thread */
+	unsigned reclaimed;		/* pages taken back by zeropool_reclaim */
+} zp_stats;
+
+/*
+ * Wake the zeroing thread if the pool has run low. Call with
+ * zp_spinlock held.
+ */
+static
+void
+zp_checklow(void)
+{
+	KASSERT(spinlock_do_i_hold(&zp_spinlock));
+
+	if (!zp_refilling && zp_count < (zp_target + 1) / 2) {
+		zp_refilling = true;
+		wchan_wakeone(zp_wchan, &zp_spinlock);
+	}
+}
+
+/*
+ * The zeroing thread. OS/161 has no thread priorities, so "idle time"
+ * means the local run queue is empty; otherwise it yields and looks
+ * again. The run queue is read without its lock, which is fine for a
+ * hint.
+ */
+static
+void
+zeropool_thread(void *unused1, unsigned long unused2)
+{
+	vaddr_t kvaddr;
+	bool done;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		spinlock_acquire(&zp_spinlock);
+		while (!zp_refilling) {
+			wchan_sleep(zp_wchan, &zp_spinlock);
+		}
+		done = zp_count >= zp_target || frame_nfree() <= ZP_MINFREE;
+		if (done) {
+			zp_refilling = false;
+		}
+		spinlock_release(&zp_spinlock);
+
+		if (done) {
+			continue;
+		}
+		if (!threadlist_isempty(&curcpu->c_runqueue)) {
+			thread_yield();
+			continue;
+		}
+
+		kvaddr = alloc_kpages(1);
+		if (kvaddr == 0) {
+			spinlock_acquire(&zp_spinlock);
+			zp_refilling = false;
+			spinlock_release(&zp_spinlock);
+			continue;
+		}
+		bzero((void *)kvaddr, PAGE_SIZE);
+
+		spinlock_acquire(&zp_spinlock);
+		if (zp_count < ZEROPOOL_MAXPAGES) {
+			zp_pages[zp_count++] = KVADDR_TO_PADDR(kvaddr);
+			zp_stats.zeroed++;
+			kvaddr = 0;
+		}
+		spinlock_release(&zp_spinlock);
+
+		if (kvaddr != 0) {
+			free_kpages(kvaddr);
+		}
+		thread_yield();
+	}
+}
+
+void
+zeropool_bootstrap(void)
+{
+	int result;
+
+	zp_wchan = wchan_create("zeropool");
+	if (zp_wchan == NULL) {
+		panic("zeropool_bootstrap: out of memory\n");
+	}
+
+	result = thread_fork("zeropool", NULL, zeropool_thread, NULL, 0);
+	if (result) {
+		panic("zeropool_bootstrap: thread_fork: %s\n",
+		      strerror(result));
+	}
+
+	/* Fill the pool the first time the system goes idle */
+	spinlock_acquire(&zp_spinlock);
+	zp_checklow();
+	spinlock_release(&zp_spinlock);
+}
+
+vaddr_t
+zeropool_get(void)
+{
+	paddr_t paddr = 0;
+
+	spinlock_acquire(&zp_spinlock);
+	if (zp_count > 0) {
+		paddr = zp_pages[--zp_count];
+		zp_stats.hits++;
+	}
+	else {
+		zp_stats.misses++;
+	}
+	zp_checklow();
+	spinlock_release(&zp_spinlock);
+
+	return paddr == 0 ? 0 : PADDR_TO_KVADDR(paddr);
+}
+
+vaddr_t
+zeropool_reclaim(void)
+{
+	paddr_t paddr = 0;
+
+	spinlock_acquire(&zp_spinlock);
+	if (zp_count > 0) {
+		paddr = zp_pages[--zp_count];
+		zp_stats.reclaimed++;
+	}
+	spinlock_release(&zp_spinlock);
+
+	return paddr == 0 ? 0 : PADDR_TO_KVADDR(paddr);
+}
+
+int
+zeropool_settarget(unsigned target)
+{
+	if (target > ZEROPOOL_MAXPAGES) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&zp_spinlock);
+	zp_target = target;
+	zp_checklow();
+	spinlock_release(&zp_spinlock);
+
+	return 0;
+}
+
+void
+zeropool_printstats(void)
+{
+	unsigned count, target;
+	unsigned hits, misses, zeroed, reclaimed;
+
+	/* Don't print with the spinlock held */
+	spinlock_acquire(&zp_spinlock);
+	count = zp_count;
+	target = zp_target;
+	hits = zp_stats.hits;
+	misses = zp_stats.misses;
+	zeroed = zp_stats.zeroed;
+	reclaimed = zp_stats.reclaimed;
+	spinlock_release(&zp_spinlock);
+
+	kprintf("zeropool: %u of %u pages\n", count, target);
+	kprintf("  %u hits, %u misses, %u pages zeroed, %u reclaimed\n",
+		hits, misses, zeroed, reclaimed);
+}
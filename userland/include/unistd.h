@@ -40,6 +40,8 @@
  */
 #include <kern/fcntl.h>
 #include <kern/ioctl.h>
+#include <kern/iovec.h>
+#include <kern/mman.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
@@ -142,6 +144,10 @@ int chdir(const char *path);
 /* Optional. */
 void *sbrk(__intptr_t change);
 ssize_t getdirentry(int filehandle, char *buf, size_t buflen);
+ssize_t pread(int filehandle, void *buf, size_t size, off_t pos);
+ssize_t pwrite(int filehandle, const void *buf, size_t size, off_t pos);
+ssize_t readv(int filehandle, const struct iovec *iov, int iovcnt);
+ssize_t writev(int filehandle, const struct iovec *iov, int iovcnt);
 int symlink(const char *target, const char *linkname);
 ssize_t readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
@@ -162,12 +168,14 @@ time_t time(time_t *seconds);			/* calls __time */
 /* UNSW versions of mmap() and munmap()
  * This are simplified compared to the standard version on UNIX
  * You should implement this version as this is what we expect to test.
+ *
+ * The kernel picks the address. PROT_* and MAP_* are in kern/mman.h;
+ * MAP_PRIVATE is or'ed into prot. munmap and msync take the address
+ * mmap returned and act on the whole mapping.
  */
 
-#define PROT_READ 1
-#define PROT_WRITE 2
-
 void *mmap(size_t length, int prot, int fd, off_t offset);
 int munmap(void *addr);
+int msync(void *addr);
 
 #endif /* _UNISTD_H_ */
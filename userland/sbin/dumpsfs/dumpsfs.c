@@ -163,6 +163,13 @@ dumpsb(void)
 		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks)));
 	dumpvalf("Block size", "%u bytes", SFS_BLOCKSIZE);
 	dumplval("Volume name", sb.sb_volname);
+	if (sb.sb_jnlblocks != 0) {
+		dumpvalf("Journal", "%u blocks at %u",
+			 SWAP32(sb.sb_jnlblocks), SWAP32(sb.sb_jnlstart));
+	}
+	else {
+		dumplval("Journal", "none");
+	}
 
 	for (i=0; i<ARRAYCOUNT(sb.reserved); i++) {
 		if (sb.reserved[i] != 0) {
@@ -230,8 +237,11 @@ dumpfreemap(uint32_t fsblocks)
 
 static
 void
-dumpindirect(uint32_t block)
+dumpindirect(uint32_t block, unsigned level)
 {
+	static const char *const names[] = {
+		NULL, "Indirect", "Double indirect", "Triple indirect"
+	};
 	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
 	char tmp[128];
 	unsigned i;
@@ -239,7 +249,7 @@ dumpindirect(uint32_t block)
 	if (block == 0) {
 		return;
 	}
-	printf("Indirect block %u\n", block);
+	printf("%s block %u\n", names[level], block);
 
 	diskread(ib, block);
 	for (i=0; i<ARRAYCOUNT(ib); i++) {
@@ -253,12 +263,23 @@ dumpindirect(uint32_t block)
 			printf("\n");
 		}
 	}
+
+	if (level > 1) {
+		for (i=0; i<ARRAYCOUNT(ib); i++) {
+			dumpindirect(SWAP32(ib[i]), level - 1);
+		}
+	}
 }
 
+/*
+ * Walk through an indirect block of level LEVEL (1, 2, or 3), calling
+ * DOBLOCK for each file block it maps up to NUMBLOCKS. A hole at any
+ * level shows up as disk block 0 for every file block under it.
+ */
 static
 uint32_t
 traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
-	    void (*doblock)(uint32_t, uint32_t))
+	    unsigned level, void (*doblock)(uint32_t, uint32_t))
 {
 	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
 	unsigned i;
@@ -270,7 +291,14 @@ traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
 		diskread(ib, block);
 	}
 	for (i=0; i<ARRAYCOUNT(ib) && fileblock < numblocks; i++) {
-		doblock(fileblock++, SWAP32(ib[i]));
+		if (level > 1) {
+			fileblock = traverse_ib(fileblock, numblocks,
+						SWAP32(ib[i]), level - 1,
+						doblock);
+		}
+		else {
+			doblock(fileblock++, SWAP32(ib[i]));
+		}
 	}
 	return fileblock;
 }
@@ -286,12 +314,41 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 	numblocks = DIVROUNDUP(SWAP32(sfi->sfi_size), SFS_BLOCKSIZE);
 
 	fileblock = 0;
+	if (SWAP32(sfi->sfi_flags) & SFS_IF_EXTENTS) {
+		for (i=0; i<SFS_NEXTENTS; i++) {
+			uint32_t block = SWAP32(sfi->sfi_extents[i].se_block);
+			uint32_t len = SWAP32(sfi->sfi_extents[i].se_len);
+			uint32_t j;
+
+			if (len == 0) {
+				break;
+			}
+			for (j=0; j<len && fileblock < numblocks; j++) {
+				doblock(fileblock++, block == 0 ? 0 : block + j);
+			}
+		}
+		/* Anything left is a hole */
+		while (fileblock < numblocks) {
+			doblock(fileblock++, 0);
+		}
+		return;
+	}
 	for (i=0; i<SFS_NDIRECT && fileblock < numblocks; i++) {
 		doblock(fileblock++, SWAP32(sfi->sfi_direct[i]));
 	}
 	if (fileblock < numblocks) {
 		fileblock = traverse_ib(fileblock, numblocks,
-					SWAP32(sfi->sfi_indirect), doblock);
+					SWAP32(sfi->sfi_indirect), 1, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_dindirect), 2,
+					doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_tindirect), 3,
+					doblock);
 	}
 	assert(fileblock == numblocks);
 }
@@ -324,12 +381,91 @@ dumpdirblock(uint32_t fileblock, uint32_t diskblock)
 	}
 }
 
+/*
+ * For hashed directories: file block 0 is the header, leaves are
+ * marked with their magic number, and everything else is part of
+ * the table.
+ */
+static
+void
+dumphashdirblock(uint32_t fileblock, uint32_t diskblock)
+{
+	union {
+		struct sfs_dirhdr hdr;
+		struct sfs_dirleaf leaf;
+		uint32_t table[SFS_DBPERIDB];
+	} u;
+	uint32_t depth, ino;
+	unsigned i, ntable;
+
+	if (diskblock == 0) {
+		printf("    [block %u - missing]\n", diskblock);
+		return;
+	}
+	diskread(&u, diskblock);
+
+	if (fileblock == 0) {
+		depth = SWAP32(u.hdr.sdh_depth);
+		printf("    [block %u - header]\n", diskblock);
+		printf("        magic 0x%x, depth %u\n",
+		       SWAP32(u.hdr.sdh_magic), depth);
+		if (depth > SFS_DIRHASH_MAXDEPTH) {
+			/* bogus; show them all */
+			ntable = ARRAYCOUNT(u.hdr.sdh_index);
+		}
+		else {
+			ntable = DIVROUNDUP(1U << depth, SFS_DBPERIDB);
+		}
+		printf("        table blocks:");
+		for (i=0; i<ntable; i++) {
+			printf(" %u", SWAP32(u.hdr.sdh_index[i]));
+		}
+		printf("\n");
+	}
+	else if (SWAP32(u.leaf.sdl_magic) == SFS_DIRLEAF_MAGIC) {
+		printf("    [block %u - leaf, depth %u]\n", diskblock,
+		       SWAP32(u.leaf.sdl_depth));
+		for (i=0; i<SFS_DIRLEAF_NENTRIES; i++) {
+			ino = SWAP32(u.leaf.sdl_entries[i].sfd_ino);
+			if (ino==SFS_NOINO) {
+				printf("        [free entry]\n");
+			}
+			else {
+				/* just in case */
+				u.leaf.sdl_entries[i].sfd_name[SFS_NAMELEN-1]
+					= 0;
+				printf("        %u %s\n", ino,
+				       u.leaf.sdl_entries[i].sfd_name);
+			}
+		}
+	}
+	else {
+		printf("    [block %u - table]\n", diskblock);
+		for (i=0; i<SFS_DBPERIDB; i++) {
+			if (i % 8 == 0) {
+				printf("        @%-3u", i);
+			}
+			printf(" %u", SWAP32(u.table[i]));
+			if (i % 8 == 7) {
+				printf("\n");
+			}
+		}
+	}
+}
+
 static
 void
 dumpdir(uint32_t ino, const struct sfs_dinode *sfi)
 {
 	int nentries;
 
+	if (SWAP32(sfi->sfi_flags) & SFS_IF_HASHDIR) {
+		printf("Hashed directory contents for inode %u: %u blocks\n",
+		       ino, DIVROUNDUP(SWAP32(sfi->sfi_size), SFS_BLOCKSIZE));
+		traverse(sfi, dumphashdirblock);
+		return;
+	}
+
 	nentries = SWAP32(sfi->sfi_size) / sizeof(struct sfs_direntry);
 	if (SWAP32(sfi->sfi_size) % sizeof(struct sfs_direntry) != 0) {
 		warnx("Warning: dir size is not a multiple of dir entry size");
@@ -362,12 +498,44 @@ recursedirblock(uint32_t fileblock, uint32_t diskblock)
 	}
 }
 
+static
+void
+recursehashdirblock(uint32_t fileblock, uint32_t diskblock)
+{
+	struct sfs_dirleaf leaf;
+	unsigned i;
+
+	if (fileblock == 0 || diskblock == 0) {
+		return;
+	}
+	diskread(&leaf, diskblock);
+	if (SWAP32(leaf.sdl_magic) != SFS_DIRLEAF_MAGIC) {
+		return;
+	}
+
+	for (i=0; i<SFS_DIRLEAF_NENTRIES; i++) {
+		uint32_t ino = SWAP32(leaf.sdl_entries[i].sfd_ino);
+		if (ino==SFS_NOINO) {
+			continue;
+		}
+		leaf.sdl_entries[i].sfd_name[SFS_NAMELEN-1] = 0;
+		dumpinode(ino, leaf.sdl_entries[i].sfd_name);
+	}
+}
+
 static
 void
 recursedir(uint32_t ino, const struct sfs_dinode *sfi)
 {
 	int nentries;
 
+	if (SWAP32(sfi->sfi_flags) & SFS_IF_HASHDIR) {
+		printf("Reading files in hashed directory %u\n", ino);
+		traverse(sfi, recursehashdirblock);
+		printf("Done with directory %u\n", ino);
+		return;
+	}
+
 	nentries = SWAP32(sfi->sfi_size) / sizeof(struct sfs_direntry);
 	printf("Reading files in directory %u: %d entries\n", ino, nentries);
 	traverse(sfi, recursedirblock);
@@ -449,8 +617,30 @@ dumpinode(uint32_t ino, const char *name)
 	dumpvalf("Type", "%u (%s)", SWAP16(sfi.sfi_type), typename);
 	dumpvalf("Size", "%u", SWAP32(sfi.sfi_size));
 	dumpvalf("Link count", "%u", SWAP16(sfi.sfi_linkcount));
+	dumpvalf("Flags", "0x%x%s%s", SWAP32(sfi.sfi_flags),
+		 (SWAP32(sfi.sfi_flags) & SFS_IF_HASHDIR) ? " (hashed)" : "",
+		 (SWAP32(sfi.sfi_flags) & SFS_IF_EXTENTS) ? " (extents)" : "");
 	printf("\n");
 
+	if (SWAP32(sfi.sfi_flags) & SFS_IF_EXTENTS) {
+		printf("    Extents:\n");
+		for (i=0; i<SFS_NEXTENTS; i++) {
+			if (sfi.sfi_extents[i].se_len == 0) {
+				break;
+			}
+			if (sfi.sfi_extents[i].se_block == 0) {
+				snprintf(tmp, sizeof(tmp), "hole");
+			}
+			else {
+				snprintf(tmp, sizeof(tmp), "%u (0x%x)",
+					 SWAP32(sfi.sfi_extents[i].se_block),
+					 SWAP32(sfi.sfi_extents[i].se_block));
+			}
+			printf("@%-2u      %-16s  length %u\n", i, tmp,
+			       SWAP32(sfi.sfi_extents[i].se_len));
+		}
+	}
+
         printf("    Direct blocks:\n");
         for (i=0; i<SFS_NDIRECT; i++) {
 		if (i % 4 == 0) {
@@ -476,6 +666,10 @@ dumpinode(uint32_t ino, const char *name)
 	}
 	printf("    Indirect block: %u (0x%x)\n",
 	       SWAP32(sfi.sfi_indirect), SWAP32(sfi.sfi_indirect));
+	printf("    Double indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_dindirect), SWAP32(sfi.sfi_dindirect));
+	printf("    Triple indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_tindirect), SWAP32(sfi.sfi_tindirect));
 	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
 		if (sfi.sfi_waste[i] != 0) {
 			printf("    Word %u in waste area: 0x%x\n",
@@ -484,7 +678,9 @@ dumpinode(uint32_t ino, const char *name)
 	}
 
 	if (doindirect) {
-		dumpindirect(SWAP32(sfi.sfi_indirect));
+		dumpindirect(SWAP32(sfi.sfi_indirect), 1);
+		dumpindirect(SWAP32(sfi.sfi_dindirect), 2);
+		dumpindirect(SWAP32(sfi.sfi_tindirect), 3);
 	}
 
 	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR && dodirs) {
@@ -73,6 +73,10 @@ check(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_dirhdr)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_dirleaf)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jdesc)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jcommit)==SFS_BLOCKSIZE);
 }
 
 /*
@@ -125,7 +129,8 @@ initfreemap(uint32_t fsblocks)
  */
 static
 void
-writesuper(const char *volname, uint32_t nblocks)
+writesuper(const char *volname, uint32_t nblocks,
+	   uint32_t jnlstart, uint32_t jnlblocks)
 {
 	struct sfs_superblock sb;
 
@@ -140,6 +145,8 @@ writesuper(const char *volname, uint32_t nblocks)
 	sb.sb_magic = SWAP32(SFS_MAGIC);
 	sb.sb_nblocks = SWAP32(nblocks);
 	strcpy(sb.sb_volname, volname);
+	sb.sb_jnlstart = SWAP32(jnlstart);
+	sb.sb_jnlblocks = SWAP32(jnlblocks);
 
 	/* and write it out. */
 	diskwrite(&sb, SFS_SUPER_BLOCK);
@@ -165,19 +172,94 @@ writefreemap(uint32_t fsblocks)
 }
 
 /*
- * Write out the root directory inode.
+ * Set aside the journal, in the blocks starting at START: a 32nd of
+ * the volume, up to SFS_JNL_DEFBLOCKS, or none if that would be less
+ * than SFS_JNL_MINBLOCKS. It starts out empty, which takes zeroing
+ * the first block of each slot. Returns its size.
+ */
+static
+uint32_t
+writejournal(uint32_t fsblocks, uint32_t start)
+{
+	char block[SFS_BLOCKSIZE];
+	uint32_t jnlblocks, i;
+
+	jnlblocks = fsblocks / 32;
+	if (jnlblocks > SFS_JNL_DEFBLOCKS) {
+		jnlblocks = SFS_JNL_DEFBLOCKS;
+	}
+	if (jnlblocks < SFS_JNL_MINBLOCKS) {
+		return 0;
+	}
+	if (start + jnlblocks >= fsblocks) {
+		errx(1, "Filesystem too small");
+	}
+
+	for (i=0; i<jnlblocks; i++) {
+		allocblock(start + i);
+	}
+
+	bzero((void *)block, sizeof(block));
+	diskwrite(block, start);
+	diskwrite(block, start + SFS_JNL_SLOTSIZE(jnlblocks));
+
+	return jnlblocks;
+}
+
+/*
+ * Write out the root directory inode, and the blocks of a new hashed
+ * directory: the header in file block 0, the (one pointer) table in
+ * file block 1, and a single leaf with . and .. in file block 2. They
+ * go in the blocks starting at START.
  */
 static
 void
-writerootdir(void)
+writerootdir(uint32_t fsblocks, uint32_t start)
 {
 	struct sfs_dinode sfi;
+	struct sfs_dirhdr hdr;
+	uint32_t table[SFS_DBPERIDB];
+	struct sfs_dirleaf leaf;
+	uint32_t hdrblock, tableblock, leafblock;
+
+	hdrblock = start;
+	tableblock = hdrblock + 1;
+	leafblock = hdrblock + 2;
+	if (leafblock >= fsblocks) {
+		errx(1, "Filesystem too small");
+	}
+	allocblock(hdrblock);
+	allocblock(tableblock);
+	allocblock(leafblock);
+
+	bzero((void *)&hdr, sizeof(hdr));
+	hdr.sdh_magic = SWAP32(SFS_DIRHDR_MAGIC);
+	hdr.sdh_depth = SWAP32(0);
+	hdr.sdh_index[0] = SWAP32(1);
+	diskwrite(&hdr, hdrblock);
+
+	bzero((void *)table, sizeof(table));
+	table[0] = SWAP32(2);
+	diskwrite(table, tableblock);
+
+	bzero((void *)&leaf, sizeof(leaf));
+	leaf.sdl_magic = SWAP32(SFS_DIRLEAF_MAGIC);
+	leaf.sdl_depth = SWAP32(0);
+	leaf.sdl_entries[0].sfd_ino = SWAP32(SFS_ROOTDIR_INO);
+	strcpy(leaf.sdl_entries[0].sfd_name, ".");
+	leaf.sdl_entries[1].sfd_ino = SWAP32(SFS_ROOTDIR_INO);
+	strcpy(leaf.sdl_entries[1].sfd_name, "..");
+	diskwrite(&leaf, leafblock);
 
 	/* Initialize the dinode */
 	bzero((void *)&sfi, sizeof(sfi));
-	sfi.sfi_size = SWAP32(0);
+	sfi.sfi_size = SWAP32(3 * SFS_BLOCKSIZE);
 	sfi.sfi_type = SWAP16(SFS_TYPE_DIR);
-	sfi.sfi_linkcount = SWAP16(1);
+	sfi.sfi_linkcount = SWAP16(2);
+	sfi.sfi_direct[0] = SWAP32(hdrblock);
+	sfi.sfi_direct[1] = SWAP32(tableblock);
+	sfi.sfi_direct[2] = SWAP32(leafblock);
+	sfi.sfi_flags = SWAP32(SFS_IF_HASHDIR);
 
 	/* Write it out */
 	diskwrite(&sfi, SFS_ROOTDIR_INO);
@@ -189,7 +271,7 @@ writerootdir(void)
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, blocksize, jnlstart, jnlblocks;
 	char *volname, *s;
 
 #ifdef HOST
@@ -228,11 +310,13 @@ main(int argc, char **argv)
 	}
 	size = diskblocks();
 
-	/* Write out the on-disk structures */
+	/* Write out the on-disk structures; the journal follows the freemap */
 	initfreemap(size);
-	writesuper(volname, size);
+	jnlstart = SFS_FREEMAP_START + SFS_FREEMAPBLOCKS(size);
+	jnlblocks = writejournal(size, jnlstart);
+	writesuper(volname, size, jnlblocks ? jnlstart : 0, jnlblocks);
+	writerootdir(size, jnlstart + jnlblocks);
 	writefreemap(size);
-	writerootdir();
 
 	closedisk();
 
@@ -0,0 +1,130 @@
+/*
+ * Journal replay. See <kern/sfs.h> for the format.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <err.h>
+
+#include "compat.h"
+#include <kern/sfs.h>
+
+#include "disk.h"
+#include "sb.h"
+#include "journal.h"
+#include "main.h"
+
+/*
+ * Checksum of a block, continuing from SUM.
+ */
+static
+uint32_t
+journal_sum(uint32_t sum, const unsigned char *data)
+{
+	unsigned i;
+
+	for (i=0; i<SFS_BLOCKSIZE; i++) {
+		sum = ((sum << 1) | (sum >> 31)) + data[i];
+	}
+	return sum;
+}
+
+/*
+ * Read the descriptor of the transaction in slot WHICH, which starts
+ * at block SLOT, into JD. Return 1 if the transaction is complete.
+ */
+static
+int
+journal_check(uint32_t slot, unsigned which, uint32_t slotsize,
+	      struct sfs_jdesc *jd)
+{
+	unsigned char block[SFS_BLOCKSIZE];
+	struct sfs_jcommit jc;
+	uint32_t i, b, sum;
+
+	diskread(jd, slot);
+	jd->jd_magic = SWAP32(jd->jd_magic);
+	jd->jd_seq = SWAP32(jd->jd_seq);
+	jd->jd_nblocks = SWAP32(jd->jd_nblocks);
+	for (i=0; i<SFS_JNL_MAXBLOCKS; i++) {
+		jd->jd_blocks[i] = SWAP32(jd->jd_blocks[i]);
+	}
+
+	if (jd->jd_magic != SFS_JNL_DESCMAGIC || jd->jd_seq % 2 != which ||
+	    jd->jd_nblocks == 0 || jd->jd_nblocks > slotsize - 2) {
+		return 0;
+	}
+	for (i=0; i<jd->jd_nblocks; i++) {
+		b = jd->jd_blocks[i];
+		if (b == SFS_SUPER_BLOCK || b >= sb_totalblocks() ||
+		    (b >= sb_jnlstart() &&
+		     b < sb_jnlstart() + sb_jnlblocks())) {
+			return 0;
+		}
+	}
+
+	sum = 0;
+	for (i=0; i<jd->jd_nblocks; i++) {
+		diskread(block, slot + 1 + i);
+		sum = journal_sum(sum, block);
+	}
+
+	diskread(&jc, slot + 1 + jd->jd_nblocks);
+	if (SWAP32(jc.jc_magic) != SFS_JNL_COMMITMAGIC ||
+	    SWAP32(jc.jc_seq) != jd->jd_seq ||
+	    SWAP32(jc.jc_nblocks) != jd->jd_nblocks ||
+	    SWAP32(jc.jc_sum) != sum) {
+		return 0;
+	}
+	return 1;
+}
+
+void
+journal_replay(void)
+{
+	unsigned char block[SFS_BLOCKSIZE];
+	struct sfs_jdesc jd[2];
+	int complete[2], used;
+	uint32_t slotsize, slot, i;
+	unsigned which;
+
+	if (sb_jnlblocks() == 0) {
+		return;
+	}
+	slotsize = SFS_JNL_SLOTSIZE(sb_jnlblocks());
+
+	used = 0;
+	for (i=0; i<2; i++) {
+		complete[i] = journal_check(sb_jnlstart() + i * slotsize, i,
+					    slotsize, &jd[i]);
+		if (jd[i].jd_magic == SFS_JNL_DESCMAGIC) {
+			used = 1;
+		}
+	}
+	if (!used) {
+		return;
+	}
+
+	if (complete[0] || complete[1]) {
+		if (complete[0] && complete[1]) {
+			which = (int32_t)(jd[1].jd_seq - jd[0].jd_seq) > 0;
+		}
+		else {
+			which = complete[1];
+		}
+		slot = sb_jnlstart() + which * slotsize;
+		for (i=0; i<jd[which].jd_nblocks; i++) {
+			diskread(block, slot + 1 + i);
+			diskwrite(block, jd[which].jd_blocks[i]);
+		}
+		warnx("Replayed journal transaction %lu (%lu blocks)",
+		      (unsigned long)jd[which].jd_seq,
+		      (unsigned long)jd[which].jd_nblocks);
+	}
+
+	/* Empty it, so the kernel doesn't replay it again later */
+	memset(block, 0, sizeof(block));
+	diskwrite(block, sb_jnlstart());
+	diskwrite(block, sb_jnlstart() + slotsize);
+	setbadness(EXIT_RECOV);
+}
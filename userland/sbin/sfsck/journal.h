@@ -0,0 +1,13 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/*
+ * The journal module finishes whatever the kernel committed to the
+ * journal but may not have written in place, and then empties the
+ * journal, so that the kernel doesn't replay it over any repairs.
+ */
+
+/* Replay the journal. Call after checking the superblock. */
+void journal_replay(void);
+
+#endif /* JOURNAL_H */
@@ -38,6 +38,7 @@
 #include "sfs.h"
 #include "sb.h"
 #include "freemap.h"
+#include "journal.h"
 #include "inode.h"
 #include "passes.h"
 #include "main.h"
@@ -78,6 +79,7 @@ main(int argc, char **argv)
 	sfs_setup();
 	sb_load();
 	sb_check();
+	journal_replay();
 	freemap_setup();
 
 	printf("Phase 1 -- check blocks and sizes\n");
@@ -89,7 +89,6 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 
 	if (*ientry > 0 && *ientry < ibs->volblocks) {
 		sfs_readindirect(*ientry, entries);
-		freemap_blockinuse(*ientry, B_IBLOCK, ibs->ino);
 	}
 	else {
 		if (*ientry >= ibs->volblocks) {
@@ -165,13 +164,113 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 		}
 	}
 	else {
+		/*
+		 * Don't mark the indirect block in use until now, so
+		 * that if it turns out to be empty it can be freed.
+		 */
 		assert(*ientry != 0);
+		freemap_blockinuse(*ientry, B_IBLOCK, ibs->ino);
 		if (localchanged) {
 			sfs_writeindirect(*ientry, entries);
 		}
 	}
 }
 
+/*
+ * Check the extents of inode INO, which is mapped by extents. The
+ * blocks they name are recorded as in use; blocks past EOF are freed,
+ * and extents naming blocks outside the volume become holes. As in
+ * the kernel, the list ends at the first extent of length 0.
+ *
+ * Returns nonzero if SFI has been modified.
+ */
+static
+int
+check_inode_extents(struct ibstate *ibs, struct sfs_dinode *sfi)
+{
+	struct sfs_extent *ext = sfi->sfi_extents;
+	uint32_t base, len, keep, j;
+	unsigned i, n;
+	int changed = 0;
+
+	base = 0;
+	for (i=0; i<SFS_NEXTENTS && ext[i].se_len > 0; i++) {
+		len = ext[i].se_len;
+		if (ext[i].se_block != 0 &&
+		    (ext[i].se_block >= ibs->volblocks ||
+		     len > ibs->volblocks - ext[i].se_block)) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: extent %u (blocks %lu-%lu) "
+			      "outside of volume (made a hole)",
+			      (unsigned long)ibs->ino, i,
+			      (unsigned long)ext[i].se_block,
+			      (unsigned long)ext[i].se_block + len - 1);
+			ext[i].se_block = 0;
+			changed = 1;
+		}
+
+		/* How much of it is before EOF */
+		if (base >= ibs->fileblocks) {
+			keep = 0;
+		}
+		else if (ibs->fileblocks - base < len) {
+			keep = ibs->fileblocks - base;
+		}
+		else {
+			keep = len;
+		}
+		if (ext[i].se_block != 0) {
+			for (j=0; j<len; j++) {
+				if (j < keep) {
+					freemap_blockinuse(ext[i].se_block + j,
+							   ibs->usagetype,
+							   ibs->ino);
+				}
+				else {
+					setbadness(EXIT_RECOV);
+					ibs->pasteofcount++;
+					freemap_blockfree(ext[i].se_block + j);
+				}
+			}
+		}
+		else if (keep < len) {
+			/* harmless, but the kernel never does it */
+			warnx("Inode %lu: hole extent runs past EOF (trimmed)",
+			      (unsigned long)ibs->ino);
+			setbadness(EXIT_RECOV);
+		}
+		if (keep < len) {
+			ext[i].se_len = keep;
+			if (keep == 0) {
+				ext[i].se_block = 0;
+			}
+			changed = 1;
+		}
+		base += len;
+	}
+
+	/* Squeeze out any extents emptied above, and clear the rest */
+	for (i=n=0; i<SFS_NEXTENTS; i++) {
+		if (ext[i].se_len == 0) {
+			break;
+		}
+		ext[n++] = ext[i];
+	}
+	for (; i<SFS_NEXTENTS; i++) {
+		if (ext[i].se_block != 0 || ext[i].se_len != 0) {
+			setbadness(EXIT_RECOV);
+			warnx("Inode %lu: extent %u past end of list "
+			      "(cleared)", (unsigned long)ibs->ino, i);
+			changed = 1;
+		}
+	}
+	for (i=n; i<SFS_NEXTENTS; i++) {
+		ext[i].se_block = 0;
+		ext[i].se_len = 0;
+	}
+	return changed;
+}
+
 /*
  * Check the blocks belonging to inode INO, whose inode has already
  * been loaded into SFI. ISDIR is a shortcut telling us if the inode
@@ -185,7 +284,7 @@ int
 check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 {
 	struct ibstate ibs;
-	uint32_t size, datablock;
+	uint32_t size, datablock, ptrs;
 	int changed;
 	int i;
 
@@ -200,6 +299,44 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 
 	changed = 0;
 
+	if (sfi->sfi_flags & SFS_IF_EXTENTS) {
+		/* The block pointers should all be zero */
+		ptrs = 0;
+		for (i=0; i<NUM_D; i++) {
+			ptrs |= GET_D(sfi, i);
+			SET_D(sfi, i) = 0;
+		}
+		for (i=0; i<NUM_I; i++) {
+			ptrs |= GET_I(sfi, i);
+			SET_I(sfi, i) = 0;
+		}
+		for (i=0; i<NUM_II; i++) {
+			ptrs |= GET_II(sfi, i);
+			SET_II(sfi, i) = 0;
+		}
+		for (i=0; i<NUM_III; i++) {
+			ptrs |= GET_III(sfi, i);
+			SET_III(sfi, i) = 0;
+		}
+		if (ptrs != 0) {
+			warnx("Inode %lu: block pointers in extent-mapped "
+			      "inode (cleared)", (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			changed = 1;
+		}
+		if (check_inode_extents(&ibs, sfi)) {
+			changed = 1;
+		}
+		goto done;
+	}
+
+	if (checkzeroed(sfi->sfi_extents, sizeof(sfi->sfi_extents))) {
+		warnx("Inode %lu: extents in inode not using them (cleared)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+
 	for (ibs.curfileblock=0; ibs.curfileblock<NUM_D; ibs.curfileblock++) {
 		datablock = GET_D(sfi, ibs.curfileblock);
 		if (datablock >= ibs.volblocks) {
@@ -238,6 +375,7 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 		check_indirect_block(&ibs, &SET_III(sfi, i), &changed, 3);
 	}
 
+ done:
 	if (ibs.pasteofcount > 0) {
 		warnx("Inode %lu: %u blocks after EOF (freed)",
 		     (unsigned long) ibs.ino, ibs.pasteofcount);
@@ -270,6 +408,16 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 
 	freemap_blockinuse(ino, B_INODE, ino);
 
+	if ((sfi->sfi_flags & ~(SFS_IF_HASHDIR|SFS_IF_EXTENTS)) != 0 ||
+	    ((sfi->sfi_flags & SFS_IF_HASHDIR) && !isdir)) {
+		warnx("Inode %lu: invalid flags 0x%lx (fixed)",
+		      (unsigned long) ino, (unsigned long) sfi->sfi_flags);
+		sfi->sfi_flags &= SFS_IF_EXTENTS |
+			(isdir ? SFS_IF_HASHDIR : 0);
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+
 	if (checkzeroed(sfi->sfi_waste, sizeof(sfi->sfi_waste))) {
 		warnx("Inode %lu: sfi_waste section not zeroed (fixed)",
 		      (unsigned long) ino);
@@ -381,11 +529,21 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 		return;
 	}
 
-	ndirentries = sfi.sfi_size/sizeof(struct sfs_direntry);
-	direntries = domalloc(sfi.sfi_size);
+	ndirentries = sfs_dirnentries(&sfi);
+	direntries = domalloc(ndirentries * sizeof(struct sfs_direntry));
 
 	sfs_readdir(&sfi, direntries, ndirentries);
 
+	/* If it's hashed and the hashing is broken, make it plain. */
+	if (sfsdir_checkhashed(&sfi, direntries, ndirentries, pathsofar)) {
+		sfs_writeinode(ino, &sfi);
+		free(direntries);
+		ndirentries = sfs_dirnentries(&sfi);
+		direntries = domalloc(ndirentries *
+				      sizeof(struct sfs_direntry));
+		sfs_readdir(&sfi, direntries, ndirentries);
+	}
+
 	for (i=0; i<ndirentries; i++) {
 		if (pass1_direntry(pathsofar, i, &direntries[i])) {
 			dchanged = 1;
@@ -437,6 +595,12 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 
 	if (dchanged) {
 		sfs_writedir(&sfi, direntries, ndirentries);
+
+		/* Renamed entries may no longer be in the right leaf */
+		if (sfsdir_checkhashed(&sfi, direntries, ndirentries,
+				       pathsofar)) {
+			sfs_writeinode(ino, &sfi);
+		}
 	}
 
 	free(direntries);
@@ -79,12 +79,18 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	/*
 	 * Load the directory. If there is any leftover room in the
 	 * last block, allocate space for it in case we want to insert
-	 * entries.
+	 * entries. (Not for hashed directories: sfs_dirnentries counts
+	 * all their slots already.)
 	 */
 
-	ndirentries = sfi.sfi_size/sizeof(struct sfs_direntry);
-	maxdirentries = SFS_ROUNDUP(ndirentries,
-				    SFS_BLOCKSIZE/sizeof(struct sfs_direntry));
+	ndirentries = sfs_dirnentries(&sfi);
+	if (sfi.sfi_flags & SFS_IF_HASHDIR) {
+		maxdirentries = ndirentries;
+	}
+	else {
+		maxdirentries = SFS_ROUNDUP(ndirentries,
+			SFS_BLOCKSIZE/sizeof(struct sfs_direntry));
+	}
 	dirsize = maxdirentries * sizeof(struct sfs_direntry);
 	direntries = domalloc(dirsize);
 
@@ -303,6 +309,12 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 
 	if (dchanged) {
 		sfs_writedir(&sfi, direntries, ndirentries);
+
+		/* Renamed or added entries may not be in the right leaf */
+		if (sfsdir_checkhashed(&sfi, direntries, ndirentries,
+				       pathsofar)) {
+			ichanged = 1;
+		}
 	}
 
 	if (ichanged) {
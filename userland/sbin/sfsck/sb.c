@@ -83,6 +83,18 @@ sb_check(void)
 		setbadness(EXIT_RECOV);
 		schanged = 1;
 	}
+	if (sb.sb_jnlblocks != 0 &&
+	    (sb.sb_jnlstart < SFS_FREEMAP_START +
+	     SFS_FREEMAPBLOCKS(sb.sb_nblocks) ||
+	     sb.sb_jnlstart > sb.sb_nblocks ||
+	     sb.sb_jnlblocks > sb.sb_nblocks - sb.sb_jnlstart ||
+	     SFS_JNL_SLOTSIZE(sb.sb_jnlblocks) < 3)) {
+		warnx("Journal location invalid (journal removed)");
+		setbadness(EXIT_RECOV);
+		sb.sb_jnlstart = 0;
+		sb.sb_jnlblocks = 0;
+		schanged = 1;
+	}
 	if (checkzeroed(sb.reserved, sizeof(sb.reserved))) {
 		warnx("Reserved section of superblock not zeroed (fixed)");
 		setbadness(EXIT_RECOV);
@@ -122,3 +134,21 @@ sb_volname(void)
 {
 	return sb.sb_volname;
 }
+
+/*
+ * Return the first block of the journal.
+ */
+uint32_t
+sb_jnlstart(void)
+{
+	return sb.sb_jnlstart;
+}
+
+/*
+ * Return the number of blocks in the journal, or 0 if there isn't one.
+ */
+uint32_t
+sb_jnlblocks(void)
+{
+	return sb.sb_jnlblocks;
+}
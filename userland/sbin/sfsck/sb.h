@@ -49,6 +49,10 @@ uint32_t sb_freemapblocks(void);
 /* After the superblock is loaded: return volume name. */
 const char *sb_volname(void);
 
+/* After the superblock is loaded: return journal location and size. */
+uint32_t sb_jnlstart(void);
+uint32_t sb_jnlblocks(void);
+
 /* Check the superblock. Must load it first. */
 void sb_check(void);
 
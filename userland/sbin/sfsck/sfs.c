@@ -51,6 +51,8 @@ sfs_setup(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_dirhdr)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_dirleaf)==SFS_BLOCKSIZE);
 }
 
 ////////////////////////////////////////////////////////////
@@ -62,6 +64,8 @@ swapsb(struct sfs_superblock *sb)
 {
 	sb->sb_magic = SWAP32(sb->sb_magic);
 	sb->sb_nblocks = SWAP32(sb->sb_nblocks);
+	sb->sb_jnlstart = SWAP32(sb->sb_jnlstart);
+	sb->sb_jnlblocks = SWAP32(sb->sb_jnlblocks);
 }
 
 static
@@ -81,6 +85,14 @@ swapinode(struct sfs_dinode *sfi)
 	sfi->sfi_size = SWAP32(sfi->sfi_size);
 	sfi->sfi_type = SWAP16(sfi->sfi_type);
 	sfi->sfi_linkcount = SWAP16(sfi->sfi_linkcount);
+	sfi->sfi_flags = SWAP32(sfi->sfi_flags);
+
+	for (i=0; i<SFS_NEXTENTS; i++) {
+		sfi->sfi_extents[i].se_block =
+			SWAP32(sfi->sfi_extents[i].se_block);
+		sfi->sfi_extents[i].se_len =
+			SWAP32(sfi->sfi_extents[i].se_len);
+	}
 
 	for (i=0; i<NUM_D; i++) {
 		SET_D(sfi, i) = SWAP32(GET_D(sfi, i));
@@ -155,13 +167,30 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 /*
  * bmap() for SFS.
  *
- * Given an inode and a file block, returns a disk block.
+ * Given an inode and a file block, returns a disk block. The inode
+ * may use either extents or block pointers.
  */
 static
 uint32_t
 bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 {
 	uint32_t iblock, offset;
+	unsigned i;
+
+	if (sfi->sfi_flags & SFS_IF_EXTENTS) {
+		offset = 0;
+		for (i=0; i<SFS_NEXTENTS && sfi->sfi_extents[i].se_len; i++) {
+			if (fileblock < offset + sfi->sfi_extents[i].se_len) {
+				if (sfi->sfi_extents[i].se_block == 0) {
+					return 0;
+				}
+				return sfi->sfi_extents[i].se_block +
+					(fileblock - offset);
+			}
+			offset += sfi->sfi_extents[i].se_len;
+		}
+		return 0;
+	}
 
 	if (fileblock < INOMAX_D) {
 		return GET_D(sfi, fileblock);
@@ -289,6 +318,119 @@ sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 	}
 }
 
+/*
+ * Read file block FILEBLOCK of a hashed directory into LEAF. Returns
+ * nonzero if it is missing or isn't a leaf.
+ */
+static
+int
+sfs_readleaf(const struct sfs_dinode *sfi, uint32_t fileblock,
+	     struct sfs_dirleaf *leaf)
+{
+	uint32_t diskblock;
+	unsigned i;
+
+	diskblock = bmap(sfi, fileblock);
+	if (fileblock == 0 || diskblock == 0) {
+		return -1;
+	}
+	diskread(leaf, diskblock);
+	if (SWAP32(leaf->sdl_magic) != SFS_DIRLEAF_MAGIC) {
+		return -1;
+	}
+	leaf->sdl_magic = SWAP32(leaf->sdl_magic);
+	leaf->sdl_depth = SWAP32(leaf->sdl_depth);
+	for (i=0; i<SFS_DIRLEAF_NENTRIES; i++) {
+		swapdir(&leaf->sdl_entries[i]);
+	}
+	return 0;
+}
+
+/*
+ * Write LEAF back to file block FILEBLOCK of a hashed directory.
+ */
+static
+void
+sfs_writeleaf(const struct sfs_dinode *sfi, uint32_t fileblock,
+	      struct sfs_dirleaf *leaf)
+{
+	unsigned i;
+
+	leaf->sdl_magic = SWAP32(leaf->sdl_magic);
+	leaf->sdl_depth = SWAP32(leaf->sdl_depth);
+	for (i=0; i<SFS_DIRLEAF_NENTRIES; i++) {
+		swapdir(&leaf->sdl_entries[i]);
+	}
+	diskwrite(leaf, bmap(sfi, fileblock));
+	leaf->sdl_magic = SWAP32(leaf->sdl_magic);
+	leaf->sdl_depth = SWAP32(leaf->sdl_depth);
+	for (i=0; i<SFS_DIRLEAF_NENTRIES; i++) {
+		swapdir(&leaf->sdl_entries[i]);
+	}
+}
+
+/*
+ * Read or write the entries of a hashed directory, which are the
+ * entries of every leaf, in order. Blocks that aren't leaves are
+ * skipped, so this works even if the header or table is damaged.
+ */
+static
+void
+sfs_rwhashdir(const struct sfs_dinode *sfi, struct sfs_direntry *d,
+	      unsigned nd, int dowrite)
+{
+	struct sfs_dirleaf leaf;
+	uint32_t nblocks, fileblock;
+	unsigned i, n;
+
+	nblocks = sfi->sfi_size / SFS_BLOCKSIZE;
+	n = 0;
+	for (fileblock=1; fileblock<nblocks; fileblock++) {
+		if (sfs_readleaf(sfi, fileblock, &leaf)) {
+			continue;
+		}
+		assert(n + SFS_DIRLEAF_NENTRIES <= nd);
+		for (i=0; i<SFS_DIRLEAF_NENTRIES; i++) {
+			if (dowrite) {
+				leaf.sdl_entries[i] = d[n + i];
+			}
+			else {
+				d[n + i] = leaf.sdl_entries[i];
+			}
+		}
+		if (dowrite) {
+			sfs_writeleaf(sfi, fileblock, &leaf);
+		}
+		n += SFS_DIRLEAF_NENTRIES;
+	}
+	assert(n == nd);
+}
+
+/*
+ * Return the number of directory entries (used or not) in the
+ * directory SFI; this is what sfs_readdir and sfs_writedir want.
+ */
+unsigned
+sfs_dirnentries(const struct sfs_dinode *sfi)
+{
+	struct sfs_dirleaf leaf;
+	uint32_t nblocks, fileblock;
+	unsigned n;
+
+	if ((sfi->sfi_flags & SFS_IF_HASHDIR) == 0) {
+		return sfi->sfi_size / sizeof(struct sfs_direntry);
+	}
+
+	nblocks = sfi->sfi_size / SFS_BLOCKSIZE;
+	n = 0;
+	for (fileblock=1; fileblock<nblocks; fileblock++) {
+		if (sfs_readleaf(sfi, fileblock, &leaf) == 0) {
+			n += SFS_DIRLEAF_NENTRIES;
+		}
+	}
+	return n;
+}
+
 /*
  * Read in a directory, from the inode SFI, into D, which is a buffer
  * with ND slots. The caller is assumed to have figured out the right
@@ -304,6 +446,11 @@ sfs_readdir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 	struct sfs_direntry buffer[atonce];
 	uint32_t diskblock;
 
+	if (sfi->sfi_flags & SFS_IF_HASHDIR) {
+		sfs_rwhashdir(sfi, d, nd, 0);
+		return;
+	}
+
 	left = nd;
 	for (i=0; i<nblocks; i++) {
 		diskblock = bmap(sfi, i);
@@ -369,6 +516,11 @@ sfs_writedir(const struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 	struct sfs_direntry buffer[atonce];
 	uint32_t diskblock;
 
+	if (sfi->sfi_flags & SFS_IF_HASHDIR) {
+		sfs_rwhashdir(sfi, d, nd, 1);
+		return;
+	}
+
 	left = nd;
 	for (i=0; i<nblocks; i++) {
 		diskblock = bmap(sfi, i);
@@ -391,6 +543,164 @@ sfs_writedir(const struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 	assert(left == 0);
 }
 
+////////////////////////////////////////////////////////////
+// hashed directories
+
+/*
+ * The name hash (see kern/sfs.h).
+ */
+static
+uint32_t
+dirhash(const char *name)
+{
+	uint32_t h = 2166136261U;
+	unsigned i;
+
+	for (i=0; i<SFS_NAMELEN && name[i] != 0; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Check the header and table of the hashed directory SFI, and that
+ * every entry is in the leaf where a lookup would look for it.
+ * Returns nonzero if anything is wrong.
+ */
+static
+int
+sfs_checkhashdir(const struct sfs_dinode *sfi)
+{
+	struct sfs_dirhdr hdr;
+	struct sfs_dirleaf leaf;
+	uint32_t *table, *count, *leafdepth;
+	uint32_t nblocks, ntable, nptrs, fileblock, diskblock, mask, i, j;
+	int bad = 0;
+
+	nblocks = sfi->sfi_size / SFS_BLOCKSIZE;
+	if (sfi->sfi_size % SFS_BLOCKSIZE != 0 || nblocks < 3) {
+		return -1;
+	}
+
+	diskblock = bmap(sfi, 0);
+	if (diskblock == 0) {
+		return -1;
+	}
+	diskread(&hdr, diskblock);
+	hdr.sdh_magic = SWAP32(hdr.sdh_magic);
+	hdr.sdh_depth = SWAP32(hdr.sdh_depth);
+	if (hdr.sdh_magic != SFS_DIRHDR_MAGIC ||
+	    hdr.sdh_depth > SFS_DIRHASH_MAXDEPTH) {
+		return -1;
+	}
+
+	/* Load the table */
+	nptrs = 1U << hdr.sdh_depth;
+	ntable = SFS_ROUNDUP(nptrs, SFS_DBPERIDB) / SFS_DBPERIDB;
+	table = domalloc(ntable * SFS_BLOCKSIZE);
+	for (i=0; i<ntable; i++) {
+		fileblock = SWAP32(hdr.sdh_index[i]);
+		diskblock = fileblock < nblocks ? bmap(sfi, fileblock) : 0;
+		if (fileblock == 0 || diskblock == 0) {
+			free(table);
+			return -1;
+		}
+		sfs_readindirect(diskblock, table + i * SFS_DBPERIDB);
+	}
+
+	/* Each leaf must be named by exactly the pointers it should be */
+	count = domalloc(nblocks * sizeof(uint32_t));
+	leafdepth = domalloc(nblocks * sizeof(uint32_t));
+	for (i=0; i<nblocks; i++) {
+		count[i] = 0;
+		leafdepth[i] = 0;
+		if (sfs_readleaf(sfi, i, &leaf) == 0 &&
+		    leaf.sdl_depth <= hdr.sdh_depth) {
+			leafdepth[i] = leaf.sdl_depth + 1;
+		}
+	}
+	for (i=0; !bad && i<nptrs; i++) {
+		fileblock = table[i];
+		if (fileblock >= nblocks || leafdepth[fileblock] == 0) {
+			bad = 1;
+			break;
+		}
+		mask = (1U << (leafdepth[fileblock] - 1)) - 1;
+		if (table[i & mask] != fileblock) {
+			bad = 1;
+		}
+		count[fileblock]++;
+	}
+	for (i=0; !bad && i<nblocks; i++) {
+		if (count[i] > 0 &&
+		    count[i] != 1U << (hdr.sdh_depth - (leafdepth[i] - 1))) {
+			bad = 1;
+		}
+	}
+
+	/* Each entry must be in the leaf its hash leads to */
+	mask = nptrs - 1;
+	for (i=1; !bad && i<nblocks; i++) {
+		if (sfs_readleaf(sfi, i, &leaf)) {
+			continue;
+		}
+		for (j=0; j<SFS_DIRLEAF_NENTRIES; j++) {
+			if (leaf.sdl_entries[j].sfd_ino == SFS_NOINO) {
+				continue;
+			}
+			if (table[dirhash(leaf.sdl_entries[j].sfd_name) & mask]
+			    != i) {
+				bad = 1;
+			}
+		}
+	}
+
+	free(leafdepth);
+	free(count);
+	free(table);
+	return bad;
+}
+
+/*
+ * If SFI is a hashed directory that is damaged, or has entries that
+ * lookups won't find (because they were renamed or added here), turn
+ * it into a plain directory with the same entries in the same blocks.
+ * D and ND are the entries as last read or written. Returns nonzero
+ * if it did so, in which case the caller must write out the inode.
+ */
+int
+sfsdir_checkhashed(struct sfs_dinode *sfi, struct sfs_direntry *d,
+		   unsigned nd, const char *path)
+{
+	struct sfs_direntry *flat;
+	unsigned nslots, i, j;
+
+	if ((sfi->sfi_flags & SFS_IF_HASHDIR) == 0 ||
+	    sfs_checkhashdir(sfi) == 0) {
+		return 0;
+	}
+
+	setbadness(EXIT_RECOV);
+	warnx("Directory %s: hash table damaged or out of date "
+	      "(made a plain directory)", path);
+
+	nslots = sfi->sfi_size / sizeof(struct sfs_direntry);
+	flat = domalloc(nslots * sizeof(struct sfs_direntry));
+	bzero(flat, nslots * sizeof(struct sfs_direntry));
+	for (i=j=0; i<nd; i++) {
+		if (d[i].sfd_ino != SFS_NOINO) {
+			assert(j < nslots);
+			flat[j++] = d[i];
+		}
+	}
+
+	sfi->sfi_flags &= ~SFS_IF_HASHDIR;
+	sfs_writedir(sfi, flat, nslots);
+	free(flat);
+	return 1;
+}
+
 ////////////////////////////////////////////////////////////
 // directory utilities
 
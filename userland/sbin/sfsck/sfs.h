@@ -66,10 +66,15 @@ void sfs_readindirect(uint32_t blocknum, uint32_t *entries);
 void sfs_writeindirect(uint32_t blocknum, uint32_t *entries);
 
 /* directory - ND should be the number of directory entries D points to */
+unsigned sfs_dirnentries(const struct sfs_dinode *sfi);
 void sfs_readdir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd);
 void sfs_writedir(const struct sfs_dinode *sfi,
 		  struct sfs_direntry *d, unsigned nd);
 
+/* Make a hashed directory plain if its hashing is broken. */
+int sfsdir_checkhashed(struct sfs_dinode *sfi, struct sfs_direntry *d,
+		       unsigned nd, const char *path);
+
 /* Try to add an entry to a directory. */
 int sfsdir_tryadd(struct sfs_direntry *d, int nd,
 		  const char *name, uint32_t ino);
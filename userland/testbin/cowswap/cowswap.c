@@ -0,0 +1,178 @@
+/*
+ * cowswap - fork under memory pressure, through swap and copy-on-write.
+ *
+ * Fills a region bigger than a good share of RAM, then forks children
+ * that all start out sharing it copy-on-write. Each child checks the
+ * region, writes its own pattern over every other page (so between
+ * them they need several times the memory there is, and pages go out
+ * to swap and back), and checks it all again. The parent writes over
+ * the other half meanwhile. Once the children are gone the parent is
+ * the last sharer of the pages it didn't write, and writes those too.
+ * Checks that:
+ *    - children see the parent's data as of the fork;
+ *    - nobody sees anyone else's writes;
+ *    - every page survives being swapped out and in again.
+ *
+ * Usage: cowswap [pages] [children]
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE     4096
+#define PAGEWORDS    (PAGESIZE / sizeof(unsigned))
+#define STRIDE       61
+#define DEFPAGES     512
+#define DEFCHILDREN  4
+#define MAXCHILDREN  16
+
+static unsigned *region;
+static unsigned npages;
+
+static
+unsigned
+value(unsigned page, unsigned word, unsigned who)
+{
+	return page * 1000003 + word * 7 + who * 65537;
+}
+
+static
+void
+fill(unsigned page, unsigned who)
+{
+	unsigned i;
+
+	for (i=0; i<PAGEWORDS; i++) {
+		region[page * PAGEWORDS + i] = value(page, i, who);
+	}
+}
+
+/*
+ * Check the region: pages with (page % 2 == parity) should belong to
+ * WHO, the rest to OTHER.
+ */
+static
+int
+check(const char *name, unsigned parity, unsigned who, unsigned other)
+{
+	unsigned page, i, w;
+
+	for (page=0; page<npages; page++) {
+		w = page % 2 == parity ? who : other;
+		for (i=page % STRIDE; i<PAGEWORDS; i+=STRIDE) {
+			if (region[page * PAGEWORDS + i] != value(page, i, w)) {
+				warnx("%s: page %u word %u is %u, not %u",
+				      name, page, i,
+				      region[page * PAGEWORDS + i],
+				      value(page, i, w));
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static
+void
+child(unsigned n)
+{
+	char name[32];
+	unsigned page;
+
+	snprintf(name, sizeof(name), "child %u", n);
+	if (check(name, 0, 0, 0)) {
+		_exit(1);
+	}
+	for (page=0; page<npages; page+=2) {
+		fill(page, n + 2);
+	}
+	if (check(name, 0, n + 2, 0)) {
+		_exit(1);
+	}
+	/* And once more, after the others have had a chance to run */
+	if (check(name, 0, n + 2, 0)) {
+		_exit(1);
+	}
+	_exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	pid_t pids[MAXCHILDREN];
+	unsigned nchildren = DEFCHILDREN;
+	unsigned page, i;
+	int status, failed = 0;
+
+	npages = DEFPAGES;
+	if (argc > 1) {
+		npages = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		nchildren = atoi(argv[2]);
+	}
+	if (argc > 3 || npages == 0 || nchildren == 0 ||
+	    nchildren > MAXCHILDREN) {
+		errx(1, "Usage: cowswap [pages] [children]");
+	}
+
+	region = malloc(npages * PAGESIZE);
+	if (region == NULL) {
+		err(1, "malloc");
+	}
+
+	printf("Filling %u pages...\n", npages);
+	for (page=0; page<npages; page++) {
+		fill(page, 0);
+	}
+
+	printf("Forking %u children...\n", nchildren);
+	for (i=0; i<nchildren; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			child(i);
+		}
+	}
+
+	/* The parent writes the odd pages while the children run */
+	for (page=1; page<npages; page+=2) {
+		fill(page, 1);
+	}
+	if (check("parent", 1, 1, 0)) {
+		failed = 1;
+	}
+
+	for (i=0; i<nchildren; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			warnx("child %u failed", i);
+			failed = 1;
+		}
+	}
+
+	/* Now the even pages are the parent's alone */
+	if (check("parent", 1, 1, 0)) {
+		failed = 1;
+	}
+	for (page=0; page<npages; page+=2) {
+		fill(page, 1);
+	}
+	if (check("parent", 1, 1, 1)) {
+		failed = 1;
+	}
+
+	if (failed) {
+		errx(1, "FAILED");
+	}
+	printf("Passed cowswap.\n");
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * dirhash - create, look up, and unlink many names in one directory.
+ *
+ * Meant for a hashed SFS directory (the root directory of a volume
+ * made by mksfs), where enough names split leaves and double the hash
+ * table several times over. Checks that:
+ *    - every name can be created, and created only once;
+ *    - every name finds its own file, whose contents are its number;
+ *    - after every other name is unlinked, those are gone and the
+ *      rest are all still found;
+ *    - the unlinked names can be created again;
+ *    - once everything is unlinked, nothing is left.
+ *
+ * Usage: dirhash [count]     (works in the current directory)
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#define DEFCOUNT  1500
+
+static
+void
+makename(char *buf, size_t len, int n)
+{
+	snprintf(buf, len, "dirhash-%d-%s", n, n % 3 ? "x" : "longername");
+}
+
+static
+void
+create(int n)
+{
+	char name[64];
+	int fd, r;
+
+	makename(name, sizeof(name), n);
+	fd = open(name, O_WRONLY|O_CREAT|O_EXCL, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", name);
+	}
+	r = write(fd, &n, sizeof(n));
+	if (r != sizeof(n)) {
+		err(1, "%s: write", name);
+	}
+	close(fd);
+
+	if (open(name, O_WRONLY|O_CREAT|O_EXCL, 0664) >= 0 ||
+	    errno != EEXIST) {
+		errx(1, "%s: created twice", name);
+	}
+}
+
+static
+void
+lookup(int n, int present)
+{
+	char name[64];
+	int fd, r, m;
+
+	makename(name, sizeof(name), n);
+	fd = open(name, O_RDONLY);
+	if (!present) {
+		if (fd >= 0 || errno != ENOENT) {
+			errx(1, "%s: still there after unlink", name);
+		}
+		return;
+	}
+	if (fd < 0) {
+		err(1, "%s: open", name);
+	}
+	r = read(fd, &m, sizeof(m));
+	if (r != sizeof(m)) {
+		err(1, "%s: read", name);
+	}
+	if (m != n) {
+		errx(1, "%s: found file %d", name, m);
+	}
+	close(fd);
+}
+
+static
+void
+unlink_one(int n)
+{
+	char name[64];
+
+	makename(name, sizeof(name), n);
+	if (remove(name)) {
+		err(1, "%s: remove", name);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	int count = DEFCOUNT;
+	int i;
+
+	if (argc == 2) {
+		count = atoi(argv[1]);
+	}
+	if (argc > 2 || count <= 0) {
+		errx(1, "Usage: dirhash [count]");
+	}
+
+	printf("Creating %d files...\n", count);
+	for (i=0; i<count; i++) {
+		create(i);
+	}
+
+	printf("Looking them up...\n");
+	for (i=0; i<count; i++) {
+		lookup(i, 1);
+	}
+
+	printf("Unlinking every other one...\n");
+	for (i=0; i<count; i+=2) {
+		unlink_one(i);
+	}
+	for (i=0; i<count; i++) {
+		lookup(i, i % 2);
+	}
+
+	printf("Creating those again...\n");
+	for (i=0; i<count; i+=2) {
+		create(i);
+	}
+	for (i=0; i<count; i++) {
+		lookup(i, 1);
+	}
+
+	printf("Unlinking everything...\n");
+	for (i=count-1; i>=0; i--) {
+		unlink_one(i);
+	}
+	for (i=0; i<count; i++) {
+		lookup(i, 0);
+	}
+
+	printf("Passed dirhash.\n");
+	return 0;
+}
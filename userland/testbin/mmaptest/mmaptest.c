@@ -0,0 +1,176 @@
+/*
+ * mmaptest - exercise mmap, munmap, and msync.
+ *
+ * Makes a file a few pages long, then checks that:
+ *    - a mapping shows the file's contents, and zeros past its end;
+ *    - writes through a shared mapping reach the file at msync;
+ *    - writes through a private mapping never do;
+ *    - a child's writes through an inherited shared mapping are seen
+ *      by the parent, and reach the file when the child exits;
+ *    - munmap removes the mapping.
+ *
+ * Usage: mmaptest [filename]
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGESIZE  4096
+#define FILESIZE  (3 * PAGESIZE + 100)
+#define MAPSIZE   (5 * PAGESIZE)
+
+static char buf[FILESIZE];
+
+static
+char
+pattern(int i)
+{
+	return 'a' + (i * 7 + i / 13) % 26;
+}
+
+/*
+ * Check that the file holds the pattern, except at OFF, which holds C.
+ */
+static
+void
+checkfile(const char *file, int off, char c)
+{
+	int fd, i, r;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", file);
+	}
+	r = read(fd, buf, sizeof(buf));
+	if (r < 0) {
+		err(1, "%s: read", file);
+	}
+	if (r != FILESIZE) {
+		errx(1, "%s: short read (%d bytes)", file, r);
+	}
+	close(fd);
+
+	for (i=0; i<FILESIZE; i++) {
+		if (buf[i] != (i == off ? c : pattern(i))) {
+			errx(1, "%s: byte %d is %d, not %d", file, i,
+			     buf[i], i == off ? c : pattern(i));
+		}
+	}
+}
+
+static
+char *
+domap(int fd, int prot)
+{
+	char *p;
+
+	p = mmap(MAPSIZE, prot, fd, 0);
+	if (p == (char *)-1) {
+		err(1, "mmap");
+	}
+	return p;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = "mmaptest.dat";
+	char *p, *q;
+	int fd, i, r, status;
+	pid_t pid;
+
+	if (argc == 2) {
+		file = argv[1];
+	}
+	else if (argc > 2) {
+		errx(1, "Usage: mmaptest [filename]");
+	}
+
+	fd = open(file, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", file);
+	}
+	for (i=0; i<FILESIZE; i++) {
+		buf[i] = pattern(i);
+	}
+	r = write(fd, buf, FILESIZE);
+	if (r != FILESIZE) {
+		err(1, "%s: write", file);
+	}
+
+	printf("Reading through a mapping...\n");
+	p = domap(fd, PROT_READ);
+	for (i=0; i<MAPSIZE; i++) {
+		if (p[i] != (i < FILESIZE ? pattern(i) : 0)) {
+			errx(1, "Mapped byte %d is %d", i, p[i]);
+		}
+	}
+	if (munmap(p)) {
+		err(1, "munmap");
+	}
+	if (munmap(p) == 0 || errno != EINVAL) {
+		errx(1, "munmap of an unmapped address worked");
+	}
+
+	printf("Writing through a private mapping...\n");
+	p = domap(fd, PROT_READ|PROT_WRITE|MAP_PRIVATE);
+	p[PAGESIZE + 5] = '!';
+	if (p[PAGESIZE + 5] != '!' || p[PAGESIZE + 6] != pattern(PAGESIZE + 6)) {
+		errx(1, "Private write went missing");
+	}
+	if (msync(p)) {
+		err(1, "msync");
+	}
+	if (munmap(p)) {
+		err(1, "munmap");
+	}
+	checkfile(file, -1, 0);
+
+	printf("Writing through a shared mapping...\n");
+	p = domap(fd, PROT_READ|PROT_WRITE);
+	q = domap(fd, PROT_READ);
+	p[2 * PAGESIZE + 3] = '@';
+	if (q[2 * PAGESIZE + 3] != '@') {
+		errx(1, "Second mapping did not see the write");
+	}
+	if (msync(p)) {
+		err(1, "msync");
+	}
+	checkfile(file, 2 * PAGESIZE + 3, '@');
+
+	printf("Writing from a child...\n");
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		p[2 * PAGESIZE + 3] = pattern(2 * PAGESIZE + 3);
+		p[10] = '#';
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (p[10] != '#' || q[10] != '#') {
+		errx(1, "Parent did not see the child's write");
+	}
+	checkfile(file, 10, '#');
+
+	p[10] = pattern(10);
+	if (munmap(p) || munmap(q)) {
+		err(1, "munmap");
+	}
+	checkfile(file, -1, 0);
+
+	close(fd);
+	remove(file);
+	printf("Passed mmaptest.\n");
+	return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * preadtest - exercise pread, pwrite, readv, and writev.
+ *
+ * Makes a file with writev, then checks that:
+ *    - readv splits the file across its buffers in order, including
+ *      empty ones, and moves the seek position by the total;
+ *    - pread and pwrite use the position given, and leave the seek
+ *      position alone;
+ *    - pread past the end of the file reads nothing;
+ *    - bad offsets and iovec counts, and pread on the console, fail.
+ *
+ * Usage: preadtest [filename]
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#define FILESIZE  3000
+
+static char buf[FILESIZE];
+static char part1[1000], part2[FILESIZE - 1000];
+
+static
+char
+pattern(int i)
+{
+	return 'a' + (i * 7 + i / 13) % 26;
+}
+
+static
+void
+checkpos(int fd, off_t expected)
+{
+	off_t pos;
+
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos < 0) {
+		err(1, "lseek");
+	}
+	if (pos != expected) {
+		errx(1, "Seek position is %ld, not %ld",
+		     (long)pos, (long)expected);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = "preadtest.dat";
+	struct iovec iov[3];
+	char c;
+	int fd, i, r;
+
+	if (argc == 2) {
+		file = argv[1];
+	}
+	else if (argc > 2) {
+		errx(1, "Usage: preadtest [filename]");
+	}
+
+	fd = open(file, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", file);
+	}
+
+	printf("Writing with writev...\n");
+	for (i=0; i<FILESIZE; i++) {
+		buf[i] = pattern(i);
+	}
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 1000;
+	iov[1].iov_base = buf + 1000;
+	iov[1].iov_len = 0;
+	iov[2].iov_base = buf + 1000;
+	iov[2].iov_len = FILESIZE - 1000;
+	r = writev(fd, iov, 3);
+	if (r != FILESIZE) {
+		err(1, "%s: writev", file);
+	}
+	checkpos(fd, FILESIZE);
+
+	printf("Reading with readv...\n");
+	lseek(fd, 0, SEEK_SET);
+	iov[0].iov_base = part1;
+	iov[0].iov_len = sizeof(part1);
+	iov[1].iov_base = &c;
+	iov[1].iov_len = 0;
+	iov[2].iov_base = part2;
+	iov[2].iov_len = sizeof(part2);
+	r = readv(fd, iov, 3);
+	if (r != FILESIZE) {
+		err(1, "%s: readv", file);
+	}
+	if (memcmp(part1, buf, sizeof(part1)) ||
+	    memcmp(part2, buf + sizeof(part1), sizeof(part2))) {
+		errx(1, "readv read the wrong data");
+	}
+	checkpos(fd, FILESIZE);
+
+	printf("Reading and writing with pread and pwrite...\n");
+	lseek(fd, 10, SEEK_SET);
+	r = pwrite(fd, "!!", 2, 2000);
+	if (r != 2) {
+		err(1, "%s: pwrite", file);
+	}
+	checkpos(fd, 10);
+	r = pread(fd, part1, 4, 1999);
+	if (r != 4) {
+		err(1, "%s: pread", file);
+	}
+	if (part1[0] != pattern(1999) || part1[1] != '!' ||
+	    part1[2] != '!' || part1[3] != pattern(2002)) {
+		errx(1, "pread read the wrong data");
+	}
+	checkpos(fd, 10);
+	r = pread(fd, part1, 4, FILESIZE + 100);
+	if (r != 0) {
+		errx(1, "pread past the end of the file returned %d", r);
+	}
+
+	printf("Checking errors...\n");
+	if (pread(fd, part1, 4, -1) != -1 || errno != EINVAL) {
+		errx(1, "pread at a negative offset worked");
+	}
+	if (readv(fd, iov, 0) != -1 || errno != EINVAL) {
+		errx(1, "readv of no buffers worked");
+	}
+	if (pread(STDIN_FILENO, part1, 4, 0) != -1 || errno != ESPIPE) {
+		errx(1, "pread on the console worked");
+	}
+
+	close(fd);
+	remove(file);
+	printf("Passed preadtest.\n");
+	return 0;
+}